@@ -0,0 +1,192 @@
+#include "fetch-benchmark.h"
+#include <algorithm>
+#include <iostream>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QProcess>
+#include <QRegularExpression>
+#include <QTemporaryDir>
+
+static const int kServerStartTimeoutMs = 10000;
+
+namespace {
+// Link profiles, as query parameters of the test server. Rates are per
+// connection.
+bool FindProfile(const QString& name, FetchBenchmark::Profile* profile) {
+  static const char* kProfiles[][2] = {
+    {"unshaped", ""},
+    {"lan", "latency=1"},
+    {"broadband", "rate=2M&latency=20&jitter=5"},
+    {"mobile", "rate=256K&latency=80&jitter=40"},
+    {"lossy", "rate=1M&latency=40&jitter=20&reset_rate=0.02"}};
+  for (const auto& entry : kProfiles) {
+    if (name == entry[0]) {
+      profile->name = entry[0];
+      profile->query = entry[1];
+      return true;
+    }
+  }
+  return false;
+}
+
+// Starts the test server on a free port and returns its url, or an empty
+// string if it didn't come up.
+QString StartServer(QProcess* server, const QString& binary, quint64 seed) {
+  server->setProcessChannelMode(QProcess::SeparateChannels);
+  server->start(binary, QStringList() << "--port" << "0"
+                                      << "--seed" << QString::number(seed));
+  if (!server->waitForStarted(kServerStartTimeoutMs)) {
+    return QString();
+  }
+  QRegularExpression serving("Serving on (http://\\S+?)/?\\s");
+  QByteArray output;
+  while (server->waitForReadyRead(kServerStartTimeoutMs)) {
+    output += server->readAllStandardError();
+    QRegularExpressionMatch match = serving.match(QString(output));
+    if (match.hasMatch()) {
+      return match.captured(1);
+    }
+  }
+  return QString();
+}
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("qaccelerator-fetchbench");
+  qRegisterMetaType<QNetworkReply::NetworkError>();
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Measures Fetcher end to end against the local test server. Prints "
+      "one JSON object per run on stdout.");
+  parser.addHelpOption();
+  QCommandLineOption server_option(
+      "server", "Url of a running test server. By default one is started.",
+      "url");
+  QCommandLineOption server_binary_option(
+      "server-binary", "Test server to start (default: "
+      "qaccelerator-testserver next to this binary or in the build tree).",
+      "path");
+  QCommandLineOption sizes_option(
+      "sizes", "Comma separated file sizes, up to 20G.", "sizes",
+      "1M,100M,1G");
+  QCommandLineOption connections_option(
+      "connections", "Comma separated connection counts, up to 1000.",
+      "counts", "1,4,16,64");
+  QCommandLineOption profiles_option(
+      "profiles", "Comma separated link profiles: unshaped, lan, broadband, "
+      "mobile, lossy.", "profiles", "unshaped,broadband");
+  QCommandLineOption repeat_option(
+      "repeat", "Runs of each case.", "n", "1");
+  QCommandLineOption dir_option(
+      "dir", "Directory to download to (default: a temporary one).", "dir");
+  QCommandLineOption label_option(
+      "label", "Label copied into every record, e.g. a commit id.", "label");
+  QCommandLineOption timeout_option(
+      "timeout", "Seconds after which a run is stopped and counted as "
+      "failed.", "seconds", "600");
+  QCommandLineOption no_verify_option(
+      "no-verify", "Don't check the downloaded files.");
+  QCommandLineOption seed_option(
+      "seed", "Seed of the server's content.", "seed", "1");
+  parser.addOption(server_option);
+  parser.addOption(server_binary_option);
+  parser.addOption(sizes_option);
+  parser.addOption(connections_option);
+  parser.addOption(profiles_option);
+  parser.addOption(repeat_option);
+  parser.addOption(dir_option);
+  parser.addOption(label_option);
+  parser.addOption(timeout_option);
+  parser.addOption(no_verify_option);
+  parser.addOption(seed_option);
+  parser.process(app);
+
+  FetchBenchmark::Options options;
+  for (const QString& size : parser.value(sizes_option).split(',')) {
+    qint64 parsed = ParseByteSize(size);
+    if (parsed <= 0) {
+      std::cerr << "Malformed size " << size.toLocal8Bit().constData()
+                << std::endl;
+      return 2;
+    }
+    options.sizes.push_back(parsed);
+  }
+  for (const QString& count : parser.value(connections_option).split(',')) {
+    int parsed = count.toInt();
+    if (parsed < 1 || parsed > kMaxConnections) {
+      std::cerr << "Connection counts must be between 1 and "
+                << kMaxConnections << std::endl;
+      return 2;
+    }
+    options.connections.push_back(parsed);
+  }
+  for (const QString& name : parser.value(profiles_option).split(',')) {
+    FetchBenchmark::Profile profile;
+    if (!FindProfile(name.trimmed(), &profile)) {
+      std::cerr << "Unknown profile " << name.toLocal8Bit().constData()
+                << std::endl;
+      return 2;
+    }
+    options.profiles.push_back(profile);
+  }
+  options.repeat = std::max(parser.value(repeat_option).toInt(), 1);
+  options.label = parser.value(label_option);
+  options.timeout_s = parser.value(timeout_option).toInt();
+  options.verify = !parser.isSet(no_verify_option);
+  options.seed = parser.value(seed_option).toULongLong();
+
+  QTemporaryDir temp_dir;
+  options.dir = parser.isSet(dir_option) ? parser.value(dir_option)
+                                         : temp_dir.path();
+  if (!QDir(options.dir).exists()) {
+    std::cerr << "Directory " << options.dir.toLocal8Bit().constData()
+              << " does not exist" << std::endl;
+    return 2;
+  }
+
+  QProcess server;
+  if (parser.isSet(server_option)) {
+    options.server_url = parser.value(server_option);
+    if (options.server_url.endsWith("/")) {
+      options.server_url.chop(1);
+    }
+  } else {
+    QString binary = parser.value(server_binary_option);
+    if (binary.isEmpty()) {
+      QDir app_dir(QCoreApplication::applicationDirPath());
+      QStringList candidates;
+      candidates << app_dir.filePath("qaccelerator-testserver")
+                 << app_dir.filePath("../testserver/qaccelerator-testserver")
+                 << app_dir.filePath(
+                        "../../testserver/release/qaccelerator-testserver");
+      binary = candidates.first();
+      for (const QString& candidate : candidates) {
+        if (QFileInfo(candidate).exists()
+            || QFileInfo(candidate + ".exe").exists()) {
+          binary = candidate;
+          break;
+        }
+      }
+    }
+    options.server_url = StartServer(&server, binary, options.seed);
+    if (options.server_url.isEmpty()) {
+      std::cerr << "Failed to start " << binary.toLocal8Bit().constData()
+                << "; pass --server or --server-binary." << std::endl;
+      return 2;
+    }
+  }
+
+  FetchBenchmark benchmark(&app, options);
+  QObject::connect(&benchmark, SIGNAL(Finished()), &app, SLOT(quit()));
+  benchmark.Run();
+  app.exec();
+  if (server.state() != QProcess::NotRunning) {
+    server.kill();
+    server.waitForFinished();
+  }
+  return benchmark.NumFailed() > 0 ? 1 : 0;
+}
@@ -0,0 +1,228 @@
+#include "fetch-benchmark.h"
+
+#include "bench/testserver/generated-content.h"
+#include <algorithm>
+#include <iostream>
+#include <QDateTime>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+// Threads are counted this often while a download runs.
+static const int kSampleIntervalMs = 100;
+static const qint64 kVerifyBufferSize = 4 * 1024 * 1024;
+
+FetchBenchmark::FetchBenchmark(QObject* parent, const Options& options)
+    : QObject(parent),
+      options_(options),
+      next_case_(0),
+      num_failed_(0),
+      finalizer_(new Finalizer(this)),
+      stopping_(false),
+      merge_start_ms_(-1),
+      peak_rss_was_reset_(false),
+      max_threads_(-1) {
+  for (qint64 size : options_.sizes) {
+    for (int connections : options_.connections) {
+      for (const Profile& profile : options_.profiles) {
+        for (int i = 0; i < options_.repeat; ++i) {
+          cases_.push_back(Case{size, connections, profile, i});
+        }
+      }
+    }
+  }
+  connect(&sample_timer_, SIGNAL(timeout()), this, SLOT(OnSample()));
+  timeout_timer_.setSingleShot(true);
+  connect(&timeout_timer_, SIGNAL(timeout()), this, SLOT(OnTimeout()));
+}
+
+void FetchBenchmark::Run() {
+  StartNext();
+}
+
+void FetchBenchmark::StartNext() {
+  if (next_case_ >= cases_.size()) {
+    emit Finished();
+    return;
+  }
+  const Case& c = cases_[next_case_];
+  QString url = QString("%1/%2.bin").arg(options_.server_url).arg(c.size);
+  if (!c.profile.query.isEmpty()) {
+    url += "?" + c.profile.query;
+  }
+  save_as_ = JoinPath(options_.dir, QString("fetch-bench-%1.bin")
+                                        .arg(next_case_));
+  QFile::remove(save_as_);
+  std::cerr << "Fetching " << c.size << " bytes over " << c.connections
+            << " connections, " << c.profile.name.toLocal8Bit().constData()
+            << std::endl;
+
+  fetcher_.reset(new Fetcher(url, c.size, save_as_, finalizer_));
+  // Each case measures the number of connections it names.
+  Fetcher::RampUpPolicy ramp_up;
+  ramp_up.interval_ms = 0;
+  fetcher_->SetRampUp(ramp_up);
+  fetcher_->SetUseCapabilityCache(false);
+  connect(fetcher_.get(), SIGNAL(Completed()), this, SLOT(OnCompleted()));
+  connect(fetcher_.get(), SIGNAL(Error(QNetworkReply::NetworkError)),
+          this, SLOT(OnError(QNetworkReply::NetworkError)));
+  connect(fetcher_.get(), SIGNAL(Paused()), this, SLOT(OnPaused()));
+  connect(fetcher_.get(), SIGNAL(Finalizing(qint64, qint64)),
+          this, SLOT(OnFinalizing(qint64, qint64)));
+  connect(fetcher_.get(), &Fetcher::ChangeSaveAs,
+          [=] (const QString& new_save_as) {
+    save_as_ = new_save_as;
+  });
+  error_.clear();
+  stopping_ = false;
+  merge_start_ms_ = -1;
+  peak_rss_was_reset_ = ResetPeakRss();
+  start_stats_ = ReadProcessStats();
+  max_threads_ = start_stats_.num_threads;
+  sample_timer_.start(kSampleIntervalMs);
+  if (options_.timeout_s > 0) {
+    timeout_timer_.start(options_.timeout_s * 1000);
+  }
+  wall_timer_.start();
+  fetcher_->Start(c.connections);
+}
+
+void FetchBenchmark::OnCompleted() {
+  FinishCase(true, QString());
+}
+
+void FetchBenchmark::OnError(QNetworkReply::NetworkError code) {
+  if (error_.isEmpty()) {
+    error_ = QString("network error %1").arg(code);
+  }
+  if (!stopping_) {
+    stopping_ = true;
+    fetcher_->Stop();
+  }
+}
+
+void FetchBenchmark::OnPaused() {
+  FinishCase(false, error_.isEmpty() ? "incomplete" : error_);
+}
+
+void FetchBenchmark::OnFinalizing(qint64 done_bytes, qint64 total_bytes) {
+  Q_UNUSED(done_bytes);
+  Q_UNUSED(total_bytes);
+  if (merge_start_ms_ < 0) {
+    merge_start_ms_ = wall_timer_.elapsed();
+  }
+}
+
+void FetchBenchmark::OnSample() {
+  max_threads_ = std::max(max_threads_, ReadProcessStats().num_threads);
+}
+
+void FetchBenchmark::OnTimeout() {
+  error_ = "timed out";
+  if (merge_start_ms_ >= 0) {
+    return;  // The merge can't be stopped; the run ends when it does.
+  }
+  if (!stopping_) {
+    stopping_ = true;
+    fetcher_->Stop();
+  }
+}
+
+void FetchBenchmark::FinishCase(bool ok, const QString& error) {
+  qint64 wall_ms = wall_timer_.elapsed();
+  sample_timer_.stop();
+  timeout_timer_.stop();
+  OnSample();
+  ProcessStats end_stats = ReadProcessStats();
+  const Case& c = cases_[next_case_];
+
+  QString verify_error;
+  bool verified = false;
+  if (ok && options_.verify) {
+    verified = Verify(save_as_, c.size, &verify_error);
+  }
+  if (!ok) {
+    fetcher_->RemoveWorkDir();
+  }
+  QFile::remove(save_as_);
+
+  QJsonObject record;
+  record["label"] = options_.label;
+  record["timestamp_ms"] = QDateTime::currentMSecsSinceEpoch();
+  record["size"] = c.size;
+  record["connections"] = c.connections;
+  record["profile"] = c.profile.name;
+  record["iteration"] = c.iteration;
+  record["ok"] = ok;
+  if (!ok) {
+    record["error"] = error;
+  }
+  if (options_.verify && ok) {
+    record["verified"] = verified;
+    if (!verified) {
+      record["verify_error"] = verify_error;
+    }
+  }
+  record["wall_ms"] = wall_ms;
+  record["throughput_mib_s"] = ok
+      ? c.size / (1024.0 * 1024.0) / (std::max(wall_ms, (qint64) 1) / 1000.0)
+      : 0.0;
+  record["merge_ms"] = merge_start_ms_ >= 0 ? wall_ms - merge_start_ms_ : -1;
+  record["user_cpu_ms"] = end_stats.user_cpu_ms - start_stats_.user_cpu_ms;
+  record["system_cpu_ms"] =
+      end_stats.system_cpu_ms - start_stats_.system_cpu_ms;
+  record["peak_rss_kb"] = end_stats.peak_rss_kb;
+  // Otherwise the peak may come from an earlier run.
+  record["peak_rss_is_per_run"] = peak_rss_was_reset_;
+  record["max_threads"] = max_threads_;
+  record["read_syscalls"] = end_stats.read_syscalls < 0 ? -1
+      : end_stats.read_syscalls - start_stats_.read_syscalls;
+  record["write_syscalls"] = end_stats.write_syscalls < 0 ? -1
+      : end_stats.write_syscalls - start_stats_.write_syscalls;
+  record["voluntary_switches"] = end_stats.voluntary_switches < 0 ? -1
+      : end_stats.voluntary_switches - start_stats_.voluntary_switches;
+  record["involuntary_switches"] = end_stats.involuntary_switches < 0 ? -1
+      : end_stats.involuntary_switches - start_stats_.involuntary_switches;
+  std::cout << QJsonDocument(record).toJson(QJsonDocument::Compact)
+      .constData() << std::endl;
+
+  if (!ok || (options_.verify && !verified)) {
+    ++num_failed_;
+  }
+  // The fetcher may be the sender; it is deleted once control returns to
+  // the event loop.
+  fetcher_.release()->deleteLater();
+  ++next_case_;
+  StartNext();
+}
+
+bool FetchBenchmark::Verify(const QString& fpath, qint64 size,
+                            QString* error) {
+  QFile file(fpath);
+  if (!file.open(QIODevice::ReadOnly)) {
+    *error = "failed to open " + fpath;
+    return false;
+  }
+  if (file.size() != size) {
+    *error = QString("size is %1").arg(file.size());
+    return false;
+  }
+  QByteArray buffer;
+  buffer.resize(kVerifyBufferSize);
+  qint64 offset = 0;
+  while (offset < size) {
+    qint64 num_read = file.read(buffer.data(), buffer.size());
+    if (num_read <= 0) {
+      *error = QString("read failed at %1").arg(offset);
+      return false;
+    }
+    qint64 mismatch = FindContentMismatch(options_.seed, offset,
+                                          buffer.constData(), num_read);
+    if (mismatch >= 0) {
+      *error = QString("first wrong byte at %1").arg(mismatch);
+      return false;
+    }
+    offset += num_read;
+  }
+  return true;
+}
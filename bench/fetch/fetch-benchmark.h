@@ -0,0 +1,87 @@
+#ifndef FETCH_BENCHMARK_H_
+#define FETCH_BENCHMARK_H_
+
+#include "fetcher.h"
+#include "finalizer.h"
+#include "process-stats.h"
+#include <memory>
+#include <vector>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+// Downloads generated files from the test server with Fetcher, for every
+// combination of file size, connection count and link profile, and prints
+// one JSON object per run on stdout.
+class FetchBenchmark : public QObject {
+  Q_OBJECT
+
+ public:
+  // Shaping applied by the test server, as query parameters.
+  struct Profile {
+    QString name;
+    QString query;
+  };
+
+  struct Options {
+    QString server_url;  // Without a trailing slash.
+    std::vector<qint64> sizes;
+    std::vector<int> connections;
+    std::vector<Profile> profiles;
+    int repeat;
+    QString dir;  // Where files are downloaded to, then deleted.
+    QString label;  // Copied into every record, e.g. a commit id.
+    int timeout_s;
+    bool verify;  // Check the downloaded bytes against the server's.
+    quint64 seed;  // Of the server's content.
+  };
+
+  FetchBenchmark(QObject* parent, const Options& options);
+
+  // Runs every case, then emits Finished().
+  void Run();
+  int NumFailed() { return num_failed_; }
+
+ signals:
+  void Finished();
+
+ private slots:
+  void OnCompleted();
+  void OnError(QNetworkReply::NetworkError code);
+  void OnPaused();
+  void OnFinalizing(qint64 done_bytes, qint64 total_bytes);
+  void OnSample();
+  void OnTimeout();
+
+ private:
+  struct Case {
+    qint64 size;
+    int connections;
+    Profile profile;
+    int iteration;
+  };
+
+  void StartNext();
+  void FinishCase(bool ok, const QString& error);
+  bool Verify(const QString& fpath, qint64 size, QString* error);
+
+  Options options_;
+  std::vector<Case> cases_;
+  size_t next_case_;
+  int num_failed_;
+  Finalizer* finalizer_;
+  std::unique_ptr<Fetcher> fetcher_;
+  QString save_as_;
+  QString error_;
+  bool stopping_;
+  QElapsedTimer wall_timer_;
+  qint64 merge_start_ms_;  // -1 until the merge starts.
+  ProcessStats start_stats_;
+  bool peak_rss_was_reset_;
+  int max_threads_;
+  QTimer sample_timer_;
+  QTimer timeout_timer_;
+};
+
+#endif  // FETCH_BENCHMARK_H_
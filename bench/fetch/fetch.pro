@@ -0,0 +1,29 @@
+#-------------------------------------------------
+#
+# End-to-end Fetcher benchmarks against the local test server.
+#
+#-------------------------------------------------
+
+QT       += core network
+QT       -= gui
+
+TARGET = qaccelerator-fetchbench
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+include(../../core/core-lib.pri)
+
+win32: LIBS += -lpsapi
+
+SOURCES += \
+    fetch-bench-main.cc \
+    fetch-benchmark.cc \
+    process-stats.cc \
+    ../testserver/generated-content.cc
+
+HEADERS += \
+    fetch-benchmark.h \
+    process-stats.h \
+    ../testserver/generated-content.h
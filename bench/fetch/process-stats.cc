@@ -0,0 +1,118 @@
+#include "process-stats.h"
+
+#include <QFile>
+#include <QList>
+#include <QByteArray>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#include <tlhelp32.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+namespace {
+// Reads "<name>: <value>" lines of a /proc file. Values that are missing stay
+// -1.
+void ReadProcFields(const char* fpath, const QList<QByteArray>& names,
+                    QList<qint64*> values) {
+  QFile file(fpath);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return;
+  }
+  // /proc files report a size of 0, so they are read line by line.
+  while (!file.atEnd()) {
+    QByteArray line = file.readLine();
+    int colon = line.indexOf(':');
+    if (colon < 0) {
+      continue;
+    }
+    int i = names.indexOf(line.left(colon));
+    if (i < 0) {
+      continue;
+    }
+    QByteArray value = line.mid(colon + 1).trimmed();
+    *values[i] = value.split(' ').first().toLongLong();
+  }
+}
+
+#ifdef Q_OS_WIN
+qint64 FileTimeToMillis(const FILETIME& time) {
+  ULARGE_INTEGER value;
+  value.LowPart = time.dwLowDateTime;
+  value.HighPart = time.dwHighDateTime;
+  return value.QuadPart / 10000;  // 100ns units.
+}
+#endif
+}
+
+ProcessStats ReadProcessStats() {
+  ProcessStats stats = {-1, -1, -1, -1, -1, -1, -1, -1};
+#ifdef Q_OS_WIN
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                      &user)) {
+    stats.user_cpu_ms = FileTimeToMillis(user);
+    stats.system_cpu_ms = FileTimeToMillis(kernel);
+  }
+  PROCESS_MEMORY_COUNTERS memory;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+    stats.peak_rss_kb = memory.PeakWorkingSetSize / 1024;
+  }
+  HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+  if (snapshot != INVALID_HANDLE_VALUE) {
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    int num_threads = 0;
+    DWORD pid = GetCurrentProcessId();
+    for (BOOL ok = Thread32First(snapshot, &entry); ok;
+         ok = Thread32Next(snapshot, &entry)) {
+      if (entry.th32OwnerProcessID == pid) {
+        ++num_threads;
+      }
+    }
+    CloseHandle(snapshot);
+    stats.num_threads = num_threads;
+  }
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats.user_cpu_ms = usage.ru_utime.tv_sec * 1000LL
+        + usage.ru_utime.tv_usec / 1000;
+    stats.system_cpu_ms = usage.ru_stime.tv_sec * 1000LL
+        + usage.ru_stime.tv_usec / 1000;
+    stats.voluntary_switches = usage.ru_nvcsw;
+    stats.involuntary_switches = usage.ru_nivcsw;
+#ifdef Q_OS_MAC
+    stats.peak_rss_kb = usage.ru_maxrss / 1024;  // Bytes on macOS.
+#else
+    stats.peak_rss_kb = usage.ru_maxrss;
+#endif
+  }
+  qint64 num_threads = -1;
+  qint64 peak_rss_kb = -1;
+  ReadProcFields("/proc/self/status",
+                 QList<QByteArray>() << "Threads" << "VmHWM",
+                 QList<qint64*>() << &num_threads << &peak_rss_kb);
+  stats.num_threads = (int) num_threads;
+  if (peak_rss_kb >= 0) {
+    stats.peak_rss_kb = peak_rss_kb;  // Unlike ru_maxrss, it can be reset.
+  }
+  ReadProcFields("/proc/self/io",
+                 QList<QByteArray>() << "syscr" << "syscw",
+                 QList<qint64*>() << &stats.read_syscalls
+                                  << &stats.write_syscalls);
+#endif
+  return stats;
+}
+
+bool ResetPeakRss() {
+#ifdef Q_OS_LINUX
+  QFile clear_refs("/proc/self/clear_refs");
+  if (clear_refs.open(QIODevice::WriteOnly)) {
+    return clear_refs.write("5") == 1;
+  }
+#endif
+  return false;
+}
@@ -0,0 +1,26 @@
+#ifndef PROCESS_STATS_H_
+#define PROCESS_STATS_H_
+
+#include <QtGlobal>
+
+// Resource usage of the current process. Values the platform doesn't report
+// are -1.
+struct ProcessStats {
+  qint64 user_cpu_ms;
+  qint64 system_cpu_ms;
+  qint64 peak_rss_kb;
+  int num_threads;
+  qint64 read_syscalls;  // Read-like syscalls, e.g. read(2) and recv(2).
+  qint64 write_syscalls;
+  qint64 voluntary_switches;
+  qint64 involuntary_switches;
+};
+
+ProcessStats ReadProcessStats();
+
+// Starts measuring the peak RSS afresh, so that it covers only what follows.
+// Returns false where the platform can't, in which case the peak is the
+// peak of the process so far.
+bool ResetPeakRss();
+
+#endif  // PROCESS_STATS_H_
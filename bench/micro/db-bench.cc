@@ -0,0 +1,76 @@
+// Database reads and writes that the UI makes on every tick and every
+// preference lookup. Each one is a full SQL round trip through the sqlite
+// driver.
+
+#include "microbench.h"
+
+#include <QDir>
+#include <QString>
+#include <QTemporaryDir>
+#include <QVariant>
+#include "qaccelerator-db.h"
+
+using microbench::DoNotOptimize;
+
+namespace {
+// A fresh database in a temp dir, shared by the benchmarks of this file,
+// since Session opens qaccelerator.db in the current dir and the default
+// connection can only be opened once.
+Session* BenchSession() {
+  static Session* session = nullptr;
+  if (session == nullptr) {
+    microbench::EnsureApplication();
+    static QTemporaryDir temp_dir;
+    QString current_dir = QDir::currentPath();
+    QDir::setCurrent(temp_dir.path());
+    session = new Session();
+    QDir::setCurrent(current_dir);
+  }
+  return session;
+}
+
+DownloadItem BenchItem() {
+  static Nullable<DownloadItem> item;
+  if (item.IsNull()) {
+    item = DownloadItem::AddNew(
+        {{"url", "http://example.com/file.bin"},
+         {"save_as", "/tmp/file.bin"},
+         {"file_size", 1073741824},
+         {"progress", 0.5},
+         {"status", 0}},
+        BenchSession());
+  }
+  return item.Get();
+}
+}
+
+// Model::GetField() through the getter.
+BENCHMARK(BM_DownloadItemGetField) {
+  microbench::StopTiming();
+  DownloadItem item = BenchItem();
+  microbench::StartTiming();
+  for (qint64 i = 0; i < iterations; ++i) {
+    DoNotOptimize(item.FileSize());
+  }
+}
+
+// Model::SetField() through the setter.
+BENCHMARK(BM_DownloadItemSetField) {
+  microbench::StopTiming();
+  DownloadItem item = BenchItem();
+  microbench::StartTiming();
+  for (qint64 i = 0; i < iterations; ++i) {
+    item.SetProgress((i % 1000) / 1000.0);
+  }
+}
+
+BENCHMARK(BM_PreferenceManagerGet) {
+  microbench::StopTiming();
+  PreferenceManager preference_manager(BenchSession());
+  microbench::StartTiming();
+  int num_connections = 0;
+  for (qint64 i = 0; i < iterations; ++i) {
+    preference_manager.Get("num_connections", &num_connections);
+    DoNotOptimize(num_connections);
+  }
+}
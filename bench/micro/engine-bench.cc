@@ -0,0 +1,144 @@
+// The file-level work of a download: splitting the missing bytes among
+// connections, finding the shards of a work dir when a download resumes, and
+// merging the shards when it completes.
+//
+// Work dirs are created in the system temp dir, so the merge results depend
+// on its filesystem. Set TMPDIR to measure another disk.
+
+#include "microbench.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QTemporaryDir>
+#include "engine-metrics.h"
+#include "finalizer.h"
+#include "qaccelerator-utils.h"
+#include "segment-allocator.h"
+
+using microbench::DoNotOptimize;
+using microbench::StartTiming;
+using microbench::StopTiming;
+using std::vector;
+
+namespace {
+const qint64 kFragmentSize = 256 * 1024;
+// Bytes merged per iteration, whatever the number of shards.
+const qint64 kMergedSize = 32 * 1024 * 1024;
+const int kNumConnections = 16;
+
+// `num_segments` downloaded segments with a gap after each, in random order,
+// as left behind by many resumed downloads.
+vector<Segment> MakeFragmentedSegments(qint64 num_segments) {
+  vector<Segment> segments;
+  for (qint64 i = 0; i < num_segments; ++i) {
+    qint64 start = 2 * i * kFragmentSize;
+    segments.push_back(Segment(start, start + kFragmentSize - 1));
+  }
+  std::mt19937 random(42);
+  std::shuffle(segments.begin(), segments.end(), random);
+  return segments;
+}
+
+// Creates `num_shards` shards that together hold `total_size` bytes.
+bool MakeShards(const QString& work_dir, qint64 num_shards,
+                qint64 total_size) {
+  if (!QDir().mkpath(work_dir)) {
+    return false;
+  }
+  qint64 shard_size = total_size / num_shards;
+  QByteArray contents(shard_size, 'q');
+  for (qint64 i = 0; i < num_shards; ++i) {
+    Segment segment(i * shard_size, (i + 1) * shard_size - 1);
+    QFile shard(MakeShardPath(work_dir, segment));
+    if (!shard.open(QIODevice::WriteOnly)
+        || shard.write(contents) != shard_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RunMerge(qint64 iterations, qint64 num_shards, int buffer_size,
+             bool use_kernel_copy) {
+  StopTiming();
+  QTemporaryDir temp_dir;
+  QString work_dir = temp_dir.path() + "/merged.bin.qaccelerator";
+  QString save_as = temp_dir.path() + "/merged.bin";
+  FinalizerWorker worker;
+  worker.SetCopyOptions(buffer_size, use_kernel_copy);
+  for (qint64 i = 0; i < iterations; ++i) {
+    QFile::remove(save_as);
+    if (!MakeShards(work_dir, num_shards, kMergedSize)) {
+      DIE() << "Failed to create shards in " << work_dir;
+    }
+    // Finalizer::Merge() counts the job in before handing it to the worker,
+    // which counts it out when done.
+    EngineMetrics::Instance()->AddFinalizerJobs(1);
+    StartTiming();
+    worker.Merge(0, work_dir, save_as);
+    StopTiming();
+  }
+}
+}
+
+BENCHMARK_WITH_ARGS(BM_CalculateAllocations, {10, 1000, 10000}) {
+  vector<Segment> fragmented = MakeFragmentedSegments(arg);
+  qint64 file_size = 2 * arg * kFragmentSize;
+  vector<Segment> downloaded;
+  vector<vector<Segment> > allocations;
+  for (qint64 i = 0; i < iterations; ++i) {
+    StopTiming();
+    downloaded = fragmented;
+    allocations.clear();
+    StartTiming();
+    CalculateAllocations(&downloaded, file_size, kNumConnections,
+                         &allocations);
+    DoNotOptimize(allocations);
+  }
+}
+
+BENCHMARK(BM_ParseSegment) {
+  QString fname = "shard_1073741824_1342177279";
+  Segment segment;
+  for (qint64 i = 0; i < iterations; ++i) {
+    DoNotOptimize(ParseSegment(fname, &segment));
+  }
+}
+
+BENCHMARK_WITH_ARGS(BM_ListShards, {100, 1000, 10000}) {
+  StopTiming();
+  QTemporaryDir temp_dir;
+  if (!MakeShards(temp_dir.path(), arg, arg)) {
+    DIE() << "Failed to create shards in " << temp_dir.path();
+  }
+  StartTiming();
+  vector<Segment> segments;
+  for (qint64 i = 0; i < iterations; ++i) {
+    segments.clear();
+    ListShards(temp_dir.path(), &segments);
+    DoNotOptimize(segments);
+  }
+  StopTiming();  // Removing the shards isn't part of it.
+}
+
+BENCHMARK_WITH_ARGS(BM_MergeShards_Buffer64K, {4, 64, 512}) {
+  RunMerge(iterations, arg, 64 * 1024, false);
+}
+
+BENCHMARK_WITH_ARGS(BM_MergeShards_Buffer1M, {4, 64, 512}) {
+  RunMerge(iterations, arg, 1024 * 1024, false);
+}
+
+BENCHMARK_WITH_ARGS(BM_MergeShards_Buffer4M, {4, 64, 512}) {
+  RunMerge(iterations, arg, 4 * 1024 * 1024, false);
+}
+
+// copy_file_range(2) where the filesystem supports it, which is what the
+// finalizer does.
+BENCHMARK_WITH_ARGS(BM_MergeShards_KernelCopy, {4, 64, 512}) {
+  RunMerge(iterations, arg, 4 * 1024 * 1024, true);
+}
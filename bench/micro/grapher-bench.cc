@@ -0,0 +1,51 @@
+// The speed grapher's work on every UI tick, for series of growing length.
+// Series longer than the plot is wide are downsampled into buckets, so the
+// cost should level off past a few hundred points.
+
+#include "microbench.h"
+
+#include <cmath>
+#include <vector>
+#include "speed-grapher.h"
+
+using microbench::StartTiming;
+using microbench::StopTiming;
+using std::vector;
+
+namespace {
+vector<double> MakeSeries(qint64 length) {
+  vector<double> ys;
+  for (qint64 i = 0; i < length; ++i) {
+    ys.push_back(std::fabs(std::sin(i * 0.01)) * 1024 * 1024);
+  }
+  return ys;
+}
+}
+
+BENCHMARK_WITH_ARGS(BM_SpeedGrapherUpdatePlot, {100, 1000, 10000}) {
+  StopTiming();
+  microbench::EnsureApplication();
+  SpeedGrapher grapher(nullptr);
+  grapher.SetData(MakeSeries(arg));
+  grapher.SetProgress(0.5);
+  grapher.SetIndicatorText("1.0 MB/s");
+  StartTiming();
+  for (qint64 i = 0; i < iterations; ++i) {
+    grapher.UpdatePlot(true);
+  }
+  StopTiming();
+}
+
+// What the monitor page does when a new speed sample comes in.
+BENCHMARK_WITH_ARGS(BM_SpeedGrapherAddDataPoint, {100, 1000, 10000}) {
+  StopTiming();
+  microbench::EnsureApplication();
+  SpeedGrapher grapher(nullptr);
+  vector<double> ys = MakeSeries(arg);
+  grapher.SetData(ys);
+  StartTiming();
+  for (qint64 i = 0; i < iterations; ++i) {
+    grapher.AddDataPoint(ys[i % ys.size()], 0.5, "1.0 MB/s");
+  }
+  StopTiming();
+}
@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# Micro-benchmarks for hot paths of qaccelerator.
+#
+#-------------------------------------------------
+
+QT       += core network sql widgets
+
+TARGET = qaccelerator-microbench
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+include(../../core/core-lib.pri)
+
+SOURCES += \
+    ../../speed-grapher.cc \
+    db-bench.cc \
+    engine-bench.cc \
+    grapher-bench.cc \
+    microbench.cc \
+    nullable-bench.cc
+
+HEADERS += \
+    ../../speed-grapher.h \
+    microbench.h
@@ -0,0 +1,186 @@
+#include "microbench.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include <QApplication>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+// Every heap allocation in the process goes through these, so the harness can
+// count allocations per iteration.
+namespace {
+std::atomic<qint64> num_allocations(0);
+
+void* CountedAlloc(std::size_t size) {
+  ++num_allocations;
+  void* pointer = std::malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+}
+
+void* operator new(std::size_t size) {
+  return CountedAlloc(size);
+}
+
+void* operator new[](std::size_t size) {
+  return CountedAlloc(size);
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  std::free(pointer);
+}
+
+namespace microbench {
+namespace {
+// Benchmarks run until a single run takes at least this long.
+const qint64 kMinRunTimeNs = 200 * 1000 * 1000;
+const qint64 kMaxIterations = 1000 * 1000 * 1000;
+
+const void* volatile sink = nullptr;
+
+// Of the run in progress.
+QElapsedTimer run_timer;
+bool timing = false;
+qint64 stopped_at_ns = 0;
+qint64 stopped_at_allocations = 0;
+qint64 excluded_ns = 0;
+qint64 excluded_allocations = 0;
+
+std::vector<std::pair<std::string, Body> >& Registry() {
+  static std::vector<std::pair<std::string, Body> > registry;
+  return registry;
+}
+
+bool Matches(const std::string& name, int argc, char* argv[]) {
+  if (argc < 2) {
+    return true;
+  }
+  for (int i = 1; i < argc; ++i) {
+    if (name.find(argv[i]) != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Run(const std::string& name, const Body& body) {
+  qint64 iterations = 1;
+  while (true) {
+    excluded_ns = 0;
+    excluded_allocations = 0;
+    qint64 allocations_before = NumAllocations();
+    timing = true;
+    run_timer.start();
+    body(iterations);
+    if (!timing) {
+      StartTiming();
+    }
+    timing = false;
+    qint64 elapsed_ns =
+        std::max<qint64>(run_timer.nsecsElapsed() - excluded_ns, 1);
+    qint64 allocations =
+        NumAllocations() - allocations_before - excluded_allocations;
+    if (elapsed_ns >= kMinRunTimeNs || iterations >= kMaxIterations) {
+      printf("%-45s %12lld %12.1f ns/op %10.2f allocs/op\n", name.c_str(),
+             static_cast<long long>(iterations),
+             static_cast<double>(elapsed_ns) / iterations,
+             static_cast<double>(allocations) / iterations);
+      fflush(stdout);
+      return;
+    }
+    // Aim a bit past the minimum run time, but never grow more than 100x at
+    // once so a noisy first run does not blow up the iteration count.
+    double multiplier = 1.4 * kMinRunTimeNs / elapsed_ns;
+    multiplier = std::min(std::max(multiplier, 2.0), 100.0);
+    iterations = std::min(static_cast<qint64>(iterations * multiplier),
+                          kMaxIterations);
+  }
+}
+}
+
+bool Register(const char* name, const Body& body) {
+  Registry().push_back(std::make_pair(std::string(name), body));
+  return true;
+}
+
+bool RegisterWithArgs(const char* name, std::initializer_list<qint64> args,
+                      const BodyWithArg& body) {
+  for (qint64 arg : args) {
+    Registry().push_back(std::make_pair(
+        std::string(name) + "/" + std::to_string(arg),
+        [=] (qint64 iterations) { body(iterations, arg); }));
+  }
+  return true;
+}
+
+void StopTiming() {
+  if (!timing) {
+    return;
+  }
+  timing = false;
+  stopped_at_ns = run_timer.nsecsElapsed();
+  stopped_at_allocations = NumAllocations();
+}
+
+void StartTiming() {
+  if (timing) {
+    return;
+  }
+  timing = true;
+  excluded_ns += run_timer.nsecsElapsed() - stopped_at_ns;
+  excluded_allocations += NumAllocations() - stopped_at_allocations;
+}
+
+void EnsureApplication() {
+  if (QApplication::instance() != nullptr) {
+    return;
+  }
+  bool was_timing = timing;
+  StopTiming();
+  if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+    qputenv("QT_QPA_PLATFORM", "offscreen");
+  }
+  // QApplication keeps references to these, so they outlive it.
+  static int argc = 1;
+  static char arg0[] = "qaccelerator-microbench";
+  static char* argv[] = {arg0, nullptr};
+  new QApplication(argc, argv);
+  if (was_timing) {
+    StartTiming();
+  }
+}
+
+qint64 NumAllocations() {
+  return num_allocations.load();
+}
+
+void Escape(const void* pointer) {
+  sink = pointer;
+}
+
+}  // namespace microbench
+
+// Usage: qaccelerator-microbench [name-substring...]
+// Runs all benchmarks whose name contains one of the given substrings, or all
+// benchmarks if none are given.
+int main(int argc, char* argv[]) {
+  for (const auto& benchmark : microbench::Registry()) {
+    if (microbench::Matches(benchmark.first, argc, argv)) {
+      microbench::Run(benchmark.first, benchmark.second);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef MICROBENCH_H_
+#define MICROBENCH_H_
+
+#include <functional>
+#include <initializer_list>
+#include <QtGlobal>
+
+// A tiny harness for code paths that are too small to measure from the GUI.
+// A benchmark body runs its loop `iterations` times. The harness picks the
+// iteration count and reports the time and the number of heap allocations per
+// iteration.
+//
+//   BENCHMARK(BM_Foo) {
+//     Foo foo;
+//     for (qint64 i = 0; i < iterations; ++i) {
+//       microbench::DoNotOptimize(foo.Bar());
+//     }
+//   }
+//
+// A benchmark that takes an argument, such as an input size, is registered
+// once per argument and reported as name/arg:
+//
+//   BENCHMARK_WITH_ARGS(BM_Sort, {10, 1000, 100000}) {
+//     microbench::StopTiming();
+//     std::vector<int> input = MakeInput(arg);
+//     microbench::StartTiming();
+//     ...
+//   }
+namespace microbench {
+
+typedef std::function<void(qint64 iterations)> Body;
+typedef std::function<void(qint64 iterations, qint64 arg)> BodyWithArg;
+
+bool Register(const char* name, const Body& body);
+bool RegisterWithArgs(const char* name, std::initializer_list<qint64> args,
+                      const BodyWithArg& body);
+
+// Excludes the time and allocations between the two calls from the
+// measurement, e.g. to set up fresh input for every iteration. Timing is on
+// when a body starts.
+void StopTiming();
+void StartTiming();
+
+// Creates the QApplication that widgets and some Qt modules need, the first
+// time it is called. It renders offscreen, so no display is needed.
+void EnsureApplication();
+
+// Number of calls to operator new so far.
+qint64 NumAllocations();
+
+// Stops the compiler from optimizing away the computation of a value.
+void Escape(const void* pointer);
+
+template<typename T>
+void DoNotOptimize(const T& value) {
+  Escape(&value);
+}
+
+}  // namespace microbench
+
+#define BENCHMARK(name) \
+  static void name(qint64 iterations); \
+  static const bool name##_registered = microbench::Register(#name, name); \
+  static void name(qint64 iterations)
+
+#define BENCHMARK_WITH_ARGS(name, ...) \
+  static void name(qint64 iterations, qint64 arg); \
+  static const bool name##_registered = \
+      microbench::RegisterWithArgs(#name, __VA_ARGS__, name); \
+  static void name(qint64 iterations, qint64 arg)
+
+#endif  // MICROBENCH_H_
@@ -0,0 +1,118 @@
+// Allocation counts of the value types that every DownloadItem getter and
+// every FileSpec hand-off goes through.
+
+#include "microbench.h"
+
+#include <memory>
+#include <utility>
+#include <QString>
+#include <QVariant>
+#include "qaccelerator-utils.h"
+
+using microbench::DoNotOptimize;
+
+namespace {
+// The heap-backed Nullable that qaccelerator used before values were stored
+// inline. Kept for comparison.
+template<typename T>
+class HeapNullable {
+ public:
+  HeapNullable(const T& val) {
+    val_.reset(new T(val));
+  }
+  HeapNullable() {}
+  HeapNullable(const HeapNullable<T>& other) {
+    if (!other.IsNull()) {
+      val_.reset(new T(other.Get()));
+    }
+  }
+
+  T& Get() const {
+    return *val_;
+  }
+
+  bool IsNull() const {
+    return val_ == nullptr;
+  }
+
+ private:
+  std::unique_ptr<T> val_;
+};
+
+// What Model::GetField() followed by a getter such as FileSize() does.
+HeapNullable<QVariant> HeapGetField(qint64 i) {
+  return QVariant(i);
+}
+
+HeapNullable<qint64> HeapFileSize(qint64 i) {
+  HeapNullable<QVariant> value = HeapGetField(i);
+  if (value.IsNull()) {
+    return HeapNullable<qint64>();
+  }
+  return value.Get().toLongLong();
+}
+
+Nullable<QVariant> GetField(qint64 i) {
+  return QVariant(i);
+}
+
+Nullable<qint64> FileSize(qint64 i) {
+  Nullable<QVariant> value = GetField(i);
+  if (value.IsNull()) {
+    return Nullable<qint64>();
+  }
+  return value.Get().toLongLong();
+}
+
+const char* kUrl = "http://example.com/downloads/some-file.iso";
+}
+
+BENCHMARK(BM_HeapNullableGetter) {
+  for (qint64 i = 0; i < iterations; ++i) {
+    HeapNullable<qint64> file_size = HeapFileSize(i);
+    DoNotOptimize(file_size.Get());
+  }
+}
+
+BENCHMARK(BM_NullableGetter) {
+  for (qint64 i = 0; i < iterations; ++i) {
+    Nullable<qint64> file_size = FileSize(i);
+    DoNotOptimize(file_size.Get());
+  }
+}
+
+BENCHMARK(BM_HeapNullableQStringCopy) {
+  HeapNullable<QString> url = QString(kUrl);
+  for (qint64 i = 0; i < iterations; ++i) {
+    HeapNullable<QString> copy(url);
+    DoNotOptimize(copy.Get());
+  }
+}
+
+BENCHMARK(BM_NullableQStringCopy) {
+  Nullable<QString> url = QString(kUrl);
+  for (qint64 i = 0; i < iterations; ++i) {
+    Nullable<QString> copy(url);
+    DoNotOptimize(copy.Get());
+  }
+}
+
+BENCHMARK(BM_FileSpecCopy) {
+  FileSpec spec(1, kUrl);
+  spec.SetMimeType("application/octet-stream");
+  spec.SetFileSize(1 << 30);
+  spec.SetAccelerable(true);
+  for (qint64 i = 0; i < iterations; ++i) {
+    FileSpec copy(spec);
+    DoNotOptimize(copy);
+  }
+}
+
+BENCHMARK(BM_DownloadParamsCopy) {
+  DownloadParams params(kUrl, "/tmp/some-file.iso", 1 << 30, 8);
+  for (qint64 i = 0; i < iterations; ++i) {
+    DownloadParams copy(params);
+    DownloadParams moved(std::move(copy));
+    DoNotOptimize(moved);
+  }
+}
@@ -0,0 +1,43 @@
+#include "generated-content.h"
+
+namespace {
+// Each aligned 8 byte word of the file is SplitMix64 of its index, which is
+// fast to compute and has no visible period.
+quint64 Word(quint64 seed, qint64 index) {
+  quint64 z = seed + (quint64) index * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+char ByteOf(quint64 word, qint64 offset) {
+  return (char) ((word >> (8 * (offset & 7))) & 0xff);
+}
+}
+
+void FillGeneratedContent(quint64 seed, qint64 offset, char* data,
+                          qint64 length) {
+  qint64 end = offset + length;
+  while (offset < end) {
+    quint64 word = Word(seed, offset >> 3);
+    qint64 word_end = qMin((offset | 7) + 1, end);
+    for (; offset < word_end; ++offset) {
+      *data++ = ByteOf(word, offset);
+    }
+  }
+}
+
+qint64 FindContentMismatch(quint64 seed, qint64 offset, const char* data,
+                           qint64 length) {
+  qint64 end = offset + length;
+  while (offset < end) {
+    quint64 word = Word(seed, offset >> 3);
+    qint64 word_end = qMin((offset | 7) + 1, end);
+    for (; offset < word_end; ++offset) {
+      if (*data++ != ByteOf(word, offset)) {
+        return offset;
+      }
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef GENERATED_CONTENT_H_
+#define GENERATED_CONTENT_H_
+
+#include <QtGlobal>
+
+// Contents of the files served by the test server. Byte i of a file depends
+// only on i and the seed, so any range can be produced, or checked, without
+// storing the file, and a byte written at the wrong offset shows up as a
+// mismatch.
+
+// Fills `data` with the `length` bytes starting at `offset`.
+void FillGeneratedContent(quint64 seed, qint64 offset, char* data,
+                          qint64 length);
+
+// Returns the offset of the first byte of `data` that differs from the
+// generated content at `offset`, or -1 if all of them match.
+qint64 FindContentMismatch(quint64 seed, qint64 offset, const char* data,
+                           qint64 length);
+
+#endif  // GENERATED_CONTENT_H_
@@ -0,0 +1,496 @@
+#include "range-server.h"
+
+#include "generated-content.h"
+#include "qaccelerator-utils.h"
+#include <algorithm>
+#include <utility>
+#include <QDateTime>
+#include <QDebug>
+#include <QLocale>
+#include <QMetaObject>
+#include <QUrl>
+#include <QUrlQuery>
+
+using std::max;
+using std::min;
+using std::pair;
+using std::vector;
+
+typedef pair<qint64, qint64> ByteRange;  // Both ends inclusive.
+
+static const int kMaxHeadSize = 64 * 1024;
+// Generated bytes are written in chunks of up to this size, and no more are
+// written while this much is waiting to go out on the socket.
+static const qint64 kChunkSize = 64 * 1024;
+static const qint64 kMaxBufferedBytes = 256 * 1024;
+// A rate capped connection tops up its allowance this often.
+static const int kPaceIntervalMs = 10;
+static const qint64 kMinBurst = 1460;
+static const char* kLastModified = "Thu, 01 Jan 2015 00:00:00 GMT";
+
+namespace {
+enum class RangeParse {
+  IGNORE,  // Malformed, so the whole file is sent.
+  UNSATISFIABLE,
+  OK
+};
+
+RangeParse ParseRanges(const QByteArray& header, qint64 size,
+                       vector<ByteRange>* ranges) {
+  if (!header.startsWith("bytes=")) {
+    return RangeParse::IGNORE;
+  }
+  QList<QByteArray> specs = header.mid(6).split(',');
+  for (const QByteArray& raw_spec : specs) {
+    QByteArray spec = raw_spec.trimmed();
+    int dash = spec.indexOf('-');
+    if (dash < 0) {
+      return RangeParse::IGNORE;
+    }
+    bool ok = true;
+    if (dash == 0) {  // Suffix range: the last n bytes.
+      qint64 n = spec.mid(1).toLongLong(&ok);
+      if (!ok || n < 0) {
+        return RangeParse::IGNORE;
+      }
+      if (n > 0 && size > 0) {
+        ranges->push_back(ByteRange(max(size - n, (qint64) 0), size - 1));
+      }
+      continue;
+    }
+    qint64 first = spec.left(dash).toLongLong(&ok);
+    if (!ok || first < 0) {
+      return RangeParse::IGNORE;
+    }
+    qint64 last = size - 1;
+    if (dash + 1 < spec.size()) {
+      last = spec.mid(dash + 1).toLongLong(&ok);
+      if (!ok || last < first) {
+        return RangeParse::IGNORE;
+      }
+    }
+    if (first < size) {
+      ranges->push_back(ByteRange(first, min(last, size - 1)));
+    }
+  }
+  return ranges->empty() ? RangeParse::UNSATISFIABLE : RangeParse::OK;
+}
+
+QByteArray StatusText(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 416: return "Range Not Satisfiable";
+  case 429: return "Too Many Requests";
+  case 431: return "Request Header Fields Too Large";
+  case 503: return "Service Unavailable";
+  default: return "Error";
+  }
+}
+
+QByteArray ContentRange(const ByteRange& range, qint64 size) {
+  return QString("bytes %1-%2/%3").arg(range.first).arg(range.second)
+      .arg(size).toLatin1();
+}
+}
+
+ServerConnection::ServerConnection(QObject* parent,
+                                   const ServerOptions& options,
+                                   std::atomic<int>* num_connections,
+                                   qintptr descriptor,
+                                   quint64 connection_id)
+    : QObject(parent),
+      options_(options),
+      shaping_(options.shaping),
+      num_connections_(num_connections),
+      is_over_cap_(false),
+      socket_(new QTcpSocket(this)),
+      responding_(false),
+      sending_(false),
+      close_after_response_(false),
+      body_bytes_sent_(0),
+      reset_after_(-1),
+      allowance_(0),
+      last_refill_millis_(0),
+      random_(options.seed ^ (connection_id * 0x9e3779b97f4a7c15ULL)) {
+  int count = ++*num_connections_;
+  is_over_cap_ = options_.max_connections > 0
+      && count > options_.max_connections;
+  pace_timer_.setSingleShot(true);
+  connect(&pace_timer_, SIGNAL(timeout()), this, SLOT(Pump()));
+  connect(socket_, SIGNAL(readyRead()), this, SLOT(OnReadyRead()));
+  connect(socket_, SIGNAL(bytesWritten(qint64)), this, SLOT(Pump()));
+  connect(socket_, SIGNAL(disconnected()), this, SLOT(OnDisconnected()));
+  if (!socket_->setSocketDescriptor(descriptor)) {
+    qDebug() << "Failed to take connection: " << socket_->errorString();
+    deleteLater();
+    return;
+  }
+  socket_->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+}
+
+ServerConnection::~ServerConnection() {
+  --*num_connections_;
+}
+
+void ServerConnection::OnReadyRead() {
+  input_.append(socket_->readAll());
+  ProcessNextRequest();
+}
+
+void ServerConnection::OnDisconnected() {
+  pace_timer_.stop();
+  deleteLater();
+}
+
+void ServerConnection::ProcessNextRequest() {
+  if (responding_ || close_after_response_) {
+    return;
+  }
+  shaping_ = options_.shaping;
+  int end = input_.indexOf("\r\n\r\n");
+  if (end < 0) {
+    if (input_.size() <= kMaxHeadSize) {
+      return;  // Wait for the rest.
+    }
+    close_after_response_ = true;
+    QueueError(431, "Request head too large");
+  } else {
+    QByteArray head = input_.left(end);
+    input_.remove(0, end + 4);
+    Request request;
+    if (!ParseRequest(head, &request)) {
+      close_after_response_ = true;
+      QueueError(400, "Malformed request");
+    } else {
+      HandleRequest(request);
+    }
+  }
+  responding_ = true;
+  int delay = shaping_.latency_ms + Jitter();
+  if (delay > 0) {
+    QTimer::singleShot(delay, this, SLOT(StartResponse()));
+  } else {
+    StartResponse();
+  }
+}
+
+bool ServerConnection::ParseRequest(const QByteArray& head,
+                                    Request* request) {
+  QList<QByteArray> lines = head.split('\n');
+  QList<QByteArray> request_line = lines[0].trimmed().split(' ');
+  if (request_line.size() != 3 || !request_line[2].startsWith("HTTP/")) {
+    return false;
+  }
+  request->method = request_line[0];
+  request->target = request_line[1];
+  request->version = request_line[2];
+  for (int i = 1; i < lines.size(); ++i) {
+    int colon = lines[i].indexOf(':');
+    if (colon <= 0) {
+      continue;
+    }
+    request->headers[lines[i].left(colon).trimmed().toLower()] =
+        lines[i].mid(colon + 1).trimmed();
+  }
+  return true;
+}
+
+void ServerConnection::HandleRequest(const Request& request) {
+  QByteArray connection = request.headers.value("connection").toLower();
+  if (request.version == "HTTP/1.0") {
+    close_after_response_ = !connection.contains("keep-alive");
+  } else {
+    close_after_response_ = connection.contains("close");
+  }
+  // Request bodies aren't expected, so rather than skip one the connection
+  // is closed after the response.
+  if (request.headers.value("content-length", "0").toLongLong() > 0) {
+    close_after_response_ = true;
+  }
+
+  QUrl url = QUrl::fromEncoded(request.target);
+  QUrlQuery query(url);
+  if (query.hasQueryItem("rate")) {
+    shaping_.rate = max(ParseByteSize(query.queryItemValue("rate")),
+                        (qint64) 0);
+  }
+  if (query.hasQueryItem("latency")) {
+    shaping_.latency_ms = query.queryItemValue("latency").toInt();
+  }
+  if (query.hasQueryItem("jitter")) {
+    shaping_.jitter_ms = query.queryItemValue("jitter").toInt();
+  }
+  if (query.hasQueryItem("error_rate")) {
+    shaping_.error_rate = query.queryItemValue("error_rate").toDouble();
+  }
+  if (query.hasQueryItem("reset_rate")) {
+    shaping_.reset_rate = query.queryItemValue("reset_rate").toDouble();
+  }
+  if (options_.verbose) {
+    qDebug() << request.method << request.target << "range:"
+             << request.headers.value("range");
+  }
+
+  if (is_over_cap_) {
+    close_after_response_ = true;
+    QueueError(options_.error_status, "Too many connections");
+    return;
+  }
+  if (Chance(shaping_.error_rate)) {
+    QueueError(options_.error_status, "Injected error");
+    return;
+  }
+  bool is_head = (request.method == "HEAD");
+  if (!is_head && request.method != "GET") {
+    QueueError(405, "Only GET and HEAD are supported");
+    return;
+  }
+  QString name = url.path().section('/', -1).section('.', 0, 0);
+  qint64 size = ParseByteSize(name);
+  if (name.isEmpty() || size < 0) {
+    QueueError(404, "Request /<size>, e.g. /100M.bin");
+    return;
+  }
+
+  QByteArray etag = QString("\"%1-%2\"").arg(size).arg(options_.seed)
+      .toLatin1();
+  QList<QByteArray> headers;
+  headers << "Accept-Ranges: bytes"
+          << "ETag: " + etag
+          << QByteArray("Last-Modified: ") + kLastModified;
+  vector<ByteRange> ranges;
+  RangeParse parse = RangeParse::IGNORE;
+  if (request.headers.contains("range")) {
+    // A stale validator means the client's copy changed; it gets the whole
+    // file.
+    QByteArray if_range = request.headers.value("if-range");
+    if (if_range.isEmpty() || if_range == etag || if_range == kLastModified) {
+      parse = ParseRanges(request.headers.value("range"), size, &ranges);
+    }
+  }
+
+  if (parse == RangeParse::UNSATISFIABLE) {
+    headers << "Content-Range: bytes */" + QByteArray::number(size);
+    QueueHeaders(416, headers, 0);
+    return;
+  }
+  if (parse == RangeParse::IGNORE) {
+    headers << "Content-Type: application/octet-stream";
+    QueueHeaders(200, headers, size);
+    if (!is_head && size > 0) {
+      parts_.push_back(Part{QByteArray(), 0, size});
+    }
+    return;
+  }
+  if (ranges.size() == 1) {
+    headers << "Content-Type: application/octet-stream"
+            << "Content-Range: " + ContentRange(ranges[0], size);
+    qint64 length = ranges[0].second - ranges[0].first + 1;
+    QueueHeaders(206, headers, length);
+    if (!is_head) {
+      parts_.push_back(Part{QByteArray(), ranges[0].first, length});
+    }
+    return;
+  }
+  QByteArray boundary = "QACCELERATOR_TESTSERVER_BOUNDARY";
+  vector<Part> body;
+  qint64 content_length = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    QByteArray part_head = (i == 0 ? "--" : "\r\n--") + boundary + "\r\n"
+        + "Content-Type: application/octet-stream\r\n"
+        + "Content-Range: " + ContentRange(ranges[i], size) + "\r\n\r\n";
+    qint64 length = ranges[i].second - ranges[i].first + 1;
+    body.push_back(Part{part_head, 0, 0});
+    body.push_back(Part{QByteArray(), ranges[i].first, length});
+    content_length += part_head.size() + length;
+  }
+  QByteArray tail = "\r\n--" + boundary + "--\r\n";
+  body.push_back(Part{tail, 0, 0});
+  content_length += tail.size();
+  headers << "Content-Type: multipart/byteranges; boundary=" + boundary;
+  QueueHeaders(206, headers, content_length);
+  if (!is_head) {
+    parts_.insert(parts_.end(), body.begin(), body.end());
+  }
+}
+
+void ServerConnection::QueueHeaders(int status,
+                                    const QList<QByteArray>& headers,
+                                    qint64 content_length) {
+  QByteArray head = "HTTP/1.1 " + QByteArray::number(status) + " "
+      + StatusText(status) + "\r\n";
+  head += "Date: " + QLocale::c().toString(
+      QDateTime::currentDateTimeUtc(), "ddd, dd MMM yyyy hh:mm:ss 'GMT'")
+      .toLatin1() + "\r\n";
+  head += "Server: qaccelerator-testserver\r\n";
+  for (const QByteArray& header : headers) {
+    head += header + "\r\n";
+  }
+  head += "Content-Length: " + QByteArray::number(content_length) + "\r\n";
+  head += close_after_response_ ? "Connection: close\r\n"
+                                : "Connection: keep-alive\r\n";
+  head += "\r\n";
+  parts_.push_back(Part{head, 0, 0});
+}
+
+void ServerConnection::QueueError(int status, const QByteArray& message) {
+  QList<QByteArray> headers;
+  headers << "Content-Type: text/plain";
+  if ((status == 429 || status == 503) && options_.retry_after_s > 0) {
+    headers << "Retry-After: " + QByteArray::number(options_.retry_after_s);
+  }
+  QByteArray body = message + "\n";
+  QueueHeaders(status, headers, body.size());
+  parts_.push_back(Part{body, 0, 0});
+}
+
+void ServerConnection::StartResponse() {
+  sending_ = true;
+  body_bytes_sent_ = 0;
+  reset_after_ = -1;
+  qint64 body_size = 0;
+  for (const Part& part : parts_) {
+    body_size += part.length;
+  }
+  if (body_size > 0 && Chance(shaping_.reset_rate)) {
+    reset_after_ = std::uniform_int_distribution<qint64>(
+        0, body_size - 1)(random_);
+  }
+  allowance_ = 0;
+  last_refill_millis_ = QDateTime::currentMSecsSinceEpoch();
+  Pump();
+}
+
+void ServerConnection::Pump() {
+  if (!sending_) {
+    return;
+  }
+  while (!parts_.empty() && socket_->bytesToWrite() < kMaxBufferedBytes) {
+    qint64 budget = kChunkSize;
+    if (shaping_.rate > 0) {
+      qint64 now = QDateTime::currentMSecsSinceEpoch();
+      qint64 burst = max(
+          shaping_.rate * (kPaceIntervalMs + shaping_.jitter_ms) / 1000,
+          kMinBurst);
+      allowance_ = min(
+          allowance_ + (now - last_refill_millis_) * shaping_.rate / 1000,
+          burst);
+      last_refill_millis_ = now;
+      if (allowance_ <= 0) {
+        if (!pace_timer_.isActive()) {
+          pace_timer_.start(kPaceIntervalMs + Jitter());
+        }
+        return;
+      }
+      budget = min(budget, allowance_);
+    }
+    Part& part = parts_.front();
+    if (!part.literal.isEmpty()) {
+      socket_->write(part.literal);
+      allowance_ -= part.literal.size();
+      parts_.pop_front();
+      continue;
+    }
+    qint64 length = min(budget, part.length);
+    if (reset_after_ >= 0) {
+      length = min(length, reset_after_ - body_bytes_sent_);
+      if (length <= 0) {
+        if (options_.verbose) {
+          qDebug() << "Resetting connection after" << body_bytes_sent_
+                   << "bytes";
+        }
+        sending_ = false;
+        socket_->abort();
+        return;
+      }
+    }
+    buffer_.resize(length);
+    FillGeneratedContent(options_.seed, part.offset, buffer_.data(), length);
+    socket_->write(buffer_.constData(), length);
+    allowance_ -= length;
+    body_bytes_sent_ += length;
+    part.offset += length;
+    part.length -= length;
+    if (part.length == 0) {
+      parts_.pop_front();
+    }
+  }
+  if (parts_.empty()) {
+    FinishResponse();
+  }
+}
+
+void ServerConnection::FinishResponse() {
+  sending_ = false;
+  responding_ = false;
+  if (close_after_response_) {
+    socket_->disconnectFromHost();  // After the buffered bytes are sent.
+    return;
+  }
+  QMetaObject::invokeMethod(this, "ProcessNextRequest", Qt::QueuedConnection);
+}
+
+bool ServerConnection::Chance(double probability) {
+  if (probability <= 0) {
+    return false;
+  }
+  return std::uniform_real_distribution<double>(0, 1)(random_) < probability;
+}
+
+int ServerConnection::Jitter() {
+  if (shaping_.jitter_ms <= 0) {
+    return 0;
+  }
+  return std::uniform_int_distribution<int>(0, shaping_.jitter_ms)(random_);
+}
+
+ConnectionAcceptor::ConnectionAcceptor(const ServerOptions& options,
+                                       std::atomic<int>* num_connections)
+    : options_(options),
+      num_connections_(num_connections) {}
+
+void ConnectionAcceptor::Accept(qintptr descriptor, quint64 connection_id) {
+  new ServerConnection(this, options_, num_connections_, descriptor,
+                       connection_id);
+}
+
+RangeServer::RangeServer(QObject* parent, const ServerOptions& options,
+                         int num_threads)
+    : QTcpServer(parent),
+      options_(options),
+      num_connections_(0),
+      next_thread_(0),
+      next_connection_id_(0) {
+  qRegisterMetaType<qintptr>("qintptr");
+  for (int i = 0; i < max(num_threads, 1); ++i) {
+    QThread* thread = new QThread(this);
+    ConnectionAcceptor* acceptor =
+        new ConnectionAcceptor(options_, &num_connections_);
+    acceptor->moveToThread(thread);
+    // Connections are children of the acceptor, so they go with it.
+    connect(thread, SIGNAL(finished()), acceptor, SLOT(deleteLater()));
+    thread->start();
+    threads_.push_back(thread);
+    acceptors_.push_back(acceptor);
+  }
+}
+
+RangeServer::~RangeServer() {
+  close();
+  for (QThread* thread : threads_) {
+    thread->quit();
+    thread->wait();
+  }
+}
+
+void RangeServer::incomingConnection(qintptr descriptor) {
+  ConnectionAcceptor* acceptor = acceptors_[next_thread_];
+  next_thread_ = (next_thread_ + 1) % acceptors_.size();
+  QMetaObject::invokeMethod(acceptor, "Accept", Qt::QueuedConnection,
+                            Q_ARG(qintptr, descriptor),
+                            Q_ARG(quint64, next_connection_id_++));
+}
@@ -0,0 +1,143 @@
+#ifndef RANGE_SERVER_H_
+#define RANGE_SERVER_H_
+
+#include <atomic>
+#include <deque>
+#include <random>
+#include <vector>
+#include <QByteArray>
+#include <QMap>
+#include <QObject>
+#include <QString>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+
+// How responses are slowed down or broken. The server-wide values can be
+// overridden per request with query parameters of the same names, e.g.
+// /100M.bin?rate=2M&latency=50.
+struct ShapingOptions {
+  qint64 rate;  // Bytes per second per connection, 0 for no cap.
+  int latency_ms;  // Delay before each response.
+  // Up to this much is added, at random, to the latency and to each pause
+  // of a rate capped connection.
+  int jitter_ms;
+  double error_rate;  // Fraction of requests answered with an error status.
+  // Fraction of responses whose connection is reset at a random point of
+  // the body.
+  double reset_rate;
+};
+
+struct ServerOptions {
+  ShapingOptions shaping;
+  int max_connections;  // Connections past this get errors. 0 for no cap.
+  int error_status;  // 503 or 429.
+  int retry_after_s;  // Sent with error statuses. 0 to leave it out.
+  quint64 seed;  // Of the generated content.
+  bool verbose;
+};
+
+// One client connection, served on the thread of its parent. Requests are
+// answered in order, so pipelined requests work.
+class ServerConnection : public QObject {
+  Q_OBJECT
+
+ public:
+  ServerConnection(QObject* parent, const ServerOptions& options,
+                   std::atomic<int>* num_connections, qintptr descriptor,
+                   quint64 connection_id);
+  ~ServerConnection();
+
+ private slots:
+  void OnReadyRead();
+  void OnDisconnected();
+  void ProcessNextRequest();
+  void StartResponse();
+  void Pump();
+
+ private:
+  struct Request {
+    QByteArray method;
+    QByteArray target;
+    QByteArray version;
+    QMap<QByteArray, QByteArray> headers;  // Names are lower case.
+  };
+  // A piece of a response: literal bytes, or `length` generated bytes
+  // starting at `offset` if `literal` is empty.
+  struct Part {
+    QByteArray literal;
+    qint64 offset;
+    qint64 length;
+  };
+
+  bool ParseRequest(const QByteArray& head, Request* request);
+  void HandleRequest(const Request& request);
+  void QueueHeaders(int status, const QList<QByteArray>& headers,
+                    qint64 content_length);
+  void QueueError(int status, const QByteArray& message);
+  void FinishResponse();
+  bool Chance(double probability);
+  int Jitter();
+
+  ServerOptions options_;
+  ShapingOptions shaping_;  // Of the current response.
+  std::atomic<int>* num_connections_;
+  bool is_over_cap_;
+  QTcpSocket* socket_;
+  QByteArray input_;
+  bool responding_;  // From reading a request until its response is sent.
+  bool sending_;  // Once the latency has passed.
+  bool close_after_response_;
+  std::deque<Part> parts_;
+  qint64 body_bytes_sent_;
+  qint64 reset_after_;  // Body bytes after which to reset, -1 for never.
+  qint64 allowance_;
+  qint64 last_refill_millis_;
+  QTimer pace_timer_;
+  QByteArray buffer_;
+  std::mt19937_64 random_;
+};
+
+// Creates the connections of one thread.
+class ConnectionAcceptor : public QObject {
+  Q_OBJECT
+
+ public:
+  ConnectionAcceptor(const ServerOptions& options,
+                     std::atomic<int>* num_connections);
+
+ public slots:
+  void Accept(qintptr descriptor, quint64 connection_id);
+
+ private:
+  ServerOptions options_;
+  std::atomic<int>* num_connections_;
+};
+
+// HTTP/1.1 server of generated files, for measuring the fetcher offline.
+// GET or HEAD /<size>[.ext], e.g. /100M.bin, returns a file of that many
+// bytes whose contents are given by FillGeneratedContent(). Single and
+// multiple byte ranges and If-Range are supported, and responses are shaped
+// by ShapingOptions. Connections are spread over a pool of threads.
+class RangeServer : public QTcpServer {
+  Q_OBJECT
+
+ public:
+  RangeServer(QObject* parent, const ServerOptions& options, int num_threads);
+  ~RangeServer();
+
+ protected:
+  // Override
+  void incomingConnection(qintptr descriptor);
+
+ private:
+  ServerOptions options_;
+  std::atomic<int> num_connections_;
+  std::vector<QThread*> threads_;
+  std::vector<ConnectionAcceptor*> acceptors_;
+  size_t next_thread_;
+  quint64 next_connection_id_;
+};
+
+#endif  // RANGE_SERVER_H_
@@ -0,0 +1,102 @@
+#include "range-server.h"
+#include "qaccelerator-utils.h"
+#include <iostream>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QHostAddress>
+#include <QThread>
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("qaccelerator-testserver");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Serves generated files with range support for benchmarks. "
+      "GET /<size>[.ext], e.g. /100M.bin. Shaping options can be "
+      "overridden per request with query parameters: rate, latency, "
+      "jitter, error_rate and reset_rate.");
+  parser.addHelpOption();
+  QCommandLineOption port_option("port", "Port to listen on (default 8080).",
+                                 "port", "8080");
+  QCommandLineOption bind_option(
+      "bind", "Address to listen on (default 127.0.0.1).", "address",
+      "127.0.0.1");
+  QCommandLineOption threads_option(
+      "threads", "Threads serving connections (default: one per core).",
+      "n", QString::number(QThread::idealThreadCount()));
+  QCommandLineOption rate_option(
+      "rate", "Bandwidth cap per connection in bytes per second, optionally "
+      "suffixed with K, M or G (default: none).", "rate", "0");
+  QCommandLineOption latency_option(
+      "latency", "Delay before each response.", "ms", "0");
+  QCommandLineOption jitter_option(
+      "jitter", "Random extra delay of up to this much before each response "
+      "and each pause of a rate capped connection.", "ms", "0");
+  QCommandLineOption max_connections_option(
+      "max-connections", "Answer connections past this many with the error "
+      "status (default: no cap).", "n", "0");
+  QCommandLineOption error_rate_option(
+      "error-rate", "Fraction of requests answered with the error status.",
+      "fraction", "0");
+  QCommandLineOption reset_rate_option(
+      "reset-rate", "Fraction of responses reset part way through the body.",
+      "fraction", "0");
+  QCommandLineOption error_status_option(
+      "error-status", "Status of injected errors, 503 or 429 (default 503).",
+      "status", "503");
+  QCommandLineOption retry_after_option(
+      "retry-after", "Retry-After sent with error statuses, 0 for none "
+      "(default 1).", "seconds", "1");
+  QCommandLineOption seed_option(
+      "seed", "Seed of the generated content (default 1).", "seed", "1");
+  QCommandLineOption verbose_option(
+      QStringList() << "v" << "verbose", "Log every request.");
+  parser.addOption(port_option);
+  parser.addOption(bind_option);
+  parser.addOption(threads_option);
+  parser.addOption(rate_option);
+  parser.addOption(latency_option);
+  parser.addOption(jitter_option);
+  parser.addOption(max_connections_option);
+  parser.addOption(error_rate_option);
+  parser.addOption(reset_rate_option);
+  parser.addOption(error_status_option);
+  parser.addOption(retry_after_option);
+  parser.addOption(seed_option);
+  parser.addOption(verbose_option);
+  parser.process(app);
+
+  ServerOptions options;
+  options.shaping.rate = ParseByteSize(parser.value(rate_option));
+  options.shaping.latency_ms = parser.value(latency_option).toInt();
+  options.shaping.jitter_ms = parser.value(jitter_option).toInt();
+  options.shaping.error_rate = parser.value(error_rate_option).toDouble();
+  options.shaping.reset_rate = parser.value(reset_rate_option).toDouble();
+  options.max_connections = parser.value(max_connections_option).toInt();
+  options.error_status = parser.value(error_status_option).toInt();
+  options.retry_after_s = parser.value(retry_after_option).toInt();
+  options.seed = parser.value(seed_option).toULongLong();
+  options.verbose = parser.isSet(verbose_option);
+  if (options.shaping.rate < 0) {
+    std::cerr << "Malformed rate." << std::endl;
+    return 2;
+  }
+  if (options.error_status != 503 && options.error_status != 429) {
+    std::cerr << "Error status must be 503 or 429." << std::endl;
+    return 2;
+  }
+
+  RangeServer server(&app, options, parser.value(threads_option).toInt());
+  QHostAddress address(parser.value(bind_option));
+  quint16 port = parser.value(port_option).toUShort();
+  if (!server.listen(address, port)) {
+    std::cerr << "Failed to listen on port " << port << ": "
+              << server.errorString().toLocal8Bit().constData() << std::endl;
+    return 1;
+  }
+  std::cerr << "Serving on http://"
+            << address.toString().toLocal8Bit().constData() << ":"
+            << server.serverPort() << "/" << std::endl;
+  return app.exec();
+}
@@ -0,0 +1,26 @@
+#-------------------------------------------------
+#
+# Local HTTP/1.1 server of generated files with range support and network
+# shaping, for benchmarking the fetcher offline.
+#
+#-------------------------------------------------
+
+QT       += core network
+QT       -= gui
+
+TARGET = qaccelerator-testserver
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+include(../../core/core-lib.pri)
+
+SOURCES += \
+    generated-content.cc \
+    range-server.cc \
+    testserver-main.cc
+
+HEADERS += \
+    generated-content.h \
+    range-server.h
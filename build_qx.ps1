@@ -24,7 +24,7 @@ if ($args[0] -eq 'first_stage') {
   $env:INCLUDE = cat env.include.txt
   $env:PATH += ";$compiler_dir"
 
-  qmake ../
+  qmake ../qaccelerator.pro
 
   if (!$?) {
     exit 2
@@ -0,0 +1,191 @@
+#include "capability-cache.h"
+
+#include "qaccelerator-utils.h"
+#include <algorithm>
+#include <QFile>
+#include <QJsonDocument>
+#include <QMutexLocker>
+#include <QSaveFile>
+
+const qint64 CapabilityCache::kTtlMillis = 7 * 24 * 3600 * 1000LL;
+const qint64 CapabilityCache::kThrottleTtlMillis = 24 * 3600 * 1000LL;
+
+OriginCapabilities::OriginCapabilities()
+    : accepts_ranges(-1),
+      accepts_ranges_millis(0),
+      http2(-1),
+      http2_millis(0),
+      throttled_connections(0),
+      throttled_millis(0) {}
+
+QJsonObject OriginCapabilities::ToJson() const {
+  QJsonObject object;
+  object["accepts_ranges"] = accepts_ranges;
+  object["accepts_ranges_millis"] = accepts_ranges_millis;
+  object["http2"] = http2;
+  object["http2_millis"] = http2_millis;
+  object["throttled_connections"] = throttled_connections;
+  object["throttled_millis"] = throttled_millis;
+  return object;
+}
+
+bool OriginCapabilities::FromJson(const QJsonObject& object,
+                                  OriginCapabilities* capabilities) {
+  // Caches written before fields had their own times have one for all.
+  double updated_millis = object["updated_millis"].toDouble();
+  capabilities->accepts_ranges = object["accepts_ranges"].toInt(-1);
+  capabilities->accepts_ranges_millis =
+      (qint64) object["accepts_ranges_millis"].toDouble(updated_millis);
+  capabilities->http2 = object["http2"].toInt(-1);
+  capabilities->http2_millis =
+      (qint64) object["http2_millis"].toDouble(updated_millis);
+  capabilities->throttled_connections =
+      object["throttled_connections"].toInt();
+  capabilities->throttled_millis =
+      (qint64) object["throttled_millis"].toDouble(updated_millis);
+  return !capabilities->IsEmpty();
+}
+
+void OriginCapabilities::Expire(qint64 now_millis) {
+  if (now_millis - accepts_ranges_millis >= CapabilityCache::kTtlMillis) {
+    accepts_ranges = -1;
+  }
+  if (now_millis - http2_millis >= CapabilityCache::kTtlMillis) {
+    http2 = -1;
+  }
+  if (now_millis - throttled_millis >= CapabilityCache::kThrottleTtlMillis) {
+    throttled_connections = 0;
+  }
+}
+
+bool OriginCapabilities::IsEmpty() const {
+  return accepts_ranges < 0 && http2 < 0 && throttled_connections == 0;
+}
+
+CapabilityCache* CapabilityCache::Instance() {
+  static CapabilityCache instance;
+  return &instance;
+}
+
+QString CapabilityCache::Origin(const QUrl& url) {
+  return url.adjusted(QUrl::RemoveUserInfo | QUrl::RemovePath
+                      | QUrl::RemoveQuery | QUrl::RemoveFragment)
+      .toString().toLower();
+}
+
+void CapabilityCache::Open(const QString& path) {
+  QMutexLocker locker(&mutex_);
+  path_ = path;
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return;
+  }
+  QJsonObject origins = QJsonDocument::fromJson(file.readAll()).object();
+  qint64 now = CurrentTimeMillis();
+  for (auto it = origins.constBegin(); it != origins.constEnd(); ++it) {
+    OriginCapabilities capabilities;
+    if (!OriginCapabilities::FromJson(it.value().toObject(), &capabilities)
+        || entries_.find(it.key()) != entries_.end()) {
+      continue;
+    }
+    capabilities.Expire(now);
+    if (!capabilities.IsEmpty()) {
+      entries_[it.key()] = capabilities;
+    }
+  }
+}
+
+void CapabilityCache::Save() {
+  QMutexLocker locker(&mutex_);
+  if (path_.isEmpty() || !dirty_) {
+    return;
+  }
+  QJsonObject origins;
+  qint64 now = CurrentTimeMillis();
+  for (const auto& entry : entries_) {
+    OriginCapabilities capabilities = entry.second;
+    capabilities.Expire(now);
+    if (!capabilities.IsEmpty()) {
+      origins[entry.first] = capabilities.ToJson();
+    }
+  }
+  // Written to a temporary file first, so a crash can't truncate the cache.
+  QSaveFile file(path_);
+  if (!file.open(QIODevice::WriteOnly)) {
+    qDebug() << "Failed to save capability cache to " << path_;
+    return;
+  }
+  file.write(QJsonDocument(origins).toJson(QJsonDocument::Compact));
+  if (file.commit()) {
+    dirty_ = false;
+  }
+}
+
+bool CapabilityCache::Get(const QUrl& url, OriginCapabilities* capabilities) {
+  QMutexLocker locker(&mutex_);
+  auto it = entries_.find(Origin(url));
+  if (it == entries_.end()) {
+    return false;
+  }
+  *capabilities = it->second;
+  capabilities->Expire(CurrentTimeMillis());
+  return !capabilities->IsEmpty();
+}
+
+int CapabilityCache::SafeNumConnections(const QUrl& url, int requested) {
+  OriginCapabilities capabilities;
+  if (!Get(url, &capabilities)) {
+    return requested;
+  }
+  if (capabilities.accepts_ranges == 0) {
+    return 1;
+  }
+  if (capabilities.throttled_connections > 0) {
+    return std::max(1, std::min(requested,
+                                capabilities.throttled_connections - 1));
+  }
+  return requested;
+}
+
+OriginCapabilities* CapabilityCache::Touch(const QUrl& url) {
+  OriginCapabilities* capabilities = &entries_[Origin(url)];
+  capabilities->Expire(CurrentTimeMillis());
+  dirty_ = true;
+  return capabilities;
+}
+
+void CapabilityCache::RecordRangeSupport(const QUrl& url,
+                                         bool accepts_ranges) {
+  QMutexLocker locker(&mutex_);
+  OriginCapabilities* capabilities = Touch(url);
+  capabilities->accepts_ranges = accepts_ranges ? 1 : 0;
+  capabilities->accepts_ranges_millis = CurrentTimeMillis();
+}
+
+void CapabilityCache::RecordHttp2(const QUrl& url, bool http2) {
+  QMutexLocker locker(&mutex_);
+  OriginCapabilities* capabilities = Touch(url);
+  capabilities->http2 = http2 ? 1 : 0;
+  capabilities->http2_millis = CurrentTimeMillis();
+}
+
+void CapabilityCache::RecordCompleted(const QUrl& url, int num_connections) {
+  QMutexLocker locker(&mutex_);
+  OriginCapabilities* capabilities = Touch(url);
+  if (capabilities->throttled_connections > 0
+      && num_connections >= capabilities->throttled_connections) {
+    // Whatever made the server throttle at this count has passed.
+    capabilities->throttled_connections = 0;
+    capabilities->throttled_millis = 0;
+  }
+}
+
+void CapabilityCache::RecordThrottled(const QUrl& url, int num_connections) {
+  QMutexLocker locker(&mutex_);
+  OriginCapabilities* capabilities = Touch(url);
+  if (capabilities->throttled_connections == 0
+      || num_connections <= capabilities->throttled_connections) {
+    capabilities->throttled_connections = num_connections;
+    capabilities->throttled_millis = CurrentTimeMillis();
+  }
+}
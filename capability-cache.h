@@ -0,0 +1,83 @@
+#ifndef CAPABILITY_CACHE_H_
+#define CAPABILITY_CACHE_H_
+
+#include <map>
+#include <QJsonObject>
+#include <QMutex>
+#include <QString>
+#include <QUrl>
+
+// What a server (scheme, host and port) was seen to support by earlier
+// downloads. Tri-state fields are -1 while unknown. Each field carries the
+// time it was last confirmed, and expires on its own.
+struct OriginCapabilities {
+  OriginCapabilities();
+
+  QJsonObject ToJson() const;
+  static bool FromJson(const QJsonObject& object,
+                       OriginCapabilities* capabilities);
+  // Forgets the fields that weren't confirmed recently enough.
+  void Expire(qint64 now_millis);
+  bool IsEmpty() const;
+
+  int accepts_ranges;  // Answers range requests with 206.
+  qint64 accepts_ranges_millis;
+  int http2;
+  qint64 http2_millis;
+  // Fewest connections that were open when the server answered 429 or 503;
+  // 0 if it didn't lately.
+  int throttled_connections;
+  qint64 throttled_millis;
+};
+
+// Capabilities of the servers downloaded from. Range and HTTP/2 support are
+// kept for kTtlMillis after they were last confirmed, and a throttling
+// limit for kThrottleTtlMillis, since it often reflects a passing load.
+// Thread-safe: workers record what they see from their own threads.
+//
+// Open() makes the cache persistent; without it, what is learned lasts
+// until the process exits.
+class CapabilityCache {
+ public:
+  static const qint64 kTtlMillis;
+  static const qint64 kThrottleTtlMillis;
+
+  static CapabilityCache* Instance();
+  static QString Origin(const QUrl& url);
+
+  // Loads the cache from `path` and saves it there from now on.
+  void Open(const QString& path);
+  // Writes the cache out if anything changed since it was last written.
+  void Save();
+
+  // Returns false if nothing unexpired is known about the origin of `url`.
+  // Expired fields of `capabilities` are unknown.
+  bool Get(const QUrl& url, OriginCapabilities* capabilities);
+  // How many of `requested` connections to open to the origin of `url`:
+  // one if it ignores ranges, and fewer than got it to throttle.
+  int SafeNumConnections(const QUrl& url, int requested);
+
+  void RecordRangeSupport(const QUrl& url, bool accepts_ranges);
+  void RecordHttp2(const QUrl& url, bool http2);
+  // A download completed without being throttled, with up to
+  // `num_connections` open at once. Lifts a throttling limit it reached.
+  void RecordCompleted(const QUrl& url, int num_connections);
+  // The server throttled while `num_connections` were open.
+  void RecordThrottled(const QUrl& url, int num_connections);
+
+ private:
+  CapabilityCache() : dirty_(false) {}
+  CapabilityCache(const CapabilityCache&) = delete;
+  CapabilityCache& operator=(const CapabilityCache&) = delete;
+
+  // Must be called with mutex_ held. Returns the entry for the origin of
+  // `url`, with its expired fields cleared, and marks the cache dirty.
+  OriginCapabilities* Touch(const QUrl& url);
+
+  QMutex mutex_;
+  QString path_;
+  std::map<QString, OriginCapabilities> entries_;
+  bool dirty_;
+};
+
+#endif  // CAPABILITY_CACHE_H_
@@ -0,0 +1,275 @@
+#include "cli-downloader.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <QDir>
+#include <QFileInfo>
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static const int kTimerIntervalMs = 100;
+// Progress is redrawn this often on a terminal, and printed as a new line
+// this often otherwise, so that logs of batch jobs stay readable.
+static const qint64 kTerminalPrintIntervalMs = 500;
+static const qint64 kLogPrintIntervalMs = 10000;
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+namespace {
+bool IsTerminal(FILE* stream) {
+#ifdef Q_OS_WIN
+  return _isatty(_fileno(stream));
+#else
+  return isatty(fileno(stream));
+#endif
+}
+}
+
+CliDownloader::CliDownloader(QObject* parent, const Options& options)
+    : QObject(parent),
+      options_(options),
+      next_url_(0),
+      num_failed_(0),
+      finalizer_(new Finalizer(this)),
+      file_size_(0),
+      stopping_(false),
+      finalizing_(false),
+      start_millis_(0),
+      start_downloaded_(0),
+      last_print_millis_(0),
+      is_terminal_(IsTerminal(stderr)),
+      last_line_length_(0) {
+  connect(&timer_, SIGNAL(timeout()), this, SLOT(OnTimer()));
+}
+
+void CliDownloader::Run() {
+  timer_.start(kTimerIntervalMs);
+  StartNext();
+}
+
+void CliDownloader::Interrupt() {
+  interrupted = 1;
+}
+
+bool CliDownloader::WasInterrupted() {
+  return interrupted != 0;
+}
+
+void CliDownloader::StartNext() {
+  if (WasInterrupted() || next_url_ >= options_.urls.size()) {
+    timer_.stop();
+    emit Finished();
+    return;
+  }
+  url_ = options_.urls[next_url_++];
+  FileSpecGetter* getter = new FileSpecGetter(next_url_, url_);
+  connect(getter, SIGNAL(ResultReady(FileSpec)),
+          this, SLOT(OnSpecReady(FileSpec)));
+  connect(getter, SIGNAL(Error(int, QNetworkReply::NetworkError)),
+          this, SLOT(OnSpecError(int, QNetworkReply::NetworkError)));
+  connect(getter, SIGNAL(Finished()), getter, SLOT(deleteLater()));
+  getter->Run();
+}
+
+void CliDownloader::OnSpecReady(FileSpec spec) {
+  if (WasInterrupted()) {
+    FinishCurrent(false, "interrupted");
+    return;
+  }
+  StartFetcher(spec);
+}
+
+void CliDownloader::OnSpecError(int id, QNetworkReply::NetworkError error) {
+  Q_UNUSED(id);
+  FinishCurrent(false, QString("request failed with error %1").arg(error));
+}
+
+void CliDownloader::StartFetcher(const FileSpec& spec) {
+  QString save_as = SaveAsFor(spec);
+  if (save_as.isEmpty()) {
+    return;  // FinishCurrent() was called.
+  }
+  file_size_ = spec.FileSize().Get();
+  // Files of unknown size can only be downloaded over one connection.
+  int num_connections = options_.num_connections;
+  if (file_size_ < 1) {
+    file_size_ = 0;
+    num_connections = 1;
+  }
+  fetcher_.reset(new Fetcher(url_, file_size_, save_as, finalizer_));
+  fetcher_->SetRateLimit(options_.rate_limit);
+  fetcher_->SetRampUp(options_.ramp_up);
+  connect(fetcher_.get(), SIGNAL(Completed()), this, SLOT(OnCompleted()));
+  connect(fetcher_.get(), SIGNAL(Error(QNetworkReply::NetworkError)),
+          this, SLOT(OnError(QNetworkReply::NetworkError)));
+  connect(fetcher_.get(), SIGNAL(Paused()), this, SLOT(OnPaused()));
+  connect(fetcher_.get(), SIGNAL(Finalizing(qint64, qint64)),
+          this, SLOT(OnFinalizing(qint64, qint64)));
+  stopping_ = false;
+  finalizing_ = false;
+  QString work_dir = save_as + ".qaccelerator";
+  if (file_size_ > 0 && QFileInfo(work_dir).exists()) {
+    Print(QString("Resuming %1").arg(save_as));
+    fetcher_->Resume(work_dir, num_connections);
+  } else {
+    connect(fetcher_.get(), &Fetcher::ChangeSaveAs,
+            [=] (const QString& new_save_as) {
+      Print(QString("Saving as %1").arg(new_save_as));
+    });
+    Print(QString("Downloading %1 to %2").arg(url_).arg(save_as));
+    fetcher_->Start(num_connections);
+  }
+  start_millis_ = CurrentTimeMillis();
+  start_downloaded_ = 0;
+  qint64 overall_downloaded = 0;
+  std::vector<std::pair<qint64, qint64> > thread_stats;
+  if (fetcher_->GetProgress(&overall_downloaded, &thread_stats)) {
+    start_downloaded_ = overall_downloaded;
+  }
+  last_print_millis_ = 0;
+}
+
+QString CliDownloader::SaveAsFor(const FileSpec& spec) {
+  QString mime_type;
+  if (!spec.MimeType().IsNull()) {
+    mime_type = spec.MimeType().Get().split(";").first().simplified();
+  }
+  QString output = options_.output.isEmpty() ? QDir::currentPath()
+                                             : options_.output;
+  QFileInfo output_info(output);
+  if (output_info.isDir()) {
+    // SuggestSaveAs() only avoids existing files, so an unfinished download
+    // of the same file, which has a work dir but no file yet, gets the same
+    // name and is resumed.
+    return SuggestSaveAs(spec.Url(), mime_type,
+                         output_info.absoluteFilePath());
+  }
+  if (options_.urls.size() > 1) {
+    FinishCurrent(false, output + " is not a directory");
+    return QString();
+  }
+  if (!QFileInfo(output_info.absolutePath()).isDir()) {
+    FinishCurrent(false, output_info.absolutePath() + " does not exist");
+    return QString();
+  }
+  return output_info.absoluteFilePath();
+}
+
+void CliDownloader::OnCompleted() {
+  PrintProgress(true);
+  FinishCurrent(true, "done");
+}
+
+void CliDownloader::OnError(QNetworkReply::NetworkError code) {
+  Print(QString("Connection error %1, pausing").arg(code));
+  if (!stopping_) {
+    stopping_ = true;
+    fetcher_->Stop();
+  }
+}
+
+void CliDownloader::OnPaused() {
+  if (WasInterrupted()) {
+    FinishCurrent(false, "interrupted, run again to resume");
+  } else {
+    FinishCurrent(false, "incomplete, run again to resume");
+  }
+}
+
+void CliDownloader::OnFinalizing(qint64 done_bytes, qint64 total_bytes) {
+  finalizing_ = true;
+  if (total_bytes > 0) {
+    Print(QString("Merging files (%1%)").arg(done_bytes * 100 / total_bytes));
+  }
+}
+
+void CliDownloader::OnTimer() {
+  if (fetcher_ == nullptr) {
+    return;
+  }
+  // A merge in progress can't be stopped and is quick, so it is left to
+  // finish.
+  if (WasInterrupted() && !stopping_ && !finalizing_) {
+    stopping_ = true;
+    fetcher_->Stop();
+  }
+  if (!finalizing_) {
+    PrintProgress(false);
+  }
+}
+
+void CliDownloader::FinishCurrent(bool ok, const QString& message) {
+  if (!ok) {
+    ++num_failed_;
+  }
+  Print(QString("%1: %2").arg(url_).arg(message), !ok);
+  // The fetcher may be the sender; it is deleted once control returns to
+  // the event loop.
+  if (fetcher_ != nullptr) {
+    fetcher_.release()->deleteLater();
+  }
+  StartNext();
+}
+
+void CliDownloader::PrintProgress(bool force) {
+  if (options_.quiet || fetcher_ == nullptr) {
+    return;
+  }
+  qint64 now = CurrentTimeMillis();
+  qint64 interval = is_terminal_ ? kTerminalPrintIntervalMs
+                                 : kLogPrintIntervalMs;
+  if (!force && now - last_print_millis_ < interval) {
+    return;
+  }
+  last_print_millis_ = now;
+  qint64 downloaded = 0;
+  std::vector<std::pair<qint64, qint64> > thread_stats;
+  if (!fetcher_->GetProgress(&downloaded, &thread_stats)) {
+    return;
+  }
+  qint64 elapsed = std::max(now - start_millis_, (qint64) 1);
+  qint64 speed = std::max(downloaded - start_downloaded_, (qint64) 0)
+      * 1000 / elapsed;
+  QString line;
+  if (file_size_ > 0) {
+    line = QString("%1% of %2").arg(
+        QString::number(downloaded * 100.0 / file_size_, 'f', 1))
+        .arg(IntFileSizeToString(file_size_));
+  } else {
+    line = IntFileSizeToString(downloaded);
+  }
+  line += QString(", %1/s").arg(IntFileSizeToString(speed));
+  if (file_size_ > 0 && speed > 0) {
+    qint64 seconds_left = (file_size_ - downloaded) / speed;
+    line += QString(", %1:%2 left")
+        .arg(seconds_left / 60)
+        .arg(seconds_left % 60, 2, 10, QChar('0'));
+  }
+  if (!is_terminal_) {
+    std::cerr << line.toLocal8Bit().constData() << std::endl;
+    return;
+  }
+  // Overwrite the previous progress line, padding it out if it was longer.
+  int length = line.length();
+  if (length < last_line_length_) {
+    line += QString(last_line_length_ - length, ' ');
+  }
+  last_line_length_ = length;
+  std::cerr << "\r" << line.toLocal8Bit().constData() << std::flush;
+}
+
+void CliDownloader::Print(const QString& line, bool even_if_quiet) {
+  if (options_.quiet && !even_if_quiet) {
+    return;
+  }
+  if (last_line_length_ > 0) {
+    std::cerr << std::endl;  // Keep the last progress line.
+    last_line_length_ = 0;
+  }
+  std::cerr << line.toLocal8Bit().constData() << std::endl;
+}
@@ -0,0 +1,84 @@
+#ifndef CLI_DOWNLOADER_H_
+#define CLI_DOWNLOADER_H_
+
+#include "fetcher.h"
+#include "finalizer.h"
+#include "qaccelerator-utils.h"
+#include <memory>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+
+// Downloads a list of urls one after the other with a Fetcher, without any
+// widgets, and reports progress on stderr.
+//
+// Downloads use the same work dirs as the GUI (`<save as>.qaccelerator`), so
+// a download that was interrupted, by either, is resumed when the same file
+// is requested again.
+class CliDownloader : public QObject {
+  Q_OBJECT
+
+ public:
+  struct Options {
+    QStringList urls;
+    int num_connections;
+    // File to save to if there is a single url, otherwise a directory.
+    // Empty for the current directory.
+    QString output;
+    qint64 rate_limit;  // Bytes per second, 0 for none.
+    Fetcher::RampUpPolicy ramp_up;
+    bool quiet;
+  };
+
+  CliDownloader(QObject* parent, const Options& options);
+
+  // Starts the first download. Finished() is emitted after the last one.
+  void Run();
+  // Pauses the current download, which keeps its work dir, and skips the
+  // rest. Safe to call from a signal handler.
+  static void Interrupt();
+
+  int NumFailed() { return num_failed_; }
+  bool WasInterrupted();
+
+ signals:
+  void Finished();
+
+ private slots:
+  void OnSpecReady(FileSpec spec);
+  void OnSpecError(int id, QNetworkReply::NetworkError error);
+  void OnCompleted();
+  void OnError(QNetworkReply::NetworkError code);
+  void OnPaused();
+  void OnFinalizing(qint64 done_bytes, qint64 total_bytes);
+  void OnTimer();
+
+ private:
+  void StartNext();
+  void StartFetcher(const FileSpec& spec);
+  void FinishCurrent(bool ok, const QString& message);
+  QString SaveAsFor(const FileSpec& spec);
+  void PrintProgress(bool force);
+  // Prints `line` on its own line. Only lines that are `even_if_quiet` are
+  // printed in quiet mode.
+  void Print(const QString& line, bool even_if_quiet = false);
+
+  Options options_;
+  int next_url_;
+  int num_failed_;
+  Finalizer* finalizer_;
+  std::unique_ptr<Fetcher> fetcher_;
+  QString url_;
+  qint64 file_size_;
+  bool stopping_;
+  bool finalizing_;
+  QTimer timer_;
+  qint64 start_millis_;
+  qint64 start_downloaded_;  // Bytes already on disk when the fetcher started.
+  qint64 last_print_millis_;
+  bool is_terminal_;
+  int last_line_length_;
+};
+
+#endif  // CLI_DOWNLOADER_H_
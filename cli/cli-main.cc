@@ -0,0 +1,175 @@
+#include "cli-downloader.h"
+#include "metrics-server.h"
+#include "tracer.h"
+#include "qaccelerator-utils.h"
+#include <csignal>
+#include <iostream>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QTextStream>
+
+static const int kDefaultNumConnections = 8;
+static bool verbose = false;
+
+namespace {
+bool ReadUrls(const QString& fpath, QStringList* urls) {
+  QFile file(fpath);
+  bool is_stdin = (fpath == "-");
+  if (is_stdin ? !file.open(stdin, QIODevice::ReadOnly)
+               : !file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QTextStream in(&file);
+  while (!in.atEnd()) {
+    QString line = in.readLine().trimmed();
+    if (!line.isEmpty() && !line.startsWith("#")) {
+      urls->append(line);
+    }
+  }
+  return true;
+}
+
+// The fetcher's debug output would garble the progress line.
+void HandleCliMessage(QtMsgType type, const QMessageLogContext& context,
+                      const QString& msg) {
+  Q_UNUSED(context);
+  if (type == QtDebugMsg && !verbose) {
+    return;
+  }
+  std::cerr << msg.toLocal8Bit().constData() << std::endl;
+}
+
+void OnInterrupt(int signal) {
+  Q_UNUSED(signal);
+  CliDownloader::Interrupt();
+}
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("qaccelerator-cli");
+  qRegisterMetaType<FileSpec>();
+  qRegisterMetaType<QNetworkReply::NetworkError>();
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Downloads files over several connections. Interrupted downloads "
+      "are resumed when run again with the same output.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("urls", "Urls to download.", "[urls...]");
+  QCommandLineOption input_option(
+      QStringList() << "i" << "input",
+      "Read urls, one per line, from <file>, or stdin if it is -.", "file");
+  QCommandLineOption connections_option(
+      QStringList() << "c" << "connections",
+      QString("Number of connections per download (default %1).")
+          .arg(kDefaultNumConnections),
+      "n", QString::number(kDefaultNumConnections));
+  QCommandLineOption output_option(
+      QStringList() << "o" << "output",
+      "File to save a single download as, or directory to save downloads "
+      "in (default: the current directory).", "path");
+  QCommandLineOption rate_option(
+      QStringList() << "r" << "rate-limit",
+      "Overall download rate cap in bytes per second, optionally suffixed "
+      "with K, M or G.", "rate");
+  QCommandLineOption ramp_up_option(
+      "ramp-up",
+      QString("Open connections one at a time, at most every <ms> "
+              "milliseconds, while each speeds the download up; 0 opens all "
+              "at once (default %1).")
+          .arg(Fetcher::RampUpPolicy().interval_ms),
+      "ms");
+  QCommandLineOption metrics_port_option(
+      "metrics-port",
+      "Serve metrics in the Prometheus text format at "
+      "http://127.0.0.1:<port>/metrics while downloading.", "port");
+  QCommandLineOption trace_option(
+      "trace",
+      "Write a Chrome trace of the downloads to <file>, for chrome://tracing "
+      "or ui.perfetto.dev.", "file");
+  QCommandLineOption quiet_option(
+      QStringList() << "q" << "quiet", "Only report failures.");
+  QCommandLineOption verbose_option(
+      QStringList() << "v" << "verbose", "Print debug output.");
+  parser.addOption(input_option);
+  parser.addOption(connections_option);
+  parser.addOption(output_option);
+  parser.addOption(rate_option);
+  parser.addOption(ramp_up_option);
+  parser.addOption(metrics_port_option);
+  parser.addOption(trace_option);
+  parser.addOption(quiet_option);
+  parser.addOption(verbose_option);
+  parser.process(app);
+
+  CliDownloader::Options options;
+  options.urls = parser.positionalArguments();
+  if (parser.isSet(input_option)
+      && !ReadUrls(parser.value(input_option), &options.urls)) {
+    std::cerr << "Failed to read " << parser.value(input_option).toLocal8Bit()
+        .constData() << std::endl;
+    return 2;
+  }
+  if (options.urls.isEmpty()) {
+    parser.showHelp(2);
+  }
+  bool ok = false;
+  options.num_connections = parser.value(connections_option).toInt(&ok);
+  if (!ok || options.num_connections < 1
+      || options.num_connections > kMaxConnections) {
+    std::cerr << "Connections must be between 1 and " << kMaxConnections
+              << "." << std::endl;
+    return 2;
+  }
+  options.rate_limit = 0;
+  if (parser.isSet(rate_option)) {
+    options.rate_limit = ParseByteSize(parser.value(rate_option));
+    if (options.rate_limit < 0) {
+      std::cerr << "Malformed rate limit." << std::endl;
+      return 2;
+    }
+  }
+  if (parser.isSet(ramp_up_option)) {
+    options.ramp_up.interval_ms = parser.value(ramp_up_option).toInt(&ok);
+    if (!ok || options.ramp_up.interval_ms < 0) {
+      std::cerr << "Malformed ramp-up interval." << std::endl;
+      return 2;
+    }
+  }
+  int metrics_port = 0;
+  if (parser.isSet(metrics_port_option)) {
+    metrics_port = parser.value(metrics_port_option).toInt(&ok);
+    if (!ok || metrics_port < 1 || metrics_port > 65535) {
+      std::cerr << "Metrics port must be between 1 and 65535." << std::endl;
+      return 2;
+    }
+  }
+  options.output = parser.value(output_option);
+  options.quiet = parser.isSet(quiet_option);
+  verbose = parser.isSet(verbose_option);
+  qInstallMessageHandler(HandleCliMessage);
+
+  if (parser.isSet(trace_option)
+      && !Tracer::Instance()->Start(parser.value(trace_option))) {
+    std::cerr << "Failed to open " << parser.value(trace_option).toLocal8Bit()
+        .constData() << std::endl;
+    return 2;
+  }
+  CliDownloader downloader(&app, options);
+  MetricsServer metrics_server(&app);
+  if (metrics_port > 0 && !metrics_server.Start(metrics_port)) {
+    return 2;
+  }
+  QObject::connect(&downloader, SIGNAL(Finished()), &app, SLOT(quit()));
+  std::signal(SIGINT, OnInterrupt);
+  std::signal(SIGTERM, OnInterrupt);
+  downloader.Run();
+  app.exec();
+  Tracer::Instance()->Stop();
+  if (downloader.WasInterrupted()) {
+    return 130;
+  }
+  return downloader.NumFailed() > 0 ? 1 : 0;
+}
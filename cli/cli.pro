@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# Headless command-line downloader built on Fetcher.
+#
+#-------------------------------------------------
+
+QT       += core network
+QT       -= gui
+
+TARGET = qaccelerator-cli
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+include(../core/core-lib.pri)
+
+SOURCES += \
+    cli-downloader.cc \
+    cli-main.cc
+
+HEADERS += \
+    cli-downloader.h
@@ -0,0 +1,185 @@
+#include "connection-telemetry.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QMutexLocker>
+
+const qint64 SegmentTimeline::kStallThresholdMs;
+const qint64 SegmentTimeline::kSampleIntervalMs;
+const size_t SegmentTimeline::kMaxSamples;
+
+namespace {
+const char* kTelemetryFname = "telemetry.jsonl";
+}
+
+SegmentTimeline::SegmentTimeline()
+    : worker_id(-1),
+      segment(0, -1),
+      attempt(0),
+      request_millis(-1),
+      encrypted_millis(-1),
+      response_millis(-1),
+      first_byte_millis(-1),
+      end_millis(-1),
+      bytes(0),
+      http_status(0),
+      error(0),
+      num_stalls(0),
+      stall_millis(0),
+      num_writes(0),
+      write_nanos(0),
+      max_write_nanos(0),
+      sample_interval_millis(kSampleIntervalMs) {}
+
+qint64 SegmentTimeline::TimeToFirstByte() const {
+  if (request_millis < 0 || first_byte_millis < 0) {
+    return -1;
+  }
+  return first_byte_millis - request_millis;
+}
+
+qint64 SegmentTimeline::Duration(qint64 now_millis) const {
+  if (request_millis < 0) {
+    return 0;
+  }
+  return (IsFinished() ? end_millis : now_millis) - request_millis;
+}
+
+void SegmentTimeline::AddSample(qint64 now_millis, qint64 num_bytes) {
+  qint64 elapsed = now_millis - request_millis;
+  if (!samples.empty()
+      && elapsed - samples.back().first < sample_interval_millis) {
+    return;
+  }
+  if (samples.size() >= kMaxSamples) {
+    size_t kept = 0;
+    for (size_t i = 0; i < samples.size(); i += 2) {
+      samples[kept++] = samples[i];
+    }
+    samples.resize(kept);
+    sample_interval_millis *= 2;
+  }
+  samples.push_back(std::make_pair(elapsed, num_bytes));
+}
+
+QJsonObject SegmentTimeline::ToJson() const {
+  QJsonObject object;
+  object["worker"] = worker_id;
+  object["first"] = segment.first;
+  object["last"] = segment.second;
+  object["attempt"] = attempt;
+  object["request_ms"] = request_millis;
+  object["encrypted_ms"] = encrypted_millis;
+  object["response_ms"] = response_millis;
+  object["first_byte_ms"] = first_byte_millis;
+  object["end_ms"] = end_millis;
+  object["bytes"] = bytes;
+  object["status"] = http_status;
+  object["error"] = error;
+  object["stalls"] = num_stalls;
+  object["stall_ms"] = stall_millis;
+  object["writes"] = num_writes;
+  object["write_ns"] = write_nanos;
+  object["max_write_ns"] = max_write_nanos;
+  QJsonArray json_samples;
+  for (const auto& sample : samples) {
+    json_samples.append(QJsonArray({sample.first, sample.second}));
+  }
+  object["samples"] = json_samples;
+  return object;
+}
+
+bool SegmentTimeline::FromJson(const QJsonObject& object,
+                               SegmentTimeline* timeline) {
+  if (!object.contains("worker") || !object.contains("request_ms")) {
+    return false;
+  }
+  // Qt 5 stores JSON numbers as doubles, which hold byte offsets exactly.
+  timeline->worker_id = object["worker"].toInt();
+  timeline->segment = Segment((qint64) object["first"].toDouble(),
+                              (qint64) object["last"].toDouble());
+  timeline->attempt = object["attempt"].toInt();
+  timeline->request_millis = object["request_ms"].toDouble();
+  timeline->encrypted_millis = object["encrypted_ms"].toDouble(-1);
+  timeline->response_millis = object["response_ms"].toDouble(-1);
+  timeline->first_byte_millis = object["first_byte_ms"].toDouble(-1);
+  timeline->end_millis = object["end_ms"].toDouble(-1);
+  timeline->bytes = object["bytes"].toDouble();
+  timeline->http_status = object["status"].toInt();
+  timeline->error = object["error"].toInt();
+  timeline->num_stalls = object["stalls"].toInt();
+  timeline->stall_millis = object["stall_ms"].toDouble();
+  timeline->num_writes = object["writes"].toDouble();
+  timeline->write_nanos = object["write_ns"].toDouble();
+  timeline->max_write_nanos = object["max_write_ns"].toDouble();
+  timeline->samples.clear();
+  for (const QJsonValue& value : object["samples"].toArray()) {
+    QJsonArray sample = value.toArray();
+    timeline->samples.push_back(std::make_pair(
+        (qint64) sample.at(0).toDouble(), (qint64) sample.at(1).toDouble()));
+  }
+  return true;
+}
+
+void ConnectionTelemetry::Open(const QString& work_dir) {
+  QString path = JoinPath(work_dir, kTelemetryFname);
+  QMutexLocker locker(&mutex_);
+  if (path == path_) {
+    return;
+  }
+  path_ = path;
+  finished_.clear();
+  in_progress_.clear();
+  QFile file(path_);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return;  // Nothing saved yet.
+  }
+  while (!file.atEnd()) {
+    QByteArray line = file.readLine().trimmed();
+    if (line.isEmpty()) {
+      continue;
+    }
+    SegmentTimeline timeline;
+    // A line cut short by a crash is skipped.
+    if (SegmentTimeline::FromJson(QJsonDocument::fromJson(line).object(),
+                                  &timeline)) {
+      finished_.push_back(timeline);
+    }
+  }
+}
+
+void ConnectionTelemetry::Update(const SegmentTimeline& timeline) {
+  QMutexLocker locker(&mutex_);
+  if (!timeline.IsFinished()) {
+    in_progress_[timeline.worker_id] = timeline;
+    return;
+  }
+  in_progress_.erase(timeline.worker_id);
+  finished_.push_back(timeline);
+  Append(timeline);
+}
+
+void ConnectionTelemetry::Snapshot(std::vector<SegmentTimeline>* timelines) {
+  QMutexLocker locker(&mutex_);
+  timelines->insert(timelines->end(), finished_.begin(), finished_.end());
+  for (const auto& entry : in_progress_) {
+    timelines->push_back(entry.second);
+  }
+}
+
+void ConnectionTelemetry::Append(const SegmentTimeline& timeline) {
+  if (path_.isEmpty() || !QFileInfo(path_).dir().exists()) {
+    return;
+  }
+  // The file is not kept open, so that the work dir can be removed on any
+  // platform as soon as the download is done.
+  QFile file(path_);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+    qDebug() << "Failed to open " << path_ << ": " << file.errorString();
+    return;
+  }
+  file.write(QJsonDocument(timeline.ToJson()).toJson(QJsonDocument::Compact));
+  file.write("\n");
+}
@@ -0,0 +1,93 @@
+#ifndef CONNECTION_TELEMETRY_H_
+#define CONNECTION_TELEMETRY_H_
+
+#include "qaccelerator-utils.h"
+#include <map>
+#include <utility>
+#include <vector>
+#include <QJsonObject>
+#include <QMutex>
+#include <QString>
+
+// What happened to one segment request of a FetcherWorker, from sending the
+// request until the segment finished, failed or was stopped. Times are in
+// milliseconds since the epoch, or -1 for events that haven't happened. Qt
+// doesn't report when the TCP connection is up, so the time to the TLS
+// handshake (or to the response, for plain HTTP) includes DNS and connect,
+// and is close to zero for a kept-alive connection.
+struct SegmentTimeline {
+  // Gaps longer than this between two reads of data count as stalls.
+  static const qint64 kStallThresholdMs = 1000;
+  // Samples of the bytes downloaded are taken at least this far apart.
+  static const qint64 kSampleIntervalMs = 1000;
+  // When there are this many samples, every other one is dropped and the
+  // interval doubles, so long segments keep a bounded timeline.
+  static const size_t kMaxSamples = 256;
+
+  SegmentTimeline();
+
+  bool IsFinished() const { return end_millis >= 0; }
+  // Relative to request_millis, or -1.
+  qint64 TimeToFirstByte() const;
+  qint64 Duration(qint64 now_millis) const;
+  // Records that `num_bytes` of the segment were written by `now_millis`.
+  void AddSample(qint64 now_millis, qint64 num_bytes);
+
+  QJsonObject ToJson() const;
+  static bool FromJson(const QJsonObject& object, SegmentTimeline* timeline);
+
+  int worker_id;
+  Segment segment;  // As requested; (0, -1) if the file size is unknown.
+  int attempt;  // 0 for the first request of the segment.
+  qint64 request_millis;
+  qint64 encrypted_millis;  // TLS handshake done.
+  qint64 response_millis;  // Response headers received.
+  qint64 first_byte_millis;
+  qint64 end_millis;
+  qint64 bytes;  // Written to the shard.
+  int http_status;  // 0 until the headers arrive.
+  int error;  // A QNetworkReply::NetworkError.
+  int num_stalls;
+  qint64 stall_millis;
+  qint64 num_writes;
+  qint64 write_nanos;  // Spent writing to the shard.
+  qint64 max_write_nanos;
+  // (milliseconds since request_millis, bytes), oldest first.
+  std::vector<std::pair<qint64, qint64> > samples;
+  qint64 sample_interval_millis;
+};
+
+// Timelines of all segment requests of one download. Workers update the
+// timeline of their current request from their own threads, about once a
+// second and on every event, and any thread can take a snapshot.
+//
+// Finished timelines are appended to a file in the work dir, one JSON object
+// per line, so the telemetry of a download spans pauses and restarts.
+class ConnectionTelemetry {
+ public:
+  ConnectionTelemetry() {}
+
+  // Loads the timelines saved in `work_dir` and saves finished ones there
+  // from now on. Does nothing if `work_dir` is already open.
+  void Open(const QString& work_dir);
+  // Replaces the timeline of the worker's current request. Once it is
+  // finished, the worker's next timeline starts a new entry.
+  void Update(const SegmentTimeline& timeline);
+  // Finished timelines in the order they finished, then the ones in
+  // progress.
+  void Snapshot(std::vector<SegmentTimeline>* timelines);
+
+ private:
+  ConnectionTelemetry(const ConnectionTelemetry&) = delete;
+  ConnectionTelemetry& operator=(const ConnectionTelemetry&) = delete;
+
+  void Append(const SegmentTimeline& timeline);
+
+  QMutex mutex_;
+  QString path_;
+  std::vector<SegmentTimeline> finished_;
+  // Keyed by worker id.
+  std::map<int, SegmentTimeline> in_progress_;
+};
+
+#endif  // CONNECTION_TELEMETRY_H_
@@ -0,0 +1,18 @@
+# Links the including project against qaccelerator-core. Works from any
+# directory of the tree, as long as the tree is built from the top-level
+# project so that core is built first.
+
+QT += core network sql
+CONFIG += c++11
+
+INCLUDEPATH += $$PWD/..
+DEPENDPATH += $$PWD/..
+
+CORE_BUILD_DIR = $$OUT_PWD/$$relative_path($$PWD, $$_PRO_FILE_PWD_)
+win32:CONFIG(release, debug|release): CORE_BUILD_DIR = $$CORE_BUILD_DIR/release
+else:win32:CONFIG(debug, debug|release): CORE_BUILD_DIR = $$CORE_BUILD_DIR/debug
+
+LIBS += -L$$CORE_BUILD_DIR -lqaccelerator-core
+
+win32-msvc*: PRE_TARGETDEPS += $$CORE_BUILD_DIR/qaccelerator-core.lib
+else: PRE_TARGETDEPS += $$CORE_BUILD_DIR/libqaccelerator-core.a
@@ -0,0 +1,48 @@
+#-------------------------------------------------
+#
+# The download engine and storage, without any widgets, as a static library
+# shared by the GUI, the command-line downloader and the benchmarks.
+#
+#-------------------------------------------------
+
+QT       += core network sql
+QT       -= gui
+
+TARGET = qaccelerator-core
+TEMPLATE = lib
+
+CONFIG += c++11 staticlib
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    ../capability-cache.cc \
+    ../categorizer.cc \
+    ../connection-telemetry.cc \
+    ../download-queue.cc \
+    ../engine-metrics.cc \
+    ../fetcher.cc \
+    ../finalizer.cc \
+    ../logger.cc \
+    ../metrics-server.cc \
+    ../qaccelerator-db.cc \
+    ../qaccelerator-utils.cc \
+    ../segment-allocator.cc \
+    ../speed-history.cc \
+    ../tracer.cc
+
+HEADERS += \
+    ../capability-cache.h \
+    ../categorizer.h \
+    ../connection-telemetry.h \
+    ../download-queue.h \
+    ../engine-metrics.h \
+    ../fetcher.h \
+    ../finalizer.h \
+    ../logger.h \
+    ../metrics-server.h \
+    ../qaccelerator-db.h \
+    ../qaccelerator-utils.h \
+    ../segment-allocator.h \
+    ../speed-history.h \
+    ../tracer.h
@@ -197,6 +197,14 @@ void DownloadDialog::OnFileSpecReady(FileSpec spec) {
   }
   if (spec.FileSize().Get() > 0) {
     file_size = IntFileSizeToString(spec.FileSize().Get());
+    // Unless the user already picked a count, start with what worked best
+    // for the host.
+    int default_num_connections;
+    preference_manager_->Get("num_connections", &default_num_connections);
+    if (num_connections_sbox_->value() == default_num_connections) {
+      num_connections_sbox_->setValue(
+          preference_manager_->DefaultNumConnections(spec.Url()));
+    }
   } else {
     num_connections_sbox_->setValue(1);
   }
@@ -1,13 +1,11 @@
 #include "download-monitor-page.h"
 
 #include <QFile>
-#include <QTextStream>
 #include <QVBoxLayout>
 #include <QLabel>
 #include <Qt>
 #include <QGridLayout>
 #include <QGroupBox>
-#include <QScrollArea>
 #include <QSpinBox>
 #include <QPushButton>
 #include <QStackedWidget>
@@ -26,8 +24,6 @@ static const int kMaxSaveAsLen = 100;
 static const int kMaxCentralFnameLen = 70;
 static const qint64 kSpeedUpdateInterval = 500;
 
-static const char* kPointsFname = "points.csv";
-
 namespace {
 QString Truncate(const QString& in, int max_length) {
   if (max_length < 4) {
@@ -38,46 +34,18 @@ QString Truncate(const QString& in, int max_length) {
   }
   return in.mid(0, max_length - 3) + "...";
 }
-
-void ReadCoordsFromCSV(const QString& fpath,
-                       vector<double>* out) {
-  QFile file(fpath);
-  if (file.open(QIODevice::ReadOnly)) {
-    QTextStream stream(&file);
-    while(!stream.atEnd()) {
-      QVariant line = QVariant(stream.readLine());
-      bool ok = false;
-      double parsed = line.toDouble(&ok);
-      if (!ok) {
-        DIE() << "Failed to parse double in coords file.";
-      }
-      out->push_back(parsed);
-    }
-  } else {
-    // DIE() << "Failed to open coords file for reading.";
-  }
-}
-
-void DumpCoordsToCSV(const vector<double>& ys, const QString& fpath) {
-  QFile file(fpath);
-  if (file.open(QIODevice::WriteOnly)) {
-    QTextStream stream(&file);
-    for (double coord : ys) {
-      stream << coord << endl;
-    }
-    file.close();
-  } else {
-    DIE() << "Failed to open coords file for writing.";
-  }
-}
 }
 
 // Have this take a db item and delegate from other ctors to it.
 DownloadMonitorPage::DownloadMonitorPage(QWidget* parent, Session* session,
-                                         PreferenceManager* preference_manager)
+                                         PreferenceManager* preference_manager,
+                                         UiTicker* ticker,
+                                         Finalizer* finalizer)
     : QWidget(parent),
       session_(session),
-      preference_manager_(preference_manager) {
+      preference_manager_(preference_manager),
+      ticker_(ticker),
+      finalizer_(finalizer) {
   if (parent == nullptr) {
     DIE() << "Parent of download monitor page cannot be null.";
   }
@@ -96,23 +64,25 @@ void DownloadMonitorPage::Init() {
   } else {
     non_resume_mode_ = false;
   }
-  preference_manager_->ApplySavedPreferences(SpeedGrapherState::IN_PROGRESS,
-                                             grapher_,
-                                             false);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(
+      SpeedGrapherState::IN_PROGRESS), false);
   fname_ = FileName(db_item_.SaveAs().Get());
   progress_ = 0;
+  finalizing_ = false;
+  finalizing_progress_ = 0;
   stop_watch_.Reset(db_item_.MillisElapsed().Get());
-  connect(&progress_updater_, SIGNAL(timeout()), this, SLOT(UpdateProgress()));
+  last_progress_update_ = 0;
+  last_speed_update_ = 0;
+  grapher_is_stale_ = false;
   prev_downloaded_bytes_ = 0;
   downloaded_bytes_ = 0;
-  connect(&speed_updater_, SIGNAL(timeout()), this, SLOT(UpdateSpeed()));
   QVBoxLayout* main_layout = new QVBoxLayout(this);
   main_layout->setSpacing(0);
   main_layout->setContentsMargins(5, 5, 5, 5);
   main_layout->setAlignment(Qt::Alignment(Qt::AlignTop | Qt::AlignLeft));
   SetUpSpeedGrapher();
   SetUpProgressStats();
-  SetUpShardBox();
+  SetUpSegmentMap();
   SetUpNumConnectionsWidgets();
   SetUpControlBox();
   setFixedSize(sizeHint());
@@ -122,8 +92,11 @@ void DownloadMonitorPage::Init() {
 DownloadMonitorPage::DownloadMonitorPage(QWidget* parent,
                                          Session* session,
                                          PreferenceManager* preference_manager,
+                                         UiTicker* ticker,
+                                         Finalizer* finalizer,
                                          const DownloadItem& item)
-    : DownloadMonitorPage(parent, session, preference_manager) {
+    : DownloadMonitorPage(parent, session, preference_manager, ticker,
+                          finalizer) {
   db_item_ = item;
   Init();
 }
@@ -170,18 +143,14 @@ void DownloadMonitorPage::SetUpProgressStats() {
   layout()->addWidget(progress_box);
 }
 
-void DownloadMonitorPage::SetUpShardBox() {
-  shard_box_ = new QGroupBox(this);
-  shard_box_->setStyleSheet(kUmemeStyle);
-  QGridLayout* shard_layout = new QGridLayout(shard_box_);
-  shard_layout->setAlignment(Qt::Alignment(Qt::AlignTop));
-  shard_layout->setVerticalSpacing(8);
-  QScrollArea* scroll_area = new QScrollArea(this);
-  scroll_area->setWidgetResizable(true);
-  scroll_area->setGeometry(0, 0, 650, 300);
-  scroll_area->setFixedSize(scroll_area->size());
-  scroll_area->setWidget(shard_box_);
-  layout()->addWidget(scroll_area);
+void DownloadMonitorPage::SetUpSegmentMap() {
+  QGroupBox* segment_box = new QGroupBox(this);
+  segment_box->setStyleSheet(kUmemeStyle);
+  QVBoxLayout* segment_layout = new QVBoxLayout(segment_box);
+  segment_map_ = new SegmentMap(this);
+  segment_map_->setFixedWidth(650);
+  segment_layout->addWidget(segment_map_);
+  layout()->addWidget(segment_box);
 }
 
 // TODO(ogaro): Do we need to store the gbox, label and spin as member vars?
@@ -261,42 +230,25 @@ void DownloadMonitorPage::SetUpControlBox() {
   layout()->addWidget(control_box);
 }
 
-void DownloadMonitorPage::DrawShardGrid() {
-  QGridLayout* shard_layout = dynamic_cast<QGridLayout*>(shard_box_->layout());
-  QLayoutItem* child = shard_layout->takeAt(0);
-  while(child != nullptr) {
-    shard_layout->removeWidget(child->widget());
-    child->widget()->setParent(nullptr);
-    delete child;
-    child = shard_layout->takeAt(0);
-  }
-  shard_rows_.clear();
-
-  for (int i = 0; i < db_item_.NumConnections().Get(); ++i) {
-    shard_rows_.emplace_back(new QLabel(this), new QProgressBar(this));
-    QLabel* progress_label = shard_rows_.back().Label();
-    QProgressBar* bar = shard_rows_.back().ProgressBar();
-    progress_label->setText("0 bytes");
-    QLabel* id_label = new QLabel(this);
-    id_label->setText(QString("Connection %1").arg(i + 1));
-    shard_layout->addWidget(id_label, i, 0);
-    shard_layout->addWidget(progress_label, i, 1);
-    bar->setRange(0, 100);
-    bar->setValue(0);
-    bar->setMinimumHeight(10);
-    bar->setMaximumHeight(10);
-    shard_layout->addWidget(bar, i, 2);
-  }
+void DownloadMonitorPage::ResetSegmentMap() {
+  segment_map_->SetAllocations(db_item_.FileSize().Get(),
+                               fetcher_->PreDownloadedSegments(),
+                               fetcher_->Allocations());
 }
 
 bool DownloadMonitorPage::StartDownload() {
   qDebug() << "Starting download.";
-  DrawShardGrid();
   fetcher_.reset(new Fetcher(db_item_.Url().Get(),
                              db_item_.FileSize().Get(),
-                             db_item_.SaveAs().Get()));
+                             db_item_.SaveAs().Get(),
+                             finalizer_));
+  Fetcher::RampUpPolicy ramp_up;
+  preference_manager_->Get("ramp_up_interval_ms", &ramp_up.interval_ms);
+  fetcher_->SetRampUp(ramp_up);
   connect(fetcher_.get(), SIGNAL(Completed()),
           this, SLOT(OnCompleted()));
+  connect(fetcher_.get(), SIGNAL(Finalizing(qint64, qint64)),
+          this, SLOT(OnFinalizing(qint64, qint64)));
   connect(fetcher_.get(), SIGNAL(Error(QNetworkReply::NetworkError)),
           this, SLOT(OnDownloadError(QNetworkReply::NetworkError)));
   connect(fetcher_.get(), &Fetcher::ChangeSaveAs,
@@ -306,10 +258,13 @@ bool DownloadMonitorPage::StartDownload() {
     save_as_value_label_->setText(Truncate(new_save_as, kMaxSaveAsLen));
   });
   connect(fetcher_.get(), SIGNAL(Paused()), this, SLOT(OnPaused()));
+  connect(fetcher_.get(), SIGNAL(AllocationsChanged()),
+          this, SLOT(ResetSegmentMap()));
   Nullable<QString> work_dir = db_item_.WorkDir();
   if (work_dir.IsNull() || work_dir.Get().isEmpty()) {
     fetcher_->Start(db_item_.NumConnections().Get());
     db_item_.SetWorkDir(fetcher_->WorkDir());
+    speed_history_.Open(fetcher_->WorkDir());
     stop_watch_.Reset(db_item_.MillisElapsed().Get());
     db_item_.SetStartTime(CurrentTimeMillis());
   } else {
@@ -317,16 +272,15 @@ bool DownloadMonitorPage::StartDownload() {
       CHECK(QDir(work_dir.Get()).mkpath("."));
       // DIE() << "Work dir " << work_dir.Get() << " does not exist.";
     }
-    vector<double> coords;
-    ReadCoordsFromCSV(JoinPath(work_dir.Get(), kPointsFname), &coords);
-    grapher_->SetData(coords);
+    speed_history_.Open(work_dir.Get());
+    grapher_->SetData(speed_history_.Points());
     fetcher_->Resume(work_dir.Get(), db_item_.NumConnections().Get());
   }
-  speed_updater_.start(kSpeedUpdateInterval);
-  progress_updater_.start(kProgressUpdateInterval);
+  ResetSegmentMap();
+  StartUpdates();
   stop_watch_.Start();
   db_item_.SetStatus(DownloadItem::StatusEnum::IN_PROGRESS);
-  emit RefreshDownloadsTable();
+  emit RefreshDownloadsTable(db_item_.Id());
   return true;
 }
 
@@ -336,22 +290,21 @@ std::pair<int, double> DownloadMonitorPage::GetProgress() {
 
 void DownloadMonitorPage::Resume() {
   pause_button_->setEnabled(false);
-  preference_manager_->ApplySavedPreferences(SpeedGrapherState::IN_PROGRESS,
-                                             grapher_,
-                                             false);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(
+      SpeedGrapherState::IN_PROGRESS), false);
   fetcher_->Resume(db_item_.NumConnections().Get());
+  ResetSegmentMap();
   stop_watch_.Start();
-  speed_updater_.start(kSpeedUpdateInterval);
-  progress_updater_.start(kProgressUpdateInterval);
+  StartUpdates();
   db_item_.SetStatus(DownloadItem::StatusEnum::IN_PROGRESS);
-  emit RefreshDownloadsTable();
+  emit RefreshDownloadsTable(db_item_.Id());
   pause_button_->setText("Pause");
   pause_button_->setEnabled(true);
   close_button_->setEnabled(true);
 }
 
 void DownloadMonitorPage::Pause() {
-  if (waiting_for_paused_) {
+  if (waiting_for_paused_ || finalizing_) {
     return;
   }
   waiting_for_paused_ = true;
@@ -359,37 +312,36 @@ void DownloadMonitorPage::Pause() {
   num_connections_box_->setEnabled(false);
   pause_button_->setText("Pausing...");
   UpdateProgress();
-  progress_updater_.stop();
-  speed_updater_.stop();
+  StopUpdates();
   stop_watch_.Stop();
   fetcher_->Stop();
 }
 
 void DownloadMonitorPage::OnPaused() {
   waiting_for_paused_ = false;
-  if (speed_updater_.isActive()) {
-    progress_updater_.stop();
-    speed_updater_.stop();
+  if (ticker_->IsSubscribed(this)) {
+    StopUpdates();
     stop_watch_.Stop();
   }
-  preference_manager_->ApplySavedPreferences(SpeedGrapherState::PAUSED,
-                                             grapher_,
-                                             false);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(
+      SpeedGrapherState::PAUSED), false);
+  segment_map_->ClearConnections();
+  if (finalizing_) {  // The merge failed.
+    finalizing_ = false;
+    button2_stack_->setEnabled(true);
+  }
   if (cancel_on_paused_) {
     OnCancelled();
   } else if (resume_on_paused_) {
-    DrawShardGrid();
     Resume();
     resume_on_paused_ = false;
   } else {
     pause_button_->setText("Resume");
     close_button_->setEnabled(true);
     db_item_.SetProgress(progress_);
-    DumpCoordsToCSV(grapher_->GetData(), JoinPath(db_item_.WorkDir().Get(),
-                                                  kPointsFname));
     db_item_.SetStatus(DownloadItem::StatusEnum::PAUSED);
     db_item_.SetMillisElapsed(stop_watch_.GetTimeElapsed());
-    emit RefreshDownloadsTable();
+    emit RefreshDownloadsTable(db_item_.Id());
     if (close_on_paused_) {
       emit RemoveTab(this);
       close_on_paused_ = false;
@@ -404,11 +356,14 @@ void DownloadMonitorPage::OnCancelled() {
   db_item_.SetStatus(DownloadItem::StatusEnum::CANCELLED);
   db_item_.SetProgress(progress_);
   fetcher_->RemoveWorkDir();
-  emit RefreshDownloadsTable();
+  emit RefreshDownloadsTable(db_item_.Id());
   emit RemoveTab(this);
 }
 
 void DownloadMonitorPage::Cancel() {
+  if (finalizing_) {
+    return;
+  }
   if (IsPaused()) {
     OnCancelled();
     return;
@@ -419,6 +374,9 @@ void DownloadMonitorPage::Cancel() {
 
 void DownloadMonitorPage::PauseAndClose() {
   close_on_paused_ = true;
+  if (finalizing_) {
+    return;  // Closed once the merge is done.
+  }
   Pause();
 }
 
@@ -477,6 +435,10 @@ void DownloadMonitorPage::SetDownloadedValueLabel(qint64 downloaded_bytes) {
     display_string = QString("%1 in %2")
         .arg(str_downloaded_bytes)
         .arg(stop_watch_.GetTimeElapsedString());
+  } else if (finalizing_) {
+    display_string = QString("%1, merging files (%2%)")
+        .arg(str_downloaded_bytes)
+        .arg((int) (finalizing_progress_ * 100));
   } else if (db_item_.FileSize().Get() <= 0) {
     display_string = QString("%1 of unknown").arg(str_downloaded_bytes);
   } else {
@@ -487,30 +449,64 @@ void DownloadMonitorPage::SetDownloadedValueLabel(qint64 downloaded_bytes) {
   downloaded_value_label_->setText(display_string);
 }
 
+void DownloadMonitorPage::OnFinalizing(qint64 done_bytes,
+                                       qint64 total_bytes) {
+  if (!finalizing_) {
+    finalizing_ = true;
+    // The download itself is done; stop sampling it while the merge runs.
+    UpdateProgress();
+    StopUpdates();
+    pause_button_->setEnabled(false);
+    button2_stack_->setEnabled(false);
+    num_connections_box_->setEnabled(false);
+  }
+  finalizing_progress_ = total_bytes > 0 ? done_bytes / (double) total_bytes
+                                         : 1;
+  SetDownloadedValueLabel(downloaded_bytes_);
+}
+
 void DownloadMonitorPage::OnCompleted() {
   is_done_ = true;
-  progress_updater_.stop();
-  speed_updater_.stop();
+  finalizing_ = false;
+  StopUpdates();
   stop_watch_.Stop();
   UpdateProgress();
   UpdateSpeed();
+  segment_map_->SetCompleted();
+  pause_button_->setEnabled(true);
   button1_stack_->setCurrentIndex(1);
   button2_stack_->setCurrentIndex(1);
+  button2_stack_->setEnabled(true);
   close_button_->setEnabled(true);
   num_connections_box_->setEnabled(false);
   SetDownloadedValueLabel(downloaded_bytes_);
   emit SetTabProgress(this, Truncate(fname_, kMaxTabFNameLen));
 
-  preference_manager_->ApplySavedPreferences(SpeedGrapherState::COMPLETED,
-                                             grapher_,
-                                             false);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(
+      SpeedGrapherState::COMPLETED), false);
   grapher_->UpdatePlot(false);
   download_speed_label_->setText("Average speed: ");
   QString avg_speed = IntFileSizeToString((int)
       (downloaded_bytes_ * 1000 / stop_watch_.GetTimeElapsed()));
   download_speed_value_label_->setText(QString("%1/s").arg(avg_speed));
   db_item_.SetStatus(DownloadItem::StatusEnum::COMPLETED);
-  emit RefreshDownloadsTable();
+  // The merge removed the work dir, and with it the saved telemetry.
+  std::vector<SegmentTimeline> timelines;
+  fetcher_->GetTelemetry(&timelines);
+  SegmentTimelineRecord::AddAll(session_, db_item_.Id(), timelines);
+  // A run that only merged what was already on disk says nothing about the
+  // host.
+  if (!non_resume_mode_ && fetcher_->PeakConnections() > 0) {
+    HostStat::Record(session_, db_item_.Url().Get(),
+                     db_item_.FileSize().Get(),
+                     fetcher_->PeakConnections(),
+                     stop_watch_.GetTimeElapsed(), timelines);
+  }
+  emit RefreshDownloadsTable(db_item_.Id());
+  if (close_on_paused_) {
+    close_on_paused_ = false;
+    emit RemoveTab(this);
+  }
 }
 
 void DownloadMonitorPage::OnDownloadError(QNetworkReply::NetworkError code) {
@@ -522,6 +518,47 @@ void DownloadMonitorPage::OnDownloadError(QNetworkReply::NetworkError code) {
   }
 }
 
+void DownloadMonitorPage::OnTick(qint64 now_millis) {
+  if (now_millis - last_progress_update_ >= kProgressUpdateInterval) {
+    last_progress_update_ = now_millis;
+    UpdateProgress();
+  }
+  if (now_millis - last_speed_update_ >= kSpeedUpdateInterval) {
+    UpdateSpeed();
+  }
+}
+
+bool DownloadMonitorPage::IsShown() {
+  return isVisible() && !window()->isMinimized();
+}
+
+void DownloadMonitorPage::StartUpdates() {
+  // Speed is measured from the next tick on, not across the pause.
+  last_speed_update_ = CurrentTimeMillis();
+  prev_downloaded_bytes_ = downloaded_bytes_;
+  ticker_->Subscribe(this);
+}
+
+void DownloadMonitorPage::StopUpdates() {
+  ticker_->Unsubscribe(this);
+}
+
+void DownloadMonitorPage::SyncGrapher() {
+  if (!grapher_is_stale_) {
+    return;
+  }
+  grapher_is_stale_ = false;
+  grapher_->SetData(speed_history_.Points());
+  grapher_->SetProgress(progress_);
+  grapher_->SetIndicatorText(speed_string_);
+  grapher_->UpdatePlot(ticker_->IsSubscribed(this));
+}
+
+void DownloadMonitorPage::showEvent(QShowEvent* event) {
+  QWidget::showEvent(event);
+  SyncGrapher();
+}
+
 void DownloadMonitorPage::UpdateProgress() {
   qint64 overall_downloaded = 0;
   vector<pair<qint64, qint64> > progress_tuples;
@@ -536,36 +573,31 @@ void DownloadMonitorPage::UpdateProgress() {
           << " to " << overall_downloaded;
   }
   downloaded_bytes_ = overall_downloaded;
-  SetDownloadedValueLabel(downloaded_bytes_);
   if (file_size > 0) {
     progress_ = overall_downloaded / (double) file_size;
+  }
+  // The tab text can be seen while another tab is selected.
+  if (file_size > 0 && window()->isVisible() && !window()->isMinimized()) {
     SetTabProgress();
-  } else if (!is_done_) {
+  }
+  if (!IsShown()) {
     return;
   }
-
-  for (int i = 0; i < progress_tuples.size(); ++i) {
-    qint64 shard_downloaded = progress_tuples[i].first;
-    qint64 shard_allocation = progress_tuples[i].second;
-    if (shard_downloaded < 0) {
-      qDebug() << "Shard " << i << " had a negative file size.";
-    }
-    if (i >= shard_rows_.size()) {
-      qDebug() << "At progress tuple " << i << " but have "
-               << shard_rows_.size() << " shard rows.";
-    }
-    shard_rows_[i].Label()->setText(IntFileSizeToString(shard_downloaded));
-    int percent_completed = 0;
-    if (file_size > 0) {
-      percent_completed = (int) (shard_downloaded * 100 / shard_allocation);
-    } else if (is_done_) {
-      percent_completed = 100;
-    }
-    shard_rows_[i].ProgressBar()->setValue(percent_completed);
+  SetDownloadedValueLabel(downloaded_bytes_);
+  if (file_size <= 0 && !is_done_) {
+    return;
   }
+
+  vector<qint64> worker_downloaded;
+  vector<bool> worker_failed;
+  fetcher_->GetWorkerProgress(&worker_downloaded, &worker_failed);
+  segment_map_->SetProgress(worker_downloaded, worker_failed);
 }
 
 void DownloadMonitorPage::UpdateSpeed() {
+  qint64 now = CurrentTimeMillis();
+  qint64 millis_elapsed = now - last_speed_update_;
+  last_speed_update_ = now;
   if (downloaded_bytes_ == 0) {
     return;
   }
@@ -578,11 +610,23 @@ void DownloadMonitorPage::UpdateSpeed() {
     DIE() << "Prev downloaded is " << prev_downloaded_bytes_
           << " but downloaded is " << downloaded_bytes_;
   }
-  qint64 speed = byte_delta * 1000 / kSpeedUpdateInterval;
+  if (millis_elapsed <= 0) {
+    millis_elapsed = kSpeedUpdateInterval;
+  }
+  qint64 speed = byte_delta * 1000 / millis_elapsed;
   prev_downloaded_bytes_ += byte_delta;
-  QString speed_string = QString("%1/s").arg(IntFileSizeToString(speed));
-  grapher_->AddDataPoint(speed, progress_, speed_string);
+  speed_string_ = QString("%1/s").arg(IntFileSizeToString(speed));
+  speed_history_.Append(speed);
+  if (!IsShown()) {
+    grapher_is_stale_ = true;
+    return;
+  }
+  if (grapher_is_stale_) {
+    SyncGrapher();  // Includes this point.
+  } else {
+    grapher_->AddDataPoint(speed, progress_, speed_string_);
+  }
   if (!is_done_) {
-    download_speed_value_label_->setText(speed_string);
+    download_speed_value_label_->setText(speed_string_);
   }
 }
@@ -3,17 +3,20 @@
 
 #include "qaccelerator-db.h"
 #include "qaccelerator-utils.h"
+#include "segment-map.h"
 #include "speed-grapher.h"
+#include "speed-history.h"
 #include "fetcher.h"
+#include "ui-ticker.h"
 #include <utility>
 #include <vector>
 #include <QLabel>
-#include <QProgressBar>
 #include <QGroupBox>
 #include <QStackedWidget>
 #include <QPushButton>
 #include <QSpinBox>
 #include <QObject>
+#include <QShowEvent>
 
 class DownloadMonitorPage : public QWidget {
     Q_OBJECT
@@ -21,6 +24,8 @@ class DownloadMonitorPage : public QWidget {
   DownloadMonitorPage(QWidget* parent,
                       Session* session,
                       PreferenceManager* preference_manager,
+                      UiTicker* ticker,
+                      Finalizer* finalizer,
                       const DownloadItem& params);
   std::pair<int, double> GetProgress();
   const DownloadItem& DBItem() { return db_item_; }
@@ -35,67 +40,81 @@ class DownloadMonitorPage : public QWidget {
                          const QString& suggested_save_as);
   void SetUpSpeedGrapher();
   void SetUpProgressStats();
-  void SetUpShardBox();
+  void SetUpSegmentMap();
   void SetUpNumConnectionsWidgets();
   void SetUpControlBox();
 
+ protected:
+  // Override
+  void showEvent(QShowEvent* event);
+
  signals:
   void RemoveTab(DownloadMonitorPage* page);
-  void RefreshDownloadsTable();
+  void RefreshDownloadsTable(int db_item_id);
   void SetTabProgress(DownloadMonitorPage* page, const QString& progress);
 
  public slots:
   void Cancel();
   void OnPaused();
+  void OnTick(qint64 now_millis);
 
  private slots:
   void ChangeNumConnections();
   void TogglePause();
   void OpenFile();
   void OpenParentDirectory();
-  void UpdateSpeed();
   void SetDownloadedValueLabel(qint64 downloaded_bytes);
   void OnCompleted();
   void OnDownloadError(QNetworkReply::NetworkError code);
-  void UpdateProgress();
-  void DrawShardGrid();
+  void OnFinalizing(qint64 done_bytes, qint64 total_bytes);
+  // Shows the allocations of the fetcher's current workers.
+  void ResetSegmentMap();
 
  private:
-  struct ShardRow {
-   public:
-    ShardRow(QLabel* label, QProgressBar* bar) : label_(label), bar_(bar) {}
-
-    QLabel* Label() { return label_; }
-    QProgressBar* ProgressBar() { return bar_; }
-
-   private:
-    QLabel* label_;
-    QProgressBar* bar_;
-  };
-
   DownloadMonitorPage(QWidget* parent, Session* session,
-                      PreferenceManager* preference_manager);
+                      PreferenceManager* preference_manager,
+                      UiTicker* ticker,
+                      Finalizer* finalizer);
   void Init();
+  // Whether the page can be seen, i.e. it is the current tab of a window
+  // that is not minimized.
+  bool IsShown();
+  // Both only update counters (and the speed history) while the page is not
+  // shown.
+  void UpdateProgress();
+  void UpdateSpeed();
+  void StartUpdates();
+  void StopUpdates();
+  // Replots the speed history if points were recorded while hidden.
+  void SyncGrapher();
   void OnCancelled();
   // int index();
 
   Session* session_;
   PreferenceManager* preference_manager_;
+  UiTicker* ticker_;
+  Finalizer* finalizer_;
   StopWatch stop_watch_;
   SpeedGrapher* grapher_;
+  SpeedHistory speed_history_;
   DownloadItem db_item_;
   bool is_done_;
+  // Set while the shards are merged, which can't be paused or cancelled.
+  bool finalizing_;
+  double finalizing_progress_;
   double progress_;
   QString fname_;
   std::unique_ptr<Fetcher> fetcher_;
-  QTimer speed_updater_;
-  QTimer progress_updater_;
+  qint64 last_progress_update_;
+  qint64 last_speed_update_;
+  // Set when speed points were recorded while the page was not shown.
+  bool grapher_is_stale_;
+  QString speed_string_;
   qint64 prev_downloaded_bytes_;
   qint64 downloaded_bytes_;
   QLabel* downloaded_value_label_;
   QLabel* download_speed_value_label_;
-  QGroupBox* shard_box_;
-  std::vector<ShardRow> shard_rows_;
+  SegmentMap* segment_map_;
   QStackedWidget* button1_stack_;
   QStackedWidget* button2_stack_;
   QPushButton* close_button_;
@@ -1,15 +1,24 @@
 #include "download-monitor.h"
 
+#include "capability-cache.h"
 #include <QVBoxLayout>
 #include <QFile>
 #include <QMessageBox>
 
+// Rows per INSERT statement when queueing in bulk.
+static const int kBulkQueueBatchSize = 250;
+
 DownloadMonitor::DownloadMonitor(QWidget* parent,
                                  Session* session,
-                                 PreferenceManager* preference_manager)
+                                 PreferenceManager* preference_manager,
+                                 UiTicker* ticker,
+                                 Finalizer* finalizer)
     : QTabWidget(parent),
       session_(session),
       preference_manager_(preference_manager),
+      ticker_(ticker),
+      finalizer_(finalizer),
+      queue_(session, QueuePolicy()),
       waiting_for_all_tabs_paused_(false),
       close_and_signal_requested_(false),
       closed_(false) {
@@ -72,7 +81,7 @@ void DownloadMonitor::CancelDownload(DownloadItem &item) {
   if (tab == nullptr) {
     Nullable<QString> work_dir = item.WorkDir();
     if (!work_dir.IsNull() && QFile::exists(work_dir.Get())) {
-      QDir(work_dir.Get()).removeRecursively();
+      finalizer_->RemoveDir(work_dir.Get());
     }
   } else {
     if (!tab->IsDone()) {
@@ -81,13 +90,20 @@ void DownloadMonitor::CancelDownload(DownloadItem &item) {
   }
 }
 
+void DownloadMonitor::ChangePriority(DownloadItem& item, int delta) {
+  Nullable<int> priority = item.Priority();
+  queue_.SetPriority(item, (priority.IsNull() ? 0 : priority.Get()) + delta);
+  emit RefreshDownloadsTable(item.Id());
+}
+
 void DownloadMonitor::AddDownload(const DownloadParams &params) {
   StartOrQueueDownload(params);
 }
 
 void DownloadMonitor::QueueDownload(DownloadItem &item) {
   item.SetStatus(DownloadItem::StatusEnum::QUEUED);
-  emit RefreshDownloadsTable();
+  queue_.Push(item);
+  emit RefreshDownloadsTable(item.Id());
 }
 
 void DownloadMonitor::QueueDownload(const DownloadParams &params) {
@@ -103,15 +119,77 @@ void DownloadMonitor::QueueDownload(const DownloadParams &params) {
   QueueDownload(item.Get());
 }
 
+bool DownloadMonitor::QueueDownloads(const BatchSource& next_batch,
+                                     const ProgressCallback& progress) {
+  if (!session_->Transaction()) {
+    return false;
+  }
+  bool ok = true;
+  int num_queued = 0;
+  std::vector<DownloadParams> batch;
+  QList<QMap<QString, QVariant> > rows;
+  while (ok) {
+    batch.clear();
+    ok = next_batch(&batch);
+    if (!ok || batch.empty()) {
+      break;
+    }
+    qint64 position = queue_.ReservePositions(batch.size());
+    for (size_t i = 0; ok && i < batch.size(); ++i) {
+      const DownloadParams& entry = batch[i];
+      QMap<QString, QVariant> row = {
+          {"url", entry.Url()},
+          {"save_as", entry.SaveAs()},
+          {"file_size", entry.FileSize()},
+          {"num_connections", entry.NumConnections()},
+          {"priority", entry.Priority()},
+          {"status", DownloadItem::ToInt(DownloadItem::StatusEnum::QUEUED)},
+          {"queue_position", position++}
+      };
+      rows.append(row);
+      if (rows.size() == kBulkQueueBatchSize || i + 1 == batch.size()) {
+        ok = DownloadItem::AddNewBatch(rows, session_);
+        rows.clear();
+      }
+    }
+    num_queued += batch.size();
+    progress(num_queued);
+  }
+  if (ok) {
+    CHECK(session_->Commit());
+  } else {
+    session_->Rollback();
+  }
+  queue_.Reload();
+  emit RefreshDownloadsTable(-1);
+  MaybePopQueueFront();
+  return ok;
+}
+
 void DownloadMonitor::MaybePopQueueFront() {
   typedef DownloadItem::StatusEnum Status;
-  Nullable<DownloadItem> front = DownloadItem::Get(
-      session_, "status", DownloadItem::ToInt(Status::QUEUED));
-  if (!front.IsNull()) {
-    StartOrQueueDownload(front.Get());
+  if (queue_.IsEmpty() || ShouldQueueNextDownload()) {
+    return;
+  }
+  queue_.SetPolicy(QueuePolicy());
+  int id = -1;
+  while (queue_.Pop(&id)) {
+    // Entries of items that were deleted, or started from the downloads
+    // table, are dropped here.
+    Nullable<DownloadItem> front = DownloadItem::Get(session_, id);
+    if (!front.IsNull() && front.Get().Status().Get() == Status::QUEUED) {
+      StartDownload(front.Get());
+      return;
+    }
   }
 }
 
+DownloadQueue::Policy DownloadMonitor::QueuePolicy() {
+  int policy_id = 0;
+  preference_manager_->Get("queue_policy", &policy_id);
+  return DownloadQueue::MakePolicy(policy_id);
+}
+
 bool DownloadMonitor::ShouldQueueNextDownload() {
   // Only one download should be initializing at any given time.
   if (initialization_in_progress_) {
@@ -131,6 +209,7 @@ bool DownloadMonitor::ShouldQueueNextDownload() {
 
 void DownloadMonitor::StartDownload(DownloadItem &item) {
   initialization_in_progress_ = true;
+  queue_.Remove(item.Id());
   Nullable<qint64> file_size = item.FileSize();
   // qDebug() << "Starting " << item.Url().Get();
   if (file_size.IsNull() || file_size.Get() == 0
@@ -154,9 +233,8 @@ void DownloadMonitor::StartDownload(DownloadItem &item) {
       }
       Nullable<int> num_connections = item.NumConnections();
       if (num_connections.IsNull() || num_connections.Get() < 1) {
-        int default_num_connections = 0;
-        preference_manager_->Get("num_connections", &default_num_connections);
-        item.SetNumConnections(default_num_connections);
+        item.SetNumConnections(
+            preference_manager_->DefaultNumConnections(item.Url().Get()));
       }
       // qDebug() << "Starting or queueing download again.";
       StartDownload(item);
@@ -166,7 +244,7 @@ void DownloadMonitor::StartDownload(DownloadItem &item) {
       qDebug() << error;
       initialization_in_progress_ = false;
       item.SetStatus(DownloadItem::StatusEnum::FAILED);
-      emit RefreshDownloadsTable();
+      emit RefreshDownloadsTable(item.Id());
       MaybePopQueueFront();
       MaybeCloseOrHide();
     });
@@ -178,7 +256,7 @@ void DownloadMonitor::StartDownload(DownloadItem &item) {
   QString save_as_dir = DirName(item.SaveAs().Get());
   if (!QFileInfo(save_as_dir).exists()) {
     item.SetStatus(DownloadItem::StatusEnum::FAILED);
-    emit RefreshDownloadsTable();
+    emit RefreshDownloadsTable(item.Id());
     QMessageBox::critical(
         this,
         "Directory does not exist",
@@ -188,6 +266,16 @@ void DownloadMonitor::StartDownload(DownloadItem &item) {
     MaybePopQueueFront();
     return;
   }
+  // Start no more connections than the server is known to take.
+  Nullable<int> num_connections = item.NumConnections();
+  if (!num_connections.IsNull() && num_connections.Get() > 1) {
+    int safe_num_connections =
+        CapabilityCache::Instance()->SafeNumConnections(
+            item.Url().Get(), num_connections.Get());
+    if (safe_num_connections < num_connections.Get()) {
+      item.SetNumConnections(safe_num_connections);
+    }
+  }
   AddDownloadTab(item);
   initialization_in_progress_ = false;
   MaybePopQueueFront();
@@ -222,13 +310,13 @@ void DownloadMonitor::OnGetterError(int id, QNetworkReply::NetworkError error) {
 
 void DownloadMonitor::AddDownloadTab(DownloadItem &item) {
   DownloadMonitorPage* new_tab = new DownloadMonitorPage(
-      this, session_, preference_manager_, item);
+      this, session_, preference_manager_, ticker_, finalizer_, item);
   SetUpNewTab(new_tab);
 }
 
 void DownloadMonitor::SetUpNewTab(DownloadMonitorPage* new_tab) {
-  connect(new_tab, SIGNAL(RefreshDownloadsTable()),
-          this, SLOT(TransmitRefreshDownloadsTable()));
+  connect(new_tab, SIGNAL(RefreshDownloadsTable(int)),
+          this, SLOT(TransmitRefreshDownloadsTable(int)));
   connect(new_tab, SIGNAL(SetTabProgress(DownloadMonitorPage*,QString)),
           this, SLOT(SetTabProgress(DownloadMonitorPage*,QString)));
   connect(new_tab, SIGNAL(RemoveTab(DownloadMonitorPage*)),
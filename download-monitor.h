@@ -4,8 +4,12 @@
 #include "qaccelerator-db.h"
 #include "qaccelerator-utils.h"
 #include "download-monitor-page.h"
+#include "download-queue.h"
+#include "finalizer.h"
+#include "ui-ticker.h"
 #include <QTabWidget>
 #include <QWidget>
+#include <functional>
 #include <utility>
 #include <vector>
 #include <QCloseEvent>
@@ -17,7 +21,9 @@ class DownloadMonitor : public QTabWidget {
  public:
   DownloadMonitor(QWidget* parent,
                   Session* session,
-                  PreferenceManager* preference_manager);
+                  PreferenceManager* preference_manager,
+                  UiTicker* ticker,
+                  Finalizer* finalizer);
   void MaybePopQueueFront();
   void StartOrQueueDownload(const DownloadParams& params);
   void StartOrQueueDownload(DownloadItem& item);
@@ -25,23 +31,44 @@ class DownloadMonitor : public QTabWidget {
   void CloseAndSignal();
   void QueueDownload(const DownloadParams& params);
 
+  // Fills the batch with the next downloads to queue, leaving it empty when
+  // there are no more. Returns false on error.
+  typedef std::function<bool(std::vector<DownloadParams>* batch)> BatchSource;
+  // Called with the number of downloads queued so far after each batch.
+  typedef std::function<void(int num_queued)> ProgressCallback;
+
+  // Bulk queueing, e.g. for imports. Batches from `next_batch` are written
+  // as they come, all in one transaction, so either all or none are queued,
+  // and the queue and downloads table are refreshed once. The transaction
+  // never spans a return to the event loop, so no other write can end up in
+  // it; `progress` must not return to it either. Returns false if nothing
+  // was queued.
+  bool QueueDownloads(const BatchSource& next_batch,
+                      const ProgressCallback& progress);
+
  signals:
-  void RefreshDownloadsTable();
+  // The item of `db_item_id` changed. Items added since the downloads table
+  // last read them are picked up too; -1 if nothing else changed.
+  void RefreshDownloadsTable(int db_item_id);
   void AllTabsClosed();
 
  public slots:
   void ResumeDownload(DownloadItem& item);
   void PauseDownload(DownloadItem& item);
   void CancelDownload(DownloadItem& item);
+  void ChangePriority(DownloadItem& item, int delta);
   void AddDownload(const DownloadParams& params);
-  void TransmitRefreshDownloadsTable() {
-    emit RefreshDownloadsTable();
+  void TransmitRefreshDownloadsTable(int db_item_id) {
+    emit RefreshDownloadsTable(db_item_id);
     if (!waiting_for_all_tabs_paused_) {
       MaybePopQueueFront();
     }
   }
   void SetTabProgress(DownloadMonitorPage* page, const QString& progress) {
-    setTabText(indexOf(page), progress);
+    int index = indexOf(page);
+    if (tabText(index) != progress) {
+      setTabText(index, progress);
+    }
   }
   void RemoveTab(DownloadMonitorPage* page) {
     removeTab(indexOf(page));
@@ -61,11 +88,15 @@ class DownloadMonitor : public QTabWidget {
   void QueueDownload(DownloadItem& item);
   void BringToFront();
   bool ShouldQueueNextDownload();
+  DownloadQueue::Policy QueuePolicy();
   void AddDownloadTab(DownloadItem &item);
   void SetUpNewTab(DownloadMonitorPage* new_tab);
 
   Session* session_;
   PreferenceManager* preference_manager_;
+  UiTicker* ticker_;
+  Finalizer* finalizer_;
+  DownloadQueue queue_;
   bool waiting_for_all_tabs_paused_;  // TODO(ogaro): Unncessary.
   bool close_and_signal_requested_;
   bool closed_;
@@ -0,0 +1,151 @@
+#include "download-queue.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using std::vector;
+
+namespace {
+// Downloads of unknown size go behind all downloads of known size.
+qint64 SortableFileSize(qint64 file_size) {
+  return file_size > 0 ? file_size : std::numeric_limits<qint64>::max();
+}
+}
+
+DownloadQueue::Policy DownloadQueue::MakePolicy(int policy_id) {
+  switch(policy_id) {
+  case 0:
+    return Policy::FIFO;
+  case 1:
+    return Policy::PRIORITY;
+  case 2:
+    return Policy::SMALLEST_FIRST;
+  default:
+    qDebug() << "Invalid queue policy id " << policy_id
+             << ". Falling back to FIFO.";
+    return Policy::FIFO;
+  }
+}
+
+bool DownloadQueue::Compare::operator()(const Entry& a,
+                                        const Entry& b) const {
+  switch(policy) {
+  case Policy::PRIORITY:
+    if (a.priority != b.priority) {
+      return a.priority > b.priority;
+    }
+    break;
+  case Policy::SMALLEST_FIRST:
+    if (SortableFileSize(a.file_size) != SortableFileSize(b.file_size)) {
+      return SortableFileSize(a.file_size) < SortableFileSize(b.file_size);
+    }
+    break;
+  default:
+    break;
+  }
+  // Ties are broken by queue order, then by id, so the order is total.
+  if (a.position != b.position) {
+    return a.position < b.position;
+  }
+  return a.id < b.id;
+}
+
+DownloadQueue::DownloadQueue(Session* session, Policy policy)
+    : session_(session),
+      policy_(policy),
+      entries_(Compare{policy}),
+      next_position_(1) {
+  Reload();
+}
+
+void DownloadQueue::Reload() {
+  entries_.clear();
+  index_.clear();
+  next_position_ = 1;
+  QString query = QString(
+      "SELECT id, priority, queue_position, file_size FROM %1 "
+      "WHERE status = %2")
+      .arg(DownloadItem::TableName())
+      .arg(DownloadItem::ToInt(DownloadItem::StatusEnum::QUEUED));
+  session_->Exec(query);
+  QSqlQuery& result = session_->GetQuery();
+  while (result.next()) {
+    Entry entry;
+    entry.id = result.value(0).toInt();
+    entry.priority = result.value(1).toInt();
+    entry.position = result.value(2).toLongLong();
+    entry.file_size = result.value(3).toLongLong();
+    Insert(entry);
+    next_position_ = std::max(next_position_, entry.position + 1);
+  }
+}
+
+void DownloadQueue::SetPolicy(Policy policy) {
+  if (policy == policy_) {
+    return;
+  }
+  policy_ = policy;
+  vector<Entry> entries(entries_.begin(), entries_.end());
+  entries_ = EntrySet(Compare{policy});
+  index_.clear();
+  for (const Entry& entry : entries) {
+    Insert(entry);
+  }
+}
+
+void DownloadQueue::Push(DownloadItem& item) {
+  Remove(item.Id());
+  Entry entry;
+  entry.id = item.Id();
+  Nullable<int> priority = item.Priority();
+  entry.priority = priority.IsNull() ? 0 : priority.Get();
+  Nullable<qint64> file_size = item.FileSize();
+  entry.file_size = file_size.IsNull() ? 0 : file_size.Get();
+  entry.position = next_position_++;
+  item.SetQueuePosition(entry.position);
+  Insert(entry);
+}
+
+qint64 DownloadQueue::ReservePositions(int count) {
+  qint64 first = next_position_;
+  next_position_ += count;
+  return first;
+}
+
+void DownloadQueue::SetPriority(DownloadItem& item, int priority) {
+  item.SetPriority(priority);
+  auto it = index_.find(item.Id());
+  if (it == index_.end()) {
+    return;
+  }
+  Entry entry = *(it->second);
+  entries_.erase(it->second);
+  index_.erase(it);
+  entry.priority = priority;
+  Insert(entry);
+}
+
+bool DownloadQueue::Pop(int* id) {
+  if (entries_.empty()) {
+    return false;
+  }
+  EntrySet::iterator front = entries_.begin();
+  *id = front->id;
+  index_.erase(front->id);
+  entries_.erase(front);
+  return true;
+}
+
+void DownloadQueue::Remove(int id) {
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return;
+  }
+  entries_.erase(it->second);
+  index_.erase(it);
+}
+
+void DownloadQueue::Insert(const Entry& entry) {
+  index_[entry.id] = entries_.insert(entry).first;
+}
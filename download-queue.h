@@ -0,0 +1,77 @@
+#ifndef DOWNLOAD_QUEUE_H_
+#define DOWNLOAD_QUEUE_H_
+
+#include "qaccelerator-db.h"
+#include <set>
+#include <unordered_map>
+
+// In-memory mirror of the queued download items. Every queued item also has a
+// queue_position (and a priority) in the db, so the queue can be rebuilt in
+// the same order with one indexed query after a restart.
+//
+// Entries are never looked up in the db while the queue is being ordered;
+// Push(), Pop() and Remove() are O(log n).
+class DownloadQueue {
+ public:
+  enum class Policy {
+    FIFO = 0,            // Oldest first.
+    PRIORITY = 1,        // Highest priority first, then oldest first.
+    SMALLEST_FIRST = 2   // Smallest known file size first, then oldest first.
+  };
+
+  static Policy MakePolicy(int policy_id);
+
+  DownloadQueue(Session* session, Policy policy);
+
+  // Discards the in-memory entries and reads all queued items from the db.
+  void Reload();
+
+  // Re-sorts the entries if `policy` differs from the current one.
+  void SetPolicy(Policy policy);
+  Policy GetPolicy() { return policy_; }
+
+  // Appends the item to the back of the queue and persists its position.
+  // The item's status is not modified.
+  void Push(DownloadItem& item);
+
+  // Returns the first of `count` consecutive queue positions, for callers
+  // that write queued items to the db themselves. Call Reload() once they
+  // are written.
+  qint64 ReservePositions(int count);
+
+  // Changes the priority of the item, both in the db and in the queue.
+  void SetPriority(DownloadItem& item, int priority);
+
+  // Removes the front entry and writes its id to `id`. Returns false if the
+  // queue is empty.
+  bool Pop(int* id);
+
+  void Remove(int id);
+  bool IsEmpty() { return entries_.empty(); }
+  int Size() { return entries_.size(); }
+
+ private:
+  struct Entry {
+    int id;
+    int priority;
+    qint64 position;
+    qint64 file_size;  // Non-positive if unknown.
+  };
+
+  struct Compare {
+    Policy policy;
+    bool operator()(const Entry& a, const Entry& b) const;
+  };
+
+  typedef std::set<Entry, Compare> EntrySet;
+
+  void Insert(const Entry& entry);
+
+  Session* session_;
+  Policy policy_;
+  EntrySet entries_;
+  std::unordered_map<int, EntrySet::iterator> index_;
+  qint64 next_position_;
+};
+
+#endif  // DOWNLOAD_QUEUE_H_
@@ -0,0 +1,436 @@
+#include "downloads-table-model.h"
+
+#include "categorizer.h"
+#include <algorithm>
+#include <memory>
+#include <unordered_set>
+#include <QDir>
+#include <QFile>
+#include <QFileIconProvider>
+#include <QFileInfo>
+
+using std::unique_ptr;
+using std::unordered_set;
+using std::vector;
+typedef DownloadItem::StatusEnum Status;
+
+static const char* ICON_FILES_DIRNAME = "icon_files";
+
+namespace {
+QString ProgressToString(double progress) {
+  return QString::number(progress * 100, 'f', 1) + "%";
+}
+}
+
+DownloadsTableModel::DownloadsTableModel(QObject* parent, Session* session)
+    : QAbstractTableModel(parent),
+      session_(session),
+      archived_(false),
+      last_fetched_id_(0),
+      all_fetched_(false),
+      editable_row_(-1) {
+  header_labels_ = QStringList({
+      "File",
+      "Size",
+      "Status",
+      "Progress",
+      "Start Time"});
+}
+
+bool DownloadsTableModel::SetFilter(
+    const Nullable<DownloadItem::StatusEnum>& status,
+    const Nullable<Category>& category,
+    bool archived) {
+  bool same_status = (status.IsNull() == status_.IsNull())
+      && (status.IsNull() || status.Get() == status_.Get());
+  bool same_category = (category.IsNull() == category_.IsNull())
+      && (category.IsNull() || category.Get() == category_.Get());
+  if (same_status && same_category && archived == archived_
+      && last_fetched_id_ > 0) {
+    Refresh();
+    return false;
+  }
+  beginResetModel();
+  status_ = status;
+  category_ = category;
+  archived_ = archived;
+  rows_.clear();
+  id_to_row_.clear();
+  last_fetched_id_ = 0;
+  all_fetched_ = false;
+  editable_row_ = -1;
+  endResetModel();
+  fetchMore(QModelIndex());
+  return true;
+}
+
+void DownloadsTableModel::Refresh() {
+  vector<Row> fresh;
+  int last_id = 0;
+  ReadRows(QString("id <= %1").arg(last_fetched_id_), 0, &fresh, &last_id);
+  ApplyRows(fresh);
+  FetchAdded();
+}
+
+void DownloadsTableModel::Refresh(const vector<int>& db_item_ids) {
+  // Items not fetched yet are read when the view scrolls to them.
+  QStringList ids;
+  for (int id : db_item_ids) {
+    if (id > 0 && id <= last_fetched_id_) {
+      ids.append(QString::number(id));
+    }
+  }
+  if (!ids.isEmpty()) {
+    vector<Row> fresh;
+    int last_id = 0;
+    ReadRows(QString("id IN (%1)").arg(ids.join(",")), 0, &fresh, &last_id);
+    std::unordered_map<int, const Row*> fresh_by_id;
+    for (const Row& row : fresh) {
+      fresh_by_id[row.id] = &row;
+    }
+    for (const QString& id_str : ids) {
+      int id = id_str.toInt();
+      auto fresh_it = fresh_by_id.find(id);
+      auto row_it = id_to_row_.find(id);
+      if (row_it == id_to_row_.end()) {
+        if (fresh_it != fresh_by_id.end()) {
+          InsertRow(*fresh_it->second);
+        }
+      } else if (fresh_it == fresh_by_id.end()) {
+        RemoveRow(row_it->second);
+      } else if (!(rows_[row_it->second] == *fresh_it->second)) {
+        int row = row_it->second;
+        rows_[row] = *fresh_it->second;
+        emit dataChanged(index(row, 0), index(row, NUM_COLUMNS - 1));
+      }
+    }
+  }
+  FetchAdded();
+}
+
+void DownloadsTableModel::FetchAdded() {
+  // Items added since the last fetch (typically new downloads) show up at
+  // the bottom, one batch at a time.
+  if (all_fetched_) {
+    all_fetched_ = false;
+    fetchMore(QModelIndex());
+  }
+}
+
+void DownloadsTableModel::SetProgress(int db_item_id, double progress) {
+  auto it = id_to_row_.find(db_item_id);
+  if (it == id_to_row_.end()) {
+    return;  // Item does not match currently selected status and category.
+  }
+  Row& row = rows_[it->second];
+  QString progress_str = ProgressToString(progress);
+  if (row.cells[PROGRESS_COLUMN] == progress_str) {
+    return;
+  }
+  row.cells[PROGRESS_COLUMN] = progress_str;
+  QModelIndex cell = index(it->second, PROGRESS_COLUMN);
+  emit dataChanged(cell, cell);
+}
+
+DownloadItem DownloadsTableModel::ItemAt(int row) {
+  return DownloadItem(session_, rows_[row].id, archived_);
+}
+
+int DownloadsTableModel::RowOf(int db_item_id) {
+  auto it = id_to_row_.find(db_item_id);
+  return it == id_to_row_.end() ? -1 : it->second;
+}
+
+int DownloadsTableModel::rowCount(const QModelIndex& parent) const {
+  return parent.isValid() ? 0 : rows_.size();
+}
+
+int DownloadsTableModel::columnCount(const QModelIndex& parent) const {
+  return parent.isValid() ? 0 : NUM_COLUMNS;
+}
+
+QVariant DownloadsTableModel::data(const QModelIndex& index, int role) const {
+  if (!index.isValid() || index.row() >= static_cast<int>(rows_.size())) {
+    return QVariant();
+  }
+  const Row& row = rows_[index.row()];
+  if (role == Qt::DisplayRole || role == Qt::EditRole) {
+    return row.cells[index.column()];
+  }
+  if (role == Qt::DecorationRole && index.column() == FILE_COLUMN
+      && !row.save_as.isEmpty()) {
+    return GetIcon(row.save_as);
+  }
+  return QVariant();
+}
+
+QVariant DownloadsTableModel::headerData(int section,
+                                         Qt::Orientation orientation,
+                                         int role) const {
+  if (role != Qt::DisplayRole) {
+    return QVariant();
+  }
+  if (orientation == Qt::Horizontal) {
+    return header_labels_.value(section);
+  }
+  return section + 1;
+}
+
+Qt::ItemFlags DownloadsTableModel::flags(const QModelIndex& index) const {
+  Qt::ItemFlags flags = Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+  if (index.isValid() && index.row() == editable_row_
+      && index.column() == FILE_COLUMN) {
+    flags |= Qt::ItemIsEditable;
+  }
+  return flags;
+}
+
+bool DownloadsTableModel::setData(const QModelIndex& index,
+                                  const QVariant& value,
+                                  int role) {
+  if (role != Qt::EditRole || !index.isValid()
+      || index.row() != editable_row_ || index.column() != FILE_COLUMN) {
+    return false;
+  }
+  editable_row_ = -1;
+  Row& row = rows_[index.row()];
+  QString new_fname = value.toString();
+  if (new_fname.isEmpty() || new_fname == FileName(row.save_as)) {
+    return false;
+  }
+  QString new_save_as = JoinPath(DirName(row.save_as), new_fname);
+  if (!QFile::rename(row.save_as, new_save_as)) {
+    return false;
+  }
+  ItemAt(index.row()).SetSaveAs(new_save_as);
+  row.save_as = new_save_as;
+  row.cells[FILE_COLUMN] = new_fname;
+  emit dataChanged(index, index);
+  return true;
+}
+
+bool DownloadsTableModel::canFetchMore(const QModelIndex& parent) const {
+  return !parent.isValid() && !all_fetched_;
+}
+
+void DownloadsTableModel::fetchMore(const QModelIndex& parent) {
+  if (parent.isValid()) {
+    return;
+  }
+  vector<Row> batch;
+  // Keep reading until something matches, otherwise views that are not full
+  // yet would never ask for more.
+  while (batch.empty() && !all_fetched_) {
+    int num_read = ReadRows(QString("id > %1").arg(last_fetched_id_),
+                            kFetchBatchSize, &batch, &last_fetched_id_);
+    all_fetched_ = (num_read < kFetchBatchSize);
+  }
+  if (batch.empty()) {
+    return;
+  }
+  beginInsertRows(QModelIndex(), rows_.size(),
+                  rows_.size() + batch.size() - 1);
+  for (Row& row : batch) {
+    id_to_row_[row.id] = rows_.size();
+    rows_.push_back(row);
+  }
+  endInsertRows();
+}
+
+const QString& DownloadsTableModel::Table() const {
+  return archived_ ? DownloadItem::ArchiveTableName()
+                   : DownloadItem::TableName();
+}
+
+int DownloadsTableModel::ReadRows(const QString& id_condition, int limit,
+                                  vector<Row>* rows, int* last_id) {
+  QStringList conditions;
+  conditions.append(id_condition);
+  if (!status_.IsNull() && !archived_) {
+    conditions.append(
+        QString("status = %1").arg(DownloadItem::ToInt(status_.Get())));
+  }
+  QString query = QString(
+      "SELECT id, save_as, file_size, status, progress, start_time FROM %1 "
+      "WHERE %2 ORDER BY id")
+      .arg(Table())
+      .arg(conditions.join(" AND "));
+  if (limit > 0) {
+    query += QString(" LIMIT %1").arg(limit);
+  }
+  session_->Exec(query);
+  QSqlQuery& result = session_->GetQuery();
+  int num_read = 0;
+  while (result.next()) {
+    ++num_read;
+    Row row;
+    row.id = result.value(0).toInt();
+    *last_id = row.id;
+    QVariant save_as = result.value(1);
+    row.save_as = save_as.isNull() ? QString() : save_as.toString();
+    if (!category_.IsNull()) {
+      Category item_category = Category::OTHER;
+      if (!row.save_as.isEmpty()) {
+        item_category = Categorizer::Categorize(FileExt(row.save_as));
+      }
+      if (item_category != category_.Get()) {
+        continue;
+      }
+    }
+    row.status = DownloadItem::MakeStatus(result.value(3).toInt());
+
+    QString file_size_str = "";
+    QVariant file_size = result.value(2);
+    if (!file_size.isNull()) {
+      if (file_size.toLongLong() > 0) {
+        file_size_str = IntFileSizeToString(file_size.toLongLong());
+      } else {
+        file_size_str = "Unknown";
+      }
+    }
+    QString progress_str = "";
+    QVariant progress = result.value(4);
+    if (row.status == Status::COMPLETED) {
+      progress_str = "100.0%";
+    } else if (!progress.isNull()) {
+      progress_str = ProgressToString(progress.toDouble());
+    }
+    QString start_time_str = "";
+    QVariant start_time = result.value(5);
+    if (!start_time.isNull()) {
+      if (start_time.toLongLong() > 0) {
+        start_time_str = StringifyTimeStamp(start_time.toLongLong());
+      } else {
+        start_time_str = "Not started";
+      }
+    }
+    // In order of the columns.
+    row.cells = QStringList({
+        row.save_as.isEmpty() ? QString() : FileName(row.save_as),
+        file_size_str,
+        DownloadItem::ToString(row.status),
+        progress_str,
+        start_time_str});
+    rows->push_back(row);
+  }
+  return num_read;
+}
+
+void DownloadsTableModel::ApplyRows(const vector<Row>& fresh) {
+  // Remove the rows that are gone, last ones first so that row numbers of the
+  // rows still to be checked stay valid.
+  unordered_set<int> fresh_ids;
+  for (const Row& row : fresh) {
+    fresh_ids.insert(row.id);
+  }
+  int i = rows_.size() - 1;
+  while (i >= 0) {
+    if (fresh_ids.count(rows_[i].id) > 0) {
+      --i;
+      continue;
+    }
+    int last = i;
+    while (i >= 0 && fresh_ids.count(rows_[i].id) == 0) {
+      --i;
+    }
+    beginRemoveRows(QModelIndex(), i + 1, last);
+    rows_.erase(rows_.begin() + i + 1, rows_.begin() + last + 1);
+    endRemoveRows();
+  }
+  if (editable_row_ >= static_cast<int>(rows_.size())) {
+    editable_row_ = -1;
+  }
+
+  // Both lists are in id order and the remaining rows are a subset of the
+  // fresh ones, so a single merge pass finds the changed and new rows.
+  size_t row = 0;
+  size_t j = 0;
+  while (j < fresh.size()) {
+    if (row < rows_.size() && rows_[row].id == fresh[j].id) {
+      if (!(rows_[row] == fresh[j])) {
+        rows_[row] = fresh[j];
+        emit dataChanged(index(row, 0), index(row, NUM_COLUMNS - 1));
+      }
+      ++row;
+      ++j;
+      continue;
+    }
+    size_t end = j;
+    while (end < fresh.size()
+           && (row >= rows_.size() || fresh[end].id != rows_[row].id)) {
+      ++end;
+    }
+    beginInsertRows(QModelIndex(), row, row + (end - j) - 1);
+    rows_.insert(rows_.begin() + row, fresh.begin() + j, fresh.begin() + end);
+    endInsertRows();
+    row += end - j;
+    j = end;
+  }
+  RebuildIndex();
+}
+
+void DownloadsTableModel::InsertRow(const Row& row) {
+  // Rows are kept in id order.
+  auto it = std::lower_bound(rows_.begin(), rows_.end(), row.id,
+                             [] (const Row& r, int id) { return r.id < id; });
+  int at = it - rows_.begin();
+  beginInsertRows(QModelIndex(), at, at);
+  rows_.insert(it, row);
+  endInsertRows();
+  if (editable_row_ >= at) {
+    editable_row_ = -1;
+  }
+  ReindexFrom(at);
+}
+
+void DownloadsTableModel::RemoveRow(int row) {
+  beginRemoveRows(QModelIndex(), row, row);
+  id_to_row_.erase(rows_[row].id);
+  rows_.erase(rows_.begin() + row);
+  endRemoveRows();
+  if (editable_row_ >= row) {
+    editable_row_ = -1;
+  }
+  ReindexFrom(row);
+}
+
+void DownloadsTableModel::RebuildIndex() {
+  id_to_row_.clear();
+  ReindexFrom(0);
+}
+
+void DownloadsTableModel::ReindexFrom(int first_row) {
+  for (size_t row = first_row; row < rows_.size(); ++row) {
+    id_to_row_[rows_[row].id] = row;
+  }
+}
+
+const QIcon& DownloadsTableModel::GetIcon(const QString& fpath) const {
+  QString file_ext = FileExt(fpath);
+  auto cached = file_ext_to_icon_.find(file_ext);
+  if (cached != file_ext_to_icon_.end()) {
+    return cached.value();
+  }
+  unique_ptr<QIcon> icon;
+  if (QFile::exists(fpath)) {
+    icon.reset(new QIcon(QFileIconProvider().icon(QFileInfo(fpath))));
+  } else {
+    QString icon_files_dir = JoinPath(QDir::currentPath(), ICON_FILES_DIRNAME);
+    if (!QFile::exists(icon_files_dir)) {
+      QDir(QDir::currentPath()).mkdir(ICON_FILES_DIRNAME);
+    }
+    QString temp_fpath = JoinPath(icon_files_dir,
+                                  "qaccelerator_temp." + file_ext);
+    QFile temp_file(temp_fpath);
+    if (!temp_file.exists()) {
+      temp_file.open(QFile::WriteOnly);
+      temp_file.close();
+    }
+    icon.reset(new QIcon(QFileIconProvider().icon(QFileInfo(temp_file))));
+  }
+  if (icon->isNull()) {
+    icon.reset(new QIcon(":images/default_file_icon.png"));
+  }
+  file_ext_to_icon_[file_ext] = *icon;
+  return file_ext_to_icon_[file_ext];
+}
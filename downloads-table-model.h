@@ -0,0 +1,121 @@
+#ifndef DOWNLOADS_TABLE_MODEL_H_
+#define DOWNLOADS_TABLE_MODEL_H_
+
+#include "qaccelerator-utils.h"
+#include "qaccelerator-db.h"
+#include <unordered_map>
+#include <vector>
+#include <QAbstractTableModel>
+#include <QIcon>
+#include <QMap>
+#include <QStringList>
+
+// Table model of the download items that match the selected status and
+// category.
+//
+// Rows are read from the db in batches of kFetchBatchSize, with one query per
+// batch, as the view scrolls (see canFetchMore() and fetchMore()). Refresh()
+// re-reads only the rows that were fetched so far, or only those of the items
+// known to have changed, and notifies views of the rows that actually
+// changed, appeared or disappeared, so views keep their selection and scroll
+// position.
+class DownloadsTableModel : public QAbstractTableModel {
+  Q_OBJECT
+
+ public:
+  enum Column {
+    FILE_COLUMN = 0,
+    SIZE_COLUMN = 1,
+    STATUS_COLUMN = 2,
+    PROGRESS_COLUMN = 3,
+    START_TIME_COLUMN = 4,
+    NUM_COLUMNS = 5
+  };
+
+  static const int kFetchBatchSize = 256;
+
+  DownloadsTableModel(QObject* parent, Session* session);
+
+  // Shows the items with the given status and category (all statuses or
+  // categories if null). Archived items are shown instead of the others if
+  // `archived` is true, regardless of `status`. Equivalent to Refresh() if
+  // the filter has not changed. Returns true if the rows were reloaded.
+  bool SetFilter(const Nullable<DownloadItem::StatusEnum>& status,
+                 const Nullable<Category>& category,
+                 bool archived);
+
+  // Re-reads the fetched rows from the db.
+  void Refresh();
+  // Re-reads only the rows of `db_item_ids`, which may have changed, been
+  // deleted, or come to match the filter. Both overloads also pick up items
+  // added since the last fetch.
+  void Refresh(const std::vector<int>& db_item_ids);
+
+  void SetProgress(int db_item_id, double progress);
+
+  // The db item displayed in `row`.
+  DownloadItem ItemAt(int row);
+
+  // Returns -1 if the item is not displayed.
+  int RowOf(int db_item_id);
+
+  // Only the file name in `row` can be edited, and only until the next call
+  // to setData(). Pass -1 to make all rows read-only.
+  void SetEditableRow(int row) { editable_row_ = row; }
+
+  // Overrides
+  int rowCount(const QModelIndex& parent) const;
+  int columnCount(const QModelIndex& parent) const;
+  QVariant data(const QModelIndex& index, int role) const;
+  QVariant headerData(int section, Qt::Orientation orientation,
+                      int role) const;
+  Qt::ItemFlags flags(const QModelIndex& index) const;
+  // Renames the downloaded file.
+  bool setData(const QModelIndex& index, const QVariant& value, int role);
+  bool canFetchMore(const QModelIndex& parent) const;
+  void fetchMore(const QModelIndex& parent);
+
+ private:
+  // Displayed fields of a db item.
+  struct Row {
+    int id;
+    QString save_as;
+    DownloadItem::StatusEnum status;
+    QStringList cells;  // In column order.
+
+    bool operator==(const Row& other) const {
+      return id == other.id && save_as == other.save_as
+          && status == other.status && cells == other.cells;
+    }
+  };
+
+  const QString& Table() const;
+  // Reads the matching rows whose ids satisfy `id_condition`, in id order.
+  // limit <= 0 means no limit. Writes the largest id read (whether or not it
+  // matched the category) to last_id.
+  int ReadRows(const QString& id_condition, int limit,
+               std::vector<Row>* rows, int* last_id);
+  void ApplyRows(const std::vector<Row>& fresh);
+  void FetchAdded();
+  void InsertRow(const Row& row);
+  void RemoveRow(int row);
+  void RebuildIndex();
+  // Updates the index entries of `first_row` and the rows after it.
+  void ReindexFrom(int first_row);
+  const QIcon& GetIcon(const QString& fpath) const;
+
+  Session* session_;
+  Nullable<DownloadItem::StatusEnum> status_;
+  Nullable<Category> category_;
+  bool archived_;
+  std::vector<Row> rows_;
+  std::unordered_map<int, int> id_to_row_;
+  // Largest id read from the db so far.
+  int last_fetched_id_;
+  bool all_fetched_;
+  int editable_row_;
+  QStringList header_labels_;
+  mutable QMap<QString, QIcon> file_ext_to_icon_;
+};
+
+#endif  // DOWNLOADS_TABLE_MODEL_H_
@@ -1,13 +1,13 @@
 #include "downloads-table.h"
 
 #include "qaccelerator-utils.h"
+#include <algorithm>
 #include <QAbstractItemView>
 #include <QDesktopServices>
+#include <QHeaderView>
 #include <QUrl>
 #include <QFileInfo>
 #include <QFile>
-#include <QTableWidgetItem>
-#include <unordered_set>
 #include <QAction>
 #include <utility>
 #include <QMenu>
@@ -16,56 +16,36 @@
 #include <QClipboard>
 
 using std::unordered_map;
-using std::unordered_set;
 using std::vector;
 using std::pair;
 using std::make_pair;
 using std::unique_ptr;
 typedef DownloadItem::StatusEnum Status;
 
-static const char* ICON_FILES_DIRNAME = "icon_files";
-
-namespace {
-QString ProgressToString(double progress) {
-  return QString::number(progress * 100, 'f', 1) + "%";
-}
-}
-
-DownloadsTable::DownloadsTable(QWidget* parent)
-    : QTableWidget(parent) {
+DownloadsTable::DownloadsTable(QWidget* parent, Session* session)
+    : QTableView(parent) {
   rename_in_progress_ = false;
   batch_operation_in_progress_ = false;
-  displayed_field_names_ = QStringList({
-      "File",
-      "Size",
-      "Status",
-      "Progress",
-      "Start Time"});
-  setColumnCount(displayed_field_names_.size());
-  setHorizontalHeaderLabels(displayed_field_names_);
+  model_ = new DownloadsTableModel(this, session);
+  setModel(model_);
   setSelectionBehavior(QAbstractItemView::SelectRows);
   setSelectionMode(QAbstractItemView::ExtendedSelection);
-  foreach(const QString& field_name, displayed_field_names_) {
-    normalized_field_names_.append(NormalizeFieldName(field_name));
-  }
-  connect(this, SIGNAL(cellChanged(int, int)),
-          this, SLOT(OnCellChanged(int, int)));
-  connect(this, SIGNAL(cellDoubleClicked(int, int)),
-          this, SLOT(OnCellDoubleClicked(int, int)));
+  setEditTriggers(QAbstractItemView::NoEditTriggers);
+  setWordWrap(false);
+  // Rows all have the same height, so the view never has to measure them.
+  verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+  connect(this, SIGNAL(doubleClicked(const QModelIndex&)),
+          this, SLOT(OnDoubleClicked(const QModelIndex&)));
 }
 
 DownloadsTable::~DownloadsTable() {}
 
 void DownloadsTable::selectionChanged(const QItemSelection& selected,
                                  const QItemSelection& deselected) {
-  QTableWidget::selectionChanged(selected, deselected);
+  QTableView::selectionChanged(selected, deselected);
   GenerateAndUpdateToolbarState();
 }
 
-QString DownloadsTable::NormalizeFieldName(const QString& field_name) {
-  return field_name.toLower().replace(' ', '_');
-}
-
 void DownloadsTable::OpenFile(const QString& fpath) {
   QDesktopServices::openUrl(QUrl::fromLocalFile(fpath));
 }
@@ -82,59 +62,42 @@ void DownloadsTable::DeleteFile(DownloadItem& item) {
   emit DeleteItem(item);
 }
 
-void DownloadsTable::OnCellDoubleClicked(int row, int column) {
-  DownloadItem item = row_to_db_item_.find(row).value();
+void DownloadsTable::OnDoubleClicked(const QModelIndex& index) {
+  if (rename_in_progress_) {
+    return;
+  }
+  DownloadItem item = model_->ItemAt(index.row());
   Nullable<QString> save_as = item.SaveAs();
   if (!save_as.IsNull() && QFile(save_as.Get()).exists()) {
     OpenFile(save_as.Get());
   }
 }
 
-void DownloadsTable::OnCellChanged(int row, int column) {
-  if (!rename_in_progress_) {
-    return;
-  }
-  disconnect(this, SIGNAL(cellChanged(int, int)), 0, 0);
-  DownloadItem db_item = row_to_db_item_.find(row).value();
-  QTableWidgetItem* name_item = item(row, column);
-  QString db_save_as;
-  Nullable<QString> raw = db_item.SaveAs();
-  if (!raw.IsNull()) {
-    db_save_as = raw.Get();
-  }
-  QString db_fname = QFileInfo(db_save_as).fileName();
-  QString new_fname = name_item->text();
-  bool rename_op_done = false;
-  QString new_save_as;
+void DownloadsTable::Rename(int row) {
+  rename_in_progress_ = true;
+  model_->SetEditableRow(row);
+  QModelIndex name_index = model_->index(row,
+                                         DownloadsTableModel::FILE_COLUMN);
+  setCurrentIndex(name_index);
+  edit(name_index);
+}
 
-  if (db_fname != new_fname && new_fname != "") {
-    QString download_dir = DirName(db_save_as);
-    new_save_as = JoinPath(download_dir, new_fname);
-    rename_op_done = QFile::rename(db_save_as, new_save_as);
-  }
+void DownloadsTable::closeEditor(QWidget* editor,
+                                 QAbstractItemDelegate::EndEditHint hint) {
+  QTableView::closeEditor(editor, hint);
   rename_in_progress_ = false;
-  // emit RenameFinished(db_item, new_save_as, rename_op_done);
-  if (new_fname != db_fname && !rename_op_done) {
-    name_item->setText(db_fname);
-  } else {
-    db_item.SetSaveAs(new_save_as);
-  }
-  name_item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled);
-  name_item->setIcon(GetIcon(name_item->text()));
-  connect(this, SIGNAL(cellChanged(int, int)),
-          this, SLOT(OnCellChanged(int, int)));
+  model_->SetEditableRow(-1);
+  // Picks up the changes held back while the rename was in progress.
+  emit Refresh(vector<int>());
 }
 
-void DownloadsTable::Rename(int row) {
-  disconnect(this, SIGNAL(cellChanged(int, int)), 0, 0);
-  rename_in_progress_ = true;
-  QTableWidgetItem* name_item = item(row, 0);
-  setCurrentItem(name_item);
-  name_item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled |
-                      Qt::ItemIsEditable);
-  editItem(name_item);
-  connect(this, SIGNAL(cellChanged(int, int)),
-          this, SLOT(OnCellChanged(int, int)));
+vector<int> DownloadsTable::SelectedRows() {
+  vector<int> rows;
+  for (const QModelIndex& index : selectionModel()->selectedRows()) {
+    rows.push_back(index.row());
+  }
+  std::sort(rows.begin(), rows.end());
+  return rows;
 }
 
 void DownloadsTable::GenerateAndUpdateToolbarState() {
@@ -146,17 +109,16 @@ void DownloadsTable::GenerateAndUpdateToolbarState() {
     {"delete_entry", false},
     {"clone", false}
   };
-  if (selectionModel()->selectedIndexes().isEmpty()) {
+  vector<int> rows = SelectedRows();
+  if (rows.empty()) {
     emit UpdateToolbar(possibilities);
     return;
   }
   for (const auto& entry : possibilities) {
     possibilities[entry.first] = true;
   }
-  for (const QModelIndex& index : selectionModel()->selectedIndexes()) {
-    // TODO(ogaro): Remove once we can use const downloaditem everywhere.
-    DownloadItem item = const_cast<DownloadItem&>(
-        row_to_db_item_.find(index.row()).value());
+  for (int row : rows) {
+    DownloadItem item = model_->ItemAt(row);
     for (const auto& entry : possibilities) {
       possibilities[entry.first] &= ActionIsPossible(entry.first, item);
     }
@@ -199,6 +161,8 @@ bool DownloadsTable::ActionIsPossible(const QString& action,
         !save_as.IsNull() && QFile::exists(save_as.Get());
   } else if (action == "copy_url") {
     return !item.Url().IsNull();
+  } else if (action == "raise_priority" || action == "lower_priority") {
+    return status.Get() == Status::QUEUED;
   } else {
     DIE() << "Action '" << action << "' not recognized.";
   }
@@ -233,11 +197,16 @@ void DownloadsTable::PerformAction(const QString& action,
   } else if (action == "delete_file") {
     DeleteFile(item);
   } else if (action == "rename") {
-    // TODO(ogaro): Find or null
-    int row = db_id_to_row_.find(item.Id()).value();
-    Rename(row);
+    int row = model_->RowOf(item.Id());
+    if (row >= 0) {
+      Rename(row);
+    }
   } else if (action == "copy_url") {
     QApplication::clipboard()->setText(item.Url().Get());
+  } else if (action == "raise_priority") {
+    emit ChangePriority(item, 1);
+  } else if (action == "lower_priority") {
+    emit ChangePriority(item, -1);
   } else {
     DIE() << "Action '" << action << "' not recognized.";
   }
@@ -245,29 +214,30 @@ void DownloadsTable::PerformAction(const QString& action,
 
 void DownloadsTable::PerformActionOnSelected(const QString& action) {
   batch_operation_in_progress_ = true;
-  unordered_set<int> selected_rows;
-  for (const QModelIndex& index : selectionModel()->selectedIndexes()) {
-    selected_rows.insert(index.row());
+  // Actions may refresh the model, so the items are looked up first.
+  vector<DownloadItem> items;
+  vector<int> ids;
+  for (int row : SelectedRows()) {
+    items.push_back(model_->ItemAt(row));
+    ids.push_back(items.back().Id());
   }
-  for (int row : selected_rows) {
-    DownloadItem& item = row_to_db_item_.find(row).value();
+  for (DownloadItem& item : items) {
     CHECK(item.IsValid());
     if (ActionIsPossible(action, item)) {
       PerformAction(action, item);
     }
   }
   batch_operation_in_progress_ = false;
-  emit Refresh();
+  emit Refresh(ids);
 }
 
 // TODO(ogaro): Delete all temporary actions when exec returns.
 void DownloadsTable::ShowPopup(QMouseEvent* event) {
-  QModelIndexList indexes = selectionModel()->selectedIndexes();
-  if (indexes.isEmpty()) {
+  vector<int> rows = SelectedRows();
+  if (rows.empty()) {
     return;
   }
-  int row = indexes[0].row();
-  DownloadItem& item = row_to_db_item_.find(row).value();
+  DownloadItem item = model_->ItemAt(rows[0]);
   vector<pair<QString, QAction*> > actions;
   actions.push_back(make_pair("pause",
       new QAction(QIcon(":/images/pause.png"), "Pause", this)));
@@ -289,6 +259,10 @@ void DownloadsTable::ShowPopup(QMouseEvent* event) {
   actions.push_back(make_pair("delete_file", delete_file_act));
   delete_menu.addAction(delete_entry_act);
   delete_menu.addAction(delete_file_act);
+  actions.push_back(make_pair("raise_priority",
+                              new QAction("Raise queue priority", this)));
+  actions.push_back(make_pair("lower_priority",
+                              new QAction("Lower queue priority", this)));
   actions.push_back(make_pair("rename", new QAction("Rename", this)));
   actions.push_back(make_pair("copy_url",
                               new QAction("Copy url to clipboard", this)));
@@ -317,7 +291,7 @@ void DownloadsTable::ShowPopup(QMouseEvent* event) {
 }
 
 void DownloadsTable::mousePressEvent(QMouseEvent* event) {
-  QTableWidget::mousePressEvent(event);
+  QTableView::mousePressEvent(event);
   if (event->button() == Qt::RightButton) {
     ShowPopup(event);
   }
@@ -325,114 +299,22 @@ void DownloadsTable::mousePressEvent(QMouseEvent* event) {
 
 void DownloadsTable::SetProgress(int db_item_id,
                                  double progress) {
-  auto row = db_id_to_row_.find(db_item_id);
-  if (row == db_id_to_row_.end()) {
-    return; // Item does not match currently selected status and category.
-  }
-  int col = normalized_field_names_.indexOf("progress");
-  item(row.value(), col)->setText(ProgressToString(progress));
+  model_->SetProgress(db_item_id, progress);
 }
 
-QStringList DownloadsTable::ParseFieldsFromDBItem(DownloadItem& item) {
-  QString file_size_str = "";
-  QString progress_str = "";
-  QString file = "";
-  QString start_time_str = "";
-
-  Nullable<qint64> file_size = item.FileSize();
-  if (!file_size.IsNull()) {
-    if (file_size.Get() > 0) {
-      file_size_str = IntFileSizeToString(file_size.Get());
-    } else {
-      file_size_str = "Unknown";
-    }
-  }
-  Nullable<qint64> start_time = item.StartTime();
-  if (!start_time.IsNull()) {
-    if (start_time.Get() > 0) {
-      start_time_str = StringifyTimeStamp(start_time.Get());
-    } else {
-      start_time_str = "Not started";
-    }
-  }
-  if (item.Status().Get() == Status::COMPLETED) {
-    progress_str = "100.0%";
-  } else {
-    Nullable<double> progress = item.Progress();
-    if (!progress.IsNull()) {
-      progress_str = ProgressToString(progress.Get());
-    }
-  }
-  Nullable<QString> save_as = item.SaveAs();
-  if (!save_as.IsNull()) {
-    file = FileName(save_as.Get());
-  }
-  // In order of displayed_field_names_;
-  QString status_str = DownloadItem::ToString(item.Status().Get());
-  return QStringList({
-      file,
-      file_size_str,
-      status_str,
-      progress_str,
-      start_time_str});
+void DownloadsTable::RefreshItems(const vector<int>& db_item_ids) {
+  model_->Refresh(db_item_ids);
 }
 
-void DownloadsTable::AddRow(DownloadItem& db_item) {
-  disconnect(this, SIGNAL(cellChanged(int, int)), 0, 0);
-  int last_row_id = rowCount();
-  insertRow(last_row_id);
-
-  QStringList row_contents = ParseFieldsFromDBItem(db_item);
-  for (int i = 0; i < normalized_field_names_.size(); ++i) {
-    QTableWidgetItem* item = new QTableWidgetItem(row_contents[i]);
-    item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled);
-    if (i == 0) {
-      Nullable<QString> save_as = db_item.SaveAs();
-      if (!save_as.IsNull()) {
-        item->setIcon(GetIcon(save_as.Get()));
-      }
-    }
-    setItem(last_row_id, i, item);
-  }
-  resizeColumnsToContents();
-  db_id_to_row_[db_item.Id()] = last_row_id;
-  row_to_db_item_[last_row_id] = DownloadItem(db_item);
-  connect(this, SIGNAL(cellChanged(int, int)),
-          this, SLOT(OnCellChanged(int, int)));
-}
-
-const QIcon& DownloadsTable::GetIcon(const QString& fpath) {
-  QString file_ext = FileExt(fpath);
-  auto cached = file_ext_to_icon_.find(file_ext);
-  if (cached != file_ext_to_icon_.end()) {
-    return cached.value();
+void DownloadsTable::SetFilter(
+    const Nullable<DownloadItem::StatusEnum>& status,
+    const Nullable<Category>& category,
+    bool archived) {
+  bool was_empty = (model_->rowCount(QModelIndex()) == 0);
+  bool reloaded = model_->SetFilter(status, category, archived);
+  // Sizing columns only looks at the visible rows, but is still too slow to
+  // do on every refresh.
+  if ((reloaded || was_empty) && model_->rowCount(QModelIndex()) > 0) {
+    resizeColumnsToContents();
   }
-  unique_ptr<QIcon> icon;
-  if (QFile::exists(fpath)) {
-    icon.reset(new QIcon(QFileIconProvider().icon(QFileInfo(fpath))));
-  } else {
-    QString icon_files_dir = JoinPath(QDir::currentPath(), ICON_FILES_DIRNAME);
-    if (!QFile::exists(icon_files_dir)) {
-      QDir(QDir::currentPath()).mkdir(ICON_FILES_DIRNAME);
-    }
-    QString temp_fpath = JoinPath(icon_files_dir,
-                                  "qaccelerator_temp." + file_ext);
-    QFile temp_file(temp_fpath);
-    if (!temp_file.exists()) {
-      temp_file.open(QFile::WriteOnly);
-      temp_file.close();
-    }
-    icon.reset(new QIcon(QFileIconProvider().icon(QFileInfo(temp_file))));
-  }
-  if (icon->isNull()) {
-    icon.reset(new QIcon(":images/default_file_icon.png"));
-  }
-  file_ext_to_icon_[file_ext] = *icon;
-  return file_ext_to_icon_[file_ext];
-}
-
-void DownloadsTable::Reset() {
-  setRowCount(0);
-  db_id_to_row_.clear();
-  row_to_db_item_.clear();
 }
@@ -3,22 +3,21 @@
 
 #include "qaccelerator-utils.h"
 #include "qaccelerator-db.h"
-#include <QTableWidget>
+#include "downloads-table-model.h"
+#include <QTableView>
 #include <unordered_map>
 #include <vector>
 #include <memory>
 #include <QStringList>
-#include <QIcon>
-#include <QFileIconProvider>
 #include <QMouseEvent>
 
 // TODO(ogaro): Rename item to db_item everywhere.
 // TODO(ogaro): Use const DownloadItem& instead of DownloadItem&
-class DownloadsTable : public QTableWidget {
+class DownloadsTable : public QTableView {
   Q_OBJECT
 
  public:
-  DownloadsTable(QWidget* parent);
+  DownloadsTable(QWidget* parent, Session* session);
   ~DownloadsTable();
 
   void OpenFile(const QString& fpath);
@@ -28,10 +27,14 @@ class DownloadsTable : public QTableWidget {
     return rename_in_progress_;
   }
   void GenerateAndUpdateToolbarState();
-  void Reset();
-  void AddRow(DownloadItem& item);
+  // See DownloadsTableModel::SetFilter().
+  void SetFilter(const Nullable<DownloadItem::StatusEnum>& status,
+                 const Nullable<Category>& category,
+                 bool archived);
   void PerformActionOnSelected(const QString& action_name);
   void SetProgress(int db_item_id, double progress);
+  // See DownloadsTableModel::Refresh().
+  void RefreshItems(const std::vector<int>& db_item_ids);
   bool BatchOperationInProgress() { return batch_operation_in_progress_; }
 
  signals:
@@ -41,8 +44,10 @@ class DownloadsTable : public QTableWidget {
   void CloneDownload(DownloadItem& item);
   void DeleteItem(DownloadItem& item);
   void StartOrQueueDownload(DownloadItem& item);
+  void ChangePriority(DownloadItem& item, int delta);
   void UpdateToolbar(const std::unordered_map<QString, bool>& possibilities);
-  void Refresh();
+  // The items of `db_item_ids` may have changed.
+  void Refresh(const std::vector<int>& db_item_ids);
   //void RenameFinished(DownloadItem& item, const QString& new_save_as,
   //                    bool rename_op_done);
 
@@ -54,29 +59,24 @@ class DownloadsTable : public QTableWidget {
   // Override
   void mousePressEvent(QMouseEvent * event);
 
+ protected slots:
+  // Override
+  void closeEditor(QWidget* editor, QAbstractItemDelegate::EndEditHint hint);
+
  // TODO(ogaro): Move all slots to this section.
  private slots:
-  void OnCellChanged(int row, int column);
-  void OnCellDoubleClicked(int row, int column);
+  void OnDoubleClicked(const QModelIndex& index);
   void Rename(int row);
 
  private:
-  QString NormalizeFieldName(const QString& field_name);
-  const QIcon& GetIcon(const QString& fpath);
   bool ActionIsPossible(const QString& action_name,
                         DownloadItem& item);
   void PerformAction(const QString& action_name,
                      DownloadItem& item);
   void ShowPopup(QMouseEvent* event);
-  QStringList ParseFieldsFromDBItem(DownloadItem& item);
+  std::vector<int> SelectedRows();
 
-  QStringList displayed_field_names_;
-  QStringList normalized_field_names_;
-  // TODO(ogaro): Do something more efficient than copying the DownloadItem
-  // object around?
-  QMap<int, int> db_id_to_row_;
-  QMap<int, DownloadItem> row_to_db_item_;
-  QMap<QString, QIcon> file_ext_to_icon_;
+  DownloadsTableModel* model_;
   bool rename_in_progress_;
   bool batch_operation_in_progress_;
 };
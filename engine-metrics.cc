@@ -0,0 +1,80 @@
+#include "engine-metrics.h"
+
+#include <QMutexLocker>
+
+namespace {
+const double kNanosInASecond = 1e9;
+}
+
+LatencyHistogram::LatencyHistogram(const std::vector<double>& bounds)
+    : bounds_(bounds),
+      counts_(new std::atomic<qint64>[bounds.size() + 1]),
+      sum_nanos_(0) {
+  for (size_t i = 0; i <= bounds_.size(); ++i) {
+    counts_[i].store(0);
+  }
+}
+
+void LatencyHistogram::Observe(qint64 nanos) {
+  double seconds = nanos / kNanosInASecond;
+  size_t bucket = 0;
+  while (bucket < bounds_.size() && seconds > bounds_[bucket]) {
+    ++bucket;
+  }
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Render(const QString& name, const QString& help,
+                              QString* out) const {
+  *out += QString("# HELP %1 %2\n# TYPE %1 histogram\n").arg(name).arg(help);
+  qint64 cumulative = 0;
+  for (size_t i = 0; i <= bounds_.size(); ++i) {
+    cumulative += counts_[i].load(std::memory_order_relaxed);
+    QString bound = i < bounds_.size() ? QString::number(bounds_[i]) : "+Inf";
+    *out += QString("%1_bucket{le=\"%2\"} %3\n")
+        .arg(name).arg(bound).arg(cumulative);
+  }
+  *out += QString("%1_sum %2\n").arg(name).arg(
+      sum_nanos_.load(std::memory_order_relaxed) / kNanosInASecond, 0, 'g',
+      12);
+  *out += QString("%1_count %2\n").arg(name).arg(cumulative);
+}
+
+EngineMetrics* EngineMetrics::Instance() {
+  static EngineMetrics instance;
+  return &instance;
+}
+
+EngineMetrics::EngineMetrics()
+    : num_retries_(0),
+      finalizer_queue_depth_(0),
+      db_write_latency_({0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+                         0.25, 0.5, 1}),
+      ui_tick_latency_({0.001, 0.0025, 0.005, 0.01, 0.016, 0.025, 0.05, 0.1,
+                        0.25}) {}
+
+void EngineMetrics::AddFetcher(Fetcher* fetcher) {
+  QMutexLocker locker(&mutex_);
+  fetchers_.append(fetcher);
+}
+
+void EngineMetrics::RemoveFetcher(Fetcher* fetcher) {
+  QMutexLocker locker(&mutex_);
+  fetchers_.removeAll(fetcher);
+}
+
+QList<Fetcher*> EngineMetrics::Fetchers() {
+  QMutexLocker locker(&mutex_);
+  return fetchers_;
+}
+
+void EngineMetrics::RecordNetworkError(int code) {
+  QMutexLocker locker(&mutex_);
+  ++network_errors_[code];
+}
+
+std::map<int, qint64> EngineMetrics::NetworkErrors() {
+  QMutexLocker locker(&mutex_);
+  return network_errors_;
+}
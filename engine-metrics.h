@@ -0,0 +1,83 @@
+#ifndef ENGINE_METRICS_H_
+#define ENGINE_METRICS_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+class Fetcher;
+
+// Counts of how long something took, in buckets with fixed upper bounds.
+// Observe() is lock-free, so it can be called on any thread.
+class LatencyHistogram {
+ public:
+  // `bounds` are the upper bounds of the buckets in seconds, ascending. A
+  // last bucket without a bound catches the rest.
+  explicit LatencyHistogram(const std::vector<double>& bounds);
+
+  void Observe(qint64 nanos);
+  // Appends the histogram in the Prometheus text format.
+  void Render(const QString& name, const QString& help, QString* out) const;
+
+ private:
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  std::vector<double> bounds_;
+  // Not cumulative; one more than there are bounds.
+  std::unique_ptr<std::atomic<qint64>[]> counts_;
+  std::atomic<qint64> sum_nanos_;
+};
+
+// Process-wide counters of the download engine, for MetricsServer. Updating
+// them is cheap and thread-safe, so they are kept whether or not anything
+// reads them.
+class EngineMetrics {
+ public:
+  static EngineMetrics* Instance();
+
+  // Fetchers register themselves for as long as they exist. The list must
+  // only be used on the thread that owns them.
+  void AddFetcher(Fetcher* fetcher);
+  void RemoveFetcher(Fetcher* fetcher);
+  QList<Fetcher*> Fetchers();
+
+  // A segment request that failed with `code`, a QNetworkReply::NetworkError.
+  void RecordNetworkError(int code);
+  void RecordRetry() { num_retries_.fetch_add(1, std::memory_order_relaxed); }
+  // Merges and removals waiting for, or running on, the finalizer thread.
+  void AddFinalizerJobs(int delta) {
+    finalizer_queue_depth_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  std::map<int, qint64> NetworkErrors();
+  qint64 NumRetries() {
+    return num_retries_.load(std::memory_order_relaxed);
+  }
+  int FinalizerQueueDepth() {
+    return finalizer_queue_depth_.load(std::memory_order_relaxed);
+  }
+  // Statements that change the database, including commits.
+  LatencyHistogram* DbWriteLatency() { return &db_write_latency_; }
+  // One pass of UiTicker over all its subscribers.
+  LatencyHistogram* UiTickLatency() { return &ui_tick_latency_; }
+
+ private:
+  EngineMetrics();
+  EngineMetrics(const EngineMetrics&) = delete;
+  EngineMetrics& operator=(const EngineMetrics&) = delete;
+
+  QMutex mutex_;
+  QList<Fetcher*> fetchers_;
+  std::map<int, qint64> network_errors_;
+  std::atomic<qint64> num_retries_;
+  std::atomic<int> finalizer_queue_depth_;
+  LatencyHistogram db_write_latency_;
+  LatencyHistogram ui_tick_latency_;
+};
+
+#endif  // ENGINE_METRICS_H_
@@ -1,30 +1,51 @@
 #include "fetcher.h"
 
+#include "capability-cache.h"
+#include "engine-metrics.h"
+#include "segment-allocator.h"
+#include "tracer.h"
+#include <new>
 #include <QDir>
+#include <QElapsedTimer>
 
 using std::pair;
 using std::vector;
 
 static const char * kNonResumeModeFileName = "NON_RESUMABLE";
+// Size of a reply's read buffer when the worker is rate limited.
+static const qint64 kThrottledReadBufferSize = 64 * 1024;
+// How long a rate limited worker waits before reading buffered data again.
+static const int kThrottleIntervalMs = 50;
+// Wait before restarting a throttled worker when the server gives no
+// Retry-After, and the longest wait honored when it does.
+static const qint64 kDefaultRetryAfterMs = 5000;
+static const qint64 kMaxRetryAfterMs = 5 * 60 * 1000;
+// A worker throttled more often than this fails instead.
+static const int kMaxThrottleRetries = 10;
+// After being throttled, one more connection is allowed each time this
+// passes without the server throttling again. A probe that gets throttled
+// doubles the wait, up to kMaxProbeIntervalMs.
+static const int kProbeIntervalMs = 30 * 1000;
+static const int kMaxProbeIntervalMs = 10 * 60 * 1000;
+// Returned ranges are split between idle connections down to this size.
+static const qint64 kMinSplitBytes = 1024 * 1024;
+// During a ramp-up, connections that received nothing this many intervals
+// after the last one was added no longer hold up the next.
+static const int kMaxRampUpWaitIntervals = 4;
+static const int kRampUpWarmUpIntervals = 2;
+static const int kRampUpMeasureIntervals = 3;
 
-namespace {
-struct AscendingStartIndex {
-  inline bool operator() (const Segment& a, const Segment& b) {
-    return a.first < b.first;
+WorkerStatsBlock::WorkerStatsBlock(int num_workers)
+    : num_workers_(num_workers),
+      storage_(new char[(num_workers + 1) * sizeof(Slot)]) {
+  quintptr address = reinterpret_cast<quintptr>(storage_.get());
+  address = (address + kCacheLineSize - 1) & ~(quintptr) (kCacheLineSize - 1);
+  slots_ = reinterpret_cast<Slot*>(address);
+  for (int i = 0; i < num_workers; ++i) {
+    WorkerStats* stats = &(new (&slots_[i]) Slot())->stats;
+    stats->downloaded.store(0);
+    stats->state.store(WorkerStats::IDLE);
   }
-};
-
-void Sort(std::vector<Segment>* segments) {
-  std::sort(segments->begin(), segments->end(), AscendingStartIndex());
-}
-
-qint64 CountBytes(const std::vector<Segment>& segments) {
-  qint64 sum = 0;
-  for (const Segment& segment : segments) {
-    sum += segment.second - segment.first + 1;
-  }
-  return sum;
-}
 }
 
 FetcherWorker::FetcherWorker(int worker_id,
@@ -32,7 +53,9 @@ FetcherWorker::FetcherWorker(int worker_id,
                              const vector<Segment>& segments,
                              const QUrl& url,
                              const QString& work_dir,
-                             bool non_resume_mode)
+                             bool non_resume_mode,
+                             const std::shared_ptr<WorkerStatsBlock>& stats_block,
+                             const std::shared_ptr<ConnectionTelemetry>& telemetry)
     : worker_id_(worker_id),
       pre_downloaded_(pre_downloaded),
       segments_(segments),
@@ -43,11 +66,24 @@ FetcherWorker::FetcherWorker(int worker_id,
       allocation_size_(CountBytes(segments)),
       current_segment_(segments_.begin()),
       current_request_(url),
-      non_resume_mode_(non_resume_mode) {
+      non_resume_mode_(non_resume_mode),
+      stats_block_(stats_block),
+      stats_(stats_block->At(worker_id)),
+      rate_limit_(0),
+      attempt_(0),
+      allowance_(0),
+      last_refill_millis_(0),
+      throttle_timer_(new QTimer(this)),
+      telemetry_(telemetry),
+      last_data_millis_(-1),
+      last_publish_millis_(0),
+      trace_start_micros_(-1) {
   is_done_ = false;
+  // The slot may have been used by a worker that was throttled.
+  stats_->downloaded.store(0, std::memory_order_relaxed);
+  throttle_timer_->setSingleShot(true);
+  connect(throttle_timer_, SIGNAL(timeout()), this, SLOT(OnThrottleTimeout()));
   is_in_error_ = false;
-  progress_updater_ = new QTimer(this);
-  connect(progress_updater_, SIGNAL(timeout()), this, SLOT(UpdateProgress()));
   current_request_.setRawHeader("connection", "Keep-Alive");
   current_request_.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute,
                                 true);
@@ -59,16 +95,19 @@ FetcherWorker::~FetcherWorker() {
   }
 }
 
-void FetcherWorker::UpdateProgress() {
-  emit Progress(GetTotalDownloadedBytes());
+void FetcherWorker::SetState(WorkerStats::State state) {
+  stats_->state.store(state, std::memory_order_release);
 }
 
 void FetcherWorker::Start() {
+  Tracer::Instance()->NameThread(QString("Worker %1").arg(worker_id_));
   network_.reset(new QNetworkAccessManager());
-  progress_updater_->start(kProgressUpdateInterval);
+  allowance_ = 0;
+  last_refill_millis_ = CurrentTimeMillis();
+  SetState(WorkerStats::RUNNING);
   if (!StartNextSegment() && !IsInError()) {
     is_done_ = true;
-    progress_updater_->stop();
+    SetState(WorkerStats::DONE);
     emit Completed();
   }
   // qDebug() << "Worker " << worker_id_ << " started.";
@@ -94,6 +133,18 @@ bool FetcherWorker::StartNextSegment() {
     is_in_error_ = true;
     return false;
   }
+  QString error;
+  if (!non_resume_mode_
+      && !Preallocate(current_file_.get(), 0,
+                      current_segment_->second - current_segment_->first + 1,
+                      &error)) {
+    qWarning() << "Worker " << worker_id_ << ": " << error;
+    current_file_->remove();
+    current_file_.reset();
+    // There is no code for local errors.
+    OnError(QNetworkReply::UnknownContentError);
+    return false;
+  }
 
   seg_bytes_received_ = 0;
   if (!non_resume_mode_) {
@@ -103,17 +154,33 @@ bool FetcherWorker::StartNextSegment() {
     current_request_.setRawHeader("range", range_header.toUtf8());
   }
   current_reply_.reset(network_->get(current_request_));
+  BeginTimeline();
+  if (rate_limit_ > 0) {
+    current_reply_->setReadBufferSize(kThrottledReadBufferSize);
+  }
   connect(current_reply_.get(), SIGNAL(finished()),
           this, SLOT(OnSegmentFinished()));
   connect(current_reply_.get(), SIGNAL(downloadProgress(qint64, qint64)),
           this, SLOT(OnDownloadProgress(qint64, qint64)));
+  connect(current_reply_.get(), SIGNAL(encrypted()),
+          this, SLOT(OnEncrypted()));
+  connect(current_reply_.get(), SIGNAL(metaDataChanged()),
+          this, SLOT(OnMetaDataChanged()));
   //connect(current_reply_.get(), SIGNAL(error(QNetworkReply::NetworkError)),
   //        this, SLOT(OnError(QNetworkReply::NetworkError)));
   return true;
 }
 
 void FetcherWorker::Stop() {
+  if (current_reply_ == nullptr) {
+    if (is_in_error_) {
+      emit Stopped();  // Failed before its request was made.
+    }
+    return;  // Otherwise already stopped on being throttled.
+  }
+  throttle_timer_->stop();
   disconnect(current_reply_.get(), 0, 0, 0);
+  EndTimeline(QNetworkReply::OperationCanceledError);
 
   current_reply_->abort();
   if (seg_bytes_received_ > 0) {
@@ -125,8 +192,7 @@ void FetcherWorker::Stop() {
   current_file_->close();
   current_file_.reset();
   current_reply_.reset();
-  progress_updater_->stop();
-  UpdateProgress();
+  SetState(WorkerStats::STOPPED);
   emit Stopped();
 }
 
@@ -152,11 +218,16 @@ void FetcherWorker::MaybeRenameCurrentShard() {
 }
 
 void FetcherWorker::OnSegmentFinished() {
+  // Whatever is still buffered belongs to this segment.
+  throttle_timer_->stop();
+  ReadAvailable(true);
   disconnect(current_reply_.get(), 0, 0, 0);
+  EndTimeline(current_reply_->error());
   if (non_resume_mode_) {
     // Rename file so it can be merged later.
     QString new_shard_path = MakeShardPath(
           work_dir_, Segment(0, downloaded_ - 1));
+    TraceSpan span("disk", "Rename shard");
     if (!current_file_->rename(new_shard_path)) {
       DIE() << "Shard rename to " << new_shard_path << " failed";
     }
@@ -178,29 +249,198 @@ void FetcherWorker::OnSegmentFinished() {
     current_reply_.reset();
   }
   if (is_done_) {
-    progress_updater_->stop();
-    UpdateProgress();
+    SetState(WorkerStats::DONE);
     emit Completed();
   }
 }
 
-// TODO(ogaro): Double-check whether it is ok to assume that bytesReceived
-// should always add up to the reported size of a file.
+// Counts the bytes actually written rather than bytesReceived, which also
+// includes what is still buffered in the reply.
 void FetcherWorker::OnDownloadProgress(qint64 bytesReceived,
                                        qint64 bytesTotal) {
-  if (bytesReceived < seg_bytes_received_) {
-    DIE() << "Bytes received was " << bytesReceived
-             << " but seg bytes received was" << seg_bytes_received_;
+  Q_UNUSED(bytesReceived);
+  Q_UNUSED(bytesTotal);
+  if (!throttle_timer_->isActive()) {
+    ReadAvailable(false);
+  }
+}
+
+void FetcherWorker::OnThrottleTimeout() {
+  if (current_reply_ != nullptr) {
+    ReadAvailable(false);
   }
-  qint64 delta = bytesReceived - seg_bytes_received_;
-  seg_bytes_received_ += delta;
-  downloaded_ += delta;
+}
+
+void FetcherWorker::ReadAvailable(bool drain) {
   if (current_file_ == nullptr) {
     // TODO(ogaro): Emit error.
-    DIE()<< "OnDownloadProgress encountered null file pointer.";
+    DIE()<< "ReadAvailable encountered null file pointer.";
     return;
   }
-  current_file_->write(current_reply_->readAll());
+  qint64 num_bytes = current_reply_->bytesAvailable();
+  if (rate_limit_ > 0 && !drain) {
+    // Token bucket holding at most a quarter of a second's worth of bytes.
+    qint64 now = CurrentTimeMillis();
+    allowance_ = std::min(
+        allowance_ + (now - last_refill_millis_) * rate_limit_ / 1000,
+        rate_limit_ / 4 + 1);
+    last_refill_millis_ = now;
+    num_bytes = std::min(num_bytes, std::max(allowance_, (qint64) 0));
+  }
+  if (num_bytes > 0) {
+    QByteArray data = current_reply_->read(num_bytes);
+    QElapsedTimer write_timer;
+    write_timer.start();
+    current_file_->write(data);
+    qint64 write_nanos = write_timer.nsecsElapsed();
+    allowance_ -= data.size();
+    seg_bytes_received_ += data.size();
+    downloaded_ += data.size();
+    stats_->downloaded.store(downloaded_, std::memory_order_relaxed);
+    RecordWrite(CurrentTimeMillis(), write_nanos);
+  }
+  if (rate_limit_ > 0 && !drain && current_reply_->bytesAvailable() > 0) {
+    throttle_timer_->start(kThrottleIntervalMs);
+  }
+}
+
+void FetcherWorker::OnEncrypted() {
+  timeline_.encrypted_millis = CurrentTimeMillis();
+  telemetry_->Update(timeline_);
+}
+
+void FetcherWorker::OnMetaDataChanged() {
+  if (timeline_.response_millis >= 0) {
+    return;
+  }
+  timeline_.response_millis = CurrentTimeMillis();
+  timeline_.http_status = current_reply_->attribute(
+      QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  CapabilityCache* capabilities = CapabilityCache::Instance();
+  if (timeline_.http_status == 206) {
+    capabilities->RecordRangeSupport(url_, true);
+  } else if (timeline_.http_status == 200 && !non_resume_mode_) {
+    capabilities->RecordRangeSupport(url_, false);
+  }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 9, 0)
+  capabilities->RecordHttp2(url_, current_reply_->attribute(
+      QNetworkRequest::HTTP2WasUsedAttribute).toBool());
+#endif
+  if (IsThrottlingStatus(timeline_.http_status)) {
+    HandleThrottled();
+    return;
+  }
+  telemetry_->Update(timeline_);
+}
+
+void FetcherWorker::HandleThrottled() {
+  qint64 now = CurrentTimeMillis();
+  qint64 retry_after = ParseRetryAfter(
+      current_reply_->rawHeader("Retry-After"), now);
+  if (retry_after < 0) {
+    retry_after = kDefaultRetryAfterMs;
+  }
+  retry_after = std::min(retry_after, kMaxRetryAfterMs);
+  qDebug() << "Worker " << worker_id_ << " throttled with status "
+           << timeline_.http_status << "; retrying in " << retry_after
+           << " ms";
+  throttle_timer_->stop();
+  disconnect(current_reply_.get(), 0, 0, 0);
+  EndTimeline(timeline_.http_status == 503
+                  ? QNetworkReply::ServiceUnavailableError
+                  : QNetworkReply::UnknownContentError);
+  current_reply_->abort();
+
+  SegmentList remaining;
+  if (non_resume_mode_) {
+    // Nothing can be kept; the download starts over.
+    remaining = segments_;
+  } else {
+    Segment rest(current_segment_->first + seg_bytes_received_,
+                 current_segment_->second);
+    if (rest.first <= rest.second) {
+      remaining.push_back(rest);
+    }
+    remaining.insert(remaining.end(), current_segment_ + 1, segments_.end());
+  }
+  if (seg_bytes_received_ > 0 && !non_resume_mode_) {
+    MaybeRenameCurrentShard();
+  } else {
+    current_file_->remove();
+  }
+  current_file_->close();
+  current_file_.reset();
+  current_reply_.reset();
+  SetState(WorkerStats::STOPPED);
+  emit Throttled(worker_id_, retry_after, remaining);
+  emit Stopped();
+}
+
+void FetcherWorker::BeginTimeline() {
+  timeline_ = SegmentTimeline();
+  timeline_.worker_id = worker_id_;
+  if (!non_resume_mode_) {
+    timeline_.segment = *current_segment_;
+  }
+  timeline_.attempt = attempt_;
+  attempt_ = 0;  // Later segments are first attempts.
+  timeline_.request_millis = CurrentTimeMillis();
+  last_data_millis_ = -1;
+  last_publish_millis_ = timeline_.request_millis;
+  Tracer* tracer = Tracer::Instance();
+  trace_start_micros_ = tracer->IsEnabled() ? tracer->NowMicros() : -1;
+  telemetry_->Update(timeline_);
+}
+
+void FetcherWorker::RecordWrite(qint64 now_millis, qint64 write_nanos) {
+  if (timeline_.first_byte_millis < 0) {
+    timeline_.first_byte_millis = now_millis;
+  } else if (now_millis - last_data_millis_
+             > SegmentTimeline::kStallThresholdMs) {
+    ++timeline_.num_stalls;
+    timeline_.stall_millis += now_millis - last_data_millis_;
+  }
+  last_data_millis_ = now_millis;
+  timeline_.bytes = seg_bytes_received_;
+  ++timeline_.num_writes;
+  timeline_.write_nanos += write_nanos;
+  timeline_.max_write_nanos = std::max(timeline_.max_write_nanos, write_nanos);
+  timeline_.AddSample(now_millis, seg_bytes_received_);
+  if (now_millis - last_publish_millis_ >= SegmentTimeline::kSampleIntervalMs) {
+    last_publish_millis_ = now_millis;
+    telemetry_->Update(timeline_);
+  }
+}
+
+void FetcherWorker::EndTimeline(QNetworkReply::NetworkError error) {
+  if (timeline_.request_millis < 0 || timeline_.IsFinished()) {
+    return;
+  }
+  timeline_.end_millis = CurrentTimeMillis();
+  timeline_.bytes = seg_bytes_received_;
+  timeline_.error = error;
+  if (error != QNetworkReply::NoError
+      && error != QNetworkReply::OperationCanceledError) {
+    EngineMetrics::Instance()->RecordNetworkError(error);
+  }
+  if (timeline_.http_status == 0) {
+    timeline_.http_status = current_reply_->attribute(
+        QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  }
+  if (trace_start_micros_ >= 0) {
+    Tracer::Instance()->AddSpan(
+        "net",
+        QString("Segment %1-%2").arg(timeline_.segment.first)
+            .arg(timeline_.segment.second),
+        trace_start_micros_,
+        {{"worker", worker_id_},
+         {"attempt", timeline_.attempt},
+         {"bytes", timeline_.bytes},
+         {"http_status", timeline_.http_status},
+         {"error", timeline_.error},
+         {"time_to_first_byte_ms", timeline_.TimeToFirstByte()}});
+  }
+  telemetry_->Update(timeline_);
 }
 
 void FetcherWorker::OnError(QNetworkReply::NetworkError code) {
@@ -213,7 +453,7 @@ void FetcherWorker::OnError(QNetworkReply::NetworkError code) {
   if (current_reply_ != nullptr) {
     err = current_reply_->errorString();
   }*/
-  progress_updater_->stop();
+  SetState(WorkerStats::FAILED);
   emit Error(worker_id_, code);
 }
 
@@ -221,15 +461,16 @@ WorkerUnit::WorkerUnit(FetcherWorker* worker)
       : worker_(worker),
         worker_id_(worker->GetId()),
         thread_(new QThread()),
+        is_started_(false),
         is_done_(false),
         byte_allocation_(worker->GetTotalAllocatedBytes()),
-        total_downloaded_(worker->GetPreDownloaded()) {
+        pre_downloaded_(worker->GetPreDownloaded()),
+        stats_(worker->Stats()) {
   is_stopped_ = false;
   worker_->moveToThread(thread_);
   // connect(worker_, SIGNAL(Error(QNetworkReply::NetworkError)),
   //        this, SLOT(OnError(QNetworkReply::NetworkError)));
   connect(this, SIGNAL(StopRequested()), worker_, SLOT(Stop()));
-  connect(worker_, SIGNAL(Progress(qint64)), this, SLOT(WorkerProgress(qint64)));
   connect(worker_, SIGNAL(Stopped()), this, SLOT(OnWorkerStopped()));
   connect(thread_, SIGNAL(started()), worker_, SLOT(Start()));
   connect(worker_, SIGNAL(Completed()), this, SLOT(Completed()));
@@ -239,7 +480,11 @@ WorkerUnit::WorkerUnit(FetcherWorker* worker)
 }
 
 WorkerUnit::~WorkerUnit() {
-  if (!is_done_) {
+  if (!is_started_) {
+    // Nothing ran on the thread, so nothing else deletes them.
+    delete worker_;
+    delete thread_;
+  } else if (!is_done_) {
     // worker_->deleteLater();
     // thread_->deleteLater();
   }
@@ -249,17 +494,14 @@ FetcherWorker* WorkerUnit::GetWorker() {
   return worker_;
 }
 
-void WorkerUnit::WorkerProgress(qint64 total_downloaded) {
-  total_downloaded_ = total_downloaded;
-  // qDebug() << "Worker " << worker_id_ << " has downloaded " << total_downloaded;
-}
-
 void WorkerUnit::Start() {
+  is_started_ = true;
   thread_->start();
 }
 
 void WorkerUnit::Stop() {
-  if (!worker_->IsDone() || !worker_->IsInError()) {
+  // The worker's own flags belong to its thread.
+  if (State() != WorkerStats::DONE) {
     emit StopRequested();
   }
 }
@@ -296,20 +538,52 @@ void WorkerUnit::OnError(QNetworkReply::NetworkError code) {
 }
 */
 
-Fetcher::Fetcher(const QUrl& url, qint64 file_size, const QString& save_as)
+Fetcher::RampUpPolicy::RampUpPolicy()
+    : interval_ms(500),
+      min_gain(0.1) {}
+
+Fetcher::Fetcher(const QUrl& url, qint64 file_size, const QString& save_as,
+                 Finalizer* finalizer)
       : url_(url),
         file_size_(file_size),
         save_as_(save_as),
+        finalizer_(finalizer),
+        merge_job_id_(-1),
         num_connections_(0),
-        work_dir_("") {
+        work_dir_(""),
+        telemetry_(std::make_shared<ConnectionTelemetry>()),
+        rate_limit_(0),
+        use_capability_cache_(true),
+        peak_connections_(0),
+        connection_cap_(0),
+        retry_at_millis_(0),
+        probe_interval_ms_(kProbeIntervalMs),
+        last_probe_millis_(0),
+        ramp_up_rate_(-1),
+        ramp_up_bytes_(0),
+        ramp_up_millis_(0),
+        ramp_up_steady_ticks_(-1) {
+  qRegisterMetaType<SegmentList>("SegmentList");
+  retry_timer_.setSingleShot(true);
+  connect(&retry_timer_, SIGNAL(timeout()),
+          this, SLOT(StartReturnedRanges()));
+  probe_timer_.setSingleShot(true);
+  connect(&probe_timer_, SIGNAL(timeout()), this, SLOT(ProbeConnectionCap()));
+  connect(&ramp_up_timer_, SIGNAL(timeout()), this, SLOT(OnRampUpTick()));
+  connect(finalizer_, SIGNAL(Progress(int, qint64, qint64)),
+          this, SLOT(OnFinalizerProgress(int, qint64, qint64)));
+  connect(finalizer_, SIGNAL(Finished(int, bool, QString)),
+          this, SLOT(OnFinalizerFinished(int, bool, QString)));
   is_in_error_ = false;
   waiting_for_all_workers_stopped_ = false;
   CHECK(!save_as.isEmpty());
+  EngineMetrics::Instance()->AddFetcher(this);
   // Preconditions: Overwrite save-as if preferences say so, or raise an
   // error.
 }
 
 Fetcher::~Fetcher() {
+  EngineMetrics::Instance()->RemoveFetcher(this);
   ClearWorkerUnits();
 }
 
@@ -359,6 +633,14 @@ void Fetcher::Resume(int num_connections) {
     CHECK(num_connections == 1);
   }
   num_connections_ = num_connections;
+  if (use_capability_cache_) {
+    num_connections_ = CapabilityCache::Instance()->SafeNumConnections(
+        url_, num_connections);
+  }
+  if (num_connections_ != num_connections) {
+    qDebug() << "Using " << num_connections_ << " instead of "
+             << num_connections << " connections for " << url_.host();
+  }
   QDir dir(work_dir_);
   if (file_size_ < 1) { // Unknown file size.
     if (dir.exists()) {
@@ -371,25 +653,153 @@ void Fetcher::Resume(int num_connections) {
       // qDebug() << "Work dir " << work_dir_ << " created.";
     }
   }
+  telemetry_->Open(work_dir_);
+  connection_cap_ = num_connections_;
+  peak_connections_ = 0;
+  returned_ranges_.clear();
+  probe_timer_.stop();
+  probe_interval_ms_ = kProbeIntervalMs;
+  last_probe_millis_ = 0;
   PrepareThreads();
+  if (ramp_up_.interval_ms <= 0 || worker_units_.size() < 2) {
+    StartPendingWorkers(connection_cap_);
+    return;
+  }
+  // Opening every connection at once is what gets many servers to throttle.
+  StartPendingWorkers(1);
+  ramp_up_rate_ = -1;
+  ramp_up_bytes_ = 0;
+  ramp_up_millis_ = CurrentTimeMillis();
+  ramp_up_steady_ticks_ = -1;
+  ramp_up_timer_.start(ramp_up_.interval_ms);
+}
+
+void Fetcher::SetRateLimit(qint64 bytes_per_second) {
+  rate_limit_ = bytes_per_second;
+}
+
+void Fetcher::SetRampUp(const RampUpPolicy& policy) {
+  ramp_up_ = policy;
+}
+
+int Fetcher::StartPendingWorkers(int cap) {
+  int num_active = NumActiveWorkers();
+  int num_started = 0;
+  for (WorkerUnit* unit : worker_units_) {
+    if (num_active >= cap) {
+      break;
+    }
+    if (!unit->IsStarted()) {
+      unit->Start();
+      ++num_active;
+      ++num_started;
+    }
+  }
+  UpdatePeakConnections();
+  return num_started;
+}
+
+int Fetcher::NumActiveWorkers() {
+  int num_active = 0;
   for (WorkerUnit* unit : worker_units_) {
-    unit->Start();
+    if (unit->IsStarted() && !unit->IsDone() && !unit->IsStopped()) {
+      ++num_active;
+    }
   }
+  return num_active;
+}
+
+void Fetcher::UpdatePeakConnections() {
+  peak_connections_ = std::max(peak_connections_, NumActiveWorkers());
+}
+
+qint64 Fetcher::DownloadedThisRun() {
+  qint64 downloaded = 0;
+  for (int i = 0; i < worker_units_.size(); ++i) {
+    downloaded += worker_units_[i]->TotalDownloaded()
+        - slot_pre_downloaded_[i];
+  }
+  return downloaded;
+}
+
+void Fetcher::OnRampUpTick() {
+  if (waiting_for_all_workers_stopped_ || is_in_error_) {
+    ramp_up_timer_.stop();
+    return;
+  }
+  qint64 now = CurrentTimeMillis();
+  bool all_receiving = true;
+  int num_opened = 0;  // Connections the throughput below was measured over.
+  for (WorkerUnit* unit : worker_units_) {
+    if (!unit->IsStarted() || unit->IsStopped()) {
+      continue;
+    }
+    ++num_opened;
+    if (!unit->IsDone() && unit->State() != WorkerStats::FAILED
+        && unit->TotalDownloaded() == unit->PreDownloaded()) {
+      all_receiving = false;
+    }
+  }
+  if (ramp_up_steady_ticks_ < 0) {
+    if (!all_receiving && now - ramp_up_millis_
+        < kMaxRampUpWaitIntervals * (qint64) ramp_up_.interval_ms) {
+      return;
+    }
+    ramp_up_steady_ticks_ = 0;
+  }
+  // The handshake, the first byte and TCP slow start of the connection just
+  // added would drag the throughput down, so skip a few intervals before
+  // measuring it over a few more.
+  ++ramp_up_steady_ticks_;
+  qint64 downloaded = DownloadedThisRun();
+  if (ramp_up_steady_ticks_ == kRampUpWarmUpIntervals) {
+    ramp_up_bytes_ = downloaded;
+    ramp_up_millis_ = now;
+    return;
+  }
+  if (ramp_up_steady_ticks_
+      < kRampUpWarmUpIntervals + kRampUpMeasureIntervals) {
+    return;
+  }
+  qint64 rate = (downloaded - ramp_up_bytes_) * 1000
+      / std::max(now - ramp_up_millis_, (qint64) 1);
+  if (ramp_up_rate_ > 0 && rate < ramp_up_rate_ * (1 + ramp_up_.min_gain)) {
+    // More connections wouldn't make the download faster, just the server
+    // busier.
+    connection_cap_ = std::max(1, std::min(connection_cap_, num_opened));
+    qDebug() << url_.host() << " ramped up to " << connection_cap_
+             << " connections at " << rate << " bytes/s";
+    ramp_up_timer_.stop();
+    StartPendingWorkers(connection_cap_);
+    return;
+  }
+  if (StartPendingWorkers(std::min(connection_cap_, NumActiveWorkers() + 1))
+      == 0) {
+    // All connections are open, or the server throttled.
+    ramp_up_timer_.stop();
+    return;
+  }
+  ramp_up_rate_ = rate;
+  ramp_up_steady_ticks_ = -1;
+  ramp_up_millis_ = now;
 }
 
 void Fetcher::PrepareThreads() {
   qDebug() << "File size is " << file_size_;
-  std::vector<Segment> pre_downloaded_segments;
-  GetDownloadedSegments(work_dir_, &pre_downloaded_segments);
-  std::vector<std::vector<Segment> > allocations;
+  pre_downloaded_segments_.clear();
+  ListShards(work_dir_, &pre_downloaded_segments_);
+  allocations_.clear();
   if (file_size_ > 0) {
-    CalculateAllocations(&pre_downloaded_segments, file_size_, num_connections_,
-                         &allocations);
+    CalculateAllocations(&pre_downloaded_segments_, file_size_,
+                         num_connections_, &allocations_);
   } else {
     vector<Segment> empty_alloc = { Segment(0, 0) };
-    allocations.push_back(empty_alloc);
+    allocations_.push_back(empty_alloc);
   }
-  qint64 pre_downloaded_bytes = CountBytes(pre_downloaded_segments);
+  worker_stats_ = std::make_shared<WorkerStatsBlock>(num_connections_);
+  slot_pre_downloaded_.clear();
+  slot_attempts_.assign(num_connections_, 0);
+  qint64 pre_downloaded_bytes = CountBytes(pre_downloaded_segments_);
   qint64 pre_downloaded_per_worker = pre_downloaded_bytes / num_connections_;
   for (int i = 0; i < num_connections_; ++i) {
     qint64 pre_downloaded_for_worker = pre_downloaded_per_worker;
@@ -399,20 +809,195 @@ void Fetcher::PrepareThreads() {
     FetcherWorker* worker = new FetcherWorker(
         i,
         pre_downloaded_for_worker,
-        allocations[i],
+        allocations_[i],
         url_,
         work_dir_,
-        file_size_ <= 0);
-    // () << "Worker is at " << reinterpret_cast<qint64>(worker);
-    WorkerUnit* worker_unit = new WorkerUnit(worker);
-    // qDebug() << "Worker unit is at " << reinterpret_cast<qint64>(worker_unit);
-    connect(worker_unit, SIGNAL(WorkerStopped(int)), this, SLOT(OnWorkerStopped(int)));
-    connect(worker_unit, SIGNAL(Completed(int)),
-            this, SLOT(RegisterCompletion(int)));
-    connect(worker, SIGNAL(Error(int, QNetworkReply::NetworkError)),
-            this, SLOT(HandleError(int, QNetworkReply::NetworkError)));
-    worker_units_.append(worker_unit);
+        file_size_ <= 0,
+        worker_stats_,
+        telemetry_);
+    if (rate_limit_ > 0) {
+      worker->SetRateLimit(std::max(rate_limit_ / num_connections_,
+                                    (qint64) 1));
+    }
+    worker_units_.append(MakeWorkerUnit(worker));
+    slot_pre_downloaded_.push_back(pre_downloaded_for_worker);
+  }
+}
+
+WorkerUnit* Fetcher::MakeWorkerUnit(FetcherWorker* worker) {
+  WorkerUnit* worker_unit = new WorkerUnit(worker);
+  connect(worker_unit, SIGNAL(WorkerStopped(int)),
+          this, SLOT(OnWorkerStopped(int)));
+  connect(worker_unit, SIGNAL(Completed(int)),
+          this, SLOT(RegisterCompletion(int)));
+  connect(worker, SIGNAL(Error(int, QNetworkReply::NetworkError)),
+          this, SLOT(HandleError(int, QNetworkReply::NetworkError)));
+  connect(worker, SIGNAL(Throttled(int, qint64, SegmentList)),
+          this, SLOT(OnWorkerThrottled(int, qint64, SegmentList)));
+  return worker_unit;
+}
+
+void Fetcher::OnWorkerThrottled(int worker_id, qint64 retry_after_millis,
+                                const SegmentList& remaining) {
+  EngineMetrics::Instance()->RecordRetry();
+  // The throttled worker has stopped, but was open when the server answered.
+  CapabilityCache::Instance()->RecordThrottled(url_, NumRunningWorkers() + 1);
+  ReturnedRanges returned;
+  returned.ranges = remaining;
+  returned.attempt = slot_attempts_[worker_id] + 1;
+  if (returned.attempt > kMaxThrottleRetries) {
+    HandleError(worker_id, QNetworkReply::ServiceUnavailableError);
+    return;
+  }
+  // The server coped with the connections that are still running.
+  connection_cap_ = std::max(1, std::min(connection_cap_ - 1,
+                                         NumRunningWorkers()));
+  qDebug() << url_.host() << " throttled worker " << worker_id
+           << "; now running at most " << connection_cap_ << " connections";
+  if (!returned.ranges.empty()) {
+    returned_ranges_.push_back(returned);
+    if (file_size_ > 0) {
+      // Whichever slot picks the ranges up lists them from now on.
+      TrimAllocation(worker_id);
+      emit AllocationsChanged();
+    }
+  }
+  qint64 now = CurrentTimeMillis();
+  retry_at_millis_ = std::max(retry_at_millis_, now + retry_after_millis);
+  if (last_probe_millis_ > 0
+      && now - last_probe_millis_ < probe_interval_ms_) {
+    // The last probe was one connection too many.
+    probe_interval_ms_ = std::min(probe_interval_ms_ * 2, kMaxProbeIntervalMs);
+  }
+  probe_timer_.start(probe_interval_ms_);
+}
+
+void Fetcher::ProbeConnectionCap() {
+  if (waiting_for_all_workers_stopped_ || connection_cap_ >= num_connections_) {
+    return;
+  }
+  ++connection_cap_;
+  last_probe_millis_ = CurrentTimeMillis();
+  qDebug() << "Trying " << connection_cap_ << " connections to "
+           << url_.host();
+  StartReturnedRanges();
+  if (!ramp_up_timer_.isActive()) {
+    StartPendingWorkers(connection_cap_);
+  }
+  if (connection_cap_ < num_connections_) {
+    probe_timer_.start(probe_interval_ms_);
+  }
+}
+
+void Fetcher::StartReturnedRanges() {
+  if (returned_ranges_.empty() || waiting_for_all_workers_stopped_) {
+    return;
+  }
+  qint64 now = CurrentTimeMillis();
+  if (now < retry_at_millis_) {
+    retry_timer_.start(retry_at_millis_ - now);
+    return;
+  }
+  int num_free = connection_cap_ - NumActiveWorkers();
+  // Free connections share the ranges rather than wait for one another.
+  while (num_free > (int) returned_ranges_.size() && SplitReturnedRanges()) {}
+  for (int slot = 0; slot < worker_units_.size(); ++slot) {
+    if (num_free <= 0 || returned_ranges_.empty()) {
+      break;
+    }
+    WorkerUnit* unit = worker_units_[slot];
+    if (unit->IsStarted() && (unit->IsDone() || unit->IsStopped())) {
+      StartWorkerInSlot(slot, returned_ranges_.front());
+      returned_ranges_.pop_front();
+      --num_free;
+    }
+  }
+  UpdatePeakConnections();
+}
+
+bool Fetcher::SplitReturnedRanges() {
+  if (file_size_ <= 0 || returned_ranges_.empty()) {
+    return false;
+  }
+  auto largest = returned_ranges_.begin();
+  for (auto it = returned_ranges_.begin(); it != returned_ranges_.end();
+       ++it) {
+    if (CountBytes(it->ranges) > CountBytes(largest->ranges)) {
+      largest = it;
+    }
+  }
+  qint64 half = CountBytes(largest->ranges) / 2;
+  if (half < kMinSplitBytes) {
+    return false;
+  }
+  ReturnedRanges second;
+  second.attempt = largest->attempt;
+  SegmentList first;
+  for (const Segment& segment : largest->ranges) {
+    qint64 left = half - CountBytes(first);
+    qint64 length = segment.second - segment.first + 1;
+    if (left <= 0) {
+      second.ranges.push_back(segment);
+    } else if (length <= left) {
+      first.push_back(segment);
+    } else {
+      first.push_back(Segment(segment.first, segment.first + left - 1));
+      second.ranges.push_back(Segment(segment.first + left, segment.second));
+    }
+  }
+  largest->ranges = first;
+  returned_ranges_.push_back(second);
+  return true;
+}
+
+void Fetcher::StartWorkerInSlot(int slot, const ReturnedRanges& returned) {
+  WorkerUnit* old_unit = worker_units_[slot];
+  qint64 pre_downloaded = old_unit->TotalDownloaded();
+  if (file_size_ > 0) {
+    TrimAllocation(slot);
+    allocations_[slot].insert(allocations_[slot].end(),
+                              returned.ranges.begin(), returned.ranges.end());
+  } else {
+    // Nothing was kept; the download starts over.
+    pre_downloaded = slot_pre_downloaded_[slot];
+  }
+  FetcherWorker* worker = new FetcherWorker(
+      slot,
+      pre_downloaded,
+      returned.ranges,
+      url_,
+      work_dir_,
+      file_size_ <= 0,
+      worker_stats_,
+      telemetry_);
+  if (rate_limit_ > 0) {
+    worker->SetRateLimit(std::max(rate_limit_ / num_connections_,
+                                  (qint64) 1));
   }
+  worker->SetAttempt(returned.attempt);
+  slot_attempts_[slot] = returned.attempt;
+  WorkerUnit* worker_unit = MakeWorkerUnit(worker);
+  worker_units_[slot] = worker_unit;
+  old_unit->deleteLater();
+  worker_unit->Start();
+  emit AllocationsChanged();
+}
+
+void Fetcher::TrimAllocation(int slot) {
+  // What the slot's workers downloaded stays at the front of its allocation,
+  // so its progress still reads from the start.
+  qint64 left = worker_units_[slot]->TotalDownloaded()
+      - slot_pre_downloaded_[slot];
+  vector<Segment> allocation;
+  for (const Segment& segment : allocations_[slot]) {
+    if (left <= 0) {
+      break;
+    }
+    qint64 done = std::min(left, segment.second - segment.first + 1);
+    allocation.push_back(Segment(segment.first, segment.first + done - 1));
+    left -= done;
+  }
+  allocations_[slot] = allocation;
 }
 
 void Fetcher::HandleError(int worker_id, QNetworkReply::NetworkError code) {
@@ -425,23 +1010,42 @@ void Fetcher::HandleError(int worker_id, QNetworkReply::NetworkError code) {
 
 void Fetcher::Stop() {
   waiting_for_all_workers_stopped_ = true;
+  ramp_up_timer_.stop();
+  bool has_idle_workers = !returned_ranges_.empty();
   for (const auto& unit : worker_units_) {
-    if (!unit->IsDone()) {
+    if (!unit->IsStarted() || unit->IsStopped()) {
+      has_idle_workers = true;
+    } else if (!unit->IsDone() && !unit->IsStopped()) {
       unit->Stop();
     }
   }
+  if (has_idle_workers) {
+    // Throttled workers have stopped already, and workers the ramp-up
+    // didn't get to never started. They may be all that is left.
+    OnWorkerStopped(-1);
+  }
 }
 
 void Fetcher::OnWorkerStopped(int worker_id) {
+  Q_UNUSED(worker_id);
+  if (!waiting_for_all_workers_stopped_) {
+    // Only throttled workers stop by themselves. Their slot is free now.
+    StartReturnedRanges();
+    return;
+  }
   bool all_workers_stopped = true;
   for (const auto& unit : worker_units_) {
-    if (!unit->IsDone() && !unit->IsStopped()) {
+    if (unit->IsStarted() && !unit->IsDone() && !unit->IsStopped()) {
       all_workers_stopped = false;
       break;
     }
   }
   if (all_workers_stopped) {
+    retry_timer_.stop();
+    probe_timer_.stop();
+    returned_ranges_.clear();
     ClearWorkerUnits();
+    CapabilityCache::Instance()->Save();
     emit Paused();
     waiting_for_all_workers_stopped_ = false;
   }
@@ -451,7 +1055,7 @@ void Fetcher::RemoveWorkDir() {
   if (work_dir_.isEmpty()) {
     return;
   }
-  QDir(work_dir_).removeRecursively();
+  finalizer_->RemoveDir(work_dir_);
 }
 
 void Fetcher::ClearWorkerUnits() {
@@ -469,7 +1073,7 @@ bool Fetcher::GetProgress(qint64* overall_downloaded,
     // Note: This will be 1 if file size is unknown.
     qint64 allocated = unit->Allocation();
     if (downloaded < 0) {
-      DIE() << "Running worker " << unit->GetWorker()->GetId()
+      DIE() << "Running worker " << unit->WorkerId()
             << " had negative downloaded value "
             << downloaded;
     } else if (file_size_ > 0 && downloaded > allocated) {
@@ -486,150 +1090,112 @@ bool Fetcher::GetProgress(qint64* overall_downloaded,
   return true;
 }
 
+void Fetcher::GetWorkerProgress(vector<qint64>* downloaded,
+                                vector<bool>* failed) {
+  for (int i = 0; i < worker_units_.size(); ++i) {
+    WorkerUnit* unit = worker_units_[i];
+    downloaded->push_back(unit->TotalDownloaded() - slot_pre_downloaded_[i]);
+    failed->push_back(unit->State() == WorkerStats::FAILED);
+  }
+}
+
+int Fetcher::NumRunningWorkers() {
+  int num_running = 0;
+  for (WorkerUnit* unit : worker_units_) {
+    if (unit->State() == WorkerStats::RUNNING) {
+      ++num_running;
+    }
+  }
+  return num_running;
+}
+
 void Fetcher::RegisterCompletion(int worker_id) {
   // TODO(ogaro): QMutexLocker?
   mutex_.lock();
-  bool all_completed = true;
+  if (!waiting_for_all_workers_stopped_) {
+    // A connection is free for returned ranges.
+    StartReturnedRanges();
+    if (!ramp_up_timer_.isActive()) {
+      // Or for a worker the ramp-up didn't open.
+      StartPendingWorkers(connection_cap_);
+    }
+  }
+  bool all_completed = returned_ranges_.empty();
   int num_completed = 0; // TODO(ogaro): Remove this counter;
   for (WorkerUnit* unit : worker_units_) {
-    if (!unit->IsDone()) {
+    // Outside a pause, stopped workers were throttled and gave their ranges
+    // back.
+    if (!unit->IsDone()
+        && (waiting_for_all_workers_stopped_ || !unit->IsStarted()
+            || !unit->IsStopped())) {
       all_completed = false;
       break;
     }
     ++num_completed;
   }
-  if (all_completed) {
+  if (!all_completed && waiting_for_all_workers_stopped_) {
+    // The worker completed instead of stopping, and may have been the last
+    // one the pause waited for.
+    OnWorkerStopped(-1);
+  } else if (all_completed) {
     qint64 overall_downloaded = 0;
     std::vector<std::pair<qint64, qint64> > thread_stats;
     GetProgress(&overall_downloaded, &thread_stats);
     if (overall_downloaded < file_size_) {
       qDebug() << "Sending paused signal.";
       ClearWorkerUnits();
+      CapabilityCache::Instance()->Save();
       emit Paused();
     } else {
-      MergeFiles();
-      // TODO(ogaro): At this point, not all QThreads may have been destroyed.
-      emit Completed();
+      RecordCapabilities();
+      MergeFiles();  // Completed() is emitted once the merge is done.
     }
   }
   mutex_.unlock();
 }
 
-void Fetcher::MergeFiles() {
-  std::vector<Segment> downloaded_segments;
-  GetDownloadedSegments(work_dir_, &downloaded_segments);
-  Sort(&downloaded_segments);
-
-  // TODO(ogaro): Check here that the segments are valid.
-
-  QFile merged(save_as_);
-  if (!merged.open(QIODevice::WriteOnly)) {
-    // TODO(ogaro): Send an error.
-    qDebug() << "Failed to open file " << save_as_;
-    return;
-  }
-  int buffer_size = 2048;
-
-  for (const Segment& segment : downloaded_segments) {
-    QString shard_path = MakeShardPath(work_dir_, segment);
-    QFile shard(shard_path);
-    if (!shard.open(QIODevice::ReadOnly)) {
-      // TODO(ogaro): Send an error.
-      qDebug() << "Failed to open file " << shard_path;
-      return;
-    }
-    while(!shard.atEnd()) {
-      QByteArray buffer = shard.read(buffer_size);
-      if (buffer.size() == 0) {
-        // TODO(ogaro): Log error (shard.errorString());
-        continue;
-      }
-      if (merged.write(buffer) == -1) {
-        // TODO(ogaro): Log error (merged.errorString());
+void Fetcher::RecordCapabilities() {
+  CapabilityCache* capabilities = CapabilityCache::Instance();
+  if (file_size_ > 0) {
+    std::vector<SegmentTimeline> timelines;
+    telemetry_->Snapshot(&timelines);
+    bool throttled = false;
+    for (const SegmentTimeline& timeline : timelines) {
+      if (timeline.http_status == 429 || timeline.http_status == 503) {
+        throttled = true;
+        break;
       }
     }
-    shard.close();
+    if (!throttled) {
+      capabilities->RecordCompleted(url_, peak_connections_);
+    }
   }
-  QDir(work_dir_).removeRecursively();
+  capabilities->Save();
 }
 
-void Fetcher::GetDownloadedSegments(const QString& work_dir,
-                           std::vector<Segment>* segments) {
-  QStringList fnames = QDir(work_dir).entryList(
-      QDir::NoDotAndDotDot | QDir::Files);
-  foreach(const QString& fname, fnames) {
-    Segment segment;
-    if (!ParseSegment(fname, &segment)) {
-      continue;
-    }
-    segments->push_back(segment);
-  }
+void Fetcher::MergeFiles() {
+  merge_job_id_ = finalizer_->Merge(work_dir_, save_as_);
 }
 
-void Fetcher::CalculateAllocations(std::vector<Segment>* downloaded,
-                          qint64 file_size, int num_connections,
-                          std::vector<std::vector<Segment> >* allocations) {
-  qint64 undownloaded_size = file_size - CountBytes(*downloaded);
-  for (const Segment& segment : *downloaded) {
-    if (segment.first > segment.second) {
-      DIE() << "Segment (" << segment.first << ", " << segment.second
-            << ") is invalid.";
-    }
+void Fetcher::OnFinalizerProgress(int job_id, qint64 done_bytes,
+                                  qint64 total_bytes) {
+  if (job_id == merge_job_id_) {
+    emit Finalizing(done_bytes, total_bytes);
   }
-  if (undownloaded_size < 0) {
-    DIE() << __FUNCTION__ << "File size is " << file_size
-          << " but number of undownloaded is " << undownloaded_size;
-  }
-  Sort(downloaded);
+}
 
-  // Get the boundaries of the undownloaded segments of the file.
-  std::deque<Segment> undownloaded;
-  qint64 start = 0;
-  qint64 end = 0;
-  for (int i = 0; i < downloaded->size(); ++i) {
-    end = downloaded->at(i).first - 1;
-    if (end - start + 1 > 0) {
-      undownloaded.push_back(Segment(start, end));
-    }
-    start = downloaded->at(i).second + 1;
-  }
-  end = file_size - 1;
-  if (end - start + 1 > 0) {
-    undownloaded.push_back(Segment(start, end));
+void Fetcher::OnFinalizerFinished(int job_id, bool ok, const QString& error) {
+  if (job_id != merge_job_id_) {
+    return;
   }
-
-  qint64 min_thread_load = undownloaded_size / num_connections;
-  for (int i = 0; i < num_connections; ++i) {
-    qint64 thread_load = min_thread_load;
-    std::vector<Segment> allocation;
-    if (i == num_connections - 1) {
-      thread_load += undownloaded_size % num_connections;
-    }
-    if (thread_load == 0) {
-      allocations->push_back(allocation);
-      continue;
-    }
-    qint64 capacity_left = thread_load;
-    while (undownloaded.size() > 0) {
-      Segment segment = undownloaded.at(0);
-      undownloaded.pop_front();
-      qint64 start = segment.first;
-      qint64 end = segment.second;
-      qint64 segment_size = end - start + 1;
-
-      if (segment_size < capacity_left) {
-        allocation.push_back(segment);
-        capacity_left -= segment_size;
-      } else if (segment_size == capacity_left) {
-        allocation.push_back(segment);
-        break;  // We are done allocating for thread i.
-      } else {
-        // Split segment.
-        allocation.push_back(Segment(start, start + capacity_left - 1));
-        undownloaded.push_front(Segment(start + capacity_left, end));
-        break;
-      }
-    }
-    allocations->push_back(allocation);
+  merge_job_id_ = -1;
+  if (ok) {
+    // TODO(ogaro): At this point, not all QThreads may have been destroyed.
+    emit Completed();
+    return;
   }
+  // The shards are left as they were, so resuming retries the merge.
+  qWarning() << "Merging " << work_dir_ << " failed: " << error;
+  ClearWorkerUnits();
+  emit Paused();
 }
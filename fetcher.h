@@ -2,6 +2,8 @@
 #define FETCHER_H
 // TODO(ogaro): Investigate pause-close-resume behavior.
 #include <qaccelerator-utils.h>
+#include "connection-telemetry.h"
+#include "finalizer.h"
 #include <iostream>
 #include <QDir>
 #include <vector>
@@ -19,6 +21,54 @@
 #include <QtNetwork/QNetworkRequest>
 #include <QtNetwork/QNetworkReply>
 #include <QTimer>
+#include <atomic>
+
+// Ranges a throttled worker didn't get to, in download order.
+typedef std::vector<Segment> SegmentList;
+Q_DECLARE_METATYPE(SegmentList)
+
+// Progress of one worker. Written only by the worker's thread and read by
+// the GUI thread, on its own schedule, without locks or signals.
+struct WorkerStats {
+  enum State {
+    IDLE = 0,
+    RUNNING = 1,
+    DONE = 2,
+    STOPPED = 3,
+    FAILED = 4
+  };
+
+  std::atomic<qint64> downloaded;  // Bytes downloaded since the worker started.
+  std::atomic<int> state;
+};
+
+// Stats of all workers of a fetcher, one per cache line, so that a worker
+// updating its counters doesn't invalidate the lines of the other workers.
+// Workers share ownership of the block, so it outlives workers that are
+// still winding down after the fetcher moved on.
+class WorkerStatsBlock {
+ public:
+  static const size_t kCacheLineSize = 64;
+
+  explicit WorkerStatsBlock(int num_workers);
+
+  WorkerStats* At(int i) { return &slots_[i].stats; }
+  int Size() { return num_workers_; }
+
+ private:
+  struct alignas(kCacheLineSize) Slot {
+    WorkerStats stats;
+  };
+
+  WorkerStatsBlock(const WorkerStatsBlock&) = delete;
+  WorkerStatsBlock& operator=(const WorkerStatsBlock&) = delete;
+
+  int num_workers_;
+  // Slots are carved out of an over-allocated buffer so that they start on
+  // a cache line boundary.
+  std::unique_ptr<char[]> storage_;
+  Slot* slots_;
+};
 
 class FetcherWorker : public QObject {
     Q_OBJECT
@@ -29,7 +79,9 @@ class FetcherWorker : public QObject {
                 const std::vector<Segment>& segments,
                 const QUrl& url,
                 const QString& work_dir,
-                bool non_resume_mode);
+                bool non_resume_mode,
+                const std::shared_ptr<WorkerStatsBlock>& stats_block,
+                const std::shared_ptr<ConnectionTelemetry>& telemetry);
   ~FetcherWorker();
 
   int GetId() {
@@ -54,12 +106,27 @@ class FetcherWorker : public QObject {
   qint64 GetDownloaded() {
     return downloaded_;
   }
+  WorkerStats* Stats() {
+    return stats_;
+  }
+  // Caps the rate at which this worker reads from the network. 0 means no
+  // cap. Must be called before Start().
+  void SetRateLimit(qint64 bytes_per_second) {
+    rate_limit_ = bytes_per_second;
+  }
+  // Marks the first request as the `attempt`th retry of its segment.
+  void SetAttempt(int attempt) {
+    attempt_ = attempt;
+  }
 
  signals:
   void Completed();
   void Error(int worker_id, QNetworkReply::NetworkError code);
+  // The server answered 429 or 503. The worker gave up its connection and
+  // stops; `remaining` should be downloaded after `retry_after_millis`.
+  void Throttled(int worker_id, qint64 retry_after_millis,
+                 const SegmentList& remaining);
   void Stopped();
-  void Progress(qint64 total_downloaded_);
 
  public slots:
   void Start();
@@ -69,11 +136,27 @@ class FetcherWorker : public QObject {
   void OnDownloadProgress(qint64 bytesReceived, qint64 bytesTotal);
   void OnError(QNetworkReply::NetworkError code);
   void OnSegmentFinished();
-  void UpdateProgress();
+  void OnThrottleTimeout();
+  void OnEncrypted();
+  void OnMetaDataChanged();
 
 private:
   bool StartNextSegment();
+  // Moves what the reply has buffered to the current file, as much as the
+  // rate limit allows unless `drain` is true. Under a rate limit the reply's
+  // buffer is kept small, so the server is slowed down by TCP flow control
+  // rather than the data piling up in memory.
+  void ReadAvailable(bool drain);
   void MaybeRenameCurrentShard();
+  // Drops the throttled request, keeping what was downloaded, and emits
+  // Throttled() and Stopped().
+  void HandleThrottled();
+  void SetState(WorkerStats::State state);
+  // Record the current request in timeline_ and publish it to telemetry_,
+  // at most once per sample interval while data arrives.
+  void BeginTimeline();
+  void RecordWrite(qint64 now_millis, qint64 write_nanos);
+  void EndTimeline(QNetworkReply::NetworkError error);
 
   int worker_id_;
   qint64 pre_downloaded_;
@@ -91,7 +174,18 @@ private:
   bool is_done_;
   bool is_in_error_;
   bool non_resume_mode_;
-  QTimer* progress_updater_;
+  std::shared_ptr<WorkerStatsBlock> stats_block_;
+  WorkerStats* stats_;
+  qint64 rate_limit_;
+  int attempt_;
+  qint64 allowance_;  // Bytes that may be read now. Negative after a drain.
+  qint64 last_refill_millis_;
+  QTimer* throttle_timer_;
+  std::shared_ptr<ConnectionTelemetry> telemetry_;
+  SegmentTimeline timeline_;
+  qint64 last_data_millis_;
+  qint64 last_publish_millis_;
+  qint64 trace_start_micros_;  // Of the current request; -1 if not traced.
 };
 
 
@@ -104,9 +198,18 @@ class WorkerUnit : public QObject {
   FetcherWorker* GetWorker();
   void Start();
   void Stop();
+  bool IsStarted() { return is_started_; }
   bool IsDone();
   bool IsStopped();
-  qint64 TotalDownloaded() { return total_downloaded_; }
+  qint64 TotalDownloaded() {
+    return pre_downloaded_
+        + stats_->downloaded.load(std::memory_order_relaxed);
+  }
+  qint64 PreDownloaded() { return pre_downloaded_; }
+  WorkerStats::State State() {
+    return static_cast<WorkerStats::State>(
+        stats_->state.load(std::memory_order_acquire));
+  }
   qint64 Allocation();
   int WorkerId() { return worker_id_; }
 
@@ -119,17 +222,18 @@ class WorkerUnit : public QObject {
  public slots:
   void Completed();
   void OnWorkerStopped();
-  void WorkerProgress(qint64 total_downloaded);
   // void OnError(QNetworkReply::NetworkError code);
 
  private:
   FetcherWorker* worker_;
   int worker_id_;
   QThread* thread_;
+  bool is_started_;
   bool is_done_;
   bool is_stopped_;
-  qint64 total_downloaded_;
   qint64 byte_allocation_;
+  qint64 pre_downloaded_;
+  WorkerStats* stats_;
 };
 
 
@@ -137,27 +241,81 @@ class Fetcher : public QObject {
     Q_OBJECT
 
  public:
+  // How the connections of a download are opened. With an interval of 0
+  // they all open at once. Otherwise one opens first, and the next whenever
+  // those already open have been receiving data for a few intervals, until
+  // the last connection added sped the download up by less than min_gain.
+  // The rest then open as earlier connections complete.
+  struct RampUpPolicy {
+    RampUpPolicy();
+
+    int interval_ms;
+    double min_gain;  // Fraction of the throughput before the last addition.
+  };
+
   // TODO(ogaro): Download files of unknown size on a single thread (write
   // separate constructor for that.
-  Fetcher(const QUrl& url, qint64 file_size, const QString& save_as);
+  // Shards are merged into `save_as` and work dirs removed by `finalizer`.
+  Fetcher(const QUrl& url, qint64 file_size, const QString& save_as,
+          Finalizer* finalizer);
   ~Fetcher();
 
   const QString& WorkDir();
+  const QUrl& Url() { return url_; }
+  const QString& SaveAs() { return save_as_; }
   void Resume(const QString& work_dir, int num_connections);
   void Start(int num_connections);
   void Resume(int num_connections);
   void Stop();
+  // Caps the overall download rate, split evenly among the connections.
+  // 0 means no cap. Takes effect from the next Start() or Resume().
+  void SetRateLimit(qint64 bytes_per_second);
+  // Takes effect from the next Start() or Resume().
+  void SetRampUp(const RampUpPolicy& policy);
+  // Whether Start() and Resume() open fewer connections than asked for to
+  // servers the CapabilityCache knows take fewer. On by default.
+  void SetUseCapabilityCache(bool use) { use_capability_cache_ = use; }
+  // Removes the work dir in the background.
   void RemoveWorkDir();
   bool GetProgress(qint64* overall_downloaded,
                    std::vector<std::pair<qint64, qint64> >* thread_stats);
+  // Ranges that were on disk when the workers were last started, and the
+  // ranges allocated to each worker slot, in the order they are downloaded.
+  // A slot whose worker finished or was throttled may be given more ranges;
+  // AllocationsChanged() is emitted when it is.
+  const std::vector<Segment>& PreDownloadedSegments() {
+    return pre_downloaded_segments_;
+  }
+  const std::vector<std::vector<Segment> >& Allocations() {
+    return allocations_;
+  }
+  // Bytes each slot downloaded of its allocation, and whether it stopped
+  // on an error. Reads the workers' stats directly; cheap enough to call on
+  // every UI tick.
+  void GetWorkerProgress(std::vector<qint64>* downloaded,
+                         std::vector<bool>* failed);
+  // Workers that are downloading right now.
+  int NumRunningWorkers();
+  // Most connections open at once since the last Start() or Resume(); fewer
+  // than asked for when the ramp-up flattened or the server throttled.
+  int PeakConnections() { return peak_connections_; }
   bool IsInError() { return is_in_error_; }
   void ClearError() { is_in_error_ = false; }
+  // Timelines of all segment requests of the download, including those of
+  // earlier runs that were saved in the work dir. Safe to call while the
+  // workers run.
+  void GetTelemetry(std::vector<SegmentTimeline>* timelines) {
+    telemetry_->Snapshot(timelines);
+  }
 
  signals:
   void Completed();
   void Error(QNetworkReply::NetworkError code);
   void ChangeSaveAs(const QString& new_save_as);
   void Paused();
+  // Emitted while the shards are merged, after all workers are done.
+  void Finalizing(qint64 done_bytes, qint64 total_bytes);
+  void AllocationsChanged();
 
  public slots:
   void OnWorkerStopped(int worker_id_);
@@ -165,27 +323,90 @@ class Fetcher : public QObject {
  private slots:
   void RegisterCompletion(int worker_id);
   void HandleError(int worker_id, QNetworkReply::NetworkError code);
+  void OnFinalizerProgress(int job_id, qint64 done_bytes, qint64 total_bytes);
+  void OnFinalizerFinished(int job_id, bool ok, const QString& error);
+  void OnWorkerThrottled(int worker_id, qint64 retry_after_millis,
+                         const SegmentList& remaining);
+  // Hands returned ranges to idle worker slots once Retry-After has passed,
+  // as long as the active workers are fewer than connection_cap_.
+  void StartReturnedRanges();
+  // Allows one more connection after a while without being throttled.
+  void ProbeConnectionCap();
+  // Opens one more connection if the ramp-up allows it, or ends the ramp-up.
+  void OnRampUpTick();
 
  private:
+  // Ranges a throttled worker gave back, for whichever connection is free
+  // next.
+  struct ReturnedRanges {
+    SegmentList ranges;
+    int attempt;  // Times these ranges were throttled.
+  };
+
   void PrepareThreads();
+  WorkerUnit* MakeWorkerUnit(FetcherWorker* worker);
+  // Starts a worker on `returned` in `slot`, whose worker is done or stopped.
+  void StartWorkerInSlot(int slot, const ReturnedRanges& returned);
+  // Cuts the allocation of `slot` down to what its workers downloaded.
+  void TrimAllocation(int slot);
+  // Splits the largest returned ranges in two, so more connections can share
+  // them. Returns false if they are too small to be worth it.
+  bool SplitReturnedRanges();
   void ClearWorkerUnits();
+  // Starts workers that weren't started yet, while fewer than `cap` are
+  // active. Returns the number started.
+  int StartPendingWorkers(int cap);
+  // Workers started and neither done nor stopped.
+  int NumActiveWorkers();
+  void UpdatePeakConnections();
+  // Bytes all workers downloaded since they were started.
+  qint64 DownloadedThisRun();
+  // Starts merging the shards. Completed() is emitted once it is done.
   void MergeFiles();
-  void GetDownloadedSegments(const QString& work_dir,
-                             std::vector<Segment>* segments);
-
-  // TODO(ogaro): Make `downloaded` const and assert that it is sorted. Rename
-  // it to pre_downloaded
-  void CalculateAllocations(std::vector<Segment>* downloaded,
-                            qint64 file_size, int num_connections,
-                            std::vector<std::vector<Segment> >* allocations);
+  // Tells the CapabilityCache how the server coped with the download.
+  void RecordCapabilities();
 
   QMutex mutex_;
   QUrl url_;
   qint64 file_size_;
   QString save_as_;
+  Finalizer* finalizer_;
+  int merge_job_id_;  // -1 unless a merge is in progress.
   int num_connections_;  // TODO(ogaro): Remove reliance on this.
   QString work_dir_;  // TODO(ogaro): Remove reliance on this.
   QList<WorkerUnit* > worker_units_;
+  std::vector<Segment> pre_downloaded_segments_;
+  std::vector<std::vector<Segment> > allocations_;
+  std::shared_ptr<WorkerStatsBlock> worker_stats_;
+  std::shared_ptr<ConnectionTelemetry> telemetry_;
+  qint64 rate_limit_;
+  bool use_capability_cache_;
+  // Most workers that were active at once since the last Resume().
+  int peak_connections_;
+  // Most workers allowed to run at once; lowered whenever the server
+  // throttles, and probed back up while it doesn't.
+  int connection_cap_;
+  std::deque<ReturnedRanges> returned_ranges_;
+  // Per slot: the pre-downloaded bytes of its first worker, from which the
+  // slot's progress counts, and the attempt its current worker is on.
+  std::vector<qint64> slot_pre_downloaded_;
+  std::vector<int> slot_attempts_;
+  qint64 retry_at_millis_;
+  QTimer retry_timer_;
+  QTimer probe_timer_;
+  int probe_interval_ms_;
+  qint64 last_probe_millis_;
+  RampUpPolicy ramp_up_;
+  QTimer ramp_up_timer_;
+  // Throughput, in bytes per second, before the last connection was added;
+  // -1 until the first one is.
+  qint64 ramp_up_rate_;
+  // DownloadedThisRun() and the time when the current measurement started;
+  // until the connection last added receives data, the time it was added.
+  qint64 ramp_up_bytes_;
+  qint64 ramp_up_millis_;
+  // Intervals since all open connections were receiving; -1 until they are.
+  int ramp_up_steady_ticks_;
   bool is_in_error_;
   bool waiting_for_all_workers_stopped_;
 };
@@ -0,0 +1,271 @@
+#include "finalizer.h"
+
+#include "engine-metrics.h"
+#include "tracer.h"
+#include <algorithm>
+#include <vector>
+#include <QDir>
+#include <QFileInfo>
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using std::min;
+using std::vector;
+
+// Shards are copied through a buffer of this size when the kernel can't copy
+// them by itself.
+static const int kCopyBufferSize = 4 * 1024 * 1024;
+// Progress is reported about once per this many bytes.
+static const qint64 kProgressStep = 64 * 1024 * 1024;
+
+namespace {
+// Copies up to `length` bytes between the files with copy_file_range(2), so
+// that the data doesn't pass through user space. Filesystems with reflink
+// support (btrfs, XFS) share the extents instead of copying them. Returns
+// the number of bytes copied, which is less than `length` if the kernel or
+// the filesystems can't do it; the rest has to be copied by other means.
+qint64 KernelCopy(int in_fd, qint64 in_offset, int out_fd, qint64 out_offset,
+                  qint64 length) {
+  qint64 copied = 0;
+#if defined(Q_OS_LINUX) && defined(SYS_copy_file_range)
+  while (copied < length) {
+    qint64 in_off = in_offset + copied;
+    qint64 out_off = out_offset + copied;
+    long result = syscall(SYS_copy_file_range, in_fd, &in_off, out_fd,
+                          &out_off, (size_t) (length - copied), 0u);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    copied += result;
+  }
+#else
+  Q_UNUSED(in_fd);
+  Q_UNUSED(in_offset);
+  Q_UNUSED(out_fd);
+  Q_UNUSED(out_offset);
+  Q_UNUSED(length);
+#endif
+  return copied;
+}
+
+bool AscendingStart(const Segment& a, const Segment& b) {
+  return a.first < b.first;
+}
+}
+
+FinalizerWorker::FinalizerWorker()
+    : buffer_size_(kCopyBufferSize),
+      use_kernel_copy_(true),
+      done_bytes_(0),
+      total_bytes_(0),
+      last_reported_bytes_(0) {}
+
+void FinalizerWorker::Merge(int job_id, const QString& work_dir,
+                            const QString& save_as) {
+  Tracer::Instance()->NameThread("Finalizer");
+  TraceSpan span("disk", "Merge");
+  span.AddArg("save_as", save_as);
+  QString error;
+  bool ok = MergeShards(job_id, work_dir, save_as, &error);
+  if (ok) {
+    QDir(work_dir).removeRecursively();
+  } else {
+    qDebug() << "Merge into " << save_as << " failed: " << error;
+  }
+  buffer_.clear();  // Don't hold on to the buffer between downloads.
+  EngineMetrics::Instance()->AddFinalizerJobs(-1);
+  emit Finished(job_id, ok, error);
+}
+
+void FinalizerWorker::RemoveDir(int job_id, const QString& dir) {
+  Tracer::Instance()->NameThread("Finalizer");
+  TraceSpan span("disk", "Remove work dir");
+  bool ok = !QFileInfo(dir).exists() || QDir(dir).removeRecursively();
+  EngineMetrics::Instance()->AddFinalizerJobs(-1);
+  emit Finished(job_id, ok, ok ? QString() : "Failed to remove " + dir);
+}
+
+bool FinalizerWorker::MergeShards(int job_id,
+                                  const QString& work_dir,
+                                  const QString& save_as,
+                                  QString* error) {
+  vector<Segment> segments;
+  ListShards(work_dir, &segments);
+  if (segments.empty()) {
+    *error = "No shards in " + work_dir;
+    return false;
+  }
+  std::sort(segments.begin(), segments.end(), AscendingStart);
+  // A gap or an overlap would silently corrupt the merged file.
+  qint64 expected_first = 0;
+  for (const Segment& segment : segments) {
+    if (segment.first != expected_first) {
+      *error = QString("Shards of %1 are not contiguous at byte %2")
+          .arg(work_dir).arg(expected_first);
+      return false;
+    }
+    expected_first = segment.second + 1;
+  }
+  total_bytes_ = expected_first;
+  done_bytes_ = 0;
+  ReportProgress(job_id, true);
+
+  // The others are appended to the first shard, which is only renamed to
+  // `save_as` once it is complete. Until then it keeps its name in the work
+  // dir, so a merge cut short by the process being killed starts over on
+  // resume, after the first shard is cut back to its own length.
+  QString first_shard_path = MakeShardPath(work_dir, segments[0]);
+  qint64 first_shard_size = segments[0].second + 1;
+  // ReadWrite, unlike WriteOnly, neither truncates nor appends, and
+  // copy_file_range() refuses files opened for appending.
+  QFile merged(first_shard_path);
+  bool ok = merged.open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+  if (!ok) {
+    *error = merged.errorString();
+    return false;
+  }
+  if (merged.size() < first_shard_size
+      || (merged.size() > first_shard_size
+          && !merged.resize(first_shard_size))) {
+    *error = "Unexpected size of " + first_shard_path;
+    return false;
+  }
+  qint64 merged_size = first_shard_size;
+  done_bytes_ += merged_size;
+  ReportProgress(job_id, false);
+  // Reserving the rest up front keeps the merged file contiguous, and fails
+  // before anything is copied if it won't fit.
+  ok = Preallocate(&merged, merged_size, total_bytes_ - merged_size, error);
+  for (size_t i = 1; ok && i < segments.size(); ++i) {
+    QFile shard(MakeShardPath(work_dir, segments[i]));
+    if (!shard.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+      *error = shard.errorString();
+      ok = false;
+      break;
+    }
+    if (shard.size() != segments[i].second - segments[i].first + 1) {
+      *error = "Unexpected size of " + shard.fileName();
+      ok = false;
+      break;
+    }
+    ok = AppendShard(&shard, &merged, &merged_size, error);
+    shard.close();
+    ReportProgress(job_id, false);
+  }
+  if (ok) {
+    merged.close();
+    // The work dir is next to the saved file, so the rename moves no data.
+    if (QFile::exists(save_as) && !QFile::remove(save_as)) {
+      *error = "Failed to overwrite " + save_as;
+      ok = false;
+    } else if (!QFile::rename(first_shard_path, save_as)) {
+      *error = "Failed to rename " + first_shard_path + " to " + save_as;
+      ok = false;
+    }
+  }
+  if (!ok) {
+    // Leave the first shard as it was, so the download can be resumed.
+    if (!merged.isOpen()) {
+      merged.open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+    }
+    merged.resize(first_shard_size);
+    ReleasePreallocated(&merged, first_shard_size, total_bytes_);
+    merged.close();
+    return false;
+  }
+  ReportProgress(job_id, true);
+  return true;
+}
+
+bool FinalizerWorker::AppendShard(QFile* shard, QFile* merged,
+                                  qint64* merged_size, QString* error) {
+  qint64 shard_size = shard->size();
+  qint64 offset = 0;
+  while (offset < shard_size) {
+    qint64 length = min(shard_size - offset, kProgressStep);
+    qint64 copied = 0;
+    if (use_kernel_copy_) {
+      copied = KernelCopy(shard->handle(), offset, merged->handle(),
+                          *merged_size + offset, length);
+    }
+    if (copied < length) {
+      if (buffer_.size() != buffer_size_) {
+        buffer_.resize(buffer_size_);
+      }
+      if (!shard->seek(offset + copied)
+          || !merged->seek(*merged_size + offset + copied)) {
+        *error = "Failed to seek in " + shard->fileName();
+        return false;
+      }
+      while (copied < length) {
+        qint64 num_read = shard->read(
+            buffer_.data(), min(length - copied, (qint64) buffer_.size()));
+        if (num_read <= 0) {
+          *error = "Failed to read " + shard->fileName() + ": "
+              + shard->errorString();
+          return false;
+        }
+        if (merged->write(buffer_.constData(), num_read) != num_read) {
+          *error = "Failed to write " + merged->fileName() + ": "
+              + merged->errorString();
+          return false;
+        }
+        copied += num_read;
+      }
+    }
+    offset += length;
+    done_bytes_ += length;
+  }
+  *merged_size += shard_size;
+  return true;
+}
+
+void FinalizerWorker::ReportProgress(int job_id, bool force) {
+  if (!force && done_bytes_ - last_reported_bytes_ < kProgressStep) {
+    return;
+  }
+  last_reported_bytes_ = done_bytes_;
+  emit Progress(job_id, done_bytes_, total_bytes_);
+}
+
+Finalizer::Finalizer(QObject* parent)
+    : QObject(parent),
+      worker_(new FinalizerWorker()),
+      next_job_id_(1) {
+  worker_->moveToThread(&thread_);
+  connect(&thread_, SIGNAL(finished()), worker_, SLOT(deleteLater()));
+  connect(this, SIGNAL(MergeRequested(int, QString, QString)),
+          worker_, SLOT(Merge(int, QString, QString)));
+  connect(this, SIGNAL(RemoveDirRequested(int, QString)),
+          worker_, SLOT(RemoveDir(int, QString)));
+  connect(worker_, SIGNAL(Progress(int, qint64, qint64)),
+          this, SIGNAL(Progress(int, qint64, qint64)));
+  connect(worker_, SIGNAL(Finished(int, bool, QString)),
+          this, SIGNAL(Finished(int, bool, QString)));
+  thread_.start();
+}
+
+Finalizer::~Finalizer() {
+  thread_.quit();
+  thread_.wait();
+}
+
+int Finalizer::Merge(const QString& work_dir, const QString& save_as) {
+  int job_id = next_job_id_++;
+  EngineMetrics::Instance()->AddFinalizerJobs(1);
+  emit MergeRequested(job_id, work_dir, save_as);
+  return job_id;
+}
+
+int Finalizer::RemoveDir(const QString& dir) {
+  int job_id = next_job_id_++;
+  EngineMetrics::Instance()->AddFinalizerJobs(1);
+  emit RemoveDirRequested(job_id, dir);
+  return job_id;
+}
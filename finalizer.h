@@ -0,0 +1,88 @@
+#ifndef FINALIZER_H_
+#define FINALIZER_H_
+
+#include "qaccelerator-utils.h"
+#include <QByteArray>
+#include <QFile>
+#include <QObject>
+#include <QString>
+#include <QThread>
+
+// Does the work of a Finalizer on its thread. Jobs run one at a time, in the
+// order they were requested.
+class FinalizerWorker : public QObject {
+  Q_OBJECT
+
+ public:
+  FinalizerWorker();
+
+  // Shards are copied by the kernel where it can, and otherwise through a
+  // buffer of `buffer_size` bytes. Turning the kernel copy off measures the
+  // buffered path on any platform.
+  void SetCopyOptions(int buffer_size, bool use_kernel_copy) {
+    buffer_size_ = buffer_size;
+    use_kernel_copy_ = use_kernel_copy;
+  }
+
+ signals:
+  void Progress(int job_id, qint64 done_bytes, qint64 total_bytes);
+  void Finished(int job_id, bool ok, const QString& error);
+
+ public slots:
+  void Merge(int job_id, const QString& work_dir, const QString& save_as);
+  void RemoveDir(int job_id, const QString& dir);
+
+ private:
+  bool MergeShards(int job_id, const QString& work_dir, const QString& save_as,
+                   QString* error);
+  // Appends all of `shard` to `merged` at `*merged_size` and advances it.
+  bool AppendShard(QFile* shard, QFile* merged, qint64* merged_size,
+                   QString* error);
+  void ReportProgress(int job_id, bool force);
+
+  QByteArray buffer_;
+  int buffer_size_;
+  bool use_kernel_copy_;
+  qint64 done_bytes_;
+  qint64 total_bytes_;
+  qint64 last_reported_bytes_;
+};
+
+// Runs the slow file operations that finish or discard a download, namely
+// merging the shards into the saved file and removing work dirs, on a
+// background thread so that the UI never waits on the disk.
+//
+// Each request gets a job id. Progress() and Finished() are emitted on the
+// thread that owns the Finalizer and carry the id of the job they are about,
+// since a single finalizer serves all downloads.
+class Finalizer : public QObject {
+  Q_OBJECT
+
+ public:
+  explicit Finalizer(QObject* parent);
+  // Waits for the job in progress, if any. Jobs that haven't started are
+  // dropped, which leaves their work dirs intact.
+  ~Finalizer();
+
+  // Concatenates the shards in `work_dir` into `save_as`, which is
+  // overwritten, then removes `work_dir`. Fails, leaving the shards as they
+  // were, if they don't cover the file from byte 0 without gaps or overlaps.
+  int Merge(const QString& work_dir, const QString& save_as);
+  int RemoveDir(const QString& dir);
+
+ signals:
+  void Progress(int job_id, qint64 done_bytes, qint64 total_bytes);
+  void Finished(int job_id, bool ok, const QString& error);
+
+  // Private; queue jobs on the worker.
+  void MergeRequested(int job_id, const QString& work_dir,
+                      const QString& save_as);
+  void RemoveDirRequested(int job_id, const QString& dir);
+
+ private:
+  QThread thread_;
+  FinalizerWorker* worker_;
+  int next_job_id_;
+};
+
+#endif  // FINALIZER_H_
@@ -0,0 +1,240 @@
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+// The drain thread writes what has been logged at least this often.
+static const int kDrainIntervalMs = 200;
+static const char* kLevelNames[] = {
+    "DEBUG", "INFO", "WARNING", "CRITICAL", "FATAL"};
+
+Logger::Options::Options()
+    : path("error.log"),
+      min_level(DEBUG),
+      max_file_size(4 * 1024 * 1024),
+      max_rotated_files(3),
+      json(false) {}
+
+Logger* Logger::Instance() {
+  static Logger instance;
+  return &instance;
+}
+
+Logger::Logger()
+    : started_(false),
+      stopping_(false),
+      head_(&stub_),
+      tail_(&stub_),
+      previous_handler_(nullptr) {
+  stub_.next.store(nullptr);
+}
+
+Logger::~Logger() {
+  Stop();
+}
+
+bool Logger::ParseLevel(const QString& name, Level* level) {
+  for (int i = DEBUG; i <= FATAL; ++i) {
+    if (name.compare(kLevelNames[i], Qt::CaseInsensitive) == 0) {
+      *level = static_cast<Level>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Logger::Start(const Options& options) {
+  if (started_.load()) {
+    return false;
+  }
+  options_ = options;
+  file_.setFileName(options_.path);
+  if (!file_.open(QIODevice::WriteOnly | QIODevice::Append)) {
+    fprintf(stderr, "Failed to open log %s\n",
+            options_.path.toLocal8Bit().constData());
+    return false;
+  }
+  MaybeRotate();
+  stopping_.store(false);
+  thread_.reset(new DrainThread(this));
+  thread_->start();
+  started_.store(true, std::memory_order_release);
+  previous_handler_ = qInstallMessageHandler(HandleMessage);
+  return true;
+}
+
+void Logger::Stop() {
+  if (!started_.exchange(false)) {
+    return;
+  }
+  qInstallMessageHandler(previous_handler_);
+  stopping_.store(true, std::memory_order_release);
+  wake_.release();
+  thread_->wait();
+  thread_.reset();
+  // Whatever was pushed while the drain thread finished.
+  Drain();
+  file_.close();
+}
+
+void Logger::Log(Level level, const QString& message, const char* file,
+                 int line, const char* function) {
+  if (level < options_.min_level
+      || !started_.load(std::memory_order_acquire)) {
+    return;
+  }
+  Entry* entry = new Entry;
+  entry->level = level;
+  entry->millis = QDateTime::currentMSecsSinceEpoch();
+  entry->thread_id = reinterpret_cast<quintptr>(QThread::currentThreadId());
+  entry->message = message;
+  entry->file = file;
+  entry->line = line;
+  entry->function = function;
+  Push(entry);
+  if (level == FATAL) {
+    Stop();  // The message handler aborts next.
+  } else if (level == CRITICAL) {
+    wake_.release();
+  }
+}
+
+void Logger::HandleMessage(QtMsgType type, const QMessageLogContext& context,
+                           const QString& message) {
+  Level level = DEBUG;
+  switch (type) {
+  case QtInfoMsg:
+    level = INFO;
+    break;
+  case QtWarningMsg:
+    level = WARNING;
+    break;
+  case QtCriticalMsg:
+    level = CRITICAL;
+    break;
+  case QtFatalMsg:
+    level = FATAL;
+    break;
+  default:
+    break;
+  }
+  Instance()->Log(level, message, context.file, context.line,
+                  context.function);
+  if (type == QtFatalMsg) {
+    abort();
+  }
+}
+
+void Logger::Push(Entry* entry) {
+  entry->next.store(nullptr, std::memory_order_relaxed);
+  Entry* previous = head_.exchange(entry, std::memory_order_acq_rel);
+  previous->next.store(entry, std::memory_order_release);
+}
+
+Logger::Entry* Logger::Pop() {
+  Entry* tail = tail_;
+  Entry* next = tail->next.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (next == nullptr) {
+      return nullptr;
+    }
+    tail_ = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next != nullptr) {
+    tail_ = next;
+    return tail;
+  }
+  if (tail != head_.load(std::memory_order_acquire)) {
+    // A producer is between its exchange and linking its entry; the entry
+    // is picked up on the next drain.
+    return nullptr;
+  }
+  // tail is the last entry; put the stub behind it so it can be taken.
+  Push(&stub_);
+  next = tail->next.load(std::memory_order_acquire);
+  if (next != nullptr) {
+    tail_ = next;
+    return tail;
+  }
+  return nullptr;
+}
+
+void Logger::Drain() {
+  bool wrote = false;
+  Entry* entry;
+  while ((entry = Pop()) != nullptr) {
+    Write(*entry);
+    delete entry;
+    wrote = true;
+  }
+  if (wrote) {
+    file_.flush();
+    MaybeRotate();
+  }
+}
+
+void Logger::Write(const Entry& entry) {
+  QDateTime time = QDateTime::fromMSecsSinceEpoch(entry.millis);
+  QByteArray line;
+  if (options_.json) {
+    QJsonObject object;
+    object["time"] = time.toString("yyyy-MM-ddThh:mm:ss.zzz");
+    object["level"] = kLevelNames[entry.level];
+    object["thread"] = QString::number(entry.thread_id);
+    object["message"] = entry.message;
+    if (entry.file != nullptr) {
+      object["file"] = entry.file;
+      object["line"] = entry.line;
+    }
+    if (entry.function != nullptr) {
+      object["function"] = entry.function;
+    }
+    line = QJsonDocument(object).toJson(QJsonDocument::Compact);
+  } else {
+    line = time.toString("yyyy-MM-dd hh:mm:ss.zzz").toUtf8();
+    line += '\t';
+    line += kLevelNames[entry.level];
+    line += '\t';
+    line += QByteArray::number(entry.thread_id);
+    line += '\t';
+    line += entry.message.toUtf8();
+    if (entry.file != nullptr) {
+      line += QString(" (%1:%2)").arg(entry.file).arg(entry.line).toUtf8();
+    }
+  }
+  line += '\n';
+  file_.write(line);
+}
+
+void Logger::MaybeRotate() {
+  if (options_.max_file_size <= 0 || file_.size() < options_.max_file_size) {
+    return;
+  }
+  file_.close();
+  QString path = options_.path;
+  if (options_.max_rotated_files > 0) {
+    QFile::remove(QString("%1.%2").arg(path).arg(options_.max_rotated_files));
+    for (int i = options_.max_rotated_files - 1; i >= 1; --i) {
+      QFile::rename(QString("%1.%2").arg(path).arg(i),
+                    QString("%1.%2").arg(path).arg(i + 1));
+    }
+    QFile::rename(path, path + ".1");
+  }
+  file_.open(QIODevice::WriteOnly | QIODevice::Truncate);
+}
+
+void Logger::DrainThread::run() {
+  while (true) {
+    bool stopping = logger_->stopping_.load(std::memory_order_acquire);
+    logger_->Drain();
+    if (stopping) {
+      return;
+    }
+    logger_->wake_.tryAcquire(1, kDrainIntervalMs);
+  }
+}
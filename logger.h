@@ -0,0 +1,111 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <atomic>
+#include <memory>
+#include <QFile>
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+#include <QtGlobal>
+
+// Receives every qDebug(), qWarning() etc. once started, and writes them to a
+// log file from a background thread. Logging a message only copies it into a
+// node of a lock-free queue, so it is cheap on any thread, and lines from
+// different threads never interleave.
+//
+// The file is rotated by size: when it grows past max_file_size it becomes
+// <path>.1, the previous <path>.1 becomes <path>.2 and so on.
+class Logger {
+ public:
+  enum Level {
+    DEBUG = 0,
+    INFO = 1,
+    WARNING = 2,
+    CRITICAL = 3,
+    FATAL = 4
+  };
+
+  struct Options {
+    Options();
+
+    QString path;
+    Level min_level;
+    qint64 max_file_size;
+    // Rotated files kept besides the current one.
+    int max_rotated_files;
+    // One JSON object per line instead of tab-separated text.
+    bool json;
+  };
+
+  static Logger* Instance();
+
+  // Opens the log and installs the Qt message handler. Returns false if the
+  // log can't be opened, in which case messages keep going to stderr.
+  bool Start(const Options& options);
+  // Writes out everything logged so far and restores the previous message
+  // handler. Called on exit too.
+  void Stop();
+
+  void Log(Level level, const QString& message, const char* file, int line,
+           const char* function);
+
+  static bool ParseLevel(const QString& name, Level* level);
+
+ private:
+  struct Entry {
+    std::atomic<Entry*> next;
+    Level level;
+    qint64 millis;
+    quintptr thread_id;
+    QString message;
+    // Qt passes string literals for these, or null in release builds.
+    const char* file;
+    int line;
+    const char* function;
+  };
+
+  class DrainThread : public QThread {
+   public:
+    explicit DrainThread(Logger* logger) : logger_(logger) {}
+
+   protected:
+    // Override
+    void run();
+
+   private:
+    Logger* logger_;
+  };
+
+  Logger();
+  ~Logger();
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  static void HandleMessage(QtMsgType type, const QMessageLogContext& context,
+                            const QString& message);
+  // Multiple producers, one consumer: the drain thread.
+  void Push(Entry* entry);
+  Entry* Pop();
+  // Writes all queued entries. Returns after the queue was seen empty.
+  void Drain();
+  void Write(const Entry& entry);
+  void MaybeRotate();
+
+  Options options_;
+  std::atomic<bool> started_;
+  std::atomic<bool> stopping_;
+  // Producers swap themselves in as head_; the consumer follows next links
+  // from tail_. stub_ keeps the list non-empty.
+  std::atomic<Entry*> head_;
+  Entry* tail_;
+  Entry stub_;
+  // Released to wake the drain thread early, for messages that must not
+  // wait and on Stop().
+  QSemaphore wake_;
+  std::unique_ptr<DrainThread> thread_;
+  QFile file_;
+  QtMessageHandler previous_handler_;
+};
+
+#endif  // LOGGER_H_
@@ -3,15 +3,23 @@
 #include "download-monitor.h"
 #include "qaccelerator.h"
 #include "qaccelerator-utils.h"
+#include "capability-cache.h"
 #include "download-dialog.h"
 #include "preferences-dialog.h"
+#include "tracer.h"
 #include <QApplication>
 
 int main(int argc, char *argv[]) {
-  // InitApplication();
   QApplication a(argc, argv);
+  InitApplication();
+  CapabilityCache::Instance()->Open(kCapabilityCacheFName);
+  // Set QACCELERATOR_TRACE to a file path to record a trace of the session.
+  QString trace_path = QString::fromLocal8Bit(qgetenv("QACCELERATOR_TRACE"));
+  if (!trace_path.isEmpty()) {
+    Tracer::Instance()->Start(trace_path);
+  }
   MainWindow m;
   int ret_value = a.exec();
-  // fclose(stderr);
+  Tracer::Instance()->Stop();
   return ret_value;
 }
@@ -0,0 +1,230 @@
+#include "metrics-server.h"
+
+#include "engine-metrics.h"
+#include "fetcher.h"
+#include <QHostAddress>
+#include <QMetaEnum>
+#include <QNetworkReply>
+#include <QTcpSocket>
+
+static const int kSampleIntervalMs = 1000;
+// Speeds are averaged over this many sample intervals.
+static const size_t kSpeedWindow = 5;
+// Longer request heads are refused.
+static const int kMaxRequestHeadSize = 8 * 1024;
+
+namespace {
+// Escapes a label value as the text format requires.
+QString LabelValue(const QString& value) {
+  QString escaped = value;
+  escaped.replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n");
+  return escaped;
+}
+
+void AppendHeader(const QString& name, const QString& type,
+                  const QString& help, QString* out) {
+  *out += QString("# HELP %1 %2\n# TYPE %1 %3\n").arg(name).arg(help)
+      .arg(type);
+}
+
+QString NetworkErrorName(int code) {
+  const QMetaObject& meta_object = QNetworkReply::staticMetaObject;
+  QMetaEnum meta_enum = meta_object.enumerator(
+      meta_object.indexOfEnumerator("NetworkError"));
+  const char* key = meta_enum.isValid() ? meta_enum.valueToKey(code)
+                                        : nullptr;
+  return key != nullptr ? QString(key) : QString::number(code);
+}
+}
+
+MetricsServer::MetricsServer(QObject* parent) : QTcpServer(parent) {
+  connect(this, SIGNAL(newConnection()), this, SLOT(OnNewConnection()));
+  connect(&sample_timer_, SIGNAL(timeout()), this, SLOT(OnSample()));
+}
+
+bool MetricsServer::Start(quint16 port) {
+  if (!listen(QHostAddress::LocalHost, port)) {
+    qDebug() << "Metrics server failed to listen on port " << port << ": "
+             << errorString();
+    return false;
+  }
+  sample_timer_.start(kSampleIntervalMs);
+  return true;
+}
+
+void MetricsServer::OnSample() {
+  QList<Fetcher*> fetchers = EngineMetrics::Instance()->Fetchers();
+  for (auto it = downloads_.begin(); it != downloads_.end();) {
+    if (fetchers.contains(it->first)) {
+      ++it;
+    } else {
+      it = downloads_.erase(it);
+    }
+  }
+  for (Fetcher* fetcher : fetchers) {
+    std::vector<qint64> downloaded;
+    std::vector<bool> failed;
+    fetcher->GetWorkerProgress(&downloaded, &failed);
+    qint64 bytes = 0;
+    for (qint64 worker_bytes : downloaded) {
+      bytes += worker_bytes;
+    }
+    auto it = downloads_.find(fetcher);
+    if (it == downloads_.end()) {
+      DownloadSamples samples;
+      samples.name = FileName(fetcher->SaveAs());
+      samples.host = fetcher->Url().host();
+      samples.last_bytes = bytes;
+      downloads_[fetcher] = samples;
+      continue;
+    }
+    DownloadSamples* samples = &it->second;
+    // The counts start over when the workers are restarted.
+    qint64 delta = bytes >= samples->last_bytes ? bytes - samples->last_bytes
+                                                : bytes;
+    samples->last_bytes = bytes;
+    samples->name = FileName(fetcher->SaveAs());  // It may have changed.
+    samples->deltas.push_back(delta);
+    if (samples->deltas.size() > kSpeedWindow) {
+      samples->deltas.pop_front();
+    }
+    host_bytes_[samples->host] += delta;
+  }
+}
+
+qint64 MetricsServer::Speed(const DownloadSamples& samples) {
+  if (samples.deltas.empty()) {
+    return 0;
+  }
+  qint64 bytes = 0;
+  for (qint64 delta : samples.deltas) {
+    bytes += delta;
+  }
+  return bytes * 1000 / ((qint64) samples.deltas.size() * kSampleIntervalMs);
+}
+
+QString MetricsServer::Render() {
+  EngineMetrics* metrics = EngineMetrics::Instance();
+  QList<Fetcher*> fetchers = metrics->Fetchers();
+  int num_active_downloads = 0;
+  int num_connections = 0;
+  for (Fetcher* fetcher : fetchers) {
+    int num_running = fetcher->NumRunningWorkers();
+    num_connections += num_running;
+    if (num_running > 0) {
+      ++num_active_downloads;
+    }
+  }
+  QString out;
+  AppendHeader("qaccelerator_active_downloads", "gauge",
+               "Downloads with at least one running connection.", &out);
+  out += QString("qaccelerator_active_downloads %1\n")
+      .arg(num_active_downloads);
+  AppendHeader("qaccelerator_active_connections", "gauge",
+               "Connections that are downloading.", &out);
+  out += QString("qaccelerator_active_connections %1\n").arg(num_connections);
+
+  AppendHeader("qaccelerator_download_speed_bytes", "gauge",
+               "Download speed in bytes per second, over the last few "
+               "seconds.", &out);
+  std::map<QString, qint64> host_speeds;
+  for (const auto& entry : downloads_) {
+    const DownloadSamples& samples = entry.second;
+    qint64 speed = Speed(samples);
+    host_speeds[samples.host] += speed;
+    out += QString("qaccelerator_download_speed_bytes"
+                   "{download=\"%1\",host=\"%2\"} %3\n")
+        .arg(LabelValue(samples.name)).arg(LabelValue(samples.host))
+        .arg(speed);
+  }
+  AppendHeader("qaccelerator_host_speed_bytes", "gauge",
+               "Download speed from each host in bytes per second, over the "
+               "last few seconds.", &out);
+  for (const auto& entry : host_speeds) {
+    out += QString("qaccelerator_host_speed_bytes{host=\"%1\"} %2\n")
+        .arg(LabelValue(entry.first)).arg(entry.second);
+  }
+  AppendHeader("qaccelerator_host_downloaded_bytes_total", "counter",
+               "Bytes downloaded from each host.", &out);
+  for (const auto& entry : host_bytes_) {
+    out += QString("qaccelerator_host_downloaded_bytes_total"
+                   "{host=\"%1\"} %2\n")
+        .arg(LabelValue(entry.first)).arg(entry.second);
+  }
+
+  AppendHeader("qaccelerator_retries_total", "counter",
+               "Segment requests that were retried.", &out);
+  out += QString("qaccelerator_retries_total %1\n").arg(metrics->NumRetries());
+  AppendHeader("qaccelerator_network_errors_total", "counter",
+               "Segment requests that failed, by QNetworkReply error.", &out);
+  for (const auto& entry : metrics->NetworkErrors()) {
+    out += QString("qaccelerator_network_errors_total"
+                   "{error=\"%1\",code=\"%2\"} %3\n")
+        .arg(NetworkErrorName(entry.first)).arg(entry.first)
+        .arg(entry.second);
+  }
+
+  metrics->DbWriteLatency()->Render(
+      "qaccelerator_db_write_seconds",
+      "Time taken by statements that change the database, and by commits.",
+      &out);
+  AppendHeader("qaccelerator_finalizer_queue_depth", "gauge",
+               "Shard merges and work dir removals waiting for or running on "
+               "the finalizer thread.", &out);
+  out += QString("qaccelerator_finalizer_queue_depth %1\n")
+      .arg(metrics->FinalizerQueueDepth());
+  metrics->UiTickLatency()->Render(
+      "qaccelerator_ui_tick_seconds",
+      "Time taken by one pass of periodic UI updates.", &out);
+  return out;
+}
+
+void MetricsServer::OnNewConnection() {
+  while (hasPendingConnections()) {
+    QTcpSocket* socket = nextPendingConnection();
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    connect(socket, &QTcpSocket::readyRead, [=] {
+      QByteArray head = socket->property("head").toByteArray()
+          + socket->readAll();
+      int end = head.indexOf("\r\n\r\n");
+      if (end < 0 && head.size() <= kMaxRequestHeadSize) {
+        socket->setProperty("head", head);
+        return;
+      }
+      socket->disconnect(SIGNAL(readyRead()));
+      HandleRequest(socket, end < 0 ? QByteArray() : head.left(end));
+    });
+  }
+}
+
+void MetricsServer::HandleRequest(QTcpSocket* socket,
+                                  const QByteArray& head) {
+  QList<QByteArray> request_line =
+      head.left(head.indexOf("\r\n")).split(' ');
+  QByteArray status = "200 OK";
+  QByteArray content_type = "text/plain; version=0.0.4; charset=utf-8";
+  QByteArray body;
+  if (request_line.size() != 3) {
+    status = "400 Bad Request";
+  } else if (request_line[0] != "GET" && request_line[0] != "HEAD") {
+    status = "405 Method Not Allowed";
+  } else if (request_line[1] != "/metrics"
+             && !request_line[1].startsWith("/metrics?")) {
+    status = "404 Not Found";
+  } else {
+    body = Render().toUtf8();
+  }
+  if (!status.startsWith("200")) {
+    content_type = "text/plain; charset=utf-8";
+    body = status + "\n";
+  }
+  QByteArray response = "HTTP/1.1 " + status + "\r\n"
+      + "Content-Type: " + content_type + "\r\n"
+      + "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+      + "Connection: close\r\n\r\n";
+  if (request_line.value(0) != "HEAD") {
+    response += body;
+  }
+  socket->write(response);
+  socket->disconnectFromHost();
+}
@@ -0,0 +1,53 @@
+#ifndef METRICS_SERVER_H_
+#define METRICS_SERVER_H_
+
+#include <deque>
+#include <map>
+#include <QByteArray>
+#include <QString>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+class Fetcher;
+
+// Serves EngineMetrics and the progress of all Fetchers in the Prometheus
+// text format at http://127.0.0.1:<port>/metrics. It only listens on the
+// loopback interface, and must live on the thread that owns the fetchers.
+//
+// Download speeds are averaged over the last few seconds, from samples taken
+// once a second while the server runs.
+class MetricsServer : public QTcpServer {
+  Q_OBJECT
+
+ public:
+  explicit MetricsServer(QObject* parent);
+
+  // Returns false if the port can't be bound.
+  bool Start(quint16 port);
+  // The body served at /metrics.
+  QString Render();
+
+ private slots:
+  void OnNewConnection();
+  void OnSample();
+
+ private:
+  struct DownloadSamples {
+    QString name;
+    QString host;
+    qint64 last_bytes;
+    // Bytes downloaded in each of the last sample intervals, newest last.
+    std::deque<qint64> deltas;
+  };
+
+  void HandleRequest(QTcpSocket* socket, const QByteArray& head);
+  qint64 Speed(const DownloadSamples& samples);
+
+  QTimer sample_timer_;
+  std::map<Fetcher*, DownloadSamples> downloads_;
+  // Bytes downloaded from each host since the server started.
+  std::map<QString, qint64> host_bytes_;
+};
+
+#endif  // METRICS_SERVER_H_
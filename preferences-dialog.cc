@@ -58,7 +58,7 @@ GeneralPage::GeneralPage(QWidget* parent,
   download_dir_gbox->setStyleSheet(kUmemeStyle);
   layout()->addWidget(download_dir_gbox);
   QGridLayout* download_dir_layout = new QGridLayout(download_dir_gbox);
-  controls_gbox->setMaximumHeight(200);
+  controls_gbox->setMaximumHeight(240);
   layout()->addWidget(controls_gbox);
 
   // First row: Default download dir.
@@ -88,6 +88,35 @@ GeneralPage::GeneralPage(QWidget* parent,
   concurrent_cap_spin_->setMinimum(1);
   concurrent_cap_spin_->setMaximumWidth(100);
   controls_layout->addWidget(concurrent_cap_spin_, 1, 1);
+
+  // Fourth row: Age after which finished downloads are archived
+  QLabel* archive_after_days_label = new QLabel(
+      "Archive finished downloads after (days, 0 to never archive)", this);
+  controls_layout->addWidget(archive_after_days_label, 2, 0);
+  archive_after_days_spin_ = new QSpinBox(this);
+  archive_after_days_spin_->setRange(0, 3650);
+  archive_after_days_spin_->setMaximumWidth(100);
+  controls_layout->addWidget(archive_after_days_spin_, 2, 1);
+
+  // Fifth row: Order in which queued downloads are started. Item indices
+  // match DownloadQueue::Policy.
+  QLabel* queue_policy_label = new QLabel("Start queued downloads", this);
+  controls_layout->addWidget(queue_policy_label, 3, 0);
+  queue_policy_combo_ = new QComboBox(this);
+  queue_policy_combo_->addItems({"In the order they were queued",
+                                 "By priority",
+                                 "Smallest first"});
+  controls_layout->addWidget(queue_policy_combo_, 3, 1);
+
+  // Sixth row: Port of the local metrics endpoint
+  QLabel* metrics_port_label = new QLabel(
+      "Serve metrics on localhost port (0 to turn off; applies on restart)",
+      this);
+  controls_layout->addWidget(metrics_port_label, 4, 0);
+  metrics_port_spin_ = new QSpinBox(this);
+  metrics_port_spin_->setRange(0, 65535);
+  metrics_port_spin_->setMaximumWidth(100);
+  controls_layout->addWidget(metrics_port_spin_, 4, 1);
   CreateResetButton();
   SetFieldValuesFromDb();
   ConnectSlots();
@@ -118,12 +147,21 @@ void GeneralPage::SetFieldValuesFromDb() {
   QString download_dir;
   int num_connections;
   int concurrent_cap;
+  int archive_after_days;
+  int queue_policy;
+  int metrics_port;
   preference_manager_->Get("download_dir", &download_dir);
   preference_manager_->Get("num_connections", &num_connections);
   preference_manager_->Get("concurrent_cap", &concurrent_cap);
+  preference_manager_->Get("archive_after_days", &archive_after_days);
+  preference_manager_->Get("queue_policy", &queue_policy);
+  preference_manager_->Get("metrics_port", &metrics_port);
   download_dir_edit_->setText(download_dir);
   num_connections_spin_->setValue(num_connections);
   concurrent_cap_spin_->setValue(concurrent_cap);
+  archive_after_days_spin_->setValue(archive_after_days);
+  queue_policy_combo_->setCurrentIndex(queue_policy);
+  metrics_port_spin_->setValue(metrics_port);
 }
 
 void GeneralPage::ResetDefaults() {
@@ -131,12 +169,21 @@ void GeneralPage::ResetDefaults() {
   QString download_dir;
   int num_connections;
   int concurrent_cap;
+  int archive_after_days;
+  int queue_policy;
+  int metrics_port;
   preference_manager_->GetDefault("download_dir", &download_dir);
   preference_manager_->GetDefault("num_connections", &num_connections);
   preference_manager_->GetDefault("concurrent_cap", &concurrent_cap);
+  preference_manager_->GetDefault("archive_after_days", &archive_after_days);
+  preference_manager_->GetDefault("queue_policy", &queue_policy);
+  preference_manager_->GetDefault("metrics_port", &metrics_port);
   preference_manager_->Set("download_dir", download_dir);
   preference_manager_->Set("num_connections", num_connections);
   preference_manager_->Set("concurrent_cap", concurrent_cap);
+  preference_manager_->Set("archive_after_days", archive_after_days);
+  preference_manager_->Set("queue_policy", queue_policy);
+  preference_manager_->Set("metrics_port", metrics_port);
   SetFieldValuesFromDb();
   ConnectSlots();
 }
@@ -148,6 +195,12 @@ void GeneralPage::ConnectSlots() {
           this, SLOT(UpdateNumConnections(int)));
   connect(concurrent_cap_spin_, SIGNAL(valueChanged(int)),
           this, SLOT(UpdateConcurrentCap(int)));
+  connect(archive_after_days_spin_, SIGNAL(valueChanged(int)),
+          this, SLOT(UpdateArchiveAfterDays(int)));
+  connect(queue_policy_combo_, SIGNAL(currentIndexChanged(int)),
+          this, SLOT(UpdateQueuePolicy(int)));
+  connect(metrics_port_spin_, SIGNAL(valueChanged(int)),
+          this, SLOT(UpdateMetricsPort(int)));
   connect(download_dir_edit_, SIGNAL(textChanged(QString)),
           this, SLOT(OnDownloadDirChanged(QString)));
 }
@@ -160,10 +213,25 @@ void GeneralPage::UpdateConcurrentCap(int newValue) {
   preference_manager_->Set("concurrent_cap", newValue);
 }
 
+void GeneralPage::UpdateArchiveAfterDays(int newValue) {
+  preference_manager_->Set("archive_after_days", newValue);
+}
+
+void GeneralPage::UpdateQueuePolicy(int newValue) {
+  preference_manager_->Set("queue_policy", newValue);
+}
+
+void GeneralPage::UpdateMetricsPort(int newValue) {
+  preference_manager_->Set("metrics_port", newValue);
+}
+
 void GeneralPage::DisconnectSlots() {
   disconnect(download_dir_button_, SIGNAL(clicked()), 0, 0);
   disconnect(num_connections_spin_, SIGNAL(valueChanged(int)), 0, 0);
   disconnect(concurrent_cap_spin_, SIGNAL(valueChanged(int)), 0, 0);
+  disconnect(archive_after_days_spin_, SIGNAL(valueChanged(int)), 0, 0);
+  disconnect(queue_policy_combo_, SIGNAL(currentIndexChanged(int)), 0, 0);
+  disconnect(metrics_port_spin_, SIGNAL(valueChanged(int)), 0, 0);
   disconnect(download_dir_edit_, SIGNAL(textChanged(QString)), 0, 0);
 }
 
@@ -293,10 +361,8 @@ void ChartPage::ResetDefaults() {
   }
   DisconnectSlots();
   SetFieldValuesFromDb();
-  preference_manager_->ApplySavedPreferences(
-      state,
-      grapher_,
-      state == SpeedGrapherState::IN_PROGRESS);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(state),
+                       state == SpeedGrapherState::IN_PROGRESS);
   ConnectSlots();
 }
 
@@ -373,10 +439,8 @@ void ChartPage::CreateControls() {
     controls_layout_->addWidget(indicator_dot_size_spin_, index, 1);
   }
   SpeedGrapherState state = FromString(state_);
-  preference_manager_->ApplySavedPreferences(
-      state,
-      grapher_,
-      state == SpeedGrapherState::IN_PROGRESS);
+  grapher_->ApplyStyle(preference_manager_->GrapherStyle(state),
+                       state == SpeedGrapherState::IN_PROGRESS);
   ConnectSlots();
 }
 
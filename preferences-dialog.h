@@ -9,6 +9,7 @@
 #include <QPushButton>
 #include <QSpinBox>
 #include <QLineEdit>
+#include <QComboBox>
 #include <QToolButton>
 #include <QColor>
 #include <QLabel>
@@ -46,6 +47,9 @@ class GeneralPage : public PreferencePage {
   void PromptDownloadDir();
   void UpdateNumConnections(int newValue);
   void UpdateConcurrentCap(int newValue);
+  void UpdateArchiveAfterDays(int newValue);
+  void UpdateQueuePolicy(int newValue);
+  void UpdateMetricsPort(int newValue);
 
  protected:
   virtual void SetFieldValuesFromDb() override;
@@ -57,6 +61,9 @@ class GeneralPage : public PreferencePage {
   QPushButton* download_dir_button_;
   QSpinBox* num_connections_spin_;
   QSpinBox* concurrent_cap_spin_;
+  QSpinBox* archive_after_days_spin_;
+  QComboBox* queue_policy_combo_;
+  QSpinBox* metrics_port_spin_;
   QLineEdit* download_dir_edit_;
 };
 
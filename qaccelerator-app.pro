@@ -0,0 +1,51 @@
+#-------------------------------------------------
+#
+# Project created by QtCreator 2015-07-14T19:08:34
+#
+#-------------------------------------------------
+
+QT       += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = qaccelerator
+TEMPLATE = app
+
+
+SOURCES +=\
+        qaccelerator.cc \
+    download-dialog.cc \
+    download-monitor.cc \
+    download-monitor-page.cc \
+    downloads-table.cc \
+    downloads-table-model.cc \
+    main.cc \
+    preferences-dialog.cc \
+    segment-map.cc \
+    speed-grapher.cc \
+    spinner.cc \
+    ui-ticker.cc
+
+HEADERS  += qaccelerator.h \
+    download-dialog.h \
+    download-monitor.h \
+    download-monitor-page.h \
+    downloads-table.h \
+    downloads-table-model.h \
+    preferences-dialog.h \
+    segment-map.h \
+    speed-grapher.h \
+    spinner.h \
+    ui-ticker.h \
+    version.h
+
+CONFIG += c++11
+
+QT += network
+QT += sql
+
+include(core/core-lib.pri)
+
+RESOURCES = images.qrc
+
+win32:RC_ICONS += images/qx_flash.ico
@@ -1,10 +1,25 @@
 #include "qaccelerator-db.h"
 
+#include "engine-metrics.h"
+#include "tracer.h"
+#include <algorithm>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QUrl>
+
 using std::string;
 using std::pair;
 
+// Traced statements are cut to this many characters.
+static const int kMaxTracedQueryLength = 200;
+
 template<> const QString Model<DownloadItem>::table_name_ = "download_items";
 template<> const QString Model<Preference>::table_name_ = "preferences";
+template<> const QString Model<SegmentTimelineRecord>::table_name_ =
+    "segment_timelines";
+template<> const QString Model<HostStat>::table_name_ = "host_stats";
+const QString DownloadItem::archive_table_name_ = "archived_download_items";
 
 // TODO(ogaro): Chunk size is not needed.
 template<> const QMap<QString, QString> Model<DownloadItem>::types_ = {
@@ -18,7 +33,9 @@ template<> const QMap<QString, QString> Model<DownloadItem>::types_ = {
     {"chunk_size", "INTEGER"},
     {"work_dir", "VARCHAR"},
     {"status", "INTEGER"},
-    {"millis_elapsed", "INTEGER"}
+    {"millis_elapsed", "INTEGER"},
+    {"priority", "INTEGER"},
+    {"queue_position", "INTEGER"}
 };
 
 template<> const QMap<QString, QString> Model<DownloadItem>::extra_defs_ = {
@@ -32,7 +49,9 @@ template<> const QMap<QString, QString> Model<DownloadItem>::extra_defs_ = {
     {"chunk_size", ""},
     {"work_dir", ""},
     {"status",  "DEFAULT 0"},
-    {"millis_elapsed", "DEFAULT 0"}
+    {"millis_elapsed", "DEFAULT 0"},
+    {"priority", "DEFAULT 0"},
+    {"queue_position", "DEFAULT 0"}
 };
 
 template<> const QMap<QString, QString> Model<Preference>::types_ = {
@@ -47,6 +66,54 @@ template<> const QMap<QString, QString> Model<Preference>::extra_defs_ = {
     {"value", ""}
 };
 
+template<> const QMap<QString, QString> Model<SegmentTimelineRecord>::types_ = {
+    {"id", "INTEGER"},
+    {"download_id", "INTEGER"},
+    {"worker_id", "INTEGER"},
+    {"range_first", "INTEGER"},
+    {"range_last", "INTEGER"},
+    {"attempt", "INTEGER"},
+    {"request_time", "INTEGER"},
+    {"encrypted_ms", "INTEGER"},
+    {"response_ms", "INTEGER"},
+    {"first_byte_ms", "INTEGER"},
+    {"duration_ms", "INTEGER"},
+    {"bytes", "INTEGER"},
+    {"http_status", "INTEGER"},
+    {"error", "INTEGER"},
+    {"num_stalls", "INTEGER"},
+    {"stall_ms", "INTEGER"},
+    {"num_writes", "INTEGER"},
+    {"write_us", "INTEGER"},
+    {"max_write_us", "INTEGER"},
+    // JSON array of [milliseconds after request_time, bytes] pairs.
+    {"samples", "VARCHAR"}
+};
+
+template<> const QMap<QString, QString>
+Model<SegmentTimelineRecord>::extra_defs_ = {
+    {"id", "PRIMARY KEY"}
+};
+
+template<> const QMap<QString, QString> Model<HostStat>::types_ = {
+    {"id", "INTEGER"},
+    {"host", "VARCHAR"},
+    {"finish_time", "INTEGER"},
+    {"file_size", "INTEGER"},
+    {"num_connections", "INTEGER"},
+    {"millis_elapsed", "INTEGER"},
+    // Bytes per second while the download ran, the merge included; time
+    // spent paused doesn't count.
+    {"throughput", "REAL"},
+    {"num_requests", "INTEGER"},
+    {"num_failed_requests", "INTEGER"},
+    {"error_rate", "REAL"}
+};
+
+template<> const QMap<QString, QString> Model<HostStat>::extra_defs_ = {
+    {"id", "PRIMARY KEY"}
+};
+
 // List of sqlite pragmas to be applied to the db.
 // Has to be of size at least one. Ok I need to replace this with something
 // less bizarre.
@@ -73,7 +140,11 @@ Session::Session() {
   } while (kDbPragma[++i] != nullptr);
 
   CreateDownloadItemsTable();
+  CreateArchivedDownloadItemsTable();
   CreatePreferencesTable();
+  CreateSegmentTimelinesTable();
+  CreateHostStatsTable();
+  MigrateDownloadItemIds();
 }
 
 void Session::CreateTable(
@@ -98,10 +169,41 @@ void Session::CreateTable(
 
   // Execute built query.
   Exec(query);
+
+  // Tables created by older versions may lack columns added since. Add them.
+  QStringList existing_columns;
+  Exec(QString("PRAGMA table_info(%1)").arg(table_name));
+  while (query_->next()) {
+    existing_columns.append(query_->value(1).toString());
+  }
+  it.toFront();
+  while (it.hasNext()) {
+    it.next();
+    if (existing_columns.contains(it.key())) {
+      continue;
+    }
+    Exec(QString("ALTER TABLE %1 ADD COLUMN %2 %3 %4")
+             .arg(table_name)
+             .arg(it.key())
+             .arg(it.value())
+             .arg(extra_defs[it.key()]));
+  }
 }
 
 void Session::CreateDownloadItemsTable() {
-  CreateTable(DownloadItem::TableName(), DownloadItem::Types(),
+  // Without AUTOINCREMENT SQLite hands out the ids of deleted rows again,
+  // while archived items and segment timelines may still refer to them.
+  QMap<QString, QString> extra_defs = DownloadItem::ExtraDefs();
+  extra_defs["id"] = "PRIMARY KEY AUTOINCREMENT";
+  CreateTable(DownloadItem::TableName(), DownloadItem::Types(), extra_defs);
+  // Serves the lookups of queued items made by DownloadQueue.
+  Exec(QString("CREATE INDEX IF NOT EXISTS %1_queue "
+               "ON %1 (status, priority, queue_position)")
+           .arg(DownloadItem::TableName()));
+}
+
+void Session::CreateArchivedDownloadItemsTable() {
+  CreateTable(DownloadItem::ArchiveTableName(), DownloadItem::Types(),
               DownloadItem::ExtraDefs());
 }
 
@@ -110,8 +212,80 @@ void Session::CreatePreferencesTable() {
               Preference::ExtraDefs());
 }
 
+void Session::CreateSegmentTimelinesTable() {
+  CreateTable(SegmentTimelineRecord::TableName(),
+              SegmentTimelineRecord::Types(),
+              SegmentTimelineRecord::ExtraDefs());
+  Exec(QString("CREATE INDEX IF NOT EXISTS %1_download "
+               "ON %1 (download_id)")
+           .arg(SegmentTimelineRecord::TableName()));
+}
+
+void Session::CreateHostStatsTable() {
+  CreateTable(HostStat::TableName(), HostStat::Types(), HostStat::ExtraDefs());
+  Exec(QString("CREATE INDEX IF NOT EXISTS %1_host ON %1 (host)")
+           .arg(HostStat::TableName()));
+}
+
+void Session::MigrateDownloadItemIds() {
+  Exec(QString("SELECT sql FROM sqlite_master "
+               "WHERE type = 'table' AND name = '%1'")
+           .arg(DownloadItem::TableName()));
+  if (!query_->next()
+      || query_->value(0).toString().contains("AUTOINCREMENT",
+                                              Qt::CaseInsensitive)) {
+    return;
+  }
+  // SQLite can't add AUTOINCREMENT to an existing table; rebuild it.
+  QString table = DownloadItem::TableName();
+  QString old_table = table + "_old";
+  QString columns = QStringList(DownloadItem::Types().keys()).join(",");
+  if (!db_.transaction()) {
+    return;
+  }
+  bool ok = Exec(QString("DROP INDEX IF EXISTS %1_queue").arg(table))
+      && Exec(QString("ALTER TABLE %1 RENAME TO %2").arg(table)
+                  .arg(old_table));
+  if (ok) {
+    CreateDownloadItemsTable();
+    ok = Exec(QString("INSERT INTO %1 (%2) SELECT %2 FROM %3")
+                  .arg(table).arg(columns).arg(old_table))
+        && Exec(QString("DROP TABLE %1").arg(old_table))
+        && Exec(QString("DELETE FROM sqlite_sequence WHERE name = '%1'")
+                    .arg(table))
+        // New ids start past every id handed out so far.
+        && Exec(QString("INSERT INTO sqlite_sequence (name, seq) "
+                        "SELECT '%1', COALESCE(MAX(id), 0) FROM ("
+                        "SELECT id FROM %1 UNION ALL SELECT id FROM %2 "
+                        "UNION ALL SELECT download_id AS id FROM %3)")
+                    .arg(table)
+                    .arg(DownloadItem::ArchiveTableName())
+                    .arg(SegmentTimelineRecord::TableName()));
+  }
+  if (!ok) {
+    db_.rollback();
+    DIE() << "Error while migrating " << table;
+  }
+  db_.commit();
+}
+
 bool Session::Exec(const QString& query) {
-  if (query_->exec(query)) {
+  // Reads are not timed; their cost is mostly in stepping through results.
+  bool is_write = !query.startsWith("SELECT", Qt::CaseInsensitive)
+      && !query.startsWith("PRAGMA", Qt::CaseInsensitive);
+  Tracer* tracer = Tracer::Instance();
+  qint64 trace_start_micros = tracer->IsEnabled() ? tracer->NowMicros() : -1;
+  QElapsedTimer timer;
+  timer.start();
+  bool ok = query_->exec(query);
+  if (is_write) {
+    EngineMetrics::Instance()->DbWriteLatency()->Observe(timer.nsecsElapsed());
+    if (trace_start_micros >= 0) {
+      tracer->AddSpan("db", "Write", trace_start_micros,
+                      {{"query", query.left(kMaxTracedQueryLength)}});
+    }
+  }
+  if (ok) {
     return true;
   } else {
     std::string last_query = query_->lastQuery().toStdString();
@@ -121,3 +295,180 @@ bool Session::Exec(const QString& query) {
     return false;
   }
 }
+
+bool Session::Commit() {
+  TraceSpan span("db", "Commit");
+  QElapsedTimer timer;
+  timer.start();
+  bool ok = db_.commit();
+  EngineMetrics::Instance()->DbWriteLatency()->Observe(timer.nsecsElapsed());
+  return ok;
+}
+
+int Session::ArchiveDownloadItems(qint64 cutoff_millis) {
+  typedef DownloadItem::StatusEnum Status;
+  QString condition = QString(
+      "status IN (%1, %2) "
+      "AND COALESCE(start_time, 0) + COALESCE(millis_elapsed, 0) < %3")
+      .arg(DownloadItem::ToInt(Status::COMPLETED))
+      .arg(DownloadItem::ToInt(Status::CANCELLED))
+      .arg(cutoff_millis);
+  // Name the columns explicitly; their order may differ between the two
+  // tables depending on when each was created.
+  QString columns = QStringList(DownloadItem::Types().keys()).join(",");
+
+  if (!db_.transaction()) {
+    return 0;
+  }
+  bool ok = Exec(QString("INSERT INTO %1 (%2) SELECT %2 FROM %3 WHERE %4")
+                     .arg(DownloadItem::ArchiveTableName())
+                     .arg(columns)
+                     .arg(DownloadItem::TableName())
+                     .arg(condition));
+  int num_archived = 0;
+  if (ok) {
+    num_archived = query_->numRowsAffected();
+    ok = Exec(QString("DELETE FROM %1 WHERE %2")
+                  .arg(DownloadItem::TableName())
+                  .arg(condition));
+  }
+  if (!ok) {
+    db_.rollback();
+    return 0;
+  }
+  db_.commit();
+  return num_archived;
+}
+
+void Session::Compact() {
+  Exec("VACUUM");
+  Exec("ANALYZE");
+}
+
+bool SegmentTimelineRecord::AddAll(
+    Session* session, int download_id,
+    const std::vector<SegmentTimeline>& timelines) {
+  // Older SQLite versions take at most 500 rows per INSERT.
+  const int kRowsPerInsert = 100;
+  if (timelines.empty()) {
+    return true;
+  }
+  if (!session->Transaction()) {
+    return false;
+  }
+  bool ok = true;
+  QList<QMap<QString, QVariant> > rows;
+  for (size_t i = 0; ok && i < timelines.size(); ++i) {
+    const SegmentTimeline& timeline = timelines[i];
+    auto after_request = [&timeline] (qint64 millis) {
+      return millis < 0 ? (qint64) -1 : millis - timeline.request_millis;
+    };
+    QJsonArray samples;
+    for (const auto& sample : timeline.samples) {
+      samples.append(QJsonArray({sample.first, sample.second}));
+    }
+    QMap<QString, QVariant> row = {
+        {"download_id", download_id},
+        {"worker_id", timeline.worker_id},
+        {"range_first", timeline.segment.first},
+        {"range_last", timeline.segment.second},
+        {"attempt", timeline.attempt},
+        {"request_time", timeline.request_millis},
+        {"encrypted_ms", after_request(timeline.encrypted_millis)},
+        {"response_ms", after_request(timeline.response_millis)},
+        {"first_byte_ms", after_request(timeline.first_byte_millis)},
+        {"duration_ms", after_request(timeline.end_millis)},
+        {"bytes", timeline.bytes},
+        {"http_status", timeline.http_status},
+        {"error", timeline.error},
+        {"num_stalls", timeline.num_stalls},
+        {"stall_ms", timeline.stall_millis},
+        {"num_writes", timeline.num_writes},
+        {"write_us", timeline.write_nanos / 1000},
+        {"max_write_us", timeline.max_write_nanos / 1000},
+        {"samples", QString::fromUtf8(
+            QJsonDocument(samples).toJson(QJsonDocument::Compact))}
+    };
+    rows.append(row);
+    if (rows.size() == kRowsPerInsert || i == timelines.size() - 1) {
+      ok = AddNewBatch(rows, session);
+      rows.clear();
+    }
+  }
+  if (!ok) {
+    session->Rollback();
+    return false;
+  }
+  return session->Commit();
+}
+
+bool SegmentTimelineRecord::DeleteAll(Session* session, int download_id) {
+  return session->Exec(QString("DELETE FROM %1 WHERE download_id = %2")
+                           .arg(TableName())
+                           .arg(download_id));
+}
+
+bool HostStat::Record(Session* session, const QString& url, qint64 file_size,
+                      int num_connections, qint64 millis_elapsed,
+                      const std::vector<SegmentTimeline>& timelines) {
+  // Older downloads of a host are dropped beyond this many.
+  const int kMaxDownloadsPerHost = 50;
+  QString host = QUrl(url).host();
+  if (host.isEmpty() || file_size <= 0 || millis_elapsed <= 0) {
+    return false;
+  }
+  int num_requests = 0;
+  int num_failed_requests = 0;
+  for (const SegmentTimeline& timeline : timelines) {
+    if (timeline.error == QNetworkReply::OperationCanceledError) {
+      continue;  // Paused, not failed.
+    }
+    ++num_requests;
+    if (timeline.error != QNetworkReply::NoError) {
+      ++num_failed_requests;
+    }
+  }
+  Nullable<HostStat> stat = AddNew({
+      {"host", host},
+      {"finish_time", CurrentTimeMillis()},
+      {"file_size", file_size},
+      {"num_connections", num_connections},
+      {"millis_elapsed", millis_elapsed},
+      {"throughput", file_size * 1000.0 / millis_elapsed},
+      {"num_requests", num_requests},
+      {"num_failed_requests", num_failed_requests},
+      {"error_rate", num_requests > 0
+                         ? (double) num_failed_requests / num_requests : 0.0}
+  }, session);
+  if (stat.IsNull()) {
+    return false;
+  }
+  return session->Exec(
+      QString("DELETE FROM %1 WHERE host = %2 AND id NOT IN "
+              "(SELECT id FROM %1 WHERE host = %2 ORDER BY id DESC LIMIT %3)")
+          .arg(TableName())
+          .arg(Prepare("host", host))
+          .arg(kMaxDownloadsPerHost));
+}
+
+int HostStat::BestNumConnections(Session* session, const QString& url) {
+  // Smaller downloads finish before more connections could pay off, so they
+  // say little about the best count.
+  const qint64 kMinFileSize = 4 * 1024 * 1024;
+  QString host = QUrl(url).host();
+  if (host.isEmpty()) {
+    return 0;
+  }
+  QString query = QString(
+      "SELECT num_connections, AVG(throughput * (1 - error_rate)) AS score "
+      "FROM %1 WHERE host = %2 AND file_size >= %3 "
+      "GROUP BY num_connections ORDER BY score DESC LIMIT 1")
+      .arg(TableName())
+      .arg(Prepare("host", host))
+      .arg(kMinFileSize);
+  if (!session->Exec(query) || !session->GetQuery().next()) {
+    return 0;
+  }
+  int num_connections = session->GetQuery().value(0).toInt();
+  return std::min(num_connections, kMaxConnections);
+}
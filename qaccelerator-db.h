@@ -10,7 +10,7 @@
 #ifndef QACCELERATOR_DB_H_
 #define QACCELERATOR_DB_H_
 
-#include "speed-grapher.h"
+#include "connection-telemetry.h"
 #include "qaccelerator-utils.h"
 #include <unordered_map>
 #include <iostream>
@@ -38,9 +38,34 @@ class Session {
     return *query_;
   }
 
+  bool Transaction() {
+    return db_.transaction();
+  }
+
+  bool Commit();
+
+  bool Rollback() {
+    return db_.rollback();
+  }
+
+  // Moves completed and cancelled download items that finished before
+  // `cutoff_millis` from the active table to the archive table. Returns the
+  // number of items moved.
+  int ArchiveDownloadItems(qint64 cutoff_millis);
+
+  // Rebuilds the database file and refreshes the statistics used by the
+  // query planner. Must not be called while a transaction is open.
+  void Compact();
+
  private:
   void CreateDownloadItemsTable();
+  void CreateArchivedDownloadItemsTable();
   void CreatePreferencesTable();
+  void CreateSegmentTimelinesTable();
+  void CreateHostStatsTable();
+  // Rebuilds download_items of databases created before its ids were
+  // AUTOINCREMENT.
+  void MigrateDownloadItemIds();
   void CreateTable(const QString& table_name,
       const QMap<QString, QString>& types,
       const QMap<QString, QString>& extra_defs);
@@ -89,6 +114,29 @@ class Model {
     }
   }
 
+  // Inserts all of `rows` with a single multi-row INSERT statement. Every row
+  // must have the same fields.
+  static bool AddNewBatch(const QList<QMap<QString, QVariant> >& rows,
+                          Session* session) {
+    if (rows.isEmpty()) {
+      return true;
+    }
+    QStringList fields = rows.first().keys();
+    QStringList tuples;
+    for (const QMap<QString, QVariant>& row : rows) {
+      QStringList values;
+      for (const QString& field : fields) {
+        values.append(Prepare(field, row.value(field)));
+      }
+      tuples.append(QString("(%1)").arg(values.join(",")));
+    }
+    QString query = QString("INSERT INTO %1 (%2) VALUES %3")
+        .arg(table_name_)
+        .arg(fields.join(","))
+        .arg(tuples.join(","));
+    return session->Exec(query);
+  }
+
   static Nullable<T> Get(Session* session, int id) {
     QString query = QString("SELECT id FROM %1 WHERE id = %2")
         .arg(TableName())
@@ -155,9 +203,24 @@ class Model {
     }
   }
 
+  static int Count(Session* session,
+                   const QString& field,
+                   const QVariant& value) {
+    QString query = QString("SELECT COUNT(*) FROM %1 WHERE %2 = %3")
+        .arg(table_name_)
+        .arg(field)
+        .arg(Prepare(field, value));
+    session->Exec(query);
+    if (session->GetQuery().next()) {
+      return session->GetQuery().value(0).toInt();
+    } else {
+      return -1;
+    }
+  }
+
   bool Delete() {
     QString query = QString("DELETE FROM %1 WHERE id = %2")
-        .arg(TableName())
+        .arg(Table())
         .arg(id_);
     return session_->Exec(query);
   }
@@ -171,7 +234,16 @@ class Model {
   }
 
 protected:
-  Model(Session* session, int id) : session_(session), id_(id) {}
+  Model(Session* session, int id)
+      : session_(session), id_(id), table_(&table_name_) {}
+  Model(Session* session, int id, const QString* table)
+      : session_(session), id_(id), table_(table) {}
+
+  // Name of the table this row lives in. This is TableName() unless the model
+  // keeps rows in more than one table (see DownloadItem::IsArchived()).
+  const QString& Table() const {
+    return *table_;
+  }
 
   static const QString& GetType(const QString& field) {
     // TODO(ogaro): Validate!
@@ -187,7 +259,8 @@ protected:
 
   static QString Prepare(const QString& field, const QVariant& value) {
     if (GetType(field) == "VARCHAR") {
-      return QString("'%1'").arg(value.toString());
+      // Apostrophes (e.g. in file names) are escaped by doubling them.
+      return QString("'%1'").arg(value.toString().replace("'", "''"));
     } else {
       return value.toString();
     }
@@ -196,7 +269,7 @@ protected:
   Nullable<QVariant> GetField(const QString& field) {
     QString query = QString("SELECT %1 FROM %2 WHERE id = %4")
         .arg(field)
-        .arg(TableName())
+        .arg(Table())
         .arg(id_);
    if (session_ == nullptr) {
      qDebug() << "Session is null.";
@@ -211,7 +284,7 @@ protected:
 
   bool SetField(const QString& field, const QVariant& val) {
     QString query = QString("UPDATE %1 SET %2 = %3 WHERE id = %4")
-        .arg(TableName())
+        .arg(Table())
         .arg(field)
         .arg(Prepare(field, val))
         .arg(id_);
@@ -220,6 +293,7 @@ protected:
 
   Session* session_;
   int id_;
+  const QString* table_;
   static const QString table_name_;
   static const QMap<QString, QString> types_;
   static const QMap<QString, QString> extra_defs_;
@@ -300,13 +374,50 @@ class DownloadItem : public Model<DownloadItem> {
     }
   }
 
+  // Inverse of ToString(). Returns false if `str` is not a status name.
+  static bool FromString(const QString& str, StatusEnum* status) {
+    for (int enum_id = 0; enum_id <= 5; ++enum_id) {
+      if (ToString(MakeStatus(enum_id)) == str) {
+        *status = MakeStatus(enum_id);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Completed and cancelled items are moved to this table once they are older
+  // than the "archive_after_days" preference. It has the same columns as
+  // TableName() and is only read when the user browses archived downloads.
+  static const QString& ArchiveTableName() {
+    return archive_table_name_;
+  }
+
+  static void GetAllArchived(Session* session,
+                             std::vector<DownloadItem>* models) {
+    QString query = QString("SELECT id FROM %1")
+        .arg(ArchiveTableName());
+    session->Exec(query);
+    while (session->GetQuery().next()) {
+     int id = session->GetQuery().value(0).toInt();
+     models->push_back(DownloadItem(session, id, true));
+    }
+  }
+
   DownloadItem(Session* session, int id)
       : Model<DownloadItem>::Model(session, id) {}
 
+  DownloadItem(Session* session, int id, bool archived)
+      : Model<DownloadItem>::Model(
+            session, id, archived ? &archive_table_name_ : &table_name_) {}
+
   DownloadItem() : Model<DownloadItem>::Model(nullptr, -1) {
       // TODO(ogaro): Should we be able to place these objects in containers?
   }
 
+  bool IsArchived() const {
+    return table_ == &archive_table_name_;
+  }
+
   // Getters
 
   Nullable<QString> Url() {
@@ -389,6 +500,22 @@ class DownloadItem : public Model<DownloadItem> {
     return value.Get().toLongLong();
   }
 
+  Nullable<int> Priority() {
+    Nullable<QVariant> value = GetField("priority");
+    if (value.IsNull()) {
+      return Nullable<int>();
+    }
+    return value.Get().toInt();
+  }
+
+  Nullable<qint64> QueuePosition() {
+    Nullable<QVariant> value = GetField("queue_position");
+    if (value.IsNull()) {
+      return Nullable<qint64>();
+    }
+    return value.Get().toLongLong();
+  }
+
   // Setters
 
   void SetUrl(const QString& url) {
@@ -430,6 +557,17 @@ class DownloadItem : public Model<DownloadItem> {
   void SetMillisElapsed(qint64 millis_elapsed) {
     SetField("millis_elapsed", millis_elapsed);
   }
+
+  void SetPriority(int priority) {
+    SetField("priority", priority);
+  }
+
+  void SetQueuePosition(qint64 queue_position) {
+    SetField("queue_position", queue_position);
+  }
+
+ private:
+  static const QString archive_table_name_;
 };
 
 
@@ -463,6 +601,41 @@ class Preference : public Model<Preference> {
   }
 };
 
+// Telemetry of one segment request of a completed download (see
+// SegmentTimeline), kept for analysis after the work dir is gone. Times of
+// events are in milliseconds after request_time, or -1 if they didn't happen.
+class SegmentTimelineRecord : public Model<SegmentTimelineRecord> {
+ public:
+  SegmentTimelineRecord(Session* session, int id)
+    : Model<SegmentTimelineRecord>::Model(session, id) {}
+
+  // Saves all of `timelines` for the download item `download_id`, in one
+  // transaction.
+  static bool AddAll(Session* session, int download_id,
+                     const std::vector<SegmentTimeline>& timelines);
+  static bool DeleteAll(Session* session, int download_id);
+};
+
+// How a completed download from a host went: one row per download. Rows
+// outlive their download items, so that later downloads from the host can
+// start with settings that worked.
+class HostStat : public Model<HostStat> {
+ public:
+  HostStat(Session* session, int id)
+    : Model<HostStat>::Model(session, id) {}
+
+  // Records a completed download of `url`. `timelines` are its segment
+  // requests, from which the error rate is taken. Only the most recent
+  // downloads of each host are kept.
+  static bool Record(Session* session, const QString& url, qint64 file_size,
+                     int num_connections, qint64 millis_elapsed,
+                     const std::vector<SegmentTimeline>& timelines);
+  // The number of connections that gave the best throughput, discounted by
+  // errors, in recent downloads from the host of `url` that were large
+  // enough to tell. Returns 0 if there are none.
+  static int BestNumConnections(Session* session, const QString& url);
+};
+
 // Use mutexes in every public function.
 class PreferenceManager {
  public:
@@ -534,15 +707,25 @@ class PreferenceManager {
         {"download_dir", download_dir},
         {"num_connections", 10},
         {"concurrent_cap", 2},
-        {"multiple_filters", 0}
+        {"queue_policy", 0},
+        {"multiple_filters", 0},
+        {"archive_after_days", 30},
+        {"last_compaction_time", 0},
+        {"metrics_port", 0},
+        {"ramp_up_interval_ms", 500}
     };
-    if (Preference::Count(session_) > 0) {
+    if (Preference::Count(session_) >= defaults_.size()) {
       return;
     }
+    // Only write the defaults that are missing, so preferences introduced
+    // after the db was created get a value without clobbering saved ones.
     QMapIterator<QString, QVariant> it(defaults_);
     while (it.hasNext()) {
       it.next();
-      Set(it.key(), it.value());
+      if (Preference::Get(session_, "name", it.key()).IsNull()) {
+        Preference::AddNew({{"name", it.key()}, {"value", it.value()}},
+                           session_);
+      }
     }
   }
 
@@ -582,34 +765,22 @@ class PreferenceManager {
    *read_value = value->toInt();
   }
 
-  // TODO(ogaro): Repeating db_row.Get().Value() is not great style.
   // TODO(ogaro): Die in a more transparent manner (print message that says
   // preference "%s" does not exist.
   void Get(const QString& preference, QString* read_value) {
-   EnsureValid(preference);
-   Nullable<Preference> db_row = Preference::Get(session_,
-                                                 "name",
-                                                 preference);
-   db_row.Get().Value();  // Will die if value is not in database.
-   *read_value = db_row.Get().Value().Get();
+   *read_value = GetSavedValue(preference);
   }
 
   void Get(const QString& preference, double* read_value) {
-   EnsureValid(preference);
-   Nullable<Preference> db_row = Preference::Get(session_,
-                                                 "name",
-                                                 preference);
-   db_row.Get().Value();  // Will die if value is not in database.
-   *read_value = QVariant(db_row.Get().Value().Get()).toDouble();
+   *read_value = QVariant(GetSavedValue(preference)).toDouble();
   }
 
   void Get(const QString& preference, int* read_value) {
-   EnsureValid(preference);
-   Nullable<Preference> db_row = Preference::Get(session_,
-                                                 "name",
-                                                 preference);
-   db_row.Get().Value();  // Will die if value is not in database.
-   *read_value = QVariant(db_row.Get().Value().Get()).toInt();
+   *read_value = QVariant(GetSavedValue(preference)).toInt();
+  }
+
+  void Get(const QString& preference, qint64* read_value) {
+   *read_value = QVariant(GetSavedValue(preference)).toLongLong();
   }
 
   void Get(const QString& preference, bool* read_value) {
@@ -619,17 +790,13 @@ class PreferenceManager {
   }
 
   void Get(const QString& preference, QVariant* read_value) {
-   EnsureValid(preference);
-   Nullable<Preference> db_row = Preference::Get(session_,
-                                                 "name",
-                                                 preference);
-   db_row.Get().Value();  // Will die if value is not in database.
-   *read_value = QVariant(db_row.Get().Value().Get());
+   *read_value = QVariant(GetSavedValue(preference));
   }
 
-  void ApplySavedPreferences(SpeedGrapherState state,
-                             SpeedGrapher* speed_grapher,
-                             bool show_indicators) {
+  // Saved style attributes of the speed grapher in `state`, keyed by the
+  // attribute name without the state prefix.
+  QMap<QString, QVariant> GrapherStyle(SpeedGrapherState state) {
+    QMap<QString, QVariant> style;
     QString str_state = ToString(state);
     QMapIterator<QString, QVariant> it(defaults_);
     while (it.hasNext()) {
@@ -640,10 +807,20 @@ class PreferenceManager {
         key = key.mid(1);
         QVariant value;
         Get(it.key(), &value);
-        speed_grapher->SetStyleAttribute(key, value);
+        style[key] = value;
       }
     }
-    speed_grapher->UpdatePlot(show_indicators);
+    return style;
+  }
+
+  // The connection count new downloads of `url` should start with: what
+  // worked best for its host before, or the "num_connections" preference.
+  int DefaultNumConnections(const QString& url) {
+    int num_connections = HostStat::BestNumConnections(session_, url);
+    if (num_connections < 1) {
+      Get("num_connections", &num_connections);
+    }
+    return num_connections;
   }
 
   // TODO(ogaro): This is a lazy way of getting the Session in the download
@@ -674,6 +851,16 @@ class PreferenceManager {
    GetDefaultOrDie(preference, &value);
  }
 
+ // Reads the value saved in the database with a single query. Dies if the
+ // preference is not in the database.
+ QString GetSavedValue(const QString& preference) {
+   EnsureValid(preference);
+   Nullable<Preference> db_row = Preference::Get(session_,
+                                                 "name",
+                                                 preference);
+   return db_row.Get().Value().Get();
+ }
+
  QMap<QString, QVariant> defaults_;
  Session* session_;
 };
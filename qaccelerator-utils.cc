@@ -1,12 +1,18 @@
 #include "qaccelerator-utils.h"
 
+#include "capability-cache.h"
+#include "logger.h"
+#include "tracer.h"
+#include <algorithm>
 #include <QUrl>
 #include <QRegularExpression>
 #include <stdio.h>
 #include <stdlib.h>
-#include <QApplication>
-#include <QLibraryInfo>
-#include <QMessageBox>
+#include <QFile>
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#endif
 
 // TODO(ogaro): Sanitize suggested filenames!!
 
@@ -19,8 +25,6 @@ const qint64 kMillisInADay = 86400000;
 const qint64 kMillisInAnHour = 3600000;
 const qint64 kMillisInAMinute = 60000;
 const qint64 kMillisInASecond = 1000;
-// const int kMaxErrorMessageAgeMillis = 7 * kMillisInADay;
-const int kMaxErrorMessageAgeMillis = kMillisInAMinute * 5;
 
 QString ToString(SpeedGrapherState state) {
   QString converted;
@@ -102,11 +106,6 @@ QString StringifyTimeStamp(qint64 millis) {
   return dt.toString("MMMM d yyyy, h:mm AP");
 }
 
-qint64 ParseDateTime(const QString& stringified) {
-  QDateTime dt = QDateTime::fromString(stringified, "MMMM d yyyy, h:mm:ss AP");
-  return dt.toMSecsSinceEpoch();
-}
-
 QString SuggestFileName(const QString& url, const QString& mime_type) {
   QUrl parsed(url);
   if (parsed.scheme().isEmpty() || parsed.host().isEmpty()) {
@@ -262,9 +261,14 @@ QString StopWatch::GetTimeElapsedString() {
 
 FileSpecGetter::FileSpecGetter(int id, const QString& url)
     : spec_(id, url),
-      error_encountered_(false) {}
+      error_encountered_(false),
+      trace_start_micros_(-1) {}
 
 void FileSpecGetter::Run() {
+  Tracer* tracer = Tracer::Instance();
+  if (tracer->IsEnabled()) {
+    trace_start_micros_ = tracer->NowMicros();
+  }
   QNetworkRequest request(spec_.Url());
   // qDebug() << "Creating network access manager.";
   network_.reset(new QNetworkAccessManager());
@@ -277,6 +281,10 @@ void FileSpecGetter::Run() {
 
 void FileSpecGetter::OnError(QNetworkReply::NetworkError error) {
   error_encountered_ = true;
+  if (trace_start_micros_ >= 0) {
+    Tracer::Instance()->AddSpan("net", "Probe", trace_start_micros_,
+                                {{"url", spec_.Url()}, {"error", (int) error}});
+  }
   emit Error(spec_.Id(), error);
   emit Finished();
 }
@@ -304,90 +312,41 @@ void FileSpecGetter::OnFinished() {
       spec_.SetMimeType(content_type);
     }
   }
+  CapabilityCache* capabilities = CapabilityCache::Instance();
   if (reply_->hasRawHeader(kAcceptRanges)) {
     QByteArray raw = reply_->rawHeader(kAcceptRanges);
     bool accelerable = QString(raw.constData()).compare(
         "bytes", Qt::CaseInsensitive) == 0;
     spec_.SetAccelerable(accelerable);
+    capabilities->RecordRangeSupport(spec_.Url(), accelerable);
+  } else {
+    // Many servers only say so by answering range requests.
+    OriginCapabilities known;
+    if (capabilities->Get(spec_.Url(), &known)) {
+      spec_.SetAccelerable(known.accepts_ranges == 1);
+    }
+  }
+  if (trace_start_micros_ >= 0) {
+    int http_status = reply_->attribute(
+        QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    Tracer::Instance()->AddSpan("net", "Probe", trace_start_micros_,
+                                {{"url", spec_.Url()},
+                                 {"http_status", http_status},
+                                 {"file_size", spec_.FileSize().Get()}});
   }
   emit ResultReady(spec_);
   emit Finished();
 }
 
-// Custom message handler.
-void HandleMessage(QtMsgType type,
-                   const QMessageLogContext &context,
-                   const QString &msg) {
-  QByteArray localMsg = msg.toLocal8Bit();
-  QString time_format = "MMMM d yyyy, h:mm:ss AP";
-  QString current_time = QDateTime::fromMSecsSinceEpoch(CurrentTimeMillis())
-      .toString(time_format);;
-  QString suffix;
-  if (QLibraryInfo::isDebugBuild()) {
-    suffix = QString(" (%s:%u, %s)")
-        .arg(context.file)
-        .arg(context.line)
-        .arg(context.function);
-  }
-  switch (type) {
-  case QtFatalMsg:
-    fprintf(stderr,
-            "%s\t FATAL: %s%s\n",
-            current_time.toStdString().c_str(),
-            localMsg.toStdString().c_str(),
-            suffix.toStdString().c_str());
-    abort();
-    break;
-  default:
-    fprintf(stderr,
-            "%s\t %s%s\n",
-            current_time.toStdString().c_str(),
-            localMsg.toStdString().c_str(),
-            suffix.toStdString().c_str());
-  }
-}
-
 void InitApplication() {
-  QFile error_log(kErrorLogFName);
-  // Delete old messages.
-  // TODO(ogaro): Make logging thread-safe (output from threads is interleaved).
-  if (error_log.exists()) {
-    CHECK(error_log.open(QIODevice::ReadOnly));
-    QTextStream in_stream(&error_log);
-    QStringList error_lines;
-    qint64 now = CurrentTimeMillis();
-    bool should_rewrite_log = false;
-    while (!in_stream.atEnd()) {
-      QString line = in_stream.readLine();
-      if (line.isEmpty()) {
-        continue;
-      }
-      QStringList parts = line.split("\t");
-      if (parts.isEmpty()) {
-        // TODO(ogaro): Show error message.
-        abort();
-      }
-      qint64 message_age = now - ParseDateTime(parts[0]);
-      if (message_age > kMaxErrorMessageAgeMillis) {
-        should_rewrite_log = true;
-      } else if (should_rewrite_log == true) { // Old messages encountered.
-        error_lines.append(line);
-      }
-    }
-    if (!error_lines.isEmpty()) {
-      error_log.remove();
-      CHECK(error_log.open(QIODevice::WriteOnly));
-      QTextStream out_stream(&error_log);
-      for (const QString& line : error_lines) {
-        out_stream << line << "\n";
-      }
-    }
-  } else {
-    CHECK(error_log.open(QIODevice::WriteOnly));
+  Logger::Options options;
+  options.path = kErrorLogFName;
+  QString level = QString::fromLocal8Bit(qgetenv("QACCELERATOR_LOG_LEVEL"));
+  if (!level.isEmpty() && !Logger::ParseLevel(level, &options.min_level)) {
+    fprintf(stderr, "Unknown log level %s\n", level.toLocal8Bit().constData());
   }
-  error_log.close();
-  freopen(kErrorLogFName, "a", stderr);
-  qInstallMessageHandler(HandleMessage);
+  options.json = !qgetenv("QACCELERATOR_LOG_JSON").isEmpty();
+  Logger::Instance()->Start(options);
 }
 
 QString CategoryToString(const Category& category) {
@@ -457,6 +416,17 @@ bool ParseSegment(const QString& fname, Segment* segment) {
   return start_ok && end_ok;
 }
 
+void ListShards(const QString& work_dir, std::vector<Segment>* segments) {
+  QStringList fnames = QDir(work_dir).entryList(
+      QDir::NoDotAndDotDot | QDir::Files);
+  foreach(const QString& fname, fnames) {
+    Segment segment;
+    if (ParseSegment(fname, &segment)) {
+      segments->push_back(segment);
+    }
+  }
+}
+
 void MaybeRenameShard(qint64 actual_bytes_downloaded, QFile* shard) {
   Segment expected_downloaded_segment;
   QFileInfo finfo = QFileInfo(*shard);
@@ -472,8 +442,14 @@ void MaybeRenameShard(qint64 actual_bytes_downloaded, QFile* shard) {
     // No rename necessary.
     return;
   }
+  // The rest of the segment is downloaded into another shard, which
+  // reserves space for it again.
+  ReleasePreallocated(shard, actual_bytes_downloaded,
+                      expected_downloaded_segment.second - start + 1);
   QString work_dir = finfo.dir().absolutePath();
   QString new_shard_path = MakeShardPath(work_dir, actual_downloaded_segment);
+  TraceSpan span("disk", "Rename shard");
+  span.AddArg("shard", finfo.fileName());
   if (QFile::exists(new_shard_path)) {
     QFile::remove(new_shard_path);
   }
@@ -482,21 +458,83 @@ void MaybeRenameShard(qint64 actual_bytes_downloaded, QFile* shard) {
   }
 }
 
-void PreLaunch() {
-  if (QFile::exists(kLaunchFName)) {
-    QFile::remove(kDbFName);  // Previous launch attempt failed.
-    QMessageBox::information(
-        0,
-        "Download history lost",
-        "An error occurred, and your recent download history has been lost. "
-        "Sorry about that. :(");
-  } else {
-    QFile launch_file(kLaunchFName);
-    launch_file.open(QIODevice::WriteOnly);
-    launch_file.close();
+bool IsThrottlingStatus(int http_status) {
+  return http_status == 429 || http_status == 503;
+}
+
+qint64 ParseRetryAfter(const QByteArray& value, qint64 now_millis) {
+  QString trimmed = QString::fromLatin1(value).trimmed();
+  bool ok = false;
+  qint64 seconds = trimmed.toLongLong(&ok);
+  if (ok) {
+    return seconds >= 0 ? seconds * kMillisInASecond : -1;
+  }
+  QDateTime date = QDateTime::fromString(trimmed, Qt::RFC2822Date);
+  if (!date.isValid()) {
+    return -1;
   }
+  return std::max(date.toMSecsSinceEpoch() - now_millis, (qint64) 0);
 }
 
-void PostLaunch() {
-  QFile::remove(kLaunchFName);
+qint64 ParseByteSize(const QString& size) {
+  QString number = size.trimmed().toUpper();
+  double multiplier = 1;
+  if (number.endsWith("K")) {
+    multiplier = 1024.0;
+  } else if (number.endsWith("M")) {
+    multiplier = 1024.0 * 1024;
+  } else if (number.endsWith("G")) {
+    multiplier = 1024.0 * 1024 * 1024;
+  }
+  if (multiplier > 1) {
+    number.chop(1);
+  }
+  bool ok = false;
+  double value = number.toDouble(&ok);
+  if (!ok || value < 0) {
+    return -1;
+  }
+  return (qint64) (value * multiplier);
+}
+
+bool Preallocate(QFile* file, qint64 offset, qint64 length, QString* error) {
+  if (length <= 0) {
+    return true;
+  }
+#if defined(Q_OS_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+  // Unlike posix_fallocate(), this fails rather than writing zeros where
+  // the filesystem has no support.
+  int result;
+  do {
+    result = fallocate(file->handle(), FALLOC_FL_KEEP_SIZE, offset, length);
+  } while (result != 0 && errno == EINTR);
+  if (result != 0
+      && (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+    *error = QString("Not enough disk space for %1 bytes of %2")
+        .arg(length).arg(file->fileName());
+    return false;
+  }
+#else
+  Q_UNUSED(file);
+  Q_UNUSED(offset);
+  Q_UNUSED(error);
+#endif
+  return true;
+}
+
+void ReleasePreallocated(QFile* file, qint64 size, qint64 reserved_size) {
+  if (reserved_size <= size) {
+    return;
+  }
+#if defined(Q_OS_LINUX) && defined(FALLOC_FL_PUNCH_HOLE)
+  file->flush();
+  int result;
+  do {
+    result = fallocate(file->handle(),
+                       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size,
+                       reserved_size - size);
+  } while (result != 0 && errno == EINTR);
+#else
+  Q_UNUSED(file);
+#endif
 }
@@ -13,6 +13,10 @@
 #include <math.h>
 #include <QDateTime>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <QMetaType>
 #include <QNetworkReply>
 #include <QNetworkRequest>
@@ -37,6 +41,7 @@ struct DieOnDestroyed {
 static const int kMaxConnections = 1000;
 static const char* kLaunchFName = "LAUNCH";
 static const char* kDbFName = "qaccelerator.db";
+static const char* kCapabilityCacheFName = "capabilities.json";
 
 // Time to wait for a new download to initiate before starting another.
 static const int kDownloadWaitTimeMs = 3000;
@@ -78,50 +83,114 @@ QString CategoryToString(const Category& category);
 
 Category StringToCategory(const QString& category);
 
-// Requirements for type T: Must be copyable (must have a copy constructor).
+// A value that may be absent. The value is stored inline, so constructing,
+// copying or moving a Nullable never allocates by itself.
+// Requirements for type T: Must be copyable or movable.
 template<typename T>
 class Nullable {
  public:
   // Non-explicit on purpose. We want implicit conversion of T values to
   // Nullable<T>
-  Nullable(const T& val) {
-    val_.reset(new T(val));
+  Nullable(const T& val) : is_null_(true) {
+    Construct(val);
+  }
+  Nullable(T&& val) : is_null_(true) {
+    Construct(std::move(val));
   }
   // Default constructor creates a null Nullable.
-  Nullable() {}
-  // Compiler needs us to specify explicit copy constructor
-  Nullable(const Nullable<T>& other) {
+  Nullable() : is_null_(true) {}
+  Nullable(const Nullable<T>& other) : is_null_(true) {
+    if (!other.IsNull()) {
+      Construct(*other.Ptr());
+    }
+  }
+  Nullable(Nullable<T>&& other) : is_null_(true) {
     if (!other.IsNull()) {
-      val_.reset(new T(other.Get()));
+      Construct(std::move(*other.Ptr()));
     }
   }
+  ~Nullable() {
+    Reset();
+  }
 
   Nullable<T>& operator=(const Nullable<T>& other) {
-    if (!other.IsNull()) {
-      val_.reset(new T(other.Get()));
+    if (this == &other) {
+      return *this;
+    }
+    if (other.IsNull()) {
+      Reset();
+    } else {
+      Set(*other.Ptr());
     }
     return *this;
   }
 
-  // TODO(ogaro): Return a const reference.
-  T& Get () const {
-    if (val_ != nullptr) {
-      return *val_;
+  Nullable<T>& operator=(Nullable<T>&& other) {
+    if (this == &other) {
+      return *this;
+    }
+    if (other.IsNull()) {
+      Reset();
+    } else {
+      Set(std::move(*other.Ptr()));
+    }
+    return *this;
+  }
+
+  const T& Get() const {
+    if (is_null_) {
+      DIE() << "Nullable Error: Attempted to retrieve non-existent value.";
+    }
+    return *Ptr();
+  }
+
+  T& Get() {
+    if (is_null_) {
+      DIE() << "Nullable Error: Attempted to retrieve non-existent value.";
     }
-    DIE() << "Nullable Error: Attempted to retrieve non-existent value.";
-    return *val_;
+    return *Ptr();
   }
 
   void Set(const T& val) {
-    val_.reset(new T(val));
+    if (is_null_) {
+      Construct(val);
+    } else {
+      *Ptr() = val;
+    }
+  }
+
+  void Set(T&& val) {
+    if (is_null_) {
+      Construct(std::move(val));
+    } else {
+      *Ptr() = std::move(val);
+    }
+  }
+
+  // Destroys the value, if any.
+  void Reset() {
+    if (!is_null_) {
+      Ptr()->~T();
+      is_null_ = true;
+    }
   }
 
   bool IsNull () const {
-    return val_ == nullptr;
+    return is_null_;
   }
 
  private:
-  std::unique_ptr<T> val_;
+  template<typename U>
+  void Construct(U&& val) {
+    new (&storage_) T(std::forward<U>(val));
+    is_null_ = false;
+  }
+
+  T* Ptr() { return reinterpret_cast<T*>(&storage_); }
+  const T* Ptr() const { return reinterpret_cast<const T*>(&storage_); }
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+  bool is_null_;
 };
 
 
@@ -132,17 +201,17 @@ struct DownloadParams {
     : url_(url),
       save_as_(save_as),
       file_size_(file_size),
-      num_connections_(num_connections) {}
+      num_connections_(num_connections),
+      priority_(0),
+      accelerable_(false) {}
 
-  DownloadParams() {
-    DownloadParams("", "", 0, 0);
-  }
-  ~DownloadParams() {}
+  DownloadParams() : DownloadParams("", "", 0, 0) {}
 
   const QString& Url() const { return url_; }
   const QString& SaveAs() const { return save_as_; }
   qint64 FileSize() const { return file_size_; }
   int NumConnections() const { return num_connections_; }
+  int Priority() const { return priority_; }
   bool Accelerable() const { return accelerable_; }
 
   void SetUrl(const QString& url) { url_ = url; }
@@ -151,6 +220,7 @@ struct DownloadParams {
   void SetNumConnections(int num_connections) {
     num_connections_ = num_connections;
   }
+  void SetPriority(int priority) { priority_ = priority; }
   void SetAccelerable(bool accelerable) {
     accelerable_ = accelerable;
   }
@@ -160,6 +230,7 @@ struct DownloadParams {
   QString save_as_;  // Ditto.
   qint64 file_size_;
   int num_connections_;
+  int priority_;
   bool accelerable_;
 };
 Q_DECLARE_METATYPE(DownloadParams)
@@ -183,18 +254,12 @@ class StopWatch {
 
 struct FileSpec {
  public:
-  FileSpec(int id, const QString& url) : id_(id), url_(url) {}
-  FileSpec(const FileSpec& other) {
-    id_ = other.Id();
-    url_ = other.Url();
-    mime_type_ = other.MimeType();
-    file_size_ = other.FileSize();
-    accelerable_ = other.Accelerable();
-  }
-  FileSpec() {}
+  FileSpec(int id, const QString& url)
+      : id_(id), url_(url), accelerable_(false) {}
+  FileSpec() : id_(-1), accelerable_(false) {}
 
   int Id() const { return id_; }
-  QString Url() const { return url_; }
+  const QString& Url() const { return url_; }
   bool Accelerable() const { return accelerable_; }
   const Nullable<QString>& MimeType() const { return mime_type_; }
   const Nullable<qint64>& FileSize() const { return file_size_; }
@@ -240,6 +305,7 @@ class FileSpecGetter : public QObject {
   std::unique_ptr<QNetworkReply> reply_;
   FileSpec spec_;
   bool error_encountered_;
+  qint64 trace_start_micros_;  // -1 if tracing was off.
 };
 
 QString ToString(SpeedGrapherState state);
@@ -257,7 +323,7 @@ V& FindOrDie(std::unordered_map<K, V>& col, const K& key) {
 }
 
 template<typename K, typename V>
-V* FindOrNull(std::unordered_map<K, V> col, const K& key) {
+V* FindOrNull(std::unordered_map<K, V>& col, const K& key) {
   auto it = col.find(key);
   if (it == col.end()) {
     return nullptr;
@@ -289,15 +355,32 @@ QString SuggestSaveAs(const QString& url, const QString& mime_type,
 // Suffix is set to 0 if save_as does not exist.
 QString MaybeAppendSuffix(const QString& save_as, int* suffix);
 
-void HandleMessage(QtMsgType type,
-                   const QMessageLogContext &context,
-                   const QString &msg);
-
+// Sends qDebug() and friends to error.log through Logger. The minimum level
+// and JSON lines can be chosen with the QACCELERATOR_LOG_LEVEL (e.g.
+// "warning") and QACCELERATOR_LOG_JSON environment variables.
 void InitApplication();
 
 QString MakeShardPath(const QString& work_dir, const Segment& segment);
 bool ParseSegment(const QString& fname, Segment* segment);
+// Appends the segments of the shards in `work_dir`, in no particular order.
+void ListShards(const QString& work_dir, std::vector<Segment>* segments);
 void MaybeRenameShard(qint64 actual_bytes_downloaded, QFile* shard);
-void PreLaunch();
-void PostLaunch();
+// Whether an HTTP status means the server wants fewer or slower requests.
+bool IsThrottlingStatus(int http_status);
+// Milliseconds to wait as told by a Retry-After header value, either
+// seconds or an HTTP date. Returns -1 if `value` is neither.
+qint64 ParseRetryAfter(const QByteArray& value, qint64 now_millis);
+// Parses a byte count such as "512", "64K", "100M" or "1.5G", in powers of
+// 1024. Returns -1 if `size` is malformed or negative.
+qint64 ParseByteSize(const QString& size);
+// Reserves disk space for `length` bytes of the open `file` from `offset`,
+// so writing them later neither fragments the file nor runs out of space.
+// The file's size is left as it is. Returns false, with `error` set, only if
+// the disk is too full; where the filesystem or platform can't preallocate,
+// nothing is reserved and true is returned.
+bool Preallocate(QFile* file, qint64 offset, qint64 length, QString* error);
+// Gives back the space Preallocate() reserved for the open `file` past its
+// first `size` bytes, up to `reserved_size`, once it is known that no more
+// will be written there.
+void ReleasePreallocated(QFile* file, qint64 size, qint64 reserved_size);
 #endif // QACCELERATOR_UTILS_H_
@@ -9,12 +9,10 @@
 // TODO(ogaro): Rename from flv to exe, zip in Windows is broken.
 // TODO(ogaro): Ampersand in filename?
 // TODO(ogaro): Possible race condition when writing to file.
-// TODO(ogaro): Apostrophe in filename breaks things (Windows).
 
 #include "qaccelerator.h"
 #include "download-monitor.h"
 #include "preferences-dialog.h"
-#include "categorizer.h"
 #include "version.h"
 
 #include <QVBoxLayout>
@@ -32,6 +30,9 @@
 #include <unordered_map>
 #include <algorithm>
 #include <QMessageBox>
+#include <QCoreApplication>
+#include <QProgressBar>
+#include <QProgressDialog>
 #include "download-dialog.h"
 
 using std::vector;
@@ -41,7 +42,13 @@ typedef QMessageBox::StandardButton StandardButton;
 typedef QMessageBox::StandardButtons StandardButtons;
 
 const char* kStatusAll = "Status: All";
+const char* kStatusArchived = "Archived";
 const char* kCategoryAll = "Category: All";
+const qint64 kMillisInADay = 86400000;
+const qint64 kCompactionIntervalMillis = 7 * kMillisInADay;
+// Number of import file rows written per INSERT statement.
+const int kImportBatchSize = 250;
+const int kImportProgressSteps = 1000;
 
 namespace {
 void GetSubTreeNodes(QTreeWidgetItem* item,
@@ -59,84 +66,109 @@ void GetAllItems(QTreeWidget* widget, vector<QTreeWidgetItem*>* all_items) {
 }
 
 QStringList split(QString line, const QString& sep) {
-  QStringList cells = line.split(
+  return line.split(
       sep,
       QString::SplitBehavior::KeepEmptyParts,
       Qt::CaseInsensitive);
-  QStringList simplified;
-  for (QString& cell : cells) {
-    simplified.append(cell.toLower());
-  }
-  return simplified;
 }
 
-bool ParseImportFile(const QString& fpath,
-                     vector<DownloadParams>* out,
-                     QString* error) {
-  QFile file(fpath);
-  QString sep = "\t";
-  if (file.open(QIODevice::ReadOnly)) {
-    QTextStream stream(&file);
-    QSet<QString> allowed_headers = {"url", "save as", "number of connections"};
-    QStringList headers = split(stream.readLine(), sep); // Read header row.
-    bool url_header_seen = false;
-    for (const QString& header : headers) {
+const char* kImportSep = "\t";
+
+// Reads an import file a batch of rows at a time, so that large files are
+// never held in memory in full.
+class ImportFileReader {
+ public:
+  ImportFileReader(const QString& fpath) : file_(fpath), line_number_(1) {}
+
+  // Opens the file and validates its header row.
+  bool Open(QString* error) {
+    if (!file_.open(QIODevice::ReadOnly)) {
+      *error = "Failed to open import file.";
+      return false;
+    }
+    stream_.setDevice(&file_);
+    QSet<QString> allowed_headers = {
+        "url", "save as", "number of connections", "priority"};
+    for (const QString& header : split(stream_.readLine(), kImportSep)) {
+      headers_.append(header.toLower());
+    }
+    if (!headers_.contains("url")) {
+      *error = "Url header is required.";
+      return false;
+    }
+    for (const QString& header : headers_) {
       if (!allowed_headers.contains(header)) {
         *error = "Unrecognized import file header " + header;
         return false;
       }
-      if (header == "url") {
-        url_header_seen = true;
-      }
-    }
-    if (!url_header_seen) {
-      *error = "Url header is required.";
-      return false;
     }
+    return true;
+  }
 
-    int line_number = 1;
-    while(!stream.atEnd()) {
-      line_number++;
-      QStringList cells = split(stream.readLine(), sep);
-      if (cells.size() != headers.size()) {
+  // Appends up to `max_rows` parsed rows to `out`.
+  bool ReadRows(int max_rows, vector<DownloadParams>* out, QString* error) {
+    int num_read = 0;
+    while (num_read < max_rows && !stream_.atEnd()) {
+      line_number_++;
+      QString line = stream_.readLine();
+      if (line.trimmed().isEmpty()) {
+        continue;
+      }
+      QStringList cells = split(line, kImportSep);
+      if (cells.size() != headers_.size()) {
         *error = QString("Import row %1 has an incorrect number of cells. "
                          "Open the file in a text editor and make sure the "
                          "number of cells matches that of the header row.")
-            .arg(line_number);
+            .arg(line_number_);
         return false;
       }
+      DownloadParams params("", "", 0, 0);
+      params.SetAccelerable(false);
       for (int i = 0; i < cells.size(); ++i) {
-        DownloadParams params; // Default ctor I have is not called. Weird..
-        params.SetAccelerable(false);
-        params.SetFileSize(0);
-        params.SetNumConnections(0);
-        const QString& header = headers[i];
+        const QString& header = headers_[i];
         if (header == "url") {
-          params.SetUrl(cells[i]);
+          params.SetUrl(cells[i].trimmed());
           if (params.Url().isEmpty()) {
-            *error = QString("Url is empty in row %d.").arg(line_number);
+            *error = QString("Url is empty in row %1.").arg(line_number_);
+            return false;
           }
         } else if (header == "save as") {
           params.SetSaveAs(cells[i]);
         } else if (header == "number of connections") {
           bool ok;
-          params.SetNumConnections(QVariant(cells[i]).toInt(&ok));
+          params.SetNumConnections(cells[i].toInt(&ok));
           if (!ok) {
             *error = QString("Failed to parse number of connections "
-                             "in line %d").arg(line_number);
+                             "in row %1").arg(line_number_);
+            return false;
+          }
+        } else if (header == "priority") {
+          bool ok;
+          params.SetPriority(cells[i].toInt(&ok));
+          if (!ok) {
+            *error = QString("Failed to parse priority in row %1")
+                .arg(line_number_);
             return false;
           }
         }
-        out->push_back(params);
       }
+      out->push_back(params);
+      ++num_read;
     }
-    file.close();
-  } else {
-    *error = "Failed to open import file.";
-    return false;
+    return true;
   }
-  return true;
-}
+
+  // Fraction of the file read so far.
+  double Progress() {
+    return file_.size() > 0 ? file_.pos() / (double) file_.size() : 1.0;
+  }
+
+ private:
+  QFile file_;
+  QTextStream stream_;
+  QStringList headers_;
+  int line_number_;
+};
 
 }
 
@@ -144,9 +176,19 @@ MainWindow::MainWindow() {
   tree_widget_ = new QTreeWidget(this);
   qRegisterMetaType<FileSpec>();
   preference_manager_.reset(new PreferenceManager(&session_));
-  downloads_table_ = new DownloadsTable(this);
-  monitor_ = new DownloadMonitor(this, &session_, preference_manager_.get());
+  downloads_table_ = new DownloadsTable(this, &session_);
+  ui_ticker_ = new UiTicker(this);
+  finalizer_ = new Finalizer(this);
+  last_table_progress_update_ = 0;
+  monitor_ = new DownloadMonitor(this, &session_, preference_manager_.get(),
+                                 ui_ticker_, finalizer_);
   download_dialog_ = new DownloadDialog(this, preference_manager_.get());
+  int metrics_port;
+  preference_manager_->Get("metrics_port", &metrics_port);
+  if (metrics_port > 0) {
+    MetricsServer* metrics_server = new MetricsServer(this);
+    metrics_server->Start(metrics_port);
+  }
   QWidget* central_widget = new QWidget();
   setCentralWidget(central_widget);
   QVBoxLayout* layout = new QVBoxLayout(central_widget);
@@ -160,7 +202,7 @@ MainWindow::MainWindow() {
   // TODO(ogaro): Add a function in qaccelerator-db that allows us to iterate through
   // these enums.
   statuses_ = QStringList({"In Progress", "Paused", "Completed", "Cancelled",
-      "Failed", "Queued"});
+      "Failed", "Queued", kStatusArchived});
   categories_ =  QStringList({"Videos", "Images", "Audio", "Documents",
       "Software", "Other"});
   foreach(const QString& status, statuses_) {
@@ -182,8 +224,6 @@ MainWindow::MainWindow() {
   prev_selected_items_ = tree_widget_->selectedItems();
   tree_widget_->setHeaderLabel("Filters");
   tree_widget_->setSelectionMode(QAbstractItemView::MultiSelection);
-  progress_updater_ = new QTimer(this);
-  connect(progress_updater_, SIGNAL(timeout()), this, SLOT(UpdateProgress()));
 
   // downloads_table_.reset(new DownloadsTable());
   // RefreshTable();
@@ -197,11 +237,9 @@ MainWindow::MainWindow() {
   CreateToolbar();
   CreateStatusBar();
 
-  // TODO(ogaro): Stop the progress updater when no downloads are in progress.
-  // progress_updater_.start(progress_update_interval_ms_);
-
   downloads_table_->GenerateAndUpdateToolbarState();
   CreateConnections();
+  CompactHistory();
   status_tree_item_->setSelected(true);
   category_tree_item_->setSelected(true);
   RefreshTable();
@@ -214,8 +252,8 @@ MainWindow::MainWindow() {
 }
 
 void MainWindow::CreateConnections() {
-  connect(monitor_, SIGNAL(RefreshDownloadsTable()),
-          this, SLOT(RefreshTable()));
+  connect(monitor_, SIGNAL(RefreshDownloadsTable(int)),
+          this, SLOT(RefreshItem(int)));
   connect(monitor_, SIGNAL(AllTabsClosed()),
           this, SLOT(close()));
   connect(downloads_table_, &DownloadsTable::PauseDownload,
@@ -230,14 +268,20 @@ void MainWindow::CreateConnections() {
           [=] (DownloadItem item) {
     monitor_->StartOrQueueDownload(item);
   });
+  connect(downloads_table_, &DownloadsTable::ChangePriority,
+          [=] (DownloadItem item, int delta) {
+    monitor_->ChangePriority(item, delta);
+  });
   connect(downloads_table_, &DownloadsTable::CancelDownload,
           [=] (DownloadItem item) {
     monitor_->CancelDownload(item);
   });
   connect(downloads_table_, &DownloadsTable::DeleteItem,
           [=] (DownloadItem item) {
+    int id = item.Id();
+    SegmentTimelineRecord::DeleteAll(&session_, id);
     item.Delete();
-    RefreshTable();
+    RefreshItems({id});
   });
   connect(downloads_table_, &DownloadsTable::UpdateToolbar,
           [=] (unordered_map<QString, bool> possibilities) {
@@ -245,18 +289,15 @@ void MainWindow::CreateConnections() {
       actions_[entry.first]->setEnabled(entry.second);
     }
   });
-  connect(downloads_table_, &DownloadsTable::Refresh, [=] {
-    RefreshTable();
+  connect(downloads_table_, &DownloadsTable::Refresh,
+          [=] (const vector<int>& db_item_ids) {
+    RefreshItems(db_item_ids);
   });
   connect(downloads_table_, &DownloadsTable::CloneDownload,
           [=] (DownloadItem item) {
     Nullable<QString> save_as = item.SaveAs();
     QString url = item.Url().Get();
     DownloadParams params;
-
-    // TODO(ogaro): Why the heck is this not initialized to zero?
-    params.SetFileSize(0);
-
     params.SetUrl(url);
     if (!save_as.IsNull()) {
       params.SetSaveAs(save_as.Get());
@@ -272,20 +313,39 @@ void MainWindow::CreateConnections() {
   });
 }
 
+void MainWindow::CompactHistory() {
+  int archive_after_days = 0;
+  preference_manager_->Get("archive_after_days", &archive_after_days);
+  qint64 now = CurrentTimeMillis();
+  if (archive_after_days > 0) {
+    int num_archived = session_.ArchiveDownloadItems(
+        now - archive_after_days * kMillisInADay);
+    if (num_archived > 0) {
+      qDebug() << "Archived " << num_archived << " download items.";
+    }
+  }
+  qint64 last_compaction_time = 0;
+  preference_manager_->Get("last_compaction_time", &last_compaction_time);
+  if (now - last_compaction_time > kCompactionIntervalMillis) {
+    session_.Compact();
+    preference_manager_->Set("last_compaction_time", now);
+  }
+}
+
 void MainWindow::CleanUpFailedDownloads() {
   vector<DownloadItem> items;
-  DownloadItem::GetAll(&session_, &items);
+  DownloadItem::GetAll(
+      &session_, "status",
+      DownloadItem::ToInt(DownloadItem::StatusEnum::IN_PROGRESS), &items);
   vector<DownloadItem> interrupted_items;
   bool table_refresh_needed = false;
   for (DownloadItem& item : items) {
-    if (item.Status().Get() == DownloadItem::StatusEnum::IN_PROGRESS) {
-      if (!item.WorkDir().IsNull()
-          && QFileInfo(item.WorkDir().Get()).exists()) {
-        interrupted_items.push_back(item);
-      } else {
-        table_refresh_needed = true;
-        item.SetStatus(DownloadItem::StatusEnum::FAILED);
-      }
+    if (!item.WorkDir().IsNull()
+        && QFileInfo(item.WorkDir().Get()).exists()) {
+      interrupted_items.push_back(item);
+    } else {
+      table_refresh_needed = true;
+      item.SetStatus(DownloadItem::StatusEnum::FAILED);
     }
   }
   if (interrupted_items.empty()) {
@@ -328,7 +388,7 @@ void MainWindow::CleanUpFailedDownloads() {
     for (DownloadItem& item : interrupted_items) {
       Nullable<QString> work_dir = item.WorkDir();
       if (!work_dir.IsNull() && QFileInfo(work_dir.Get()).exists()) {
-        QDir(work_dir.Get()).removeRecursively();
+        finalizer_->RemoveDir(work_dir.Get());
       }
       item.SetStatus(DownloadItem::StatusEnum::FAILED);
     }
@@ -475,29 +535,47 @@ void MainWindow::RefreshTable() {
     qDebug() << "At least one of status or category is not selected.";
     return;
   }
-  downloads_table_->Reset();
-  vector<DownloadItem> items;
-  DownloadItem::GetAll(&session_, &items);
-  bool download_in_progress = false;
-  for (DownloadItem& item : items) {
-    Category item_category = Category::OTHER;
-    Nullable<QString> save_as = item.SaveAs();
-    if (!save_as.IsNull() && !save_as.Get().isEmpty()) {
-      item_category = Categorizer::Categorize(FileExt(item.SaveAs().Get()));
-    }
-    QString item_status = DownloadItem::ToString(item.Status().Get());
-    if ((status == kStatusAll || status == item_status)
-        && (category == kCategoryAll
-            || item_category == StringToCategory(category))) {
-      downloads_table_->AddRow(item);
-    }
-    download_in_progress |= (
-        item.Status().Get() == DownloadItem::StatusEnum::IN_PROGRESS);
+  // Archived items are only read when the user asks for them.
+  bool show_archived = (status == kStatusArchived);
+  Nullable<DownloadItem::StatusEnum> status_filter;
+  DownloadItem::StatusEnum item_status;
+  if (DownloadItem::FromString(status, &item_status)) {
+    status_filter.Set(item_status);
   }
-  if (download_in_progress && !progress_updater_->isActive()) {
-    progress_updater_->start(kProgressUpdateInterval);
-  } else if (!download_in_progress && progress_updater_->isActive()) {
-    progress_updater_->stop();
+  Nullable<Category> category_filter;
+  if (category != kCategoryAll) {
+    category_filter.Set(StringToCategory(category));
+  }
+  downloads_table_->SetFilter(status_filter, category_filter, show_archived);
+  changed_item_ids_.clear();
+  UpdateTickerSubscription();
+}
+
+void MainWindow::RefreshItem(int db_item_id) {
+  RefreshItems(db_item_id > 0 ? vector<int>({db_item_id}) : vector<int>());
+}
+
+void MainWindow::RefreshItems(const vector<int>& db_item_ids) {
+  changed_item_ids_.insert(changed_item_ids_.end(),
+                           db_item_ids.begin(), db_item_ids.end());
+  if (downloads_table_->RenameInProgress()
+      || downloads_table_->BatchOperationInProgress()) {
+    return;
+  }
+  downloads_table_->RefreshItems(changed_item_ids_);
+  changed_item_ids_.clear();
+  UpdateTickerSubscription();
+}
+
+void MainWindow::UpdateTickerSubscription() {
+  bool download_in_progress = DownloadItem::Count(
+      &session_,
+      "status",
+      DownloadItem::ToInt(DownloadItem::StatusEnum::IN_PROGRESS)) > 0;
+  if (download_in_progress) {
+    ui_ticker_->Subscribe(this);
+  } else {
+    ui_ticker_->Unsubscribe(this);
   }
 }
 
@@ -643,6 +721,19 @@ void MainWindow::CreateStatusBar() {
   statusBar()->showMessage("Ready");
 }
 
+void MainWindow::OnTick(qint64 now_millis) {
+  if (now_millis - last_table_progress_update_ < kProgressUpdateInterval) {
+    return;
+  }
+  // Every tick carries the progress of all downloads, so nothing is lost by
+  // skipping ticks while the table can't be seen.
+  if (isMinimized() || !downloads_table_->isVisible()) {
+    return;
+  }
+  last_table_progress_update_ = now_millis;
+  UpdateProgress();
+}
+
 void MainWindow::UpdateProgress() {
   vector<pair<int, double> > progress_tuples;
   monitor_->GetProgress(&progress_tuples);
@@ -676,18 +767,50 @@ void MainWindow::ImportDownloads() {
   if (download_path.isEmpty()) {
     return;
   }
-  vector<DownloadParams> parsed;
   QString error;
-  if (!ParseImportFile(download_path, &parsed, &error)) {
+  ImportFileReader reader(download_path);
+  if (!reader.Open(&error)) {
     QMessageBox::critical(this,
                           "Invalid import file",
                           error);
     return;
   }
-  for (DownloadParams& params : parsed) {
-    monitor_->QueueDownload(params);
+  // Nothing may return to the event loop while the downloads are written,
+  // so the dialog is shown up front, has no cancel button, and is repainted
+  // directly after each batch.
+  QProgressDialog progress("Importing downloads...", QString(), 0,
+                           kImportProgressSteps, this);
+  progress.setWindowModality(Qt::WindowModal);
+  QProgressBar* bar = new QProgressBar(&progress);
+  bar->setRange(0, kImportProgressSteps);
+  progress.setBar(bar);
+  progress.show();
+  QCoreApplication::processEvents();
+
+  // Rows are read a batch at a time and written as they are read, so a bad
+  // row leaves nothing half-imported and large files are never held in
+  // memory in full.
+  bool read_ok = true;
+  bool ok = monitor_->QueueDownloads(
+      [&] (vector<DownloadParams>* batch) {
+        read_ok = reader.ReadRows(kImportBatchSize, batch, &error);
+        return read_ok;
+      },
+      [&] (int num_queued) {
+        progress.setLabelText(
+            QString("Imported %1 downloads...").arg(num_queued));
+        bar->setValue((int) (reader.Progress() * kImportProgressSteps));
+        progress.repaint();
+      });
+  progress.hide();
+  if (!ok) {
+    if (read_ok) {
+      error = "Failed to save the imported downloads.";
+    }
+    QMessageBox::critical(this,
+                          "Invalid import file",
+                          error);
   }
-  monitor_->MaybePopQueueFront();
 }
 
 void MainWindow::PromptPreferences() {
@@ -703,3 +826,22 @@ void MainWindow::closeEvent(QCloseEvent *event) {
     event->ignore();
   }
 }
+
+void PreLaunch() {
+  if (QFile::exists(kLaunchFName)) {
+    QFile::remove(kDbFName);  // Previous launch attempt failed.
+    QMessageBox::information(
+        0,
+        "Download history lost",
+        "An error occurred, and your recent download history has been lost. "
+        "Sorry about that. :(");
+  } else {
+    QFile launch_file(kLaunchFName);
+    launch_file.open(QIODevice::WriteOnly);
+    launch_file.close();
+  }
+}
+
+void PostLaunch() {
+  QFile::remove(kLaunchFName);
+}
@@ -7,6 +7,8 @@
 #include "downloads-table.h"
 #include "download-monitor.h"
 #include "download-dialog.h"
+#include "metrics-server.h"
+#include "ui-ticker.h"
 
 #include <memory>
 #include <QMainWindow>
@@ -15,6 +17,7 @@
 #include <QTimer>
 #include <QSplitter>
 #include <unordered_map>
+#include <vector>
 #include <QMenu>
 #include <QToolButton>
 #include <QClipboard>
@@ -30,13 +33,20 @@ protected:
 
  private slots:
   void OnTreeSelectionChanged();
-  void UpdateProgress();
+  void OnTick(qint64 now_millis);
   void AddNewDownload();
   void ImportDownloads();
   void PromptPreferences();
   void RefreshTable();
+  // Re-reads only the row of `db_item_id`, and picks up new items; -1 to
+  // only pick up new items.
+  void RefreshItem(int db_item_id);
 
  private:
+  void RefreshItems(const std::vector<int>& db_item_ids);
+  void UpdateTickerSubscription();
+  void UpdateProgress();
+  void CompactHistory();
   void CleanUpFailedDownloads();
   void CreateActions();
   void CreateMenus();
@@ -57,9 +67,13 @@ protected:
 
   QList<QTreeWidgetItem*> prev_selected_items_;
   bool waiting_for_renamed_;
-  QTimer* progress_updater_;
+  UiTicker* ui_ticker_;
+  Finalizer* finalizer_;
+  qint64 last_table_progress_update_;
   // std::unique_ptr<DownloadsTable> downloads_table_;
   DownloadsTable* downloads_table_;
+  // Items that changed while the table could not be refreshed.
+  std::vector<int> changed_item_ids_;
   QSplitter splitter_;
   std::unordered_map<QString, QAction*> actions_;
   QMenu delete_menu_;
@@ -73,4 +87,9 @@ protected:
   DownloadDialog* download_dialog_;
 };
 
+// Guard against a database that makes the application crash on launch: the
+// database is dropped if the previous launch never got to PostLaunch().
+void PreLaunch();
+void PostLaunch();
+
 #endif // QACCELERATOR_H
@@ -0,0 +1,94 @@
+#include "segment-allocator.h"
+
+#include <algorithm>
+#include <deque>
+
+using std::vector;
+
+namespace {
+struct AscendingStartIndex {
+  inline bool operator() (const Segment& a, const Segment& b) {
+    return a.first < b.first;
+  }
+};
+}
+
+void SortSegments(vector<Segment>* segments) {
+  std::sort(segments->begin(), segments->end(), AscendingStartIndex());
+}
+
+qint64 CountBytes(const vector<Segment>& segments) {
+  qint64 sum = 0;
+  for (const Segment& segment : segments) {
+    sum += segment.second - segment.first + 1;
+  }
+  return sum;
+}
+
+void CalculateAllocations(vector<Segment>* downloaded,
+                          qint64 file_size, int num_connections,
+                          vector<vector<Segment> >* allocations) {
+  qint64 undownloaded_size = file_size - CountBytes(*downloaded);
+  for (const Segment& segment : *downloaded) {
+    if (segment.first > segment.second) {
+      DIE() << "Segment (" << segment.first << ", " << segment.second
+            << ") is invalid.";
+    }
+  }
+  if (undownloaded_size < 0) {
+    DIE() << __FUNCTION__ << "File size is " << file_size
+          << " but number of undownloaded is " << undownloaded_size;
+  }
+  SortSegments(downloaded);
+
+  // Get the boundaries of the undownloaded segments of the file.
+  std::deque<Segment> undownloaded;
+  qint64 start = 0;
+  qint64 end = 0;
+  for (int i = 0; i < downloaded->size(); ++i) {
+    end = downloaded->at(i).first - 1;
+    if (end - start + 1 > 0) {
+      undownloaded.push_back(Segment(start, end));
+    }
+    start = downloaded->at(i).second + 1;
+  }
+  end = file_size - 1;
+  if (end - start + 1 > 0) {
+    undownloaded.push_back(Segment(start, end));
+  }
+
+  qint64 min_thread_load = undownloaded_size / num_connections;
+  for (int i = 0; i < num_connections; ++i) {
+    qint64 thread_load = min_thread_load;
+    vector<Segment> allocation;
+    if (i == num_connections - 1) {
+      thread_load += undownloaded_size % num_connections;
+    }
+    if (thread_load == 0) {
+      allocations->push_back(allocation);
+      continue;
+    }
+    qint64 capacity_left = thread_load;
+    while (undownloaded.size() > 0) {
+      Segment segment = undownloaded.at(0);
+      undownloaded.pop_front();
+      qint64 start = segment.first;
+      qint64 end = segment.second;
+      qint64 segment_size = end - start + 1;
+
+      if (segment_size < capacity_left) {
+        allocation.push_back(segment);
+        capacity_left -= segment_size;
+      } else if (segment_size == capacity_left) {
+        allocation.push_back(segment);
+        break;  // We are done allocating for thread i.
+      } else {
+        // Split segment.
+        allocation.push_back(Segment(start, start + capacity_left - 1));
+        undownloaded.push_front(Segment(start + capacity_left, end));
+        break;
+      }
+    }
+    allocations->push_back(allocation);
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef SEGMENT_ALLOCATOR_H_
+#define SEGMENT_ALLOCATOR_H_
+
+#include "qaccelerator-utils.h"
+#include <vector>
+
+// Sorts segments by their first byte.
+void SortSegments(std::vector<Segment>* segments);
+
+// Total size of the segments, which must not overlap.
+qint64 CountBytes(const std::vector<Segment>& segments);
+
+// Splits the bytes of a `file_size` byte file that are not in `downloaded`
+// among `num_connections` connections, as evenly as possible and in file
+// order. Each connection gets the segments it should download, in the order
+// it should download them. Sorts `downloaded`.
+// TODO(ogaro): Make `downloaded` const and assert that it is sorted. Rename
+// it to pre_downloaded
+void CalculateAllocations(std::vector<Segment>* downloaded,
+                          qint64 file_size, int num_connections,
+                          std::vector<std::vector<Segment> >* allocations);
+
+#endif  // SEGMENT_ALLOCATOR_H_
@@ -0,0 +1,281 @@
+#include "segment-map.h"
+
+#include <algorithm>
+#include <utility>
+#include <QHelpEvent>
+#include <QPainter>
+#include <QToolTip>
+
+using std::max;
+using std::min;
+using std::vector;
+
+static const int kCellSize = 8;
+static const int kCellPitch = 10;  // Cell size plus the gap between cells.
+static const int kNumRows = 12;
+static const int kLegendHeight = 22;
+static const int kLegendSwatchSize = 10;
+
+static const QColor kDownloadedColor(74, 144, 217);
+static const QColor kPendingColor(198, 220, 242);
+static const QColor kGapColor(230, 230, 230);
+static const QColor kActiveColor(245, 166, 35);
+static const QColor kFailedColor(217, 83, 79);
+
+namespace {
+QColor Blend(const QColor& from, const QColor& to, double weight) {
+  return QColor::fromRgbF(
+      from.redF() + (to.redF() - from.redF()) * weight,
+      from.greenF() + (to.greenF() - from.greenF()) * weight,
+      from.blueF() + (to.blueF() - from.blueF()) * weight);
+}
+}
+
+SegmentMap::SegmentMap(QWidget* parent)
+    : QWidget(parent),
+      file_size_(0),
+      is_completed_(false),
+      num_cells_(0) {
+  setFixedHeight(sizeHint().height());
+  setSizePolicy(QSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed));
+}
+
+void SegmentMap::SetAllocations(qint64 file_size,
+                                const vector<Segment>& downloaded,
+                                const vector<vector<Segment> >& allocations) {
+  file_size_ = file_size;
+  is_completed_ = false;
+  downloaded_segments_ = downloaded;
+  allocations_ = allocations;
+  connection_downloaded_.assign(allocations.size(), 0);
+  connection_failed_.assign(allocations.size(), false);
+  RecomputeCells();
+}
+
+void SegmentMap::SetProgress(const vector<qint64>& downloaded,
+                             const vector<bool>& failed) {
+  if (downloaded.size() != allocations_.size()
+      || failed.size() != allocations_.size()) {
+    return;
+  }
+  if (downloaded == connection_downloaded_ && failed == connection_failed_) {
+    return;
+  }
+  connection_downloaded_ = downloaded;
+  connection_failed_ = failed;
+  RecomputeCells();
+}
+
+void SegmentMap::ClearConnections() {
+  for (size_t i = 0; i < allocations_.size(); ++i) {
+    qint64 left = connection_downloaded_[i];
+    for (const Segment& segment : allocations_[i]) {
+      if (left <= 0) {
+        break;
+      }
+      qint64 done = min(left, segment.second - segment.first + 1);
+      downloaded_segments_.push_back(
+          Segment(segment.first, segment.first + done - 1));
+      left -= done;
+    }
+  }
+  allocations_.clear();
+  connection_downloaded_.clear();
+  connection_failed_.clear();
+  RecomputeCells();
+}
+
+void SegmentMap::SetCompleted() {
+  is_completed_ = true;
+  RecomputeCells();
+}
+
+QSize SegmentMap::sizeHint() const {
+  return QSize(650, kNumRows * kCellPitch + kLegendHeight);
+}
+
+bool SegmentMap::event(QEvent* event) {
+  if (event->type() != QEvent::ToolTip) {
+    return QWidget::event(event);
+  }
+  QHelpEvent* help_event = static_cast<QHelpEvent*>(event);
+  int i = CellAt(help_event->pos());
+  if (i < 0) {
+    QToolTip::hideText();
+    event->ignore();
+    return true;
+  }
+  const Cell& cell = cells_[i];
+  qint64 cell_size = CellStart(i + 1) - CellStart(i);
+  qint64 downloaded = is_completed_ ? cell_size : cell.downloaded;
+  QString text = QString("%1 to %2: %3% downloaded")
+      .arg(IntFileSizeToString(CellStart(i)))
+      .arg(IntFileSizeToString(CellStart(i + 1)))
+      .arg((int) (downloaded * 100 / cell_size));
+  if (cell.is_failed) {
+    text += ", connection failed";
+  } else if (cell.is_active) {
+    text += ", downloading";
+  }
+  QToolTip::showText(help_event->globalPos(), text, this);
+  return true;
+}
+
+void SegmentMap::paintEvent(QPaintEvent* event) {
+  QPainter painter(this);
+  int columns = NumColumns();
+  if (num_cells_ > 0) {
+    for (int i = 0; i < num_cells_; ++i) {
+      painter.fillRect((i % columns) * kCellPitch, (i / columns) * kCellPitch,
+                       kCellSize, kCellSize, colors_[i]);
+    }
+  } else {
+    QRect grid_rect(0, 0, width(), kNumRows * kCellPitch);
+    if (is_completed_) {
+      painter.fillRect(grid_rect, kDownloadedColor);
+    } else {
+      painter.fillRect(grid_rect, kGapColor);
+      painter.drawText(grid_rect, Qt::AlignCenter, "File size unknown");
+    }
+  }
+
+  // Legend.
+  const std::pair<QColor, QString> legend[] = {
+    {kDownloadedColor, "Downloaded"},
+    {kActiveColor, "Downloading"},
+    {kPendingColor, "Remaining"},
+    {kGapColor, "Not allocated"},
+    {kFailedColor, "Failed"}};
+  QFontMetrics metrics = painter.fontMetrics();
+  int y = kNumRows * kCellPitch + (kLegendHeight - kLegendSwatchSize) / 2;
+  int x = 0;
+  for (const auto& entry : legend) {
+    painter.fillRect(x, y, kLegendSwatchSize, kLegendSwatchSize, entry.first);
+    x += kLegendSwatchSize + 4;
+    QRect text_rect(x, kNumRows * kCellPitch, metrics.width(entry.second),
+                    kLegendHeight);
+    painter.drawText(text_rect, Qt::AlignVCenter | Qt::AlignLeft,
+                     entry.second);
+    x += text_rect.width() + 12;
+  }
+}
+
+void SegmentMap::resizeEvent(QResizeEvent* event) {
+  QWidget::resizeEvent(event);
+  RecomputeCells();
+}
+
+int SegmentMap::NumColumns() const {
+  return max(1, (width() + kCellPitch - kCellSize) / kCellPitch);
+}
+
+int SegmentMap::NumRows() const {
+  return kNumRows;
+}
+
+qint64 SegmentMap::CellStart(int i) const {
+  return (i * file_size_ + num_cells_ - 1) / num_cells_;
+}
+
+int SegmentMap::CellOf(qint64 byte) const {
+  return byte * num_cells_ / file_size_;
+}
+
+int SegmentMap::CellAt(const QPoint& pos) const {
+  if (pos.x() < 0 || pos.y() < 0) {
+    return -1;
+  }
+  int column = pos.x() / kCellPitch;
+  int row = pos.y() / kCellPitch;
+  if (column >= NumColumns() || row >= NumRows()) {
+    return -1;
+  }
+  int i = row * NumColumns() + column;
+  return i < num_cells_ ? i : -1;
+}
+
+void SegmentMap::AddRange(const Segment& range, qint64 Cell::* field) {
+  qint64 first = max(range.first, (qint64) 0);
+  qint64 last = min(range.second, file_size_ - 1);
+  if (first > last) {
+    return;
+  }
+  for (int i = CellOf(first); i <= CellOf(last); ++i) {
+    cells_[i].*field += min(last + 1, CellStart(i + 1))
+        - max(first, CellStart(i));
+  }
+}
+
+void SegmentMap::MarkRange(const Segment& range, bool Cell::* flag) {
+  qint64 first = max(range.first, (qint64) 0);
+  qint64 last = min(range.second, file_size_ - 1);
+  if (first > last) {
+    return;
+  }
+  for (int i = CellOf(first); i <= CellOf(last); ++i) {
+    cells_[i].*flag = true;
+  }
+}
+
+void SegmentMap::RecomputeCells() {
+  num_cells_ = 0;
+  if (file_size_ > 0) {
+    num_cells_ = (int) min((qint64) NumColumns() * NumRows(), file_size_);
+  }
+  cells_.assign(num_cells_, Cell{0, 0, false, false});
+  if (num_cells_ > 0) {
+    for (const Segment& segment : downloaded_segments_) {
+      AddRange(segment, &Cell::downloaded);
+    }
+    for (size_t i = 0; i < allocations_.size(); ++i) {
+      qint64 left = connection_downloaded_[i];
+      bool marked_active = false;
+      for (const Segment& segment : allocations_[i]) {
+        qint64 done = min(left, segment.second - segment.first + 1);
+        left -= done;
+        if (done > 0) {
+          AddRange(Segment(segment.first, segment.first + done - 1),
+                   &Cell::downloaded);
+        }
+        Segment rest(segment.first + done, segment.second);
+        if (rest.first > rest.second) {
+          continue;
+        }
+        AddRange(rest, &Cell::pending);
+        if (connection_failed_[i]) {
+          MarkRange(rest, &Cell::is_failed);
+        } else if (!marked_active) {
+          // The connection is writing at the start of its first unfinished
+          // segment.
+          MarkRange(Segment(rest.first, rest.first), &Cell::is_active);
+          marked_active = true;
+        }
+      }
+    }
+  }
+
+  vector<QColor> colors;
+  colors.reserve(num_cells_);
+  for (int i = 0; i < num_cells_; ++i) {
+    colors.push_back(CellColor(cells_[i], CellStart(i + 1) - CellStart(i)));
+  }
+  if (colors != colors_ || num_cells_ == 0) {
+    colors_.swap(colors);
+    update();
+  }
+}
+
+QColor SegmentMap::CellColor(const Cell& cell, qint64 cell_size) const {
+  if (is_completed_ || cell.downloaded >= cell_size) {
+    return kDownloadedColor;
+  }
+  if (cell.is_failed) {
+    return kFailedColor;
+  }
+  if (cell.is_active) {
+    return kActiveColor;
+  }
+  // Bytes of the cell that are neither downloaded nor allocated are gaps.
+  const QColor& base = cell.pending > 0 ? kPendingColor : kGapColor;
+  return Blend(base, kDownloadedColor, cell.downloaded / (double) cell_size);
+}
@@ -0,0 +1,89 @@
+#ifndef SEGMENT_MAP_H_
+#define SEGMENT_MAP_H_
+
+#include "qaccelerator-utils.h"
+#include <vector>
+#include <QColor>
+#include <QEvent>
+#include <QPaintEvent>
+#include <QResizeEvent>
+#include <QSize>
+#include <QWidget>
+
+// Draws the whole file as a grid of cells, each covering an equal share of
+// the bytes, coloured by how much of the share is downloaded and whether a
+// connection is working on it. Cells where a connection is currently writing
+// and ranges of failed connections are highlighted.
+//
+// Cell colours are recomputed when the progress changes, in time linear in
+// the number of cells plus the number of allocated segments. Painting only
+// fills the cells, so its cost depends on the size of the widget, not on the
+// number of connections.
+class SegmentMap : public QWidget {
+  Q_OBJECT
+
+ public:
+  explicit SegmentMap(QWidget* parent);
+
+  // Starts over with a new set of connections. `downloaded` are the ranges
+  // that were already downloaded and `allocations` the ranges allocated to
+  // each connection, in the order the connection downloads them.
+  // A non-positive file size means the size is unknown, in which case only
+  // SetCompleted() changes what is drawn.
+  void SetAllocations(qint64 file_size,
+                      const std::vector<Segment>& downloaded,
+                      const std::vector<std::vector<Segment> >& allocations);
+
+  // `downloaded` holds the bytes each connection downloaded since
+  // SetAllocations() and `failed` whether it stopped on an error. Both are
+  // ignored if they don't match the allocations.
+  void SetProgress(const std::vector<qint64>& downloaded,
+                   const std::vector<bool>& failed);
+
+  // Keeps what was downloaded and drops the connections, whose remaining
+  // ranges become gaps.
+  void ClearConnections();
+
+  void SetCompleted();
+
+  // Override
+  QSize sizeHint() const;
+
+ protected:
+  // Overrides
+  bool event(QEvent* event);
+  void paintEvent(QPaintEvent* event);
+  void resizeEvent(QResizeEvent* event);
+
+ private:
+  struct Cell {
+    qint64 downloaded;
+    qint64 pending;  // Allocated to a connection but not downloaded yet.
+    bool is_active;
+    bool is_failed;
+  };
+
+  int NumColumns() const;
+  int NumRows() const;
+  // First byte of cell `i`. CellStart(num_cells_) is the file size.
+  qint64 CellStart(int i) const;
+  int CellOf(qint64 byte) const;
+  int CellAt(const QPoint& pos) const;
+  // Adds `range` to the counter selected by `field` of the cells it covers.
+  void AddRange(const Segment& range, qint64 Cell::* field);
+  void MarkRange(const Segment& range, bool Cell::* flag);
+  void RecomputeCells();
+  QColor CellColor(const Cell& cell, qint64 cell_size) const;
+
+  qint64 file_size_;
+  bool is_completed_;
+  std::vector<Segment> downloaded_segments_;
+  std::vector<std::vector<Segment> > allocations_;
+  std::vector<qint64> connection_downloaded_;
+  std::vector<bool> connection_failed_;
+  int num_cells_;
+  std::vector<Cell> cells_;
+  std::vector<QColor> colors_;
+};
+
+#endif  // SEGMENT_MAP_H_
@@ -78,15 +78,29 @@ SpeedGrapher::SpeedGrapher(QWidget* parent, const QSize& size,
       {"indicator_text_color", "#ccc"},
       {"indicator_text_alpha", 1.0},
   };
-  ys_ = {0};
   yprop_ = 0.83;
   progress_ = 0;
   indicator_text_margin_bottom_ = 3;
   indicator_text_margin_right_ = 10;
+  // Two vertices (minimum and maximum) per bucket, so at most one bucket
+  // per two pixels keeps a vertex per pixel. The count is even so buckets
+  // can always be merged pairwise.
+  max_buckets_ = std::max(2, size_.width() / 4 * 2);
 
   setScene(&scene_);
   setRenderHints(QPainter::Antialiasing | QPainter::SmoothPixmapTransform);
+  setCacheMode(QGraphicsView::CacheBackground);
+  setViewportUpdateMode(QGraphicsView::MinimalViewportUpdate);
   scene_.setSceneRect(0, 0, size_.width(), size_.height());
+  scene_.setItemIndexMethod(QGraphicsScene::NoIndex);
+  // Items are stacked in the order they are added.
+  curve_item_ = scene_.addPath(QPainterPath());
+  area_item_ = scene_.addPath(QPainterPath());
+  progress_item_ = scene_.addRect(QRectF());
+  dot_item_ = scene_.addEllipse(QRectF());
+  line_item_ = scene_.addLine(QLineF());
+  text_item_ = scene_.addText("");
+  SetData({0});
   setFrameShape(QFrame::NoFrame);
   setFixedSize(size_);
   UpdatePlot(false);
@@ -96,6 +110,20 @@ SpeedGrapher::SpeedGrapher(QWidget* parent, const QSize& size,
   show();
 }
 
+void SpeedGrapher::SetData(const vector<double>& ys) {
+  if (ys.empty()) {
+    return;
+  }
+  buckets_.clear();
+  bucket_size_ = 1;
+  last_bucket_size_ = 0;
+  max_y_ = 0;
+  for (double y : ys) {
+    AddValue(y);
+  }
+  RebuildPaths();
+}
+
 void SpeedGrapher::SetProgress(const double progress) {
   progress_ = progress;
 }
@@ -109,107 +137,204 @@ void SpeedGrapher::SetStyleAttribute(const QString& style_attr,
   style_dict_[style_attr] = style_value;
 }
 
-void SpeedGrapher::UpdatePlot(bool show_indicators) {
-  scene_.clear();
-
-  // Draw gridlines.
-  unique_ptr<QBrush> brush = MkBrush("background");
-  scene_.setBackgroundBrush(*brush);
-  DrawGridlines();
-
-  // Draw curve
-  double last_x = 0;
-  double last_y = 0;
-  unique_ptr<QPainterPath> path(ComputeSeriesPath(&last_x, &last_y));
-  scene_.addPath(*path, *MkPen("curve"));
-
-  // Shade area under the curve.
-  QPainterPath area(*path);
-  area.lineTo(last_x, size_.height());
-  area.closeSubpath();
-  scene_.addPath(area, Qt::NoPen, *MkBrush("curve"));
-
-  // Shade area behind the progress level.
-  scene_.addRect(0, 0, progress_ * size_.width(), size_.height(),
-                 Qt::NoPen, *MkBrush("chart"));
-
-  // If we are not supposed to show the indicators, return here.
-  if (!show_indicators) {
-    return;
+void SpeedGrapher::ApplyStyle(const QMap<QString, QVariant>& style,
+                              bool show_indicators) {
+  QMapIterator<QString, QVariant> it(style);
+  while (it.hasNext()) {
+    it.next();
+    SetStyleAttribute(it.key(), it.value());
   }
-  // std::cout << progress_ << std::endl;
-  // Draw indicator dot.
-  double dot_size = style_dict_["indicator_dot_size"].toDouble();
-  double dot_x = last_x - dot_size / 2;
-  double dot_y = last_y - dot_size / 2;
-  scene_.addEllipse(dot_x, dot_y, dot_size, dot_size,
-                    *MkPen("indicator_dot"),
-                    *MkBrush("indicator_dot"));
+  UpdatePlot(show_indicators);
+}
 
-  // Draw horizontal indicator line.
-  scene_.addLine(0, last_y+0.5, size_.width(), last_y+0.5,
-                 *MkPen("indicator_line"));
+void SpeedGrapher::UpdatePlot(bool show_indicators) {
+  // Gridlines and background are drawn by drawBackground().
+  resetCachedContent();
 
-  // Draw a caption for the horizontal line.
-  QString text = indicator_text_;
-  if (text.isEmpty()) {
-    text = QString::number(last_y);
-  }
-  QGraphicsTextItem* text_item = scene_.addText(
-        text,
+  // Curve pens keep their width regardless of the transform that maps the
+  // curve onto the plot.
+  unique_ptr<QPen> curve_pen = MkPen("curve");
+  curve_pen->setCosmetic(true);
+  curve_item_->setPen(*curve_pen);
+  curve_item_->setBrush(Qt::NoBrush);
+  area_item_->setPen(Qt::NoPen);
+  area_item_->setBrush(*MkBrush("curve"));
+  progress_item_->setPen(Qt::NoPen);
+  progress_item_->setBrush(*MkBrush("chart"));
+  dot_item_->setPen(*MkPen("indicator_dot"));
+  dot_item_->setBrush(*MkBrush("indicator_dot"));
+  line_item_->setPen(*MkPen("indicator_line"));
+  text_item_->setFont(
         QFont(style_dict_["indicator_text_font_name"].toString(),
               style_dict_["indicator_text_font_size"].toDouble()));
   QColor text_color = QColor();
   text_color.setNamedColor(style_dict_["indicator_text_color"].toString());
   text_color.setAlphaF(style_dict_["indicator_text_alpha"].toDouble());
-  text_item->setDefaultTextColor(text_color);
-  double text_x = (size_.width() - indicator_text_margin_right_ -
-                   text_item->boundingRect().width());
-  double text_y = (last_y - indicator_text_margin_bottom_ -
-                   text_item->boundingRect().height());
-  text_item->setPos(text_x, text_y < 0 ? 0 : text_y);
+  text_item_->setDefaultTextColor(text_color);
+  UpdateGeometry(show_indicators);
 }
 
-void SpeedGrapher::DrawGridlines() {
-  unique_ptr<QPen> grid_pen = MkPen("grid");
+void SpeedGrapher::drawBackground(QPainter* painter, const QRectF& rect) {
+  painter->fillRect(rect, *MkBrush("background"));
+  painter->setPen(*MkPen("grid"));
 
   int horizontal_interval = (int) (size_.width() / num_vertical_gridlines_);
   int vertical_interval = (int) (size_.height() / num_horizontal_gridlines_);
 
   // Draw vertical gridlines.
   for (int x = 0; x < size_.width(); x += horizontal_interval) {
-    scene_.addLine(x + 0.5, 0, x + 0.5, size_.height(), *grid_pen);
+    painter->drawLine(QLineF(x + 0.5, 0, x + 0.5, size_.height()));
   }
 
   // Draw horizontal gridlines.
   for (int y = 0; y < size_.height(); y += vertical_interval) {
-    scene_.addLine(0, y + 0.5, size_.width(), y + 0.5, *grid_pen);
+    painter->drawLine(QLineF(0, y + 0.5, size_.width(), y + 0.5));
   }
 }
 
-QPainterPath* SpeedGrapher::ComputeSeriesPath(double* last_x, double* last_y) {
-  // Calculate the x and y coordinates of the data points in the
-  // GraphicsScene's coordinate system.
-  vector<double> prepared_ys(ys_.begin(), ys_.end());
-  vector<double> prepared_xs(ys_.begin(), ys_.end());
-  double max_y = *std::max_element(prepared_ys.begin(), prepared_ys.end());
-  if (max_y > 0) {
-    for (int i = 0; i < prepared_ys.size(); ++i) {
-      double y = prepared_ys[i];
-      prepared_ys[i] = (1 - y / max_y * yprop_) * size_.height();
-      prepared_xs[i] = i * progress_ * size_.width() / (prepared_xs.size() - 1);
+SpeedGrapher::SeriesChange SpeedGrapher::AddValue(double y) {
+  max_y_ = std::max(max_y_, y);
+  last_y_ = y;
+  if (!buckets_.empty() && last_bucket_size_ < bucket_size_) {
+    Bucket& bucket = buckets_.back();
+    if (y > bucket.max) {
+      bucket.max = y;
+      bucket.max_is_last = true;
+    } else if (y < bucket.min) {
+      bucket.min = y;
+      bucket.max_is_last = false;
     }
+    ++last_bucket_size_;
+    return SeriesChange::LAST_BUCKET_CHANGED;
+  }
+  SeriesChange change = SeriesChange::BUCKET_APPENDED;
+  if (static_cast<int>(buckets_.size()) == max_buckets_) {
+    MergeBuckets();
+    change = SeriesChange::BUCKETS_MERGED;
   }
+  buckets_.push_back(Bucket{y, y, true});
+  last_bucket_size_ = 1;
+  return change;
+}
 
-  // Prepare a path through the data points.
-  QPainterPath* path = new QPainterPath(QPointF(prepared_xs[0],
-                                                prepared_ys[0]));
-  for (int i = 0; i < prepared_ys.size(); ++i) {
-    path->lineTo(prepared_xs[i], prepared_ys[i]);
+void SpeedGrapher::MergeBuckets() {
+  vector<Bucket> merged;
+  merged.reserve(max_buckets_);
+  int merged_last_size = 0;
+  size_t last = buckets_.size() - 1;
+  for (size_t i = 0; i < buckets_.size(); i += 2) {
+    const Bucket& first = buckets_[i];
+    int size = (i == last) ? last_bucket_size_ : bucket_size_;
+    if (i + 1 > last) {
+      merged.push_back(first);
+      merged_last_size = size;
+      continue;
+    }
+    const Bucket& second = buckets_[i + 1];
+    size += (i + 1 == last) ? last_bucket_size_ : bucket_size_;
+    bool max_from_second = second.max >= first.max;
+    bool min_from_second = second.min <= first.min;
+    Bucket bucket;
+    bucket.max = max_from_second ? second.max : first.max;
+    bucket.min = min_from_second ? second.min : first.min;
+    if (max_from_second == min_from_second) {
+      bucket.max_is_last = max_from_second ? second.max_is_last
+                                           : first.max_is_last;
+    } else {
+      bucket.max_is_last = max_from_second;
+    }
+    merged.push_back(bucket);
+    merged_last_size = size;
   }
-  *last_x = prepared_xs.back();
-  *last_y = prepared_ys.back();
-  return path;
+  buckets_.swap(merged);
+  bucket_size_ *= 2;
+  last_bucket_size_ = merged_last_size;
+}
+
+void SpeedGrapher::RebuildPaths() {
+  curve_path_ = QPainterPath();
+  area_path_ = QPainterPath();
+  area_path_.moveTo(0, 0);
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    const Bucket& bucket = buckets_[i];
+    AppendVertex(i, bucket.max_is_last ? bucket.min : bucket.max);
+    AppendVertex(i, bucket.max_is_last ? bucket.max : bucket.min);
+  }
+}
+
+void SpeedGrapher::AppendVertex(double x, double y) {
+  if (curve_path_.elementCount() == 0) {
+    curve_path_.moveTo(x, y);
+    area_path_.lineTo(x, y);
+  } else {
+    curve_path_.lineTo(x, y);
+    // The last vertex of the area is on the x axis below the curve's last
+    // vertex. It becomes the new vertex and a new one is added below it.
+    area_path_.setElementPositionAt(area_path_.elementCount() - 1, x, y);
+  }
+  area_path_.lineTo(x, 0);
+}
+
+void SpeedGrapher::SetLastBucketVertices() {
+  const Bucket& bucket = buckets_.back();
+  double x = buckets_.size() - 1;
+  double first = bucket.max_is_last ? bucket.min : bucket.max;
+  double second = bucket.max_is_last ? bucket.max : bucket.min;
+  int curve_count = curve_path_.elementCount();
+  curve_path_.setElementPositionAt(curve_count - 2, x, first);
+  curve_path_.setElementPositionAt(curve_count - 1, x, second);
+  int area_count = area_path_.elementCount();
+  area_path_.setElementPositionAt(area_count - 3, x, first);
+  area_path_.setElementPositionAt(area_count - 2, x, second);
+}
+
+void SpeedGrapher::UpdateGeometry(bool show_indicators) {
+  curve_item_->setPath(curve_path_);
+  area_item_->setPath(area_path_);
+
+  // Map (bucket index, speed) onto the plot. The last bucket ends up at the
+  // progress level and the fastest speed at yprop_ of the height.
+  int num_buckets = buckets_.size();
+  double x_scale = num_buckets > 1
+      ? progress_ * size_.width() / (num_buckets - 1) : 0;
+  double y_scale = max_y_ > 0 ? yprop_ * size_.height() / max_y_ : 0;
+  QTransform transform(x_scale, 0, 0, -y_scale, 0, size_.height());
+  curve_item_->setTransform(transform);
+  area_item_->setTransform(transform);
+
+  // Shade area behind the progress level.
+  progress_item_->setRect(0, 0, progress_ * size_.width(), size_.height());
+
+  dot_item_->setVisible(show_indicators);
+  line_item_->setVisible(show_indicators);
+  text_item_->setVisible(show_indicators);
+  // If we are not supposed to show the indicators, return here.
+  if (!show_indicators) {
+    return;
+  }
+  QPointF last = transform.map(QPointF(num_buckets - 1, last_y_));
+
+  // Draw indicator dot.
+  double dot_size = style_dict_["indicator_dot_size"].toDouble();
+  dot_item_->setRect(last.x() - dot_size / 2, last.y() - dot_size / 2,
+                     dot_size, dot_size);
+
+  // Draw horizontal indicator line.
+  line_item_->setLine(0, last.y() + 0.5, size_.width(), last.y() + 0.5);
+
+  // Draw a caption for the horizontal line.
+  QString text = indicator_text_;
+  if (text.isEmpty()) {
+    text = QString::number(last.y());
+  }
+  if (text_item_->toPlainText() != text) {
+    text_item_->setPlainText(text);
+  }
+  double text_x = (size_.width() - indicator_text_margin_right_ -
+                   text_item_->boundingRect().width());
+  double text_y = (last.y() - indicator_text_margin_bottom_ -
+                   text_item_->boundingRect().height());
+  text_item_->setPos(text_x, text_y < 0 ? 0 : text_y);
 }
 
 unique_ptr<QBrush> SpeedGrapher::MkBrush(const QString& brush_name) {
@@ -244,7 +369,21 @@ void SpeedGrapher::AddDataPoint(double y, double progress,
     return;
   }
   indicator_text_ = indicator_text;
-  ys_.push_back(y);
   progress_ = progress;
-  UpdatePlot(true);
+  switch (AddValue(y)) {
+  case SeriesChange::LAST_BUCKET_CHANGED:
+    SetLastBucketVertices();
+    break;
+  case SeriesChange::BUCKET_APPENDED: {
+    const Bucket& bucket = buckets_.back();
+    double x = buckets_.size() - 1;
+    AppendVertex(x, bucket.min);
+    AppendVertex(x, bucket.max);
+    break;
+  }
+  case SeriesChange::BUCKETS_MERGED:
+    RebuildPaths();
+    break;
+  }
+  UpdateGeometry(true);
 }
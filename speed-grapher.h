@@ -4,10 +4,12 @@
 #define _USE_MATH_DEFINES 1;
 #include <math.h>
 #include <QGraphicsView>
+#include <QGraphicsItem>
 #include <QSize>
 #include <vector>
 #include <string>
 #include <QVariant>
+#include <QMap>
 #include <QPainterPath>
 #include <tuple>
 #include <memory>
@@ -18,6 +20,15 @@
 #include <QTimer>
 
 
+// Plots download speed against progress.
+//
+// The series is kept in at most one bucket per horizontal pixel. Each bucket
+// holds the minimum and maximum of the data points that fall into it, so
+// spikes survive downsampling. When the buckets run out, neighbouring buckets
+// are merged pairwise. The curve is a path in data coordinates (bucket index,
+// speed) that is mapped to the plot with an item transform, so a new data
+// point only moves or appends the last vertices of the path. The background
+// and gridlines are rendered once and cached.
 class SpeedGrapher : public QGraphicsView {
  public:
   SpeedGrapher(QWidget* parent,
@@ -28,20 +39,21 @@ class SpeedGrapher : public QGraphicsView {
     : SpeedGrapher(parent, size, 15, 10) {}
   SpeedGrapher(QWidget* parent) : SpeedGrapher(parent, QSize(650, 100)) {}
 
-  // Refreshes the plot. This is typically called right after AddDataPoint().
+  // Refreshes the plot after style attributes change. Data points are
+  // plotted as they are added.
   void UpdatePlot(bool show_indicators);
 
   // Getters and setters.
-  const std::vector<double>& GetData() { return ys_; }
-  void SetData(const std::vector<double>& ys) {
-    if (ys.empty()) {
-      return;
-    }
-    ys_.assign(ys.begin(), ys.end());
-  }
+  void SetData(const std::vector<double>& ys);
   void SetProgress(const double progress);
+  void SetIndicatorText(const QString& indicator_text) {
+    indicator_text_ = indicator_text;
+  }
   void SetStyleAttribute(const QString& style_attr,
                          const QVariant& style_value);
+  // Sets all of `style`, as read by PreferenceManager::GrapherStyle(), and
+  // refreshes the plot.
+  void ApplyStyle(const QMap<QString, QVariant>& style, bool show_indicators);
   const QVariant& GetStyleAttribute(const QString& style_attr);
   double GetDoubleStyleAttribute(const QString& style_attr) {
     return GetStyleAttribute(style_attr).toDouble();
@@ -57,18 +69,52 @@ class SpeedGrapher : public QGraphicsView {
     AddDataPoint(y, progress, "");
   }
 
+ protected:
+  // Override
+  void drawBackground(QPainter* painter, const QRectF& rect);
+
  private:
-  void DrawIndicators();
-  QPainterPath* ComputeSeriesPath(double* last_x, double* last_y);
+  struct Bucket {
+    double min;
+    double max;
+    bool max_is_last;  // Whether the maximum came after the minimum.
+  };
+
+  enum class SeriesChange {
+    LAST_BUCKET_CHANGED,
+    BUCKET_APPENDED,
+    BUCKETS_MERGED
+  };
+
+  SeriesChange AddValue(double y);
+  void MergeBuckets();
+  void RebuildPaths();
+  void AppendVertex(double x, double y);
+  void SetLastBucketVertices();
+  void UpdateGeometry(bool show_indicators);
   std::unique_ptr<QPen> MkPen(const QString& pen_name);
   std::unique_ptr<QBrush> MkBrush(const QString& brush_name);
-  void DrawGridlines();
 
   QSize size_;
-  std::vector<double> ys_;
+  std::vector<Bucket> buckets_;
+  int max_buckets_;
+  // Number of data points per bucket, and in the last bucket.
+  int bucket_size_;
+  int last_bucket_size_;
+  double max_y_;
+  double last_y_;
+  QPainterPath curve_path_;
+  // The curve, closed along the x axis.
+  QPainterPath area_path_;
   double progress_;
   QMap<QString, QVariant> style_dict_;
   QGraphicsScene scene_;
+  QGraphicsPathItem* curve_item_;
+  QGraphicsPathItem* area_item_;
+  QGraphicsRectItem* progress_item_;
+  QGraphicsEllipseItem* dot_item_;
+  QGraphicsLineItem* line_item_;
+  QGraphicsTextItem* text_item_;
 
   // TODO(ogaro): These should probably eventually be added as style
   // attributes.
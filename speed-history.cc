@@ -0,0 +1,208 @@
+#include "speed-history.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include "qaccelerator-utils.h"
+
+namespace {
+const char* kHistoryFname = "speed-history.bin";
+// Written by versions that dumped the whole series as text.
+const char* kLegacyPointsFname = "points.csv";
+
+const quint32 kMagic = 0x48535851;  // "QXSH" in little-endian order.
+const quint32 kVersion = 1;
+// magic, version, capacity, stride, number of points, samples in last point.
+const qint64 kHeaderSize = 6 * sizeof(quint32);
+// Offset of the number of points in the header.
+const qint64 kCountersOffset = 4 * sizeof(quint32);
+const qint64 kPointSize = sizeof(double);
+
+void PrepareStream(QDataStream* stream) {
+  stream->setByteOrder(QDataStream::LittleEndian);
+  stream->setFloatingPointPrecision(QDataStream::DoublePrecision);
+}
+}
+
+SpeedHistory::SpeedHistory(int capacity)
+    : capacity_(capacity),
+      stride_(1),
+      last_point_samples_(0) {
+  // Pairwise merging needs an even number of points.
+  if (capacity_ < 2 || capacity_ % 2 != 0) {
+    DIE() << "Speed history capacity must be even and at least 2.";
+  }
+}
+
+void SpeedHistory::Open(const QString& work_dir) {
+  path_ = JoinPath(work_dir, kHistoryFname);
+  if (Load()) {
+    return;
+  }
+  Clear();
+  QString legacy_path = JoinPath(work_dir, kLegacyPointsFname);
+  if (QFileInfo(legacy_path).exists()) {
+    ImportLegacyPoints(legacy_path);
+    QFile::remove(legacy_path);
+  }
+  WriteAll();
+}
+
+void SpeedHistory::Append(double speed) {
+  if (AddSample(speed)) {
+    WriteAll();
+  } else {
+    WriteLast();
+  }
+}
+
+bool SpeedHistory::AddSample(double speed) {
+  if (!points_.empty() && last_point_samples_ < stride_) {
+    double& last = points_.back();
+    last = (last * last_point_samples_ + speed) / (last_point_samples_ + 1);
+    ++last_point_samples_;
+    return false;
+  }
+  bool downsampled = false;
+  if (static_cast<int>(points_.size()) == capacity_) {
+    Downsample();
+    downsampled = true;
+  }
+  points_.push_back(speed);
+  last_point_samples_ = 1;
+  return downsampled;
+}
+
+bool SpeedHistory::Load() {
+  QFile file(path_);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QDataStream stream(&file);
+  PrepareStream(&stream);
+  quint32 magic, version, capacity, stride, num_points, last_point_samples;
+  stream >> magic >> version >> capacity >> stride >> num_points
+         >> last_point_samples;
+  if (stream.status() != QDataStream::Ok || magic != kMagic
+      || version != kVersion || stride == 0) {
+    qDebug() << "Ignoring invalid speed history " << path_;
+    return false;
+  }
+  // A crash may have cut the file short. Keep the points that made it.
+  qint64 complete_points = (file.size() - kHeaderSize) / kPointSize;
+  if (complete_points < num_points) {
+    num_points = complete_points;
+  }
+  points_.clear();
+  points_.reserve(capacity_);
+  for (quint32 i = 0; i < num_points; ++i) {
+    double point;
+    stream >> point;
+    points_.push_back(point);
+  }
+  stride_ = stride;
+  last_point_samples_ = points_.empty() ? 0 : last_point_samples;
+  if (last_point_samples_ > stride_) {
+    last_point_samples_ = stride_;
+  }
+  // The capacity may have changed since the file was written.
+  bool downsampled = false;
+  while (static_cast<int>(points_.size()) > capacity_) {
+    Downsample();
+    downsampled = true;
+  }
+  if (downsampled || capacity != static_cast<quint32>(capacity_)) {
+    WriteAll();
+  }
+  return true;
+}
+
+void SpeedHistory::ImportLegacyPoints(const QString& legacy_path) {
+  QFile file(legacy_path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return;
+  }
+  QTextStream stream(&file);
+  while (!stream.atEnd()) {
+    bool ok = false;
+    double speed = stream.readLine().toDouble(&ok);
+    if (!ok) {
+      qDebug() << "Failed to parse speed in " << legacy_path;
+      break;
+    }
+    AddSample(speed);
+  }
+}
+
+void SpeedHistory::Downsample() {
+  std::vector<double> merged;
+  merged.reserve(capacity_);
+  quint32 merged_last_samples = 0;
+  size_t last = points_.size() - 1;
+  for (size_t i = 0; i < points_.size(); i += 2) {
+    quint32 samples = (i == last) ? last_point_samples_ : stride_;
+    double sum = points_[i] * samples;
+    if (i + 1 <= last) {
+      quint32 next_samples = (i + 1 == last) ? last_point_samples_ : stride_;
+      sum += points_[i + 1] * next_samples;
+      samples += next_samples;
+    }
+    merged.push_back(sum / samples);
+    merged_last_samples = samples;
+  }
+  points_.swap(merged);
+  stride_ *= 2;
+  last_point_samples_ = merged_last_samples;
+}
+
+void SpeedHistory::Clear() {
+  points_.clear();
+  points_.reserve(capacity_);
+  stride_ = 1;
+  last_point_samples_ = 0;
+}
+
+bool SpeedHistory::WriteLast() {
+  if (path_.isEmpty()) {
+    return false;
+  }
+  QFile file(path_);
+  // The work dir may have been recreated since the last write.
+  if (!file.exists()) {
+    return WriteAll();
+  }
+  if (!file.open(QIODevice::ReadWrite)) {
+    qDebug() << "Failed to open speed history " << path_;
+    return false;
+  }
+  QDataStream stream(&file);
+  PrepareStream(&stream);
+  file.seek(kCountersOffset);
+  stream << static_cast<quint32>(points_.size()) << last_point_samples_;
+  if (!points_.empty()) {
+    file.seek(kHeaderSize + (points_.size() - 1) * kPointSize);
+    stream << points_.back();
+  }
+  return stream.status() == QDataStream::Ok;
+}
+
+bool SpeedHistory::WriteAll() {
+  if (path_.isEmpty() || !QFileInfo(DirName(path_)).exists()) {
+    return false;
+  }
+  QFile file(path_);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    qDebug() << "Failed to open speed history " << path_;
+    return false;
+  }
+  QDataStream stream(&file);
+  PrepareStream(&stream);
+  stream << kMagic << kVersion << static_cast<quint32>(capacity_) << stride_
+         << static_cast<quint32>(points_.size()) << last_point_samples_;
+  for (double point : points_) {
+    stream << point;
+  }
+  return stream.status() == QDataStream::Ok;
+}
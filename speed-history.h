@@ -0,0 +1,53 @@
+#ifndef SPEED_HISTORY_H_
+#define SPEED_HISTORY_H_
+
+#include <vector>
+#include <QString>
+#include <QtGlobal>
+
+// Download speed samples of a single download, persisted in its work dir.
+//
+// At most `capacity` points are kept. Each point is the average of `stride`
+// consecutive samples (the last point may hold fewer). When all points are
+// used up, neighbouring points are merged pairwise and the stride doubles, so
+// the history always spans the whole download at a bounded size.
+//
+// The file is a fixed header followed by the points as little-endian
+// doubles. Append() rewrites only the header counters and the last point, so
+// it is O(1) except for the (amortized) merges.
+class SpeedHistory {
+ public:
+  static const int kDefaultCapacity = 1024;
+
+  explicit SpeedHistory(int capacity);
+  SpeedHistory() : SpeedHistory(kDefaultCapacity) {}
+
+  // Loads the history saved in `work_dir`, or starts an empty one there.
+  // Points saved by older versions in points.csv are converted.
+  void Open(const QString& work_dir);
+
+  void Append(double speed);
+
+  const std::vector<double>& Points() const { return points_; }
+  bool IsEmpty() const { return points_.empty(); }
+
+ private:
+  // Adds the sample to the points in memory. Returns true if the points had
+  // to be merged to make room for it.
+  bool AddSample(double speed);
+  bool Load();
+  void ImportLegacyPoints(const QString& legacy_path);
+  void Downsample();
+  void Clear();
+  bool WriteLast();
+  bool WriteAll();
+
+  int capacity_;
+  QString path_;
+  std::vector<double> points_;
+  quint32 stride_;
+  // Number of samples averaged into points_.back().
+  quint32 last_point_samples_;
+};
+
+#endif  // SPEED_HISTORY_H_
@@ -0,0 +1,136 @@
+#include "tracer.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QJsonDocument>
+#include <QMutexLocker>
+
+// The buffer is written out once it grows past this.
+static const int kFlushThreshold = 256 * 1024;
+
+Tracer* Tracer::Instance() {
+  static Tracer instance;
+  return &instance;
+}
+
+Tracer::Tracer() : enabled_(false), first_event_(true), pid_(0) {}
+
+bool Tracer::Start(const QString& path) {
+  {
+    QMutexLocker locker(&mutex_);
+    if (file_.isOpen()) {
+      return false;
+    }
+    file_.setFileName(path);
+    if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+      qDebug() << "Failed to open trace file " << path;
+      return false;
+    }
+    file_.write("[\n");
+    first_event_ = true;
+    pid_ = QCoreApplication::applicationPid();
+    clock_.start();
+    enabled_.store(true, std::memory_order_release);
+  }
+  NameThread("Main");
+  return true;
+}
+
+void Tracer::Stop() {
+  QMutexLocker locker(&mutex_);
+  if (!file_.isOpen()) {
+    return;
+  }
+  enabled_.store(false, std::memory_order_release);
+  Flush();
+  file_.write("\n]\n");
+  file_.close();
+}
+
+qint64 Tracer::NowMicros() const {
+  return clock_.nsecsElapsed() / 1000;
+}
+
+int Tracer::ThreadId() {
+  static std::atomic<int> next_id(1);
+  thread_local int id = next_id.fetch_add(1);
+  return id;
+}
+
+void Tracer::NameThread(const QString& name) {
+  thread_local bool named = false;
+  if (!IsEnabled() || named) {
+    return;
+  }
+  named = true;
+  QJsonObject event;
+  event["ph"] = "M";
+  event["name"] = "thread_name";
+  event["args"] = QJsonObject({{"name", name}});
+  Append(event);
+}
+
+void Tracer::AddSpan(const char* category, const QString& name,
+                     qint64 start_micros, const QJsonObject& args) {
+  if (!IsEnabled()) {
+    return;
+  }
+  QJsonObject event;
+  event["ph"] = "X";
+  event["cat"] = category;
+  event["name"] = name;
+  event["ts"] = start_micros;
+  event["dur"] = NowMicros() - start_micros;
+  if (!args.isEmpty()) {
+    event["args"] = args;
+  }
+  Append(event);
+}
+
+void Tracer::Append(const QJsonObject& event) {
+  QJsonObject complete_event = event;
+  complete_event["pid"] = pid_;
+  complete_event["tid"] = ThreadId();
+  QByteArray line = QJsonDocument(complete_event).toJson(
+      QJsonDocument::Compact);
+  QMutexLocker locker(&mutex_);
+  if (!file_.isOpen()) {
+    return;
+  }
+  if (!first_event_) {
+    buffer_ += ",\n";
+  }
+  first_event_ = false;
+  buffer_ += line;
+  if (buffer_.size() > kFlushThreshold) {
+    Flush();
+  }
+}
+
+void Tracer::Flush() {
+  file_.write(buffer_);
+  file_.flush();
+  buffer_.clear();
+}
+
+TraceSpan::TraceSpan(const char* category, const QString& name)
+    : category_(category),
+      start_micros_(-1) {
+  Tracer* tracer = Tracer::Instance();
+  if (tracer->IsEnabled()) {
+    name_ = name;
+    start_micros_ = tracer->NowMicros();
+  }
+}
+
+TraceSpan::~TraceSpan() {
+  if (start_micros_ >= 0) {
+    Tracer::Instance()->AddSpan(category_, name_, start_micros_, args_);
+  }
+}
+
+void TraceSpan::AddArg(const QString& key, const QJsonValue& value) {
+  if (start_micros_ >= 0) {
+    args_[key] = value;
+  }
+}
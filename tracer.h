@@ -0,0 +1,77 @@
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <atomic>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonObject>
+#include <QMutex>
+#include <QString>
+
+// Writes spans of what the engine and the UI are doing as Chrome trace events
+// (the JSON array format), which chrome://tracing and the Perfetto UI open.
+// Tracing is off unless Start() was called; while it is off, tracing a span
+// costs a single relaxed load.
+//
+// Events are buffered and written out in batches, and the file stays valid
+// if the process dies before Stop(): viewers accept an unterminated array.
+class Tracer {
+ public:
+  static Tracer* Instance();
+
+  // Starts writing to `path`, replacing it. Names the calling thread "Main".
+  bool Start(const QString& path);
+  // Writes what is buffered and closes the file.
+  void Stop();
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Microseconds since Start().
+  qint64 NowMicros() const;
+  // Labels the calling thread in the viewer. Only the first name of a thread
+  // is kept.
+  void NameThread(const QString& name);
+  // A span on the calling thread from `start_micros` until now.
+  void AddSpan(const char* category, const QString& name, qint64 start_micros,
+               const QJsonObject& args = QJsonObject());
+
+ private:
+  Tracer();
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // Small ids, in the order threads first traced something; the viewer
+  // shows them more readably than native thread ids.
+  static int ThreadId();
+  void Append(const QJsonObject& event);
+  // Must be called with mutex_ held.
+  void Flush();
+
+  std::atomic<bool> enabled_;
+  QElapsedTimer clock_;
+  QMutex mutex_;
+  QFile file_;
+  QByteArray buffer_;
+  bool first_event_;
+  qint64 pid_;
+};
+
+// Traces a span from its construction until it goes out of scope.
+class TraceSpan {
+ public:
+  TraceSpan(const char* category, const QString& name);
+  ~TraceSpan();
+
+  void AddArg(const QString& key, const QJsonValue& value);
+
+ private:
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  const char* category_;
+  QString name_;
+  qint64 start_micros_;  // -1 if tracing was off.
+  QJsonObject args_;
+};
+
+#endif  // TRACER_H_
@@ -0,0 +1,53 @@
+#include "ui-ticker.h"
+
+#include "engine-metrics.h"
+#include "qaccelerator-utils.h"
+#include "tracer.h"
+#include <QElapsedTimer>
+
+// Every periodic UI update runs at a multiple of this interval.
+static const int kUiTickIntervalMs = 100;
+
+UiTicker::UiTicker(QObject* parent) : QObject(parent) {
+  timer_.setInterval(kUiTickIntervalMs);
+  connect(&timer_, SIGNAL(timeout()), this, SLOT(OnTimeout()));
+}
+
+void UiTicker::Subscribe(QObject* subscriber) {
+  if (subscribers_.contains(subscriber)) {
+    return;
+  }
+  subscribers_.insert(subscriber);
+  connect(this, SIGNAL(Tick(qint64)), subscriber, SLOT(OnTick(qint64)));
+  connect(subscriber, SIGNAL(destroyed(QObject*)),
+          this, SLOT(OnSubscriberDestroyed(QObject*)));
+  if (!timer_.isActive()) {
+    timer_.start();
+  }
+}
+
+void UiTicker::Unsubscribe(QObject* subscriber) {
+  if (!subscribers_.contains(subscriber)) {
+    return;
+  }
+  disconnect(this, SIGNAL(Tick(qint64)), subscriber, SLOT(OnTick(qint64)));
+  disconnect(subscriber, SIGNAL(destroyed(QObject*)),
+             this, SLOT(OnSubscriberDestroyed(QObject*)));
+  OnSubscriberDestroyed(subscriber);
+}
+
+void UiTicker::OnTimeout() {
+  // Subscribers are connected directly, so this times all their updates.
+  TraceSpan span("ui", "Tick");
+  QElapsedTimer timer;
+  timer.start();
+  emit Tick(CurrentTimeMillis());
+  EngineMetrics::Instance()->UiTickLatency()->Observe(timer.nsecsElapsed());
+}
+
+void UiTicker::OnSubscriberDestroyed(QObject* subscriber) {
+  subscribers_.remove(subscriber);
+  if (subscribers_.isEmpty()) {
+    timer_.stop();
+  }
+}
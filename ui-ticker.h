@@ -0,0 +1,41 @@
+#ifndef UI_TICKER_H_
+#define UI_TICKER_H_
+
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+
+// Drives all periodic UI updates (monitor pages, downloads table progress)
+// from a single timer, so that they run back to back in one pass per tick
+// instead of each widget waking the event loop on its own schedule. The timer
+// only runs while something is subscribed.
+//
+// Subscribers must have an OnTick(qint64 now_millis) slot. They decide for
+// themselves what to redraw; hidden widgets are expected to only update
+// their counters.
+class UiTicker : public QObject {
+  Q_OBJECT
+
+ public:
+  explicit UiTicker(QObject* parent);
+
+  // Both are no-ops if the subscriber is already (un)subscribed.
+  void Subscribe(QObject* subscriber);
+  void Unsubscribe(QObject* subscriber);
+  bool IsSubscribed(QObject* subscriber) const {
+    return subscribers_.contains(subscriber);
+  }
+
+ signals:
+  void Tick(qint64 now_millis);
+
+ private slots:
+  void OnTimeout();
+  void OnSubscriberDestroyed(QObject* subscriber);
+
+ private:
+  QTimer timer_;
+  QSet<QObject*> subscribers_;
+};
+
+#endif  // UI_TICKER_H_